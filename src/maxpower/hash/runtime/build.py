@@ -12,7 +12,8 @@ except ImportError, e:
 MAXOSDIR = os.environ['MAXELEROSDIR']
 MAXCOMPILERDIR = os.environ['MAXCOMPILERDIR']
 
-sources = ['maxhash.c', 'maxhash_slic.c']
+sources = ['maxhash.c', 'maxhash_cuckoo.c', 'maxhash_file.c', 'maxhash_frozen.c',
+		'maxhash_jenkins.c', 'maxhash_shard.c', 'maxhash_slic.c']
 target_dir = 'lib/'
 target = 'libmaxhash-slic.a'
 includes = [ '-Iinclude' ] 
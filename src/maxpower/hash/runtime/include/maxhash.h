@@ -26,6 +26,10 @@ typedef struct maxhash_table           maxhash_table_t;
 typedef struct maxhash_engine_state    maxhash_engine_state_t;
 typedef struct maxhash_table_params    maxhash_table_params_t;
 typedef struct maxhash_entry_iterator  maxhash_entry_iterator_t;
+typedef struct maxhash_commit          maxhash_commit_t;
+typedef struct maxhash_scheduler       maxhash_scheduler_t;
+typedef struct maxhash_sharded_table   maxhash_sharded_table_t;
+typedef struct maxhash_frozen          maxhash_frozen_t;
 
 struct maxhash_engine_state {
 	max_file_t   *maxfile;
@@ -48,6 +52,60 @@ maxhash_err_t maxhash_table_params_set_key_width_bits(
 maxhash_err_t maxhash_table_params_set_value_width_bits(
 		maxhash_table_params_t *params, size_t value_width_bits);
 
+/**
+ * Set the number of entries in the intermediate table of a perfect hash
+ * table, as MaxHashParameters.setNumIntermediateEntries() does for the
+ * hardware (default: the size of the table).
+ */
+maxhash_err_t maxhash_table_params_set_num_intermediate_entries(
+		maxhash_table_params_t *params, size_t num_intermediate_entries);
+
+/**
+ * Set the width of the chunks that keys are hashed in, as
+ * MaxHashParameters.setJenkinsChunkWidth() does for the hardware (default: 32
+ * bits).  The perfect hash parameters found depend on it.
+ */
+maxhash_err_t maxhash_table_params_set_jenkins_chunk_width_bits(
+		maxhash_table_params_t *params, size_t jenkins_chunk_width_bits);
+
+/**
+ * Set the number of threads used by maxhash_perfect_create() (default: 1).
+ * The resulting tables do not depend on the number of threads.
+ */
+maxhash_err_t maxhash_table_params_set_num_threads(
+		maxhash_table_params_t *params, size_t num_threads);
+
+/**
+ * Choose whether commits update the perfect hash incrementally (the default)
+ * or recalculate it from scratch.  Incremental updates only move the entries
+ * of buckets that have gained keys since the last commit, and fall back to a
+ * full rebuild when that would vacate too many slots.
+ */
+maxhash_err_t maxhash_table_params_set_incremental_puts(
+		maxhash_table_params_t *params, bool incremental_puts);
+
+/**
+ * Allow maxhash_get(), maxhash_get_batch() and maxhash_contains() to be
+ * called from any number of threads while one other thread changes the table
+ * (default: false).
+ *
+ * Lookups take no locks and never hold up the writer.  A lookup that overlaps
+ * a put or remove retries, so it sees each change either entirely or not at
+ * all; maxhash_get_batch() sees a maxhash_put_batch() in progress as a series
+ * of single puts.  Lookups are not lock-free: one that starts while a put or
+ * remove is in progress waits for it to finish.  Puts and removes change one
+ * key at a time, with any memory they need allocated beforehand, so the wait
+ * is short unless the writer is descheduled in the middle of one.  Memory
+ * that lookups may still be reading is freed once they have finished with it.
+ *
+ * All other functions, including iteration, commits and perfect hash lookups,
+ * may only be called by the writer.  Concurrent lookups cost an atomic
+ * increment and decrement each, and keep the software index from shrinking
+ * when the table is cleared.
+ */
+maxhash_err_t maxhash_table_params_set_concurrent_reads(
+		maxhash_table_params_t *params, bool concurrent_reads);
+
 /**
  * Initialise a software-only hash table.
  *
@@ -83,6 +141,24 @@ maxhash_err_t maxhash_hw_table_init(maxhash_table_t **table,
 		const char *kernel_name, const char *hash_table_name,
 		maxhash_engine_state_t *engine_state);
 
+/* Most engines that a table can be replicated on. */
+#define MAXHASH_MAX_REPLICAS 8
+
+/**
+ * Initialise a hardware-backed hash table that is replicated on
+ * "num_engines" engines, each with the same MaxFile loaded.  The table is
+ * used as one on a single engine would be, but each commit builds the perfect
+ * hash and serialises the changes once, then writes them to every engine in
+ * parallel, on a thread per engine.  Only once every engine has its data are
+ * the buffers switched, with the switches of all the engines started together.
+ *
+ * Hash tables initialised using this function must be freed using the
+ * "maxhash_free()" function in order to avoid memory leaks.
+ */
+maxhash_err_t maxhash_hw_table_init_replicated(maxhash_table_t **table,
+		const char *kernel_name, const char *hash_table_name,
+		maxhash_engine_state_t **engine_states, size_t num_engines);
+
 /**
  * Free a hash table.
  */
@@ -94,13 +170,45 @@ maxhash_err_t maxhash_free(maxhash_table_t *table);
 maxhash_err_t maxhash_set_debug_mode(maxhash_table_t *table, bool debug);
 
 /**
- * Set callback function for memory accesses.
+ * Set the number of threads used by maxhash_perfect_create().
+ */
+maxhash_err_t maxhash_set_num_threads(maxhash_table_t *table,
+		size_t num_threads);
+
+/**
+ * Choose whether commits update the perfect hash incrementally.
+ */
+maxhash_err_t maxhash_set_incremental_puts(maxhash_table_t *table,
+		bool incremental_puts);
+
+/**
+ * Allow lookups from other threads while one thread changes the table (see
+ * maxhash_table_params_set_concurrent_reads()).  No lookups may be in
+ * progress when this is called.
+ */
+maxhash_err_t maxhash_set_concurrent_reads(maxhash_table_t *table,
+		bool concurrent_reads);
+
+/**
+ * Set callback function for memory accesses.  For a replicated table, this
+ * is the function for the first engine.
  */
 maxhash_err_t maxhash_set_memory_access_fn(maxhash_table_t *table,
 		void (*mem_access_fn)(void *arg, bool is_read, size_t
 			base_address_bursts, void *data, size_t data_size_bursts),
 		void *mem_access_fn_arg);
 
+/**
+ * Set callback function for memory accesses to engine "replica" of a
+ * replicated table, numbered in the order given to
+ * maxhash_hw_table_init_replicated().  The functions of different engines are
+ * called from different threads, at the same time.
+ */
+maxhash_err_t maxhash_set_replica_memory_access_fn(maxhash_table_t *table,
+		size_t replica, void (*mem_access_fn)(void *arg, bool is_read, size_t
+			base_address_bursts, void *data, size_t data_size_bursts),
+		void *mem_access_fn_arg);
+
 /**
  * Put a key-value pair in a hash table.
  * Changes are not committed to hardware.
@@ -108,6 +216,20 @@ maxhash_err_t maxhash_set_memory_access_fn(maxhash_table_t *table,
 maxhash_err_t maxhash_put(maxhash_table_t *table, const void *key,
 		size_t key_len, const void *value, size_t value_len);
 
+/**
+ * Put "n" key-value pairs in a hash table.
+ * Changes are not committed to hardware.
+ *
+ * Key "i" is read from "keys + i * key_stride" and is "key_stride" bytes long,
+ * and similarly for values.  Keys and values whose strides match the widths
+ * of the hash table are used in place.  If "errors" is not NULL, the result of
+ * each individual put is written to errors[i].  The function returns
+ * MAXHASH_ERR_OK only if every pair was added.
+ */
+maxhash_err_t maxhash_put_batch(maxhash_table_t *table, const void *keys,
+		size_t key_stride, const void *values, size_t value_stride, size_t n,
+		maxhash_err_t *errors);
+
 /**
  * Get the value corresponding to the specified key from a hash table in
  * software (not the version that has been committed to hardware).
@@ -118,6 +240,19 @@ maxhash_err_t maxhash_put(maxhash_table_t *table, const void *key,
 maxhash_err_t maxhash_get(const maxhash_table_t *table, const void *key,
 		size_t key_len, void *value);
 
+/**
+ * Look up "n" keys in a hash table in software.
+ *
+ * Key "i" is read from "keys + i * key_stride".  If it is present, its value
+ * is written to "values + i * value_stride" and found[i] is set to true;
+ * otherwise found[i] is set to false and the value is left untouched.  Misses
+ * are not errors.  Lookups are interleaved so that their cache misses overlap,
+ * which is considerably faster than calling maxhash_get() in a loop.
+ */
+maxhash_err_t maxhash_get_batch(const maxhash_table_t *table,
+		const void *keys, size_t key_stride, size_t n, void *values,
+		size_t value_stride, bool *found);
+
 /**
  * Set present to true if the hash table contains the specified key, otherwise
  * set it to false.
@@ -184,11 +319,26 @@ maxhash_err_t maxhash_entry_iterator_get_value(maxhash_entry_iterator_t *iterato
 
 /**
  * Remove a value from a hash table.
- * Changes are not committed to hardware.
+ * The key's slot in the perfect hash table is freed straight away; changes are
+ * not committed to hardware.
  */
 maxhash_err_t maxhash_remove(maxhash_table_t *table, const void *key,
 		size_t key_len);
 
+/**
+ * Remove "n" keys from a hash table.
+ * Changes are not committed to hardware.
+ *
+ * Key "i" is read from "keys + i * key_stride".  If "removed" is not NULL,
+ * removed[i] is set to whether the key was present; keys that are not present
+ * are not errors.  Each key is taken out of the software table straight away,
+ * but its slot in the perfect hash table is only freed when the perfect hash
+ * table is next needed, typically by the next commit, which then just rewrites
+ * the freed slots rather than placing any keys.
+ */
+maxhash_err_t maxhash_remove_batch(maxhash_table_t *table, const void *keys,
+		size_t key_stride, size_t n, bool *removed);
+
 /**
  * Clear all values from a hash table.
  * Changes are not committed to hardware.
@@ -225,16 +375,200 @@ maxhash_err_t maxhash_get_value_width(const maxhash_table_t *table, size_t
 		*value_width);
 
 /**
- * Commit changes to hardware.  (Calls maxhash_perfect_create internally.)
+ * Commit changes to hardware.  (Calls maxhash_perfect_create internally, or
+ * for a collision-handling table places the keys in its ways.)  Only the
+ * memory bursts that changed since the buffer being loaded was last written
+ * are transferred.  A collision-handling table that has no room for some keys
+ * is committed without them, and the commit fails.
  */
 maxhash_err_t maxhash_commit(maxhash_table_t *table);
 
+/**
+ * Start committing the current contents of a table to hardware on a
+ * background thread.  The software table is copied when the commit starts;
+ * puts, removes and software lookups made meanwhile go into the next commit.
+ * The buffer that the hardware reads from is switched only once all of the
+ * data has been written.
+ *
+ * The perfect hash tables belong to the commit until it completes, so calls
+ * that need them (perfect hash lookups and further commits) wait for the
+ * commit to complete.  Only one commit per table can be in progress, and the
+ * engine must not be used by other threads while it is.
+ *
+ * Every commit started must be passed to maxhash_commit_wait().
+ */
+maxhash_err_t maxhash_commit_async(maxhash_table_t *table,
+		maxhash_commit_t **commit);
+
+/**
+ * Check whether an asynchronous commit has completed, without blocking.
+ */
+maxhash_err_t maxhash_commit_poll(maxhash_commit_t *commit, bool *complete);
+
+/**
+ * Wait for an asynchronous commit to complete and free it.  Returns the
+ * result of the commit.
+ */
+maxhash_err_t maxhash_commit_wait(maxhash_commit_t *commit);
+
+/**
+ * Create a scheduler, through which commits of several tables on the same
+ * engine share engine runs.  A table committed with maxhash_commit_schedule()
+ * has its perfect hash built and its changes queued straight away, but its
+ * data is only written, and its buffer switched, by the next
+ * maxhash_scheduler_flush().  The writes of every queued table are then
+ * merged into as few action sets as possible, and once all of them are
+ * complete, the buffers of all the tables are switched together in a single
+ * run.
+ *
+ * Writes to LMem go through each table's memory access function, at the
+ * flush along with the others.  They are not merged into the shared action
+ * sets: a function such as lmem_write() streams its data in a run of its own
+ * while it sends the matching memory commands.
+ */
+maxhash_err_t maxhash_scheduler_init(maxhash_scheduler_t **scheduler,
+		maxhash_engine_state_t *engine_state);
+
+/**
+ * Create a scheduler for tables replicated on "num_engines" engines, given in
+ * the same order as to maxhash_hw_table_init_replicated().  The writes to
+ * each engine are run on a thread of its own when the scheduler is flushed.
+ */
+maxhash_err_t maxhash_scheduler_init_replicated(
+		maxhash_scheduler_t **scheduler, maxhash_engine_state_t **engine_states,
+		size_t num_engines);
+
+/**
+ * Flush a scheduler and free it.
+ */
+maxhash_err_t maxhash_scheduler_free(maxhash_scheduler_t *scheduler);
+
+/**
+ * Commit a table through a scheduler (see maxhash_scheduler_init()).  The
+ * table's statistics are completed, and passed to its statistics function, by
+ * the flush.  Anything that needs the table's hardware state, including
+ * committing it again, flushes the scheduler first, so each table always sees
+ * its writes and buffer switches in order.  The table must be on the
+ * scheduler's engines.
+ */
+maxhash_err_t maxhash_commit_schedule(maxhash_table_t *table,
+		maxhash_scheduler_t *scheduler);
+
+/**
+ * Write everything queued on a scheduler and switch the buffers of the tables
+ * it was for.  This is a fence: when it returns, the hardware reads every
+ * table as committed.
+ */
+maxhash_err_t maxhash_scheduler_flush(maxhash_scheduler_t *scheduler);
+
+/* Buckets of up to this many keys are counted separately in
+ * maxhash_stats_t.bucket_sizes, and larger ones together in its last
+ * element. */
+#define MAXHASH_STATS_MAX_BUCKET_KEYS 32
+
+/**
+ * What the last commit did, and how long each part of it took, in seconds.
+ * The perfect hash fields are also set by maxhash_perfect_create().
+ */
+typedef struct maxhash_stats {
+	bool incremental;         /* perfect hash updated rather than rebuilt */
+	double search_seconds;    /* finding the perfect hash */
+	double serialise_seconds; /* writing changed entries to the images */
+	double transfer_seconds;  /* writing the images to the engine */
+	double switch_seconds;    /* switching the buffer the kernel reads */
+	double total_seconds;
+	size_t num_hashes;        /* hash parameters tried */
+	size_t parameter_max;     /* largest hash parameter, "d" */
+	size_t parameter_bits;    /* bits needed to hold parameter_max */
+	size_t direct_buckets;    /* single keys mapped without a parameter */
+	size_t moved_entries;     /* entries moved by an incremental update */
+	/* bucket_sizes[n] is the number of buckets with n keys placed: every
+	 * bucket when the perfect hash is rebuilt, otherwise those that changed. */
+	size_t bucket_sizes[MAXHASH_STATS_MAX_BUCKET_KEYS + 1];
+	size_t bursts_written;
+	size_t bytes_transferred;  /* to each engine */
+	/* How long each engine took to take its data, for a table replicated on
+	 * several engines: replica_transfer_seconds[i] is for engine "i" of
+	 * maxhash_hw_table_init_replicated(). */
+	size_t num_replicas;
+	double replica_transfer_seconds[MAXHASH_MAX_REPLICAS];
+} maxhash_stats_t;
+
+typedef void (*maxhash_stats_fn_t)(const maxhash_stats_t *stats, void *arg);
+
+/**
+ * Get the statistics of the last commit to complete.  Nothing is printed
+ * while committing unless debug mode is on, so this, or a function set with
+ * maxhash_set_stats_fn(), is how they are read.
+ */
+maxhash_err_t maxhash_get_stats(const maxhash_table_t *table,
+		maxhash_stats_t *stats);
+
+/**
+ * Call "stats_fn" with the statistics of every commit once it has written its
+ * data, from the thread doing the commit (which is a background thread for
+ * maxhash_commit_async()).  A NULL "stats_fn" stops the calls.
+ */
+maxhash_err_t maxhash_set_stats_fn(maxhash_table_t *table,
+		maxhash_stats_fn_t stats_fn, void *stats_fn_arg);
+
+/**
+ * Forget what has been written to hardware, so that the next commit to each
+ * buffer writes the whole table (e.g. after the engine has been reloaded).
+ */
+maxhash_err_t maxhash_invalidate_hw(maxhash_table_t *table);
+
+/**
+ * Save the contents of a table to a file: the keys and values in software,
+ * the perfect hash tables and, for a table with hardware backing that has
+ * been committed, their memory images.  The file is replaced atomically.
+ */
+maxhash_err_t maxhash_save(maxhash_table_t *table, const char *path);
+
+/**
+ * Replace the contents of a table with those saved in a file by
+ * maxhash_save().  The perfect hash tables are restored as they were saved,
+ * and for a table with hardware backing they are written to the engine
+ * straight away, with no rebuild.  The keys of a collision-handling table are
+ * placed in its ways again, and committed if it has hardware backing.
+ *
+ * The file is rejected if it is corrupt, was written by an incompatible
+ * version, or records key or value widths or a table geometry that differ
+ * from those of the table (for hardware tables, those in the MaxFile).  No
+ * concurrent lookups may be in progress.
+ */
+maxhash_err_t maxhash_load(maxhash_table_t *table, const char *path);
+
 /**
  * Create a perfect hash table from a non-perfect hash table, without
  * committing to hardware.
  */
 maxhash_err_t maxhash_perfect_create(maxhash_table_t *table);
 
+/* The outcome of building a perfect hash with one intermediate table size. */
+typedef struct maxhash_perfect_advice {
+	size_t num_intermediate_entries;
+	bool built;             /* a perfect hash was found */
+	maxhash_stats_t stats;  /* search_seconds is the build time */
+} maxhash_perfect_advice_t;
+
+/**
+ * Build a perfect hash table of "num_keys" keys, read from "keys + i *
+ * key_stride", in software, once for each of "num_sizes" numbers of
+ * intermediate entries, and report in advice[i] how long the build took,
+ * the largest hash parameter and the bits needed to hold it.  The other
+ * parameters, including the number of threads and the Jenkins chunk width,
+ * come from "params" and should match those of the hardware table.
+ *
+ * A size for which no perfect hash is found is reported as not built rather
+ * than being an error, so the smallest intermediate table that builds within
+ * a time budget can be chosen offline, without a DFE.
+ */
+maxhash_err_t maxhash_perfect_advise(const maxhash_table_params_t *params,
+		const void *keys, size_t key_stride, size_t num_keys,
+		const size_t *num_intermediate_entries, size_t num_sizes,
+		maxhash_perfect_advice_t *advice);
+
 /**
  * Get the capacity of a perfect hash table.  Note that this metric isn't
  * useful in non-perfect hash tables, which become full only when the maximum
@@ -249,12 +583,142 @@ maxhash_err_t maxhash_perfect_get_capacity(const maxhash_table_t *table,
 maxhash_err_t maxhash_perfect_get(maxhash_table_t *table, const void *key,
 		size_t key_len, void *value, bool *valid);
 
+/**
+ * Get "n" values from a perfect hash table, as maxhash_get_batch() does for
+ * software lookups.  If "valid" is not NULL, valid[i] is set to the valid flag
+ * of key "i", or to false if the key was not found.
+ */
+maxhash_err_t maxhash_perfect_get_batch(maxhash_table_t *table,
+		const void *keys, size_t key_stride, size_t n, void *values,
+		size_t value_stride, bool *found, bool *valid);
+
 /**
  * Get the index that has been assigned to a key in a perfect hash table.
  */
 maxhash_err_t maxhash_perfect_get_index(maxhash_table_t *table,
 		const void *key, size_t key_len, size_t *index);
 
+/* Parameter of the Jenkins hash that picks the shard of a key, as
+ * MaxHashShardFunction.SHARD_HASH_PARAM does in the kernel. */
+#define MAXHASH_SHARD_HASH_PARAM 0x9E3779B9u
+
+/**
+ * Combine "num_shards" hash tables into one logical table, in which each key
+ * is kept in the shard chosen by maxhash_sharded_shard_of().  The shards may
+ * be instances in one kernel or on several engines, or software-only tables,
+ * but must all have the same key width and Jenkins chunk width.  The sharded
+ * table takes ownership of them.
+ *
+ * A kernel finds the instance that holds a key with MaxHashShardFunction,
+ * which computes the same shard as the runtime.
+ *
+ * Sharded tables initialised using this function must be freed using the
+ * "maxhash_sharded_free()" function in order to avoid memory leaks.
+ */
+maxhash_err_t maxhash_sharded_table_init(maxhash_sharded_table_t **sharded,
+		maxhash_table_t **shards, size_t num_shards);
+
+/**
+ * Free a sharded table and all of its shards.
+ */
+maxhash_err_t maxhash_sharded_free(maxhash_sharded_table_t *sharded);
+
+/**
+ * Get the shard that holds a key: Jenkins' hash of the key, padded to the key
+ * width, with MAXHASH_SHARD_HASH_PARAM as its parameter, multiplied by the
+ * number of shards and shifted down by 32 bits.
+ */
+maxhash_err_t maxhash_sharded_shard_of(const maxhash_sharded_table_t *sharded,
+		const void *key, size_t key_len, size_t *shard);
+
+/**
+ * Get one of the shards of a sharded table, e.g. to set its memory access
+ * function or read its statistics.  Changes must be made through the sharded
+ * table.
+ */
+maxhash_err_t maxhash_sharded_get_shard(
+		const maxhash_sharded_table_t *sharded, size_t shard,
+		maxhash_table_t **table);
+
+/**
+ * Put a key-value pair in the shard that holds the key, as maxhash_put() does.
+ */
+maxhash_err_t maxhash_sharded_put(maxhash_sharded_table_t *sharded,
+		const void *key, size_t key_len, const void *value, size_t value_len);
+
+/**
+ * Get the value of a key from the shard that holds it, as maxhash_get() does.
+ */
+maxhash_err_t maxhash_sharded_get(const maxhash_sharded_table_t *sharded,
+		const void *key, size_t key_len, void *value);
+
+/**
+ * Check whether the shard that holds a key contains it, as
+ * maxhash_contains() does.
+ */
+maxhash_err_t maxhash_sharded_contains(const maxhash_sharded_table_t *sharded,
+		bool *present, const void *key, size_t key_len);
+
+/**
+ * Remove a key from the shard that holds it, as maxhash_remove() does.
+ */
+maxhash_err_t maxhash_sharded_remove(maxhash_sharded_table_t *sharded,
+		const void *key, size_t key_len);
+
+/**
+ * Clear all of the shards of a sharded table.
+ */
+maxhash_err_t maxhash_sharded_clear(maxhash_sharded_table_t *sharded);
+
+/**
+ * Get the number of entries in all of the shards of a sharded table.
+ */
+maxhash_err_t maxhash_sharded_size(const maxhash_sharded_table_t *sharded,
+		size_t *size);
+
+/**
+ * Commit the shards that have changed since they were last committed.  The
+ * shards on the same engines are committed through a scheduler, so that
+ * their writes share engine runs and their buffers are switched together.
+ * If "num_committed" is not NULL, it is set to the number of shards
+ * committed.
+ */
+maxhash_err_t maxhash_sharded_commit(maxhash_sharded_table_t *sharded,
+		size_t *num_committed);
+
+/**
+ * Take a read-only copy of the perfect hash tables of a committed table (or
+ * of the ways of a collision-handling table), laid out as flat arrays for
+ * fast lookups in software, for instance when the DFE is busy.  A lookup in
+ * a perfect hash table reads one hash parameter and one value slot, each in a
+ * cache line of its own for values of up to about 60 bytes.
+ *
+ * Lookups give the same results as the kernel did just after the commit.
+ * The copy does not change with the table, and must be taken again after the
+ * next commit; keys removed since the commit are still found.  It can be
+ * shared between threads, and outlives the table.
+ */
+maxhash_err_t maxhash_freeze(maxhash_table_t *table, maxhash_frozen_t **frozen);
+
+maxhash_err_t maxhash_frozen_free(maxhash_frozen_t *frozen);
+
+/**
+ * Look a key up as the kernel would.  "value" gets the value the kernel would
+ * output, and "contains_key" its containsKey() output: without validated
+ * results, a key that was never put may be reported as present.
+ */
+maxhash_err_t maxhash_frozen_get(const maxhash_frozen_t *frozen,
+		const void *key, size_t key_len, void *value, bool *contains_key);
+
+/**
+ * Look "n" keys up as maxhash_frozen_get() does, with keys and values laid out
+ * as for maxhash_get_batch().  Keys with bits set beyond the key width are
+ * not found, and their values are left as they were.
+ */
+maxhash_err_t maxhash_frozen_get_batch(const maxhash_frozen_t *frozen,
+		const void *keys, size_t key_stride, size_t n, void *values,
+		size_t value_stride, bool *contains_key);
+
 #ifdef __cplusplus
 }
 #endif
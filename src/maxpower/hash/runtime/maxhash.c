@@ -5,6 +5,9 @@
  *      Author: tperry
  */
 
+/* glibc 2.20 and later warn about _BSD_SOURCE on its own; older ones only
+ * know it. */
+#define _DEFAULT_SOURCE
 #define _BSD_SOURCE
 
 #include "maxhash.h"
@@ -17,10 +20,16 @@
 #include <stdio.h>
 #include <sys/time.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 
 #define DEEP_FMEM_ID_BITS 4
 
+static maxhash_err_t read_state_set(maxhash_internal_table_t *itable,
+		bool enabled);
+
 #define PAD_KEY(tparams, item, length) \
 	uint8_t key_padded[(tparams)->key_width_bytes]; \
 	if (pad(&(item), key_padded, (length), (tparams)->key_width_bits, (tparams)->key_width_bytes, false) != MAXHASH_ERR_OK) \
@@ -33,32 +42,49 @@
 
 
 
-maxhash_err_t pad(const void **item, void *padded_item, size_t item_size_bytes,
-		size_t max_size_bits, size_t max_size_bytes, bool is_value)
+/*
+ * Find the first byte of an item with bits set beyond max_size_bits.  Returns
+ * item_size_bytes if there is no such byte.
+ */
+static size_t find_excess_bits(const uint8_t *item, size_t item_size_bytes,
+		size_t max_size_bits)
 {
-	/* Check that any bits beyond max_size_bits are zero. */
 	size_t start = max_size_bits / 8;
 	size_t mod = max_size_bits % 8;
 	for (size_t i = start; i < item_size_bytes; i++)
 	{
-		uint8_t val = ((const uint8_t *)*item)[i];
-		bool bad = false;
-		if (i == start && mod != 0)
-		{
-			uint8_t mask = ((1 << mod) - 1) << mod;
-			if (val & mask)
-				bad = true;
-		}
-		else if (val)
-			bad = true;
-		if (bad)
-		{
-			const char *type = is_value ? "value" : "key";
-			fprintf(stderr, "Error: %s has bits set beyond the maximum %s "
-					"size of the hash table (%zu bits): byte %zu has the "
-					"value 0x%x.\n", type, type, max_size_bits, i, val);
-			return MAXHASH_ERR_ERR;
-		}
+		uint8_t mask = i == start && mod != 0 ? (uint8_t)~((1 << mod) - 1) :
+			0xFF;
+		if (item[i] & mask)
+			return i;
+	}
+	return item_size_bytes;
+}
+
+
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+
+maxhash_err_t pad(const void **item, void *padded_item, size_t item_size_bytes,
+		size_t max_size_bits, size_t max_size_bytes, bool is_value)
+{
+	/* Check that any bits beyond max_size_bits are zero. */
+	size_t i = find_excess_bits(*item, item_size_bytes, max_size_bits);
+	if (i != item_size_bytes)
+	{
+		const char *type = is_value ? "value" : "key";
+		fprintf(stderr, "Error: %s has bits set beyond the maximum %s "
+				"size of the hash table (%zu bits): byte %zu has the "
+				"value 0x%x.\n", type, type, max_size_bits, i,
+				((const uint8_t *)*item)[i]);
+		return MAXHASH_ERR_ERR;
 	}
 	size_t copy_size = item_size_bytes < max_size_bytes ? item_size_bytes :
 		max_size_bytes;
@@ -70,28 +96,38 @@ maxhash_err_t pad(const void **item, void *padded_item, size_t item_size_bytes,
 
 
 
-static __inline__ unsigned long long rdtsc(void)
+maxhash_err_t maxhash_set_debug_mode(maxhash_table_t *table, bool debug)
+{
+	table->tparams.debug = debug;
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_set_num_threads(maxhash_table_t *table,
+		size_t num_threads)
 {
-  unsigned hi, lo;
-  __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
-  return ( (unsigned long long)lo)|( ((unsigned long long)hi)<<32 );
+	return maxhash_table_params_set_num_threads(&table->tparams, num_threads);
 }
 
 
 
-#define TIME_START(n) \
-	uint64_t time_diff_ ## n = rdtsc(); \
-	static uint64_t total_time_ ## n;
-#define TIME_END(n) \
-	time_diff_ ## n = rdtsc() - time_diff_ ## n; \
-	total_time_ ## n += time_diff_ ## n; \
-	printf("Time (%s #%d): %ld cycles, total: %ld\n", __func__, n, \
-			time_diff_ ## n, total_time_ ## n);
+maxhash_err_t maxhash_set_incremental_puts(maxhash_table_t *table,
+		bool incremental_puts)
+{
+	return maxhash_table_params_set_incremental_puts(&table->tparams,
+			incremental_puts);
+}
+
 
-maxhash_err_t maxhash_set_debug_mode(maxhash_table_t *table, bool debug)
+
+maxhash_err_t maxhash_set_concurrent_reads(maxhash_table_t *table,
+		bool concurrent_reads)
 {
-	table->tparams.debug = debug;
-	return MAXHASH_ERR_OK;
+	if (read_state_set(&table->sw, concurrent_reads) != MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+	return maxhash_table_params_set_concurrent_reads(&table->tparams,
+			concurrent_reads);
 }
 
 
@@ -130,37 +166,6 @@ void maxhash_debug_print(const maxhash_table_t *table, const char *fmt, ...)
 
 
 
-uint32_t maxhash_function_jenkins(const void *data, size_t data_len, uint32_t
-		hashparam, size_t chunk_width)
-{
-	bool debug = false;
-	uint32_t hash = hashparam;
-
-	if (debug) printf("key: %*s\n", (int)data_len, (char *)data);
-	if (debug) printf("param: %x\n", hashparam);
-	if (debug) printf("data_len: %lx\n", data_len);
-
-	for (size_t chunk = 0; chunk < data_len; chunk += chunk_width)
-	{
-		for (size_t octet = 0; octet < chunk_width; octet++)
-			hash += chunk + octet < data_len ? ((uint8_t *)data)[chunk + octet]
-				<< (octet * 8) : 0;
-		hash += hash << 10;
-		hash ^= hash >> 6;
-		if (debug) printf("hash: %x\n", hash);
-	}
-
-	hash += hash << 3;
-	hash ^= hash >> 11;
-	hash += hash << 15;
-
-	if (debug) printf("final hash: %x\n", hash);
-
-	return hash;
-}
-
-
-
 int compare_bucket_num_keys(const void *first, const void *second)
 {
 	maxhash_bucket_t *f = (maxhash_bucket_t *)first;
@@ -176,23 +181,25 @@ void hash_print_entry(const maxhash_internal_table_t *itable, const
 		maxhash_entry_t *entry)
 {
 	const maxhash_table_params_t *tparams = &itable->table->tparams;
+	const uint8_t *key = maxhash_entry_key(entry);
+	const uint8_t *value = maxhash_entry_value(itable, entry);
 	printf("[key: ");
 	for (size_t i = 0; i < tparams->key_width_bytes; i++)
-		printf("%02x", ((uint8_t *)entry->key)[i]);
+		printf("%02x", key[i]);
 	printf(" (");
 	for (size_t i = 0; i < tparams->key_width_bytes; i++)
 	{
-		char c = ((char *)entry->key)[i];
+		char c = key[i];
 		if (c < 0x20 || c >= 0x7F) c = '.';
 		printf("%c", c);
 	}
 	printf("), value: ");
 	for (size_t i = 0; i < itable->iparams.width_bytes; i++)
-		printf("%02x", ((uint8_t *)entry->value)[i]);
+		printf("%02x", value[i]);
 	printf(" (");
 	for (size_t i = 0; i < itable->iparams.width_bytes; i++)
 	{
-		char c = ((char *)entry->value)[i];
+		char c = value[i];
 		if (c < 0x20 || c >= 0x7F) c = '.';
 		printf("%c", c);
 	}
@@ -225,18 +232,19 @@ void hash_print(const maxhash_internal_table_t *itable, bool sparse)
 	for (size_t entry_id = 0; entry_id < itable->iparams.num_buckets;
 			entry_id++)
 	{
-		maxhash_entry_t *entry = itable->buckets[entry_id].entry_list;
-		if (!sparse || entry)
+		uint32_t id = maxhash_bucket_peek(itable, entry_id)->head;
+		if (!sparse || id != MAXHASH_NIL)
 		{
 			printf("entries in bucket 0x%04lx: ", entry_id);
-			if (!entry)
+			if (id == MAXHASH_NIL)
 				printf("\n");
-			while (entry)
+			while (id != MAXHASH_NIL)
 			{
+				maxhash_entry_t *entry = maxhash_entry_get(itable, id);
 				hash_print_entry(itable, entry);
-				if (entry->next)
+				if (entry->next != MAXHASH_NIL)
 					printf("                          ");
-				entry = entry->next;
+				id = entry->next;
 			}
 		}
 	}
@@ -277,1183 +285,3901 @@ maxhash_err_t maxhash_size(const maxhash_table_t *table, size_t *size)
 
 
 
-maxhash_err_t maxhash_internal_table_init(
-		maxhash_internal_table_t *itable,
-		const maxhash_table_t *table,
-		const maxhash_internal_table_params_t *itable_params,
-		const char *itable_name)
-{
-	memcpy(&itable->iparams, itable_params,
-			sizeof(maxhash_internal_table_params_t));
+#define SLAB_BYTES           (2 * 1024 * 1024)
+#define MIN_SLAB_ENTRIES     64
+#define MIN_INDEX_BITS       6
+/* Slots of the previous index moved into the current one by each insert
+ * while the index is being rehashed.  At least two are needed for the move
+ * to finish before the index next has to grow. */
+#define MIGRATE_SLOTS        8
+/* Marks a slot of the previous index whose entry has since been removed. */
+#define INDEX_TOMBSTONE      UINT32_MAX
 
-	itable->iparams.width_bytes = (itable->iparams.width_bits + 7) / 8;
-	itable->table = table;
-	itable->buckets = calloc(itable_params->num_buckets,
-			sizeof(maxhash_bucket_t));
 
-	if (itable->buckets == NULL)
-	{
-		fprintf(stderr, "Error: failed to allocate hash table memory.\n");
-		return MAXHASH_ERR_ERR;
-	}
 
-	if (strlen(table->tparams.hash_table_name) == 0)
-	{
-		strncpy(itable->iparams.name, itable_name,
-				sizeof(itable->iparams.name));
-	}
-	else
-	{
-		snprintf(itable->iparams.name,
-				sizeof(itable->iparams.name),
-				"%s_%s", table->tparams.hash_table_name, itable_name);
-	}
+static void *alloc_cache_aligned(size_t size)
+{
+	void *ptr;
+	if (posix_memalign(&ptr, CACHE_LINE_BYTES, size) != 0)
+		return NULL;
+	return ptr;
+}
 
-	return MAXHASH_ERR_OK;
+
+
+/* Position at which probing for a hash starts (Fibonacci hashing, so that
+ * the index is decorrelated from bucket IDs, which use the low bits). */
+static inline size_t index_home_bits(uint32_t hash, unsigned index_bits)
+{
+	return (size_t)(((uint64_t)hash * 0x9E3779B97F4A7C15ull) >>
+			(64 - index_bits));
 }
 
 
 
-maxhash_err_t maxhash_internal_sw_init(maxhash_table_t **table,
-		const maxhash_table_params_t *tparams)
+static inline size_t index_home(const maxhash_internal_table_t *itable,
+		uint32_t hash)
 {
-	maxhash_err_t err = MAXHASH_ERR_OK;
+	return index_home_bits(hash, itable->index_bits);
+}
 
-	*table = calloc(1, sizeof(maxhash_table_t));
-	if (*table == NULL)
-		err = MAXHASH_ERR_ERR;
 
-	maxhash_table_t *table_p = *table;
 
-	memcpy(&table_p->tparams, tparams, sizeof(maxhash_table_params_t));
+/*
+ * Concurrent reads (see struct maxhash_read_state).  Each thread keeps to one
+ * reader stripe, assigned the first time it looks something up.
+ */
+static __thread unsigned thread_reader_stripe;
+static unsigned num_reader_threads;
 
-	table_p->tparams.key_width_bytes = (table_p->tparams.key_width_bits + 7) / 8;
-	table_p->load_buffer_select = 1;
 
-	const maxhash_internal_table_params_t *intermediate_params =
-		&tparams->intermediate;
-	const maxhash_internal_table_params_t *values_params =
-		&tparams->values;
 
-	maxhash_internal_table_params_t sw_params = {{0}};
-	sw_params.width_bits = values_params->width_bits;
-	sw_params.width_bytes = values_params->width_bytes;
-	sw_params.num_buckets = intermediate_params->num_buckets;
+static struct maxhash_reader_stripe *reader_enter(
+		struct maxhash_read_state *rs, unsigned *phase)
+{
+	if (thread_reader_stripe == 0)
+		thread_reader_stripe = __atomic_add_fetch(&num_reader_threads, 1,
+				__ATOMIC_RELAXED);
+	struct maxhash_reader_stripe *stripe =
+		&rs->stripes[thread_reader_stripe % MAXHASH_READER_STRIPES];
+
+	/* If the phase flips before we are counted, the writer may not have
+	 * seen us, so count ourselves under the new phase instead. */
+	for (;;)
+	{
+		*phase = __atomic_load_n(&rs->phase, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&stripe->active[*phase], 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&rs->phase, __ATOMIC_SEQ_CST) == *phase)
+			return stripe;
+		__atomic_sub_fetch(&stripe->active[*phase], 1, __ATOMIC_RELEASE);
+	}
+}
 
-	err |= maxhash_internal_table_init(&table_p->sw,
-			table_p, &sw_params, "Software");
-	err |= maxhash_internal_table_init(&table_p->recent,
-			table_p, &sw_params, "Recent");
-	err |= maxhash_internal_table_init(&table_p->intermediate,
-			table_p, intermediate_params, "HashParams");
-	err |= maxhash_internal_table_init(&table_p->values,
-			table_p, values_params, "Values");
 
-	if (err != MAXHASH_ERR_OK)
-		fprintf(stderr, "Error: failed to initialise hash table.\n");
 
-	return err;
+static void reader_exit(struct maxhash_reader_stripe *stripe, unsigned phase)
+{
+	__atomic_sub_fetch(&stripe->active[phase], 1, __ATOMIC_RELEASE);
 }
 
 
 
-maxhash_err_t maxhash_table_params_init(
-		maxhash_table_params_t **tparams)
+/* Wait for the change in progress, if any, to finish.  Changes are kept
+ * short (see write_reserve()), so this only waits for long if the writer is
+ * descheduled in the middle of one. */
+static uint32_t read_begin(const struct maxhash_read_state *rs)
 {
-	*tparams = calloc(1, sizeof(maxhash_table_params_t));
-	if (*tparams == NULL)
-		return MAXHASH_ERR_ERR;
-	return MAXHASH_ERR_OK;
+	uint32_t seq;
+	while ((seq = __atomic_load_n(&rs->seq, __ATOMIC_ACQUIRE)) & 1)
+		;
+	return seq;
 }
 
-maxhash_err_t maxhash_table_params_free(
-		maxhash_table_params_t *tparams)
+
+
+/* Whether a lookup that began at "seq" overlapped a change, so must retry. */
+static bool read_retry(const struct maxhash_read_state *rs, uint32_t seq)
 {
-	free(tparams);
-	return MAXHASH_ERR_OK;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&rs->seq, __ATOMIC_RELAXED) != seq;
 }
 
-maxhash_err_t maxhash_table_params_set_size(
-		maxhash_table_params_t *tparams, size_t size)
+
+
+static bool readers_drained(const struct maxhash_read_state *rs,
+		unsigned phase)
 {
-	tparams->values.num_buckets = size;
-	return MAXHASH_ERR_OK;
+	for (size_t i = 0; i < MAXHASH_READER_STRIPES; i++)
+		if (__atomic_load_n(&rs->stripes[i].active[phase],
+					__ATOMIC_SEQ_CST) != 0)
+			return false;
+	return true;
 }
 
-maxhash_err_t maxhash_table_params_set_key_width_bits(
-		maxhash_table_params_t *tparams, size_t key_width_bits)
+
+
+static void free_retired(struct maxhash_retired *retired)
 {
-	tparams->key_width_bits = key_width_bits;
-	return MAXHASH_ERR_OK;
+	for (size_t i = 0; i < retired->num; i++)
+		free(retired->ptrs[i]);
+	retired->num = 0;
 }
 
-maxhash_err_t maxhash_table_params_set_value_width_bits(
-		maxhash_table_params_t *tparams, size_t value_width_bits)
+
+
+/*
+ * Free what was retired during the previous phase if its lookups have
+ * finished, and start a new phase if there is anything left to free.  Never
+ * waits.
+ */
+static void reclaim_retired(struct maxhash_read_state *rs)
 {
-	tparams->values.width_bits = value_width_bits;
-	return MAXHASH_ERR_OK;
+	unsigned old = rs->phase ^ 1;
+
+	if (rs->retired[0].num == 0 && rs->retired[1].num == 0)
+		return;
+	if (!readers_drained(rs, old))
+		return;
+
+	free_retired(&rs->retired[old]);
+	if (rs->retired[rs->phase].num > 0)
+		__atomic_store_n(&rs->phase, old, __ATOMIC_SEQ_CST);
 }
 
 
 
-maxhash_err_t maxhash_sw_table_init(maxhash_table_t **table,
-		const maxhash_table_params_t *tparams)
+/*
+ * Wait for every lookup that is in progress to finish, and free everything
+ * that has been retired.
+ */
+static void synchronize_readers(struct maxhash_read_state *rs)
 {
-	if (tparams->values.num_buckets == 0)
+	for (int flip = 0; flip < 2; flip++)
 	{
-		fprintf(stderr, "Error: hash table size cannot be zero.\n");
-		return MAXHASH_ERR_ERR;
+		unsigned old = rs->phase ^ 1;
+		while (!readers_drained(rs, old))
+			sched_yield();
+		free_retired(&rs->retired[old]);
+		__atomic_store_n(&rs->phase, old, __ATOMIC_SEQ_CST);
 	}
+}
 
-	if (tparams->key_width_bits == 0)
+
+
+/* Free memory that lookups on other threads may still be reading. */
+static void retire(maxhash_internal_table_t *itable, void *ptr)
+{
+	struct maxhash_read_state *rs = itable->read_state;
+	if (rs == NULL)
 	{
-		fprintf(stderr, "Error: key width cannot be zero.\n");
-		return MAXHASH_ERR_ERR;
+		free(ptr);
+		return;
 	}
 
-	if (tparams->values.width_bits == 0)
+	struct maxhash_retired *retired = &rs->retired[rs->phase];
+	if (retired->num == retired->capacity)
 	{
-		fprintf(stderr, "Error: value width cannot be zero.\n");
-		return MAXHASH_ERR_ERR;
+		size_t capacity = retired->capacity ? retired->capacity * 2 : 16;
+		void **ptrs = realloc(retired->ptrs, capacity * sizeof(void *));
+		if (ptrs == NULL)
+		{
+			synchronize_readers(rs);
+			free(ptr);
+			return;
+		}
+		retired->ptrs = ptrs;
+		retired->capacity = capacity;
 	}
 
-	maxhash_table_params_t params_copy;
-	memset(&params_copy, 0, sizeof(params_copy));
-	strncpy(params_copy.hash_table_name, tparams->hash_table_name,
-			sizeof(params_copy.hash_table_name));
-	params_copy.max_bucket_entries = 1; // FIXME
-	params_copy.jenkins_chunk_width_bytes = 4; // FIXME
-	params_copy.perfect = true; // FIXME
-	params_copy.key_width_bits = tparams->key_width_bits;
-
-	params_copy.intermediate.width_bits = 32; // FIXME
-	if (tparams->intermediate.num_buckets == 0)
-		params_copy.intermediate.num_buckets = tparams->values.num_buckets;
-	else
-		params_copy.intermediate.num_buckets = tparams->intermediate.num_buckets;
+	retired->ptrs[retired->num++] = ptr;
+}
 
-	params_copy.values.width_bits = tparams->values.width_bits;
-	params_copy.values.num_buckets = tparams->values.num_buckets;
 
-	maxhash_err_t err = maxhash_internal_sw_init(table, &params_copy);
 
-	return err;
+static void read_state_free(struct maxhash_read_state *rs)
+{
+	for (int phase = 0; phase < 2; phase++)
+	{
+		free_retired(&rs->retired[phase]);
+		free(rs->retired[phase].ptrs);
+	}
+	free(rs);
 }
 
 
 
-maxhash_err_t maxhash_check_version(maxhash_engine_state_t *es)
+static maxhash_err_t read_state_set(maxhash_internal_table_t *itable,
+		bool enabled)
 {
-	bool has_version = has_constant_string(es, "", "MaxHash_Version");
-	if (!has_version)
-		fprintf(stderr, "*** Warning: MaxHash version is not defined in the MaxFile. ***\n");
+	if (!enabled)
+	{
+		if (itable->read_state != NULL)
+			read_state_free(itable->read_state);
+		itable->read_state = NULL;
+		return MAXHASH_ERR_OK;
+	}
 
-	const char *maxhash_version_maxfile = get_maxfile_string_constant(es, "", "MaxHash_Version");
+	if (itable->read_state != NULL)
+		return MAXHASH_ERR_OK;
 
-	if (!strncmp(maxhash_version_maxfile, UNRELEASED_VERSION_STRING,
-				strlen(UNRELEASED_VERSION_STRING)))
+	itable->read_state = alloc_cache_aligned(sizeof(struct
+				maxhash_read_state));
+	if (itable->read_state == NULL)
 	{
-		fprintf(stderr, "\n*** Warning: MaxFile uses an unreleased version "
-				"of MaxHash. ***\n\n");
+		fprintf(stderr, "Error: failed to allocate memory for concurrent "
+				"reads.\n");
+		return MAXHASH_ERR_ERR;
 	}
-
-	// TODO put version checking back in
+	memset(itable->read_state, 0, sizeof(struct maxhash_read_state));
 
 	return MAXHASH_ERR_OK;
 }
 
 
 
-maxhash_err_t maxhash_check_presence(maxhash_engine_state_t *es,
-		const char *kernel_name, const char *hash_table_name)
+/* Bracket a change to a table that lookups may be reading concurrently. */
+static void write_begin(maxhash_internal_table_t *itable)
 {
-	char full_name[NAME_BUF_LEN] = {0};
-	snprintf(full_name, sizeof(full_name), "%s_%s", kernel_name,
-			hash_table_name);
+	struct maxhash_read_state *rs = itable->read_state;
+	if (rs == NULL)
+		return;
+	__atomic_store_n(&rs->seq, rs->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-	bool hash_present = has_constant_uint64t(es, full_name, "_IsPresent");
-	if (!hash_present)
-	{
-		fprintf(stderr, "Error: there is no MaxHash instance named '%s' in "
-				"the kernel named '%s'.\n", hash_table_name, kernel_name);
-		return MAXHASH_ERR_ERR;
-	}
 
-	return MAXHASH_ERR_OK;
+
+static void write_end(maxhash_internal_table_t *itable)
+{
+	struct maxhash_read_state *rs = itable->read_state;
+	if (rs == NULL)
+		return;
+	__atomic_store_n(&rs->seq, rs->seq + 1, __ATOMIC_RELEASE);
+	reclaim_retired(rs);
 }
 
 
 
-maxhash_err_t maxhash_get_hw_mem_backing_params(
-		maxhash_internal_table_params_t *mem_backing_params,
-		maxhash_engine_state_t *es, const char *full_hash_name, const char
-		*mem_name)
+/*
+ * Keys and values of entries that lookups may be reading are copied with
+ * relaxed atomic loads and stores, a word at a time, since a lookup can read
+ * an entry while it is being written.  What such a lookup reads is thrown
+ * away by read_retry().  Entries are 8-byte aligned, as are their keys and
+ * values (see maxhash_internal_table_init()).
+ */
+static void shared_load(void *dst, const void *src, size_t len)
 {
-	char buf[1024];
-	snprintf(buf, sizeof(buf), "_%s_MemType", mem_name);
-	const char *mem_type = get_maxfile_string_constant(es, full_hash_name, buf);
+	const uint64_t *words = src;
+	uint8_t *d = dst;
 
-	if (!strcmp(mem_type, "FMem"))
-		mem_backing_params->mem_type = MAXHASH_MEM_TYPE_FMEM;
-	else if (!strcmp(mem_type, "DeepFMem"))
+	for (; len >= 8; len -= 8, d += 8)
 	{
-		mem_backing_params->mem_type = MAXHASH_MEM_TYPE_DEEP_FMEM;
-		snprintf(buf, sizeof(buf), "_%s_DeepFMemID", mem_name);
-		int deep_fmem_id = get_maxfile_constant(es, full_hash_name, buf);
-		if (deep_fmem_id < 0 || deep_fmem_id > 15)
-		{
-			fprintf(stderr, "Error: deep FMem ID (%d) is invalid.\n",
-					deep_fmem_id);
-			return MAXHASH_ERR_ERR;
-		}
-		maxhash_init_deep_fmem_fanout(es, deep_fmem_id);
-		mem_backing_params->deep_fmem_id = deep_fmem_id;
+		uint64_t word = __atomic_load_n(words++, __ATOMIC_RELAXED);
+		memcpy(d, &word, 8);
+	}
+	for (const uint8_t *bytes = (const uint8_t *)words; len > 0; len--)
+		*d++ = __atomic_load_n(bytes++, __ATOMIC_RELAXED);
+}
+
+
+
+static void shared_store(void *dst, const void *src, size_t len)
+{
+	uint64_t *words = dst;
+	const uint8_t *s = src;
+
+	for (; len >= 8; len -= 8, s += 8)
+	{
+		uint64_t word;
+		memcpy(&word, s, 8);
+		__atomic_store_n(words++, word, __ATOMIC_RELAXED);
+	}
+	for (uint8_t *bytes = (uint8_t *)words; len > 0; len--)
+		__atomic_store_n(bytes++, *s++, __ATOMIC_RELAXED);
+}
+
+
+
+static bool shared_equal(const void *shared, const void *key, size_t len)
+{
+	const uint64_t *words = shared;
+	const uint8_t *k = key;
+
+	for (; len >= 8; len -= 8, k += 8)
+	{
+		uint64_t word = __atomic_load_n(words++, __ATOMIC_RELAXED);
+		if (memcmp(&word, k, 8) != 0)
+			return false;
+	}
+	for (const uint8_t *bytes = (const uint8_t *)words; len > 0; len--)
+		if (__atomic_load_n(bytes++, __ATOMIC_RELAXED) != *k++)
+			return false;
+	return true;
+}
+
+
+
+/* Write the key or value of an entry. */
+static void entry_store(const maxhash_internal_table_t *itable, void *dst,
+		const void *src, size_t len)
+{
+	if (itable->read_state != NULL)
+		shared_store(dst, src, len);
+	else
+		memcpy(dst, src, len);
+}
+
+
+
+static maxhash_index_slot_t *index_alloc(unsigned index_bits)
+{
+	size_t num_slots = (size_t)1 << index_bits;
+	maxhash_index_slot_t *index = alloc_cache_aligned(num_slots *
+			sizeof(maxhash_index_slot_t));
+	if (index == NULL)
+	{
+		fprintf(stderr, "Error: failed to allocate hash table index.\n");
+		return NULL;
+	}
+	memset(index, 0, num_slots * sizeof(maxhash_index_slot_t));
+	return index;
+}
+
+
+
+/* Concurrent lookups read the mask before the index, so the index must be in
+ * place first.  Their index never shrinks. */
+static void index_publish(maxhash_internal_table_t *itable,
+		maxhash_index_slot_t *index, unsigned index_bits)
+{
+	__atomic_store_n(&itable->index, index, __ATOMIC_RELEASE);
+	itable->index_bits = index_bits;
+	__atomic_store_n(&itable->index_mask, ((size_t)1 << index_bits) - 1,
+			__ATOMIC_RELEASE);
+}
+
+
+
+static void index_place(maxhash_internal_table_t *itable, uint32_t hash,
+		uint32_t entry_id)
+{
+	size_t pos = index_home(itable, hash);
+	while (itable->index[pos].entry_id != MAXHASH_NIL)
+		pos = (pos + 1) & itable->index_mask;
+
+	__atomic_store_n(&itable->index[pos].hash, hash, __ATOMIC_RELAXED);
+	__atomic_store_n(&itable->index[pos].entry_id, entry_id,
+			__ATOMIC_RELEASE);
+}
+
+
+
+/* Move up to "num_slots" slots of the previous index into the current one.
+ * Moved entries stay in the previous index too, so lookups never miss them. */
+static void index_move(maxhash_internal_table_t *itable, size_t num_slots)
+{
+	size_t old_num_slots = itable->old_index_mask + 1;
+	size_t end = old_num_slots - itable->migrate_pos < num_slots ?
+		old_num_slots : itable->migrate_pos + num_slots;
+
+	for (size_t slot = itable->migrate_pos; slot < end; slot++)
+	{
+		uint32_t id = itable->old_index[slot].entry_id;
+		if (id != MAXHASH_NIL && id != INDEX_TOMBSTONE)
+			index_place(itable, itable->old_index[slot].hash, id);
+	}
+	itable->migrate_pos = end;
+}
+
+
+
+/* index_move(), then retire the previous index once all of its slots have
+ * been moved. */
+static void index_migrate(maxhash_internal_table_t *itable, size_t num_slots)
+{
+	index_move(itable, num_slots);
+
+	if (itable->migrate_pos == itable->old_index_mask + 1)
+	{
+		retire(itable, itable->old_index);
+		__atomic_store_n(&itable->old_index, NULL, __ATOMIC_RELEASE);
+	}
+}
+
+
+
+/* Keep the load factor at or below 1/2, so probe sequences stay short.
+ * Entries of the previous index are only counted once they are moved. */
+static bool index_full(const maxhash_internal_table_t *itable)
+{
+	return (itable->num_entries + 1) * 2 > itable->index_mask + 1;
+}
+
+
+
+/* Double the index, replacing it with "index", which has twice as many
+ * slots.  Rather than rehashing every entry at once, the current index
+ * becomes the previous one and is moved across by later inserts. */
+static void index_grow(maxhash_internal_table_t *itable,
+		maxhash_index_slot_t *index)
+{
+	if (itable->old_index != NULL)
+		index_migrate(itable, SIZE_MAX);
+
+	/* As for the current index, the previous index is in place before its
+	 * mask. */
+	__atomic_store_n(&itable->old_index, itable->index, __ATOMIC_RELEASE);
+	__atomic_store_n(&itable->old_index_mask, itable->index_mask,
+			__ATOMIC_RELEASE);
+	itable->migrate_pos = 0;
+
+	index_publish(itable, index, itable->index_bits + 1);
+}
+
+
+
+static maxhash_err_t index_insert(maxhash_internal_table_t *itable,
+		uint32_t hash, uint32_t entry_id)
+{
+	if (itable->old_index != NULL)
+		index_migrate(itable, MIGRATE_SLOTS);
+
+	if (index_full(itable))
+	{
+		maxhash_index_slot_t *index = index_alloc(itable->index_bits + 1);
+		if (index == NULL)
+			return MAXHASH_ERR_ERR;
+		index_grow(itable, index);
+	}
+
+	index_place(itable, hash, entry_id);
+	return MAXHASH_ERR_OK;
+}
+
+
+
+/* Drop the previous index, for a table that is being emptied. */
+static void index_discard_old(maxhash_internal_table_t *itable)
+{
+	if (itable->old_index == NULL)
+		return;
+	retire(itable, itable->old_index);
+	__atomic_store_n(&itable->old_index, NULL, __ATOMIC_RELEASE);
+}
+
+
+
+static void index_erase(maxhash_internal_table_t *itable, uint32_t hash,
+		uint32_t entry_id)
+{
+	/* The previous index is being moved across in slot order, so a
+	 * backward shift could move an entry to a slot that has already been
+	 * moved.  A tombstone is left instead. */
+	if (itable->old_index != NULL)
+	{
+		size_t old_mask = itable->old_index_mask;
+		unsigned old_bits = __builtin_ctzll((unsigned long long)old_mask + 1);
+		for (size_t pos = index_home_bits(hash, old_bits);
+				itable->old_index[pos].entry_id != MAXHASH_NIL;
+				pos = (pos + 1) & old_mask)
+		{
+			if (itable->old_index[pos].entry_id == entry_id)
+			{
+				__atomic_store_n(&itable->old_index[pos].entry_id,
+						INDEX_TOMBSTONE, __ATOMIC_RELEASE);
+				break;
+			}
+		}
+	}
+
+	/* An entry that has not been moved yet is only in the previous index. */
+	size_t mask = itable->index_mask;
+	size_t pos = index_home(itable, hash);
+	while (itable->index[pos].entry_id != entry_id)
+	{
+		if (itable->index[pos].entry_id == MAXHASH_NIL)
+			return;
+		pos = (pos + 1) & mask;
+	}
+
+	/* Backward-shift deletion: move later members of the probe sequence into
+	 * the hole, so that the current index needs no tombstones. */
+	size_t next = (pos + 1) & mask;
+	while (itable->index[next].entry_id != MAXHASH_NIL)
+	{
+		size_t home = index_home(itable, itable->index[next].hash);
+		if (((next - home) & mask) >= ((next - pos) & mask))
+		{
+			__atomic_store_n(&itable->index[pos].hash,
+					itable->index[next].hash, __ATOMIC_RELAXED);
+			__atomic_store_n(&itable->index[pos].entry_id,
+					itable->index[next].entry_id, __ATOMIC_RELEASE);
+			pos = next;
+		}
+		next = (next + 1) & mask;
+	}
+
+	__atomic_store_n(&itable->index[pos].entry_id, MAXHASH_NIL,
+			__ATOMIC_RELEASE);
+}
+
+
+
+/* Whether the next entry allocated needs a new slab. */
+static bool slab_full(const maxhash_internal_table_t *itable)
+{
+	return itable->free_list == MAXHASH_NIL &&
+		itable->entries_used >> itable->slab_shift == itable->num_slabs;
+}
+
+
+
+/* Add a slab to the arena.  Slabs are kept across clears, so this only
+ * happens when the table grows beyond its previous high-water mark. */
+static maxhash_err_t slab_add(maxhash_internal_table_t *itable)
+{
+	size_t slab = itable->num_slabs;
+	if ((uint64_t)(slab + 1) << itable->slab_shift > UINT32_MAX)
+		return MAXHASH_ERR_ERR;
+
+	uint8_t *new_slab = alloc_cache_aligned(itable->entry_stride <<
+			itable->slab_shift);
+	if (new_slab == NULL)
+		return MAXHASH_ERR_ERR;
+
+	/* Concurrent lookups may still be reading the old slab array, so it is
+	 * copied rather than reallocated in place.  Lookups only follow entry
+	 * IDs that were published after the slab array that holds them, so a
+	 * new slab array can be published at any time. */
+	uint8_t **old_slabs = itable->slabs;
+	uint8_t **slabs;
+	if (itable->read_state == NULL)
+		slabs = realloc(old_slabs, (slab + 1) * sizeof(uint8_t *));
+	else
+	{
+		slabs = malloc((slab + 1) * sizeof(uint8_t *));
+		if (slabs != NULL && slab > 0)
+			memcpy(slabs, old_slabs, slab * sizeof(uint8_t *));
+	}
+	if (slabs == NULL)
+	{
+		free(new_slab);
+		return MAXHASH_ERR_ERR;
+	}
+
+	slabs[slab] = new_slab;
+	__atomic_store_n(&itable->slabs, slabs, __ATOMIC_RELEASE);
+	if (itable->read_state != NULL && old_slabs != NULL)
+		retire(itable, old_slabs);
+	itable->num_slabs++;
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+static uint32_t entry_alloc(maxhash_internal_table_t *itable)
+{
+	if (itable->free_list != MAXHASH_NIL)
+	{
+		uint32_t entry_id = itable->free_list;
+		itable->free_list = maxhash_entry_get(itable, entry_id)->next;
+		return entry_id;
+	}
+
+	if (slab_full(itable) && slab_add(itable) != MAXHASH_ERR_OK)
+		return MAXHASH_NIL;
+
+	return itable->entries_used++;
+}
+
+
+
+/*
+ * Allocate what a put to a table with concurrent reads enabled may need
+ * before write_begin(), so that lookups do not wait on the allocator: a slab
+ * for the new entry, and a larger index, which is swapped in on its own.
+ * Entries left to move out of the previous index are moved first, and only
+ * the swap is bracketed, so that it takes constant time.
+ */
+static maxhash_err_t write_reserve(maxhash_internal_table_t *itable)
+{
+	if (itable->read_state == NULL)
+		return MAXHASH_ERR_OK;
+
+	if (slab_full(itable) && slab_add(itable) != MAXHASH_ERR_OK)
+	{
+		fprintf(stderr, "Error: failed to allocate hash table entry.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	if (itable->index == NULL || !index_full(itable))
+		return MAXHASH_ERR_OK;
+
+	if (itable->old_index != NULL)
+		index_move(itable, SIZE_MAX);
+	maxhash_index_slot_t *index = index_alloc(itable->index_bits + 1);
+	if (index == NULL)
+		return MAXHASH_ERR_ERR;
+
+	write_begin(itable);
+	index_grow(itable, index);
+	write_end(itable);
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+static void entry_free(maxhash_internal_table_t *itable, uint32_t entry_id)
+{
+	maxhash_entry_t *entry = maxhash_entry_get(itable, entry_id);
+	entry->in_use = false;
+	entry->next = itable->free_list;
+	itable->free_list = entry_id;
+}
+
+
+
+uint32_t maxhash_internal_hash(const maxhash_internal_table_t *itable,
+		const void *key)
+{
+	return maxhash_function_jenkins(key,
+			itable->table->tparams.key_width_bytes, 0,
+			itable->table->tparams.jenkins_chunk_width_bytes);
+}
+
+
+
+/* Probe one index of an indexed table for a key. */
+static uint32_t index_find(const maxhash_internal_table_t *itable,
+		const maxhash_index_slot_t *index, size_t mask, const void *key,
+		uint32_t hash, size_t bucket_id)
+{
+	size_t key_width_bytes = itable->table->tparams.key_width_bytes;
+	unsigned index_bits = __builtin_ctzll((unsigned long long)mask + 1);
+
+	for (size_t pos = index_home_bits(hash, index_bits);; pos = (pos + 1) &
+			mask)
+	{
+		const maxhash_index_slot_t *slot = &index[pos];
+		if (slot->entry_id == MAXHASH_NIL)
+			return MAXHASH_NIL;
+		if (slot->hash != hash || slot->entry_id == INDEX_TOMBSTONE)
+			continue;
+		const maxhash_entry_t *e = maxhash_entry_get(itable, slot->entry_id);
+		if (e->bucket_id == bucket_id &&
+				!memcmp(key, maxhash_entry_key(e), key_width_bytes))
+			return slot->entry_id;
+	}
+}
+
+
+
+/*
+ * Find the entry with the given key in the given bucket.  For indexed tables,
+ * "hash" must be the result of maxhash_internal_hash() for the key; it is
+ * ignored otherwise.
+ */
+uint32_t maxhash_internal_lookup(const maxhash_internal_table_t *itable,
+		const void *key, uint32_t hash, size_t bucket_id)
+{
+	size_t key_width_bytes = itable->table->tparams.key_width_bytes;
+
+	if (itable->index)
+	{
+		uint32_t id = index_find(itable, itable->index, itable->index_mask,
+				key, hash, bucket_id);
+		if (id == MAXHASH_NIL && itable->old_index != NULL)
+			id = index_find(itable, itable->old_index, itable->old_index_mask,
+					key, hash, bucket_id);
+		return id;
+	}
+
+	for (uint32_t id = maxhash_bucket_peek(itable, bucket_id)->head;
+			id != MAXHASH_NIL;)
+	{
+		const maxhash_entry_t *e = maxhash_entry_get(itable, id);
+		if (!memcmp(key, maxhash_entry_key(e), key_width_bytes))
+			return id;
+		id = e->next;
+	}
+
+	return MAXHASH_NIL;
+}
+
+
+
+static uint32_t lookup_in_bucket(const maxhash_internal_table_t *itable,
+		const void *key, size_t bucket_id)
+{
+	uint32_t hash = itable->index ? maxhash_internal_hash(itable, key) : 0;
+	return maxhash_internal_lookup(itable, key, hash, bucket_id);
+}
+
+
+
+/*
+ * Probe one index of a table that another thread may be changing.  Probing
+ * stops after a full cycle in case slots are being moved.  Only the software
+ * table is read concurrently, and its buckets follow from the hash, so a
+ * matching key is in the right bucket and the entry's header is not read.
+ */
+static const maxhash_entry_t *concurrent_find(
+		const maxhash_internal_table_t *itable,
+		const maxhash_index_slot_t *index, size_t mask, const void *key,
+		uint32_t hash)
+{
+	unsigned index_bits = __builtin_ctzll((unsigned long long)mask + 1);
+	size_t key_width_bytes = itable->table->tparams.key_width_bytes;
+	size_t slab_mask = ((size_t)1 << itable->slab_shift) - 1;
+
+	size_t pos = index_home_bits(hash, index_bits);
+	for (size_t probes = 0; probes <= mask; probes++, pos = (pos + 1) & mask)
+	{
+		uint32_t id = __atomic_load_n(&index[pos].entry_id,
+				__ATOMIC_ACQUIRE);
+		if (id == MAXHASH_NIL)
+			return NULL;
+		if (__atomic_load_n(&index[pos].hash, __ATOMIC_RELAXED) != hash ||
+				id == INDEX_TOMBSTONE)
+			continue;
+
+		uint8_t *const *slabs = __atomic_load_n(&itable->slabs,
+				__ATOMIC_ACQUIRE);
+		const maxhash_entry_t *e = (const maxhash_entry_t *)(slabs[id >>
+				itable->slab_shift] + (id & slab_mask) * itable->entry_stride);
+		if (shared_equal(maxhash_entry_key(e), key, key_width_bytes))
+			return e;
+	}
+
+	return NULL;
+}
+
+
+
+/*
+ * maxhash_internal_lookup() for an indexed table that another thread may be
+ * changing.  Returns the entry, which is only valid if read_retry() then
+ * fails.  Each mask is read before its index, so the index is at least as
+ * large as the mask says.
+ */
+static const maxhash_entry_t *concurrent_lookup(
+		const maxhash_internal_table_t *itable, const void *key,
+		uint32_t hash)
+{
+	size_t mask = __atomic_load_n(&itable->index_mask, __ATOMIC_ACQUIRE);
+	const maxhash_index_slot_t *index = __atomic_load_n(&itable->index,
+			__ATOMIC_ACQUIRE);
+	const maxhash_entry_t *e = concurrent_find(itable, index, mask, key,
+			hash);
+	if (e != NULL)
+		return e;
+
+	size_t old_mask = __atomic_load_n(&itable->old_index_mask,
+			__ATOMIC_ACQUIRE);
+	const maxhash_index_slot_t *old_index = __atomic_load_n(
+			&itable->old_index, __ATOMIC_ACQUIRE);
+	if (old_index == NULL)
+		return NULL;
+	return concurrent_find(itable, old_index, old_mask, key, hash);
+}
+
+
+
+/*
+ * Look up a hashed key in a table with concurrent reads enabled, copying its
+ * value to "value" unless that is NULL.  Returns whether the key was found.
+ */
+static bool concurrent_get_hashed(const maxhash_internal_table_t *itable,
+		const void *key, uint32_t hash, void *value)
+{
+	struct maxhash_read_state *rs = itable->read_state;
+	bool found;
+	uint32_t seq;
+
+	unsigned phase;
+	struct maxhash_reader_stripe *stripe = reader_enter(rs, &phase);
+	do
+	{
+		seq = read_begin(rs);
+		const maxhash_entry_t *e = concurrent_lookup(itable, key, hash);
+		found = e != NULL;
+		if (found && value != NULL)
+			shared_load(value, maxhash_entry_value(itable, e),
+					itable->iparams.width_bytes);
+	} while (read_retry(rs, seq));
+	reader_exit(stripe, phase);
+
+	return found;
+}
+
+
+
+static bool concurrent_get(const maxhash_internal_table_t *itable,
+		const void *key, void *value)
+{
+	return concurrent_get_hashed(itable, key,
+			maxhash_internal_hash(itable, key), value);
+}
+
+
+
+maxhash_err_t maxhash_internal_table_init(
+		maxhash_internal_table_t *itable,
+		const maxhash_table_t *table,
+		const maxhash_internal_table_params_t *itable_params,
+		const char *itable_name)
+{
+	memcpy(&itable->iparams, itable_params,
+			sizeof(maxhash_internal_table_params_t));
+
+	itable->iparams.width_bytes = (itable->iparams.width_bits + 7) / 8;
+	itable->table = table;
+	itable->buckets = calloc(itable_params->num_buckets,
+			sizeof(maxhash_bucket_t));
+
+	if (itable->buckets == NULL)
+	{
+		fprintf(stderr, "Error: failed to allocate hash table memory.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	size_t key_bytes = (table->tparams.key_width_bytes + 7) & ~(size_t)7;
+	itable->value_offset = ENTRY_HEADER_BYTES + key_bytes;
+	itable->entry_stride = (itable->value_offset +
+			itable->iparams.width_bytes + 7) & ~(size_t)7;
+	itable->entries_used = 1; /* Entry 0 is MAXHASH_NIL. */
+
+	/* Size slabs from the record size, rounding down to a power of two so
+	 * that entry IDs split into a slab number and an offset. */
+	size_t slab_entries = MIN_SLAB_ENTRIES;
+	while (slab_entries * 2 * itable->entry_stride <= SLAB_BYTES)
+		slab_entries *= 2;
+	itable->slab_shift = 0;
+	while (((size_t)1 << itable->slab_shift) < slab_entries)
+		itable->slab_shift++;
+
+	if (itable->iparams.is_indexed)
+	{
+		maxhash_index_slot_t *index = index_alloc(MIN_INDEX_BITS);
+		if (index == NULL)
+			return MAXHASH_ERR_ERR;
+		index_publish(itable, index, MIN_INDEX_BITS);
+	}
+
+	if (strlen(table->tparams.hash_table_name) == 0)
+	{
+		strncpy(itable->iparams.name, itable_name,
+				sizeof(itable->iparams.name));
+	}
+	else if (snprintf(itable->iparams.name, sizeof(itable->iparams.name),
+				"%s_%s", table->tparams.hash_table_name, itable_name) >=
+			(int)sizeof(itable->iparams.name))
+	{
+		fprintf(stderr, "Error: name of the \"%s\" table of \"%s\" is too "
+				"long.\n", itable_name, table->tparams.hash_table_name);
+		return MAXHASH_ERR_ERR;
+	}
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_internal_sw_init(maxhash_table_t **table,
+		const maxhash_table_params_t *tparams)
+{
+	maxhash_err_t err = MAXHASH_ERR_OK;
+
+	*table = calloc(1, sizeof(maxhash_table_t));
+	if (*table == NULL)
+		err = MAXHASH_ERR_ERR;
+
+	maxhash_table_t *table_p = *table;
+
+	memcpy(&table_p->tparams, tparams, sizeof(maxhash_table_params_t));
+
+	table_p->tparams.key_width_bytes = (table_p->tparams.key_width_bits + 7) / 8;
+	table_p->load_buffer_select = 1;
+
+	const maxhash_internal_table_params_t *intermediate_params =
+		&tparams->intermediate;
+	const maxhash_internal_table_params_t *values_params =
+		&tparams->values;
+
+	maxhash_internal_table_params_t sw_params = {{0}};
+	sw_params.width_bits = values_params->width_bits;
+	sw_params.width_bytes = values_params->width_bytes;
+	sw_params.num_buckets = intermediate_params->num_buckets;
+	sw_params.is_indexed = true;
+
+	err |= maxhash_internal_table_init(&table_p->sw,
+			table_p, &sw_params, "Software");
+	err |= maxhash_internal_table_init(&table_p->recent,
+			table_p, &sw_params, "Recent");
+	err |= maxhash_internal_table_init(&table_p->intermediate,
+			table_p, intermediate_params, "HashParams");
+	err |= maxhash_internal_table_init(&table_p->values,
+			table_p, values_params, "Values");
+
+	for (size_t way = 0; way < maxhash_num_ways(tparams); way++)
+	{
+		char way_name[NAME_BUF_LEN];
+		snprintf(way_name, sizeof(way_name), "Buckets%zu", way);
+		err |= maxhash_internal_table_init(&table_p->ways[way], table_p,
+				&tparams->ways[way], way_name);
+	}
+
+	if (err == MAXHASH_ERR_OK)
+		err |= read_state_set(&table_p->sw, tparams->concurrent_reads);
+
+	if (err != MAXHASH_ERR_OK)
+		fprintf(stderr, "Error: failed to initialise hash table.\n");
+
+	return err;
+}
+
+
+
+maxhash_err_t maxhash_table_params_init(
+		maxhash_table_params_t **tparams)
+{
+	*tparams = calloc(1, sizeof(maxhash_table_params_t));
+	if (*tparams == NULL)
+		return MAXHASH_ERR_ERR;
+	(*tparams)->num_threads = 1;
+	(*tparams)->incremental_puts = true;
+	return MAXHASH_ERR_OK;
+}
+
+maxhash_err_t maxhash_table_params_free(
+		maxhash_table_params_t *tparams)
+{
+	free(tparams);
+	return MAXHASH_ERR_OK;
+}
+
+maxhash_err_t maxhash_table_params_set_size(
+		maxhash_table_params_t *tparams, size_t size)
+{
+	tparams->values.num_buckets = size;
+	return MAXHASH_ERR_OK;
+}
+
+maxhash_err_t maxhash_table_params_set_key_width_bits(
+		maxhash_table_params_t *tparams, size_t key_width_bits)
+{
+	tparams->key_width_bits = key_width_bits;
+	return MAXHASH_ERR_OK;
+}
+
+maxhash_err_t maxhash_table_params_set_value_width_bits(
+		maxhash_table_params_t *tparams, size_t value_width_bits)
+{
+	tparams->values.width_bits = value_width_bits;
+	return MAXHASH_ERR_OK;
+}
+
+maxhash_err_t maxhash_table_params_set_num_intermediate_entries(
+		maxhash_table_params_t *tparams, size_t num_intermediate_entries)
+{
+	tparams->intermediate.num_buckets = num_intermediate_entries;
+	return MAXHASH_ERR_OK;
+}
+
+maxhash_err_t maxhash_table_params_set_jenkins_chunk_width_bits(
+		maxhash_table_params_t *tparams, size_t jenkins_chunk_width_bits)
+{
+	if (jenkins_chunk_width_bits == 0 || jenkins_chunk_width_bits >
+			MAXHASH_JENKINS_MAX_CHUNK_BYTES * 8)
+	{
+		fprintf(stderr, "Error: Jenkins chunk width must be between 1 and %d "
+				"bits.\n", MAXHASH_JENKINS_MAX_CHUNK_BYTES * 8);
+		return MAXHASH_ERR_ERR;
+	}
+
+	tparams->jenkins_chunk_width_bytes = (jenkins_chunk_width_bits + 7) / 8;
+	return MAXHASH_ERR_OK;
+}
+
+maxhash_err_t maxhash_table_params_set_num_threads(
+		maxhash_table_params_t *tparams, size_t num_threads)
+{
+	if (num_threads == 0)
+	{
+		fprintf(stderr, "Error: number of threads cannot be zero.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	tparams->num_threads = num_threads;
+	return MAXHASH_ERR_OK;
+}
+
+maxhash_err_t maxhash_table_params_set_incremental_puts(
+		maxhash_table_params_t *tparams, bool incremental_puts)
+{
+	tparams->incremental_puts = incremental_puts;
+	return MAXHASH_ERR_OK;
+}
+
+maxhash_err_t maxhash_table_params_set_concurrent_reads(
+		maxhash_table_params_t *tparams, bool concurrent_reads)
+{
+	tparams->concurrent_reads = concurrent_reads;
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_sw_table_init(maxhash_table_t **table,
+		const maxhash_table_params_t *tparams)
+{
+	if (tparams->values.num_buckets == 0)
+	{
+		fprintf(stderr, "Error: hash table size cannot be zero.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	if (tparams->key_width_bits == 0)
+	{
+		fprintf(stderr, "Error: key width cannot be zero.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	if (tparams->values.width_bits == 0)
+	{
+		fprintf(stderr, "Error: value width cannot be zero.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	maxhash_table_params_t params_copy;
+	memset(&params_copy, 0, sizeof(params_copy));
+	strncpy(params_copy.hash_table_name, tparams->hash_table_name,
+			sizeof(params_copy.hash_table_name));
+	params_copy.max_bucket_entries = 1; // FIXME
+	params_copy.jenkins_chunk_width_bytes =
+		tparams->jenkins_chunk_width_bytes ? tparams->jenkins_chunk_width_bytes :
+		4;
+	params_copy.perfect = true; // FIXME
+	params_copy.key_width_bits = tparams->key_width_bits;
+	params_copy.num_threads = tparams->num_threads;
+	params_copy.incremental_puts = tparams->incremental_puts;
+	params_copy.concurrent_reads = tparams->concurrent_reads;
+
+	params_copy.intermediate.width_bits = 32; // FIXME
+	if (tparams->intermediate.num_buckets == 0)
+		params_copy.intermediate.num_buckets = tparams->values.num_buckets;
+	else
+		params_copy.intermediate.num_buckets = tparams->intermediate.num_buckets;
+
+	params_copy.values.width_bits = tparams->values.width_bits;
+	params_copy.values.num_buckets = tparams->values.num_buckets;
+
+	maxhash_err_t err = maxhash_internal_sw_init(table, &params_copy);
+
+	return err;
+}
+
+
+
+maxhash_err_t maxhash_check_version(maxhash_engine_state_t *es)
+{
+	bool has_version = has_constant_string(es, "", "MaxHash_Version");
+	if (!has_version)
+		fprintf(stderr, "*** Warning: MaxHash version is not defined in the MaxFile. ***\n");
+
+	const char *maxhash_version_maxfile = get_maxfile_string_constant(es, "", "MaxHash_Version");
+
+	if (!strncmp(maxhash_version_maxfile, UNRELEASED_VERSION_STRING,
+				strlen(UNRELEASED_VERSION_STRING)))
+	{
+		fprintf(stderr, "\n*** Warning: MaxFile uses an unreleased version "
+				"of MaxHash. ***\n\n");
+	}
+
+	// TODO put version checking back in
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_check_presence(maxhash_engine_state_t *es,
+		const char *kernel_name, const char *hash_table_name)
+{
+	char full_name[NAME_BUF_LEN] = {0};
+	snprintf(full_name, sizeof(full_name), "%s_%s", kernel_name,
+			hash_table_name);
+
+	bool hash_present = has_constant_uint64t(es, full_name, "_IsPresent");
+	if (!hash_present)
+	{
+		fprintf(stderr, "Error: there is no MaxHash instance named '%s' in "
+				"the kernel named '%s'.\n", hash_table_name, kernel_name);
+		return MAXHASH_ERR_ERR;
+	}
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_get_hw_mem_backing_params(
+		maxhash_internal_table_params_t *mem_backing_params,
+		maxhash_engine_state_t *es, const char *full_hash_name, const char
+		*mem_name)
+{
+	char buf[1024];
+	snprintf(buf, sizeof(buf), "_%s_MemType", mem_name);
+	const char *mem_type = get_maxfile_string_constant(es, full_hash_name, buf);
+
+	if (!strcmp(mem_type, "FMem"))
+		mem_backing_params->mem_type = MAXHASH_MEM_TYPE_FMEM;
+	else if (!strcmp(mem_type, "DeepFMem"))
+	{
+		mem_backing_params->mem_type = MAXHASH_MEM_TYPE_DEEP_FMEM;
+		snprintf(buf, sizeof(buf), "_%s_DeepFMemID", mem_name);
+		int deep_fmem_id = get_maxfile_constant(es, full_hash_name, buf);
+		if (deep_fmem_id < 0 || deep_fmem_id > 15)
+		{
+			fprintf(stderr, "Error: deep FMem ID (%d) is invalid.\n",
+					deep_fmem_id);
+			return MAXHASH_ERR_ERR;
+		}
+		mem_backing_params->deep_fmem_id = deep_fmem_id;
 	}
 	else if (!strcmp(mem_type, "LMem"))
 	{
-		mem_backing_params->mem_type = MAXHASH_MEM_TYPE_LMEM;
-		snprintf(buf, sizeof(buf), "_%s_BaseAddressBursts", mem_name);
-		mem_backing_params->base_address_bursts = get_maxfile_constant(es,
-				full_hash_name, buf);
+		mem_backing_params->mem_type = MAXHASH_MEM_TYPE_LMEM;
+		snprintf(buf, sizeof(buf), "_%s_BaseAddressBursts", mem_name);
+		mem_backing_params->base_address_bursts = get_maxfile_constant(es,
+				full_hash_name, buf);
+	}
+	else
+	{
+		fprintf(stderr, "Error: hash table memory type is invalid.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	snprintf(buf, sizeof(buf), "_%s_Width", mem_name);
+	int width_bits = get_maxfile_constant(es, full_hash_name, buf);
+
+	if (width_bits <= 0)
+	{
+		fprintf(stderr, "Error: table entry width in hardware hash table "
+				"(%d) is invalid.\n", width_bits);
+		return MAXHASH_ERR_ERR;
+	}
+
+	mem_backing_params->width_bits  = width_bits;
+	mem_backing_params->width_bytes = (width_bits + 7) / 8;
+
+	snprintf(buf, sizeof(buf), "_%s_NumBuckets", mem_name);
+	int num_buckets = get_maxfile_constant(es, full_hash_name, buf);
+
+	if (num_buckets <= 0)
+	{
+		fprintf(stderr, "Error: number of buckets in hardware hash table "
+				"(%d) is invalid.\n", num_buckets);
+		return MAXHASH_ERR_ERR;
+	}
+
+	mem_backing_params->num_buckets = num_buckets;
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_get_hw_params(maxhash_table_params_t *tparams,
+		maxhash_engine_state_t *es,
+		const char *kernel_name,
+		const char *hash_table_name)
+{
+	maxhash_err_t err = MAXHASH_ERR_OK;
+
+	err |= maxhash_check_version(es);
+	err |= maxhash_check_presence(es, kernel_name, hash_table_name);
+
+	if (err != MAXHASH_ERR_OK)
+		return err;
+
+	char full_name[NAME_BUF_LEN] = {0};
+	snprintf(full_name, sizeof(full_name), "%s_%s", kernel_name,
+			hash_table_name);
+
+	int max_bucket_entries       = get_maxfile_constant(es, full_name,
+			"_MaxBucketEntries");
+	int perfect                  = get_maxfile_constant(es, full_name,
+			"_Perfect");
+	int is_double_buffered       = get_maxfile_constant(es, full_name,
+			"_IsDoubleBuffered");
+	int key_width_bits           = get_maxfile_constant(es, full_name,
+			"_KeyWidth");
+	int jenkins_chunk_width_bits = get_maxfile_constant(es, full_name,
+			"_JenkinsChunkWidth");
+
+	if (max_bucket_entries <= 0)
+	{
+		fprintf(stderr, "Error: maximum bucket entries in hardware hash table "
+				"(%d) is invalid.\n", max_bucket_entries);
+		return MAXHASH_ERR_ERR;
+	}
+
+	if (perfect < 0 || perfect > 1)
+	{
+		fprintf(stderr, "Error: value of perfect flag (%d) is invalid.\n",
+				perfect);
+		return MAXHASH_ERR_ERR;
+	}
+
+	if (key_width_bits <= 0)
+	{
+		fprintf(stderr, "Error: key width in hardware hash table (%d) is "
+				"invalid.\n", key_width_bits);
+		return MAXHASH_ERR_ERR;
+	}
+
+	if (jenkins_chunk_width_bits <= 0 || jenkins_chunk_width_bits % 8 != 0 ||
+			jenkins_chunk_width_bits > MAXHASH_JENKINS_MAX_CHUNK_BYTES * 8)
+	{
+		fprintf(stderr, "Error: Jenkins chunk width in hardware hash table "
+				"(%d) is invalid.\n", jenkins_chunk_width_bits);
+		return MAXHASH_ERR_ERR;
+	}
+
+	maxhash_internal_table_params_t *intermediate_params = &tparams->intermediate;
+	maxhash_internal_table_params_t *values_params = &tparams->values;
+
+	if (perfect == 1 && max_bucket_entries == 1)
+	{
+		err |= maxhash_get_hw_mem_backing_params(intermediate_params, es,
+				full_name, "HashParams");
+		err |= maxhash_get_hw_mem_backing_params(values_params, es,
+				full_name, "Values");
+
+		if (intermediate_params->mem_type == MAXHASH_MEM_TYPE_LMEM
+				|| values_params->mem_type == MAXHASH_MEM_TYPE_LMEM)
+			es->lmem_burst_size_bytes = get_maxfile_global_constant(es,
+					"MemCtrlPro_DataBurstSizeInBytes");
+
+		int validate_results = get_maxfile_constant(es, full_name,
+				"_ValidateResults");
+
+		if (validate_results < 0 || validate_results > 1)
+		{
+			fprintf(stderr, "Error: validate keys value in hardware hash "
+					"table (%d) is invalid.\n", validate_results);
+			return MAXHASH_ERR_ERR;
+		}
+
+		intermediate_params->validate_results = false;
+		values_params->validate_results = validate_results == 1 ? true : false;
+	}
+	else if (perfect == 0 && max_bucket_entries <= MAXHASH_MAX_WAYS)
+	{
+		/* Each way of a collision-handling table is a memory of its own, and
+		 * every way has the geometry of the first. */
+		for (int way = 0; way < max_bucket_entries; way++)
+		{
+			maxhash_internal_table_params_t *way_params = &tparams->ways[way];
+			char mem_name[NAME_BUF_LEN];
+			snprintf(mem_name, sizeof(mem_name), "Buckets%d", way);
+
+			err |= maxhash_get_hw_mem_backing_params(way_params, es,
+					full_name, mem_name);
+			if (err != MAXHASH_ERR_OK)
+				return err;
+			way_params->validate_results = true;
+
+			if (way_params->mem_type != tparams->ways[0].mem_type ||
+					way_params->width_bits != tparams->ways[0].width_bits ||
+					way_params->num_buckets != tparams->ways[0].num_buckets)
+			{
+				fprintf(stderr, "Error: way %d of hardware hash table differs "
+						"from way 0.\n", way);
+				return MAXHASH_ERR_ERR;
+			}
+		}
+
+		if (tparams->ways[0].mem_type == MAXHASH_MEM_TYPE_LMEM)
+			es->lmem_burst_size_bytes = get_maxfile_global_constant(es,
+					"MemCtrlPro_DataBurstSizeInBytes");
+
+		*values_params = tparams->ways[0];
+		values_params->mem_type = MAXHASH_MEM_TYPE_UNDEFINED;
+		memset(intermediate_params, 0, sizeof(*intermediate_params));
+		intermediate_params->num_buckets = values_params->num_buckets;
+	}
+	else
+	{
+		fprintf(stderr, "Error: hardware hash tables with %d entries per "
+				"bucket are not supported (perfect: %d, at most %d ways).\n",
+				max_bucket_entries, perfect, MAXHASH_MAX_WAYS);
+		return MAXHASH_ERR_ERR;
+	}
+
+	tparams->engine_state              = es;
+	tparams->max_bucket_entries        = max_bucket_entries;
+	tparams->perfect                   = perfect;
+	tparams->is_double_buffered        = is_double_buffered;
+	tparams->key_width_bits            = key_width_bits;
+	tparams->key_width_bytes           = (key_width_bits + 7) / 8;
+	tparams->jenkins_chunk_width_bytes = (jenkins_chunk_width_bits + 7) / 8;
+
+	return err;
+}
+
+
+
+/* Whether two engines have the same hardware table, as far as commits go. */
+static bool same_hw_params(const maxhash_table_params_t *first,
+		const maxhash_table_params_t *second)
+{
+	return first->max_bucket_entries == second->max_bucket_entries &&
+		first->perfect == second->perfect &&
+		first->is_double_buffered == second->is_double_buffered &&
+		first->key_width_bits == second->key_width_bits &&
+		first->jenkins_chunk_width_bytes ==
+			second->jenkins_chunk_width_bytes &&
+		first->engine_state->lmem_burst_size_bytes ==
+			second->engine_state->lmem_burst_size_bytes &&
+		!memcmp(&first->intermediate, &second->intermediate,
+				sizeof(first->intermediate)) &&
+		!memcmp(&first->values, &second->values, sizeof(first->values)) &&
+		!memcmp(first->ways, second->ways, sizeof(first->ways));
+}
+
+
+
+maxhash_err_t maxhash_hw_table_init(maxhash_table_t **table,
+		const char *kernel_name, const char *hash_table_name,
+		maxhash_engine_state_t *es)
+{
+	return maxhash_hw_table_init_replicated(table, kernel_name,
+			hash_table_name, &es, 1);
+}
+
+
+
+maxhash_err_t maxhash_hw_table_init_replicated(maxhash_table_t **table,
+		const char *kernel_name, const char *hash_table_name,
+		maxhash_engine_state_t **engine_states, size_t num_engines)
+{
+	maxhash_err_t err = MAXHASH_ERR_OK;
+
+	if (num_engines == 0 || num_engines > MAXHASH_MAX_REPLICAS)
+	{
+		fprintf(stderr, "Error: number of engines (%zu) is invalid; at most "
+				"%d are supported.\n", num_engines, MAXHASH_MAX_REPLICAS);
+		return MAXHASH_ERR_ERR;
+	}
+
+	maxhash_table_params_t tparams, replica_tparams;
+
+	/* Every engine must have the same table as the first one. */
+	for (size_t i = 0; i < num_engines; i++)
+	{
+		maxhash_table_params_t *params = i == 0 ? &tparams : &replica_tparams;
+		memset(params, 0, sizeof(*params));
+		snprintf(params->kernel_name, sizeof(params->kernel_name), "%s",
+				kernel_name);
+		snprintf(params->hash_table_name, sizeof(params->hash_table_name),
+				"%s", hash_table_name);
+		params->num_threads = 1;
+		params->incremental_puts = true;
+
+		err = maxhash_get_hw_params(params, engine_states[i], kernel_name,
+				hash_table_name);
+		if (err != MAXHASH_ERR_OK)
+		{
+			fprintf(stderr, "Error: failed to access required MaxHash "
+					"information in the MaxFile.\n");
+			return err;
+		}
+
+		if (i > 0 && !same_hw_params(&tparams, &replica_tparams))
+		{
+			fprintf(stderr, "Error: MaxHash table \"%s\" on engine %zu "
+					"differs from the one on engine 0.\n", hash_table_name, i);
+			return MAXHASH_ERR_ERR;
+		}
+	}
+
+	tparams.num_replicas = num_engines;
+	for (size_t i = 0; i < num_engines; i++)
+		tparams.replicas[i].es = engine_states[i];
+
+	err = maxhash_internal_sw_init(table, &tparams);
+	if (err != MAXHASH_ERR_OK)
+	{
+		fprintf(stderr, "Error: failed to initialize MaxHash software "
+				"layer.\n");
+		return err;
+	}
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_set_memory_access_fn(maxhash_table_t *table,
+		void (*mem_access_fn)(void *arg, bool is_read, size_t
+			base_address_bursts, void *data, size_t data_size_bursts),
+		void *mem_access_fn_arg)
+{
+	return maxhash_set_replica_memory_access_fn(table, 0, mem_access_fn,
+			mem_access_fn_arg);
+}
+
+
+
+maxhash_err_t maxhash_set_replica_memory_access_fn(maxhash_table_t *table,
+		size_t replica, void (*mem_access_fn)(void *arg, bool is_read, size_t
+			base_address_bursts, void *data, size_t data_size_bursts),
+		void *mem_access_fn_arg)
+{
+	if (replica >= MAXHASH_MAX_REPLICAS || (table->tparams.num_replicas > 0 &&
+				replica >= table->tparams.num_replicas))
+	{
+		fprintf(stderr, "Error: table has no engine %zu.\n", replica);
+		return MAXHASH_ERR_ERR;
+	}
+
+	maxhash_internal_wait_for_commit(table);
+	table->tparams.replicas[replica].mem_access_fn = mem_access_fn;
+	table->tparams.replicas[replica].mem_access_fn_arg = mem_access_fn_arg;
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_get_stats(const maxhash_table_t *table,
+		maxhash_stats_t *stats)
+{
+	*stats = table->stats;
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_set_stats_fn(maxhash_table_t *table,
+		maxhash_stats_fn_t stats_fn, void *stats_fn_arg)
+{
+	maxhash_internal_wait_for_commit(table);
+	table->stats_fn = stats_fn;
+	table->stats_fn_arg = stats_fn_arg;
+	return MAXHASH_ERR_OK;
+}
+
+
+
+static maxhash_bucket_t *bucket_acquire(maxhash_internal_table_t *itable,
+		size_t bucket_id)
+{
+	maxhash_bucket_t *bucket = &itable->buckets[bucket_id];
+	if (bucket->generation != itable->generation)
+	{
+		bucket->num_keys = 0;
+		bucket->head = MAXHASH_NIL;
+		bucket->tail = MAXHASH_NIL;
+		bucket->generation = itable->generation;
+	}
+	return bucket;
+}
+
+
+
+/* Record a change to a bucket of a table whose memory image has been built. */
+static inline void mark_bucket_dirty(maxhash_internal_table_t *itable,
+		size_t bucket_id)
+{
+	if (itable->image.dirty_buckets != NULL)
+		itable->image.dirty_buckets[bucket_id / 64] |=
+			UINT64_C(1) << (bucket_id % 64);
+}
+
+
+
+maxhash_err_t maxhash_internal_clear_bucket(maxhash_internal_table_t *itable,
+		size_t bucket_id)
+{
+	maxhash_bucket_t *bucket = bucket_acquire(itable, bucket_id);
+	uint32_t id = bucket->head;
+
+	mark_bucket_dirty(itable, bucket_id);
+
+	while (id != MAXHASH_NIL)
+	{
+		maxhash_entry_t *entry = maxhash_entry_get(itable, id);
+		uint32_t next = entry->next;
+		if (itable->index)
+			index_erase(itable, entry->hash, id);
+		entry_free(itable, id);
+		itable->num_entries--;
+		id = next;
+	}
+
+	bucket->head = MAXHASH_NIL;
+	bucket->tail = MAXHASH_NIL;
+	bucket->num_keys = 0;
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_internal_clear(maxhash_internal_table_t *itable)
+{
+	/* Empty every bucket at once by moving to a new generation.  Buckets
+	 * are only rewritten when the generation counter wraps around. */
+	if (++itable->generation == 0)
+		memset(itable->buckets, 0, itable->iparams.num_buckets *
+				sizeof(maxhash_bucket_t));
+	itable->image.all_buckets_dirty = true;
+
+	/* Rewind the arena; its slabs are reused by subsequent puts. */
+	itable->entries_used = 1;
+	itable->free_list = MAXHASH_NIL;
+	itable->num_entries = 0;
+
+	/* Start again with a minimal index rather than wiping a large one.
+	 * Indexes that lookups may be reading concurrently never shrink. */
+	if (itable->index)
+	{
+		index_discard_old(itable);
+		if (itable->index_bits > MIN_INDEX_BITS &&
+				itable->read_state == NULL)
+		{
+			maxhash_index_slot_t *index = index_alloc(MIN_INDEX_BITS);
+			if (index == NULL)
+				return MAXHASH_ERR_ERR;
+			free(itable->index);
+			index_publish(itable, index, MIN_INDEX_BITS);
+			return MAXHASH_ERR_OK;
+		}
+		if (itable->read_state == NULL)
+			memset(itable->index, 0, (itable->index_mask + 1) *
+					sizeof(maxhash_index_slot_t));
+		else
+			for (size_t pos = 0; pos <= itable->index_mask; pos++)
+				__atomic_store_n(&itable->index[pos].entry_id, MAXHASH_NIL,
+						__ATOMIC_RELAXED);
+	}
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+void maxhash_internal_table_free(maxhash_internal_table_t *itable)
+{
+	for (size_t slab = 0; slab < itable->num_slabs; slab++)
+		free(itable->slabs[slab]);
+	free(itable->slabs);
+	free(itable->buckets);
+	free(itable->index);
+	free(itable->old_index);
+	if (itable->read_state != NULL)
+		read_state_free(itable->read_state);
+	free(itable->image.data);
+	free(itable->image.dirty_buckets);
+	free(itable->image.dirty_bursts[0]);
+	free(itable->image.dirty_bursts[1]);
+}
+
+
+
+/*
+ * Copy the entries, buckets and index of an internal table, but not its
+ * memory image, for a table that "table" owns.
+ */
+static maxhash_err_t internal_table_copy(maxhash_internal_table_t *dest,
+		const maxhash_internal_table_t *src, const maxhash_table_t *table)
+{
+	size_t slab_entries = (size_t)1 << src->slab_shift;
+	size_t num_slabs = (src->entries_used + slab_entries - 1) / slab_entries;
+	size_t num_buckets = src->iparams.num_buckets;
+
+	*dest = *src;
+	dest->table = table;
+	dest->num_slabs = 0;
+	dest->slabs = calloc(num_slabs + 1, sizeof(uint8_t *));
+	dest->buckets = malloc(num_buckets * sizeof(maxhash_bucket_t));
+	dest->index = NULL;
+	dest->old_index = NULL;
+	dest->read_state = NULL;
+	memset(&dest->image, 0, sizeof(dest->image));
+
+	if (dest->slabs == NULL || dest->buckets == NULL)
+		return MAXHASH_ERR_ERR;
+
+	for (size_t slab = 0; slab < num_slabs; slab++)
+	{
+		size_t num_entries = slab == num_slabs - 1 ?
+			src->entries_used - slab * slab_entries : slab_entries;
+		dest->slabs[slab] = alloc_cache_aligned(src->entry_stride <<
+				src->slab_shift);
+		if (dest->slabs[slab] == NULL)
+			return MAXHASH_ERR_ERR;
+		dest->num_slabs++;
+		memcpy(dest->slabs[slab], src->slabs[slab], num_entries *
+				src->entry_stride);
+	}
+
+	memcpy(dest->buckets, src->buckets, num_buckets *
+			sizeof(maxhash_bucket_t));
+
+	if (src->index != NULL)
+	{
+		size_t index_bytes = (src->index_mask + 1) *
+			sizeof(maxhash_index_slot_t);
+		dest->index = alloc_cache_aligned(index_bytes);
+		if (dest->index == NULL)
+			return MAXHASH_ERR_ERR;
+		memcpy(dest->index, src->index, index_bytes);
+	}
+
+	if (src->old_index != NULL)
+	{
+		size_t index_bytes = (src->old_index_mask + 1) *
+			sizeof(maxhash_index_slot_t);
+		dest->old_index = alloc_cache_aligned(index_bytes);
+		if (dest->old_index == NULL)
+			return MAXHASH_ERR_ERR;
+		memcpy(dest->old_index, src->old_index, index_bytes);
+	}
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_clear(maxhash_table_t *table)
+{
+	maxhash_internal_wait_for_commit(table);
+
+	write_begin(&table->sw);
+	maxhash_internal_clear(&table->sw);
+	write_end(&table->sw);
+	maxhash_internal_clear(&table->recent);
+	maxhash_internal_clear(&table->intermediate);
+	maxhash_internal_clear(&table->values);
+	for (size_t way = 0; way < maxhash_num_ways(&table->tparams); way++)
+		maxhash_internal_clear(&table->ways[way]);
+	table->perfect_built = false;
+	table->values_free_hint = 0;
+	table->values_vacated = 0;
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_free(maxhash_table_t *table)
+{
+	maxhash_internal_wait_for_commit(table);
+
+	maxhash_internal_table_free(&table->sw);
+	maxhash_internal_table_free(&table->recent);
+	maxhash_internal_table_free(&table->intermediate);
+	maxhash_internal_table_free(&table->values);
+	for (size_t way = 0; way < maxhash_num_ways(&table->tparams); way++)
+		maxhash_internal_table_free(&table->ways[way]);
+	maxhash_internal_table_free(&table->removed);
+	free(table);
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_contains_in_bucket(
+		const maxhash_internal_table_t *itable,
+		bool *present, const void *key, size_t bucket_id)
+{
+	*present = lookup_in_bucket(itable, key, bucket_id) != MAXHASH_NIL;
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_internal_get_bucket_id(
+		const maxhash_internal_table_t *itable, size_t *bucket_id,
+		const void *key, size_t hashparam)
+{
+	*bucket_id = maxhash_function_jenkins(key,
+			itable->table->tparams.key_width_bytes, hashparam,
+			itable->table->tparams.jenkins_chunk_width_bytes)
+		% itable->iparams.num_buckets;
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_contains(const maxhash_table_t *table, bool *present,
+		const void *key, size_t key_len)
+{
+	PAD_KEY(&table->tparams, key, key_len);
+	if (table->sw.read_state != NULL)
+	{
+		*present = concurrent_get(&table->sw, key, NULL);
+		return MAXHASH_ERR_OK;
+	}
+
+	uint32_t hash = maxhash_internal_hash(&table->sw, key);
+	*present = maxhash_internal_lookup(&table->sw, key, hash,
+			hash % table->sw.iparams.num_buckets) != MAXHASH_NIL;
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_internal_set_entry_flag(maxhash_internal_table_t *itable,
+		const void *key, uint8_t flag_id, bool flag_value)
+{
+	uint32_t hash = maxhash_internal_hash(itable, key);
+	uint32_t id = maxhash_internal_lookup(itable, key, hash,
+			hash % itable->iparams.num_buckets);
+
+	if (id == MAXHASH_NIL)
+		return MAXHASH_ERR_ERR;
+
+	maxhash_entry_t *entry = maxhash_entry_get(itable, id);
+	entry->flags[flag_id] = flag_value;
+	mark_bucket_dirty(itable, entry->bucket_id);
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_internal_put_hashed(maxhash_internal_table_t *itable,
+		const void *key, uint32_t hash, const void *value, size_t bucket_id)
+{
+	const maxhash_table_params_t *tparams = &itable->table->tparams;
+
+	uint32_t id = maxhash_internal_lookup(itable, key, hash, bucket_id);
+
+	if (id != MAXHASH_NIL)
+	{
+		maxhash_entry_t *e = maxhash_entry_get(itable, id);
+		entry_store(itable, maxhash_entry_value(itable, e), value,
+				itable->iparams.width_bytes);
+		mark_bucket_dirty(itable, bucket_id);
+		maxhash_debug_print(itable->table, "Adding entry to \"%s\" table...\n",
+				itable->iparams.name);
+		if (itable->table->tparams.debug)
+			hash_print_entry(itable, e);
+		return MAXHASH_ERR_OK;
+	}
+
+	if (tparams->perfect && tparams->max_bucket_entries == 1 &&
+			itable->num_entries >= tparams->values.num_buckets)
+	{
+		fprintf(stderr, "Error: perfect hash table is full.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	id = entry_alloc(itable);
+	if (id == MAXHASH_NIL)
+	{
+		fprintf(stderr, "Error: failed to allocate hash table entry.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	/* The entry is filled in before the index points to it.  A lookup that
+	 * still has an earlier use of the entry may read its key and value
+	 * meanwhile, but not its header. */
+	maxhash_entry_t *new_entry = maxhash_entry_get(itable, id);
+	uint8_t *key_end = (uint8_t *)maxhash_entry_key(new_entry) +
+		tparams->key_width_bytes;
+	uint8_t *value_end = (uint8_t *)maxhash_entry_value(itable, new_entry) +
+		itable->iparams.width_bytes;
+	memset(new_entry, 0, ENTRY_HEADER_BYTES);
+	memset(key_end, 0, (uint8_t *)maxhash_entry_value(itable, new_entry) -
+			key_end);
+	memset(value_end, 0, (uint8_t *)new_entry + itable->entry_stride -
+			value_end);
+
+	new_entry->hash = hash;
+	new_entry->bucket_id = bucket_id;
+	new_entry->in_use = true;
+	new_entry->flags[FLAG_VALID] = true;
+
+	entry_store(itable, maxhash_entry_key(new_entry), key,
+			tparams->key_width_bytes);
+	entry_store(itable, maxhash_entry_value(itable, new_entry), value,
+			itable->iparams.width_bytes);
+
+	if (itable->index && index_insert(itable, hash, id) != MAXHASH_ERR_OK)
+	{
+		entry_free(itable, id);
+		return MAXHASH_ERR_ERR;
+	}
+
+	/* Append to the bucket, preserving insertion order within the bucket. */
+	maxhash_bucket_t *bucket = bucket_acquire(itable, bucket_id);
+	new_entry->prev = bucket->tail;
+	if (bucket->tail == MAXHASH_NIL)
+		bucket->head = id;
+	else
+		maxhash_entry_get(itable, bucket->tail)->next = id;
+	bucket->tail = id;
+
+	bucket->num_keys++;
+	itable->num_entries++;
+	mark_bucket_dirty(itable, bucket_id);
+
+	maxhash_debug_print(itable->table, "Adding entry to \"%s\" table...\n",
+			itable->iparams.name);
+	if (itable->table->tparams.debug)
+		hash_print_entry(itable, new_entry);
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_internal_put_in_bucket(maxhash_internal_table_t *itable,
+		const void *key, const void *value, size_t bucket_id)
+{
+	uint32_t hash = itable->index ? maxhash_internal_hash(itable, key) : 0;
+	return maxhash_internal_put_hashed(itable, key, hash, value, bucket_id);
+}
+
+
+
+maxhash_err_t maxhash_internal_put(maxhash_internal_table_t *itable,
+		const void *key, const void *value)
+{
+	uint32_t hash = maxhash_internal_hash(itable, key);
+	return maxhash_internal_put_hashed(itable, key, hash, value,
+			hash % itable->iparams.num_buckets);
+}
+
+
+
+maxhash_err_t maxhash_put(maxhash_table_t *table, const void *key, size_t
+		key_len, const void *value, size_t value_len)
+{
+	PAD_KEY(&table->tparams, key, key_len);
+	PAD_VAL(&table->values.iparams, value, value_len);
+
+	/* The software and recent tables have the same geometry, so the key only
+	 * needs to be hashed once. */
+	uint32_t hash = maxhash_internal_hash(&table->sw, key);
+	size_t bucket_id = hash % table->sw.iparams.num_buckets;
+
+	maxhash_err_t err = write_reserve(&table->sw);
+	if (err != MAXHASH_ERR_OK)
+		return err;
+	write_begin(&table->sw);
+	err |= maxhash_internal_put_hashed(&table->sw, key, hash, value, bucket_id);
+	write_end(&table->sw);
+	err |= maxhash_internal_put_hashed(&table->recent, key, hash, value,
+			bucket_id);
+	return err;
+}
+
+
+
+/* Number of keys that are hashed and prefetched ahead of insertion. */
+#define BATCH_BLOCK_SIZE 256
+
+/*
+ * Return a pointer to item "i" of a batch, padded to "width_bytes".  Items that
+ * are at least as wide as the table field are used in place once their excess
+ * bits have been checked; narrower items are zero-extended into "scratch".
+ */
+static const void *batch_item(const void *items, size_t stride, size_t i,
+		size_t width_bits, size_t width_bytes, bool check, void *scratch)
+{
+	const uint8_t *item = (const uint8_t *)items + i * stride;
+
+	if (check && find_excess_bits(item, stride, width_bits) != stride)
+		return NULL;
+
+	if (stride >= width_bytes)
+		return item;
+
+	memset(scratch, 0, width_bytes);
+	memcpy(scratch, item, stride);
+	return scratch;
+}
+
+
+
+/*
+ * Hash a block of keys with parameter 0, several at a time.  NULL keys (those
+ * that failed validation) get an arbitrary hash.
+ */
+static void batch_hash(const maxhash_table_t *table, const void **keys,
+		size_t n, uint32_t *hashes)
+{
+	static const uint32_t zero_params[BATCH_BLOCK_SIZE];
+	const void *valid_key = NULL;
+
+	for (size_t i = 0; i < n && valid_key == NULL; i++)
+		valid_key = keys[i];
+	if (valid_key == NULL)
+		return;
+
+	const void *hash_keys[BATCH_BLOCK_SIZE];
+	for (size_t i = 0; i < n; i++)
+		hash_keys[i] = keys[i] != NULL ? keys[i] : valid_key;
+
+	maxhash_function_jenkins_multi(hash_keys, table->tparams.key_width_bytes,
+			zero_params, n, table->tparams.jenkins_chunk_width_bytes, hashes);
+}
+
+
+
+/*
+ * Allocate scratch space for padding a block of keys that are narrower than
+ * the table's keys.  "scratch" is set to NULL when keys can be used in place.
+ */
+static maxhash_err_t batch_key_scratch(const maxhash_table_params_t *tparams,
+		size_t key_stride, uint8_t **scratch)
+{
+	*scratch = NULL;
+	if (key_stride >= tparams->key_width_bytes)
+		return MAXHASH_ERR_OK;
+
+	*scratch = malloc(BATCH_BLOCK_SIZE * tparams->key_width_bytes);
+	if (*scratch == NULL)
+	{
+		fprintf(stderr, "Error: failed to allocate memory for batch.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+/*
+ * Return the scratch slot for key "i" of a block, or NULL when keys are used
+ * in place and there is no scratch space.
+ */
+static void *batch_key_slot(const maxhash_table_params_t *tparams,
+		uint8_t *scratch, size_t i)
+{
+	return scratch != NULL ? scratch + i * tparams->key_width_bytes : NULL;
+}
+
+
+
+maxhash_err_t maxhash_put_batch(maxhash_table_t *table, const void *keys,
+		size_t key_stride, const void *values, size_t value_stride, size_t n,
+		maxhash_err_t *errors)
+{
+	const maxhash_table_params_t *tparams = &table->tparams;
+	const maxhash_internal_table_params_t *vparams = &table->values.iparams;
+
+	/* Work out once for the whole batch whether items need checking for bits
+	 * beyond the table's widths.  Where the stride matches the width exactly,
+	 * keys and values are used in place without any copying. */
+	bool check_keys = key_stride * 8 > tparams->key_width_bits;
+	bool check_values = value_stride * 8 > vparams->width_bits;
+
+	uint8_t *key_scratch;
+	if (batch_key_scratch(tparams, key_stride, &key_scratch) !=
+			MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+	uint8_t value_scratch[vparams->width_bytes];
+	const void *block_keys[BATCH_BLOCK_SIZE];
+	uint32_t hashes[BATCH_BLOCK_SIZE];
+
+	size_t num_failed = 0;
+
+	for (size_t base = 0; base < n; base += BATCH_BLOCK_SIZE)
+	{
+		size_t block_size = n - base < BATCH_BLOCK_SIZE ? n - base :
+			BATCH_BLOCK_SIZE;
+
+		/* Hash the whole block first and prefetch the index slots, so that
+		 * the cache misses of the following inserts overlap. */
+		for (size_t i = 0; i < block_size; i++)
+			block_keys[i] = batch_item(keys, key_stride, base + i,
+					tparams->key_width_bits, tparams->key_width_bytes,
+					check_keys, batch_key_slot(tparams, key_scratch, i));
+		batch_hash(table, block_keys, block_size, hashes);
+
+		for (size_t i = 0; i < block_size; i++)
+		{
+			if (block_keys[i] == NULL)
+				continue;
+			__builtin_prefetch(&table->sw.index[index_home(&table->sw,
+						hashes[i])]);
+			__builtin_prefetch(&table->recent.index[index_home(
+						&table->recent, hashes[i])]);
+		}
+
+		/* Concurrent lookups see each put on its own. */
+		for (size_t i = 0; i < block_size; i++)
+		{
+			maxhash_err_t err = MAXHASH_ERR_ERR;
+			const void *value = batch_item(values, value_stride, base + i,
+					vparams->width_bits, vparams->width_bytes, check_values,
+					value_scratch);
+
+			if (block_keys[i] != NULL && value != NULL &&
+					write_reserve(&table->sw) == MAXHASH_ERR_OK)
+			{
+				size_t bucket_id = hashes[i] % table->sw.iparams.num_buckets;
+				write_begin(&table->sw);
+				err = maxhash_internal_put_hashed(&table->sw, block_keys[i],
+						hashes[i], value, bucket_id);
+				write_end(&table->sw);
+				err |= maxhash_internal_put_hashed(&table->recent,
+						block_keys[i], hashes[i], value, bucket_id);
+			}
+
+			if (err != MAXHASH_ERR_OK)
+				num_failed++;
+			if (errors)
+				errors[base + i] = err;
+		}
+	}
+
+	free(key_scratch);
+
+	if (num_failed != 0)
+	{
+		fprintf(stderr, "Error: failed to put %zu of %zu entries in a "
+				"batch.\n", num_failed, n);
+		return MAXHASH_ERR_ERR;
+	}
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_internal_get_entry_in_bucket(
+		const maxhash_internal_table_t *itable, bool check_key,
+		const void *key, maxhash_entry_t **entry, size_t bucket_id)
+{
+	uint32_t id = check_key ? lookup_in_bucket(itable, key, bucket_id) :
+		maxhash_bucket_peek(itable, bucket_id)->head;
+
+	if (id == MAXHASH_NIL)
+		return MAXHASH_ERR_ERR;
+
+	*entry = maxhash_entry_get(itable, id);
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_internal_get_entry(
+		const maxhash_internal_table_t *itable, bool check_key,
+		const void *key, maxhash_entry_t **entry)
+{
+	uint32_t hash = maxhash_internal_hash(itable, key);
+	size_t bucket_id = hash % itable->iparams.num_buckets;
+	uint32_t id = check_key ? maxhash_internal_lookup(itable, key, hash,
+			bucket_id) : maxhash_bucket_peek(itable, bucket_id)->head;
+
+	if (id == MAXHASH_NIL)
+		return MAXHASH_ERR_ERR;
+
+	*entry = maxhash_entry_get(itable, id);
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_internal_get(const maxhash_internal_table_t *itable,
+		bool check_key, const void *key, void *value)
+{
+	maxhash_err_t err = MAXHASH_ERR_OK;
+	maxhash_entry_t *entry;
+	err |= maxhash_internal_get_entry(itable, check_key, key, &entry);
+
+	if (err == MAXHASH_ERR_ERR)
+		return err;
+
+	memcpy(value, maxhash_entry_value(itable, entry),
+			itable->iparams.width_bytes);
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_internal_get_flag(const maxhash_entry_t *entry, int flag,
+		bool *value)
+{
+	memcpy(value, &entry->flags[flag], sizeof(bool));
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_internal_perfect_get_index(const maxhash_table_t *table,
+		const void *key, size_t *index)
+{
+	maxhash_err_t err = MAXHASH_ERR_OK;
+	*index = 0;
+	bool perfect_direct;
+
+	maxhash_entry_t *entry;
+	err |= maxhash_internal_get_entry(&table->intermediate, false, key,
+			&entry);
+
+	if (err != MAXHASH_ERR_OK)
+		return err;
+
+	memcpy(index, maxhash_entry_value(&table->intermediate, entry),
+			table->intermediate.iparams.width_bytes);
+
+	err |= maxhash_internal_get_flag(entry, FLAG_PERFECT_DIRECT,
+			&perfect_direct);
+
+	if (err != MAXHASH_ERR_OK)
+		return err;
+
+	if (!perfect_direct)
+		maxhash_internal_get_bucket_id(&table->values, index, key, *index);
+
+	//printf("key: %s, intermediate: %u, perfect_direct: %u, index: %zu\n",
+			//(char *)key, intermediate, perfect_direct, *index);
+
+	return err;
+}
+
+
+
+maxhash_err_t maxhash_perfect_get_index(maxhash_table_t *table,
+		const void *key, size_t key_len, size_t *index)
+{
+	PAD_KEY(&table->tparams, key, key_len);
+	maxhash_internal_wait_for_commit(table);
+	return maxhash_internal_perfect_get_index(table, key, index);
+}
+
+
+
+maxhash_err_t maxhash_internal_perfect_get(const maxhash_table_t *table,
+		const void *key, void *value, bool *valid)
+{
+	maxhash_err_t err = MAXHASH_ERR_OK;
+	size_t index;
+	err |= maxhash_internal_perfect_get_index(table, key, &index);
+
+	if (err != MAXHASH_ERR_OK)
+		return err;
+
+	maxhash_entry_t *entry;
+	err |= maxhash_internal_get_entry_in_bucket(&table->values, true, key,
+			&entry, index);
+
+	if (err != MAXHASH_ERR_OK)
+		return err;
+
+	memcpy(value, maxhash_entry_value(&table->values, entry),
+			table->values.iparams.width_bytes);
+	err |= maxhash_internal_get_flag(entry, FLAG_VALID, valid);
+
+	//printf("index: %zu, value: %lu\n", index, *(uint64_t *)value);
+
+	return err;
+}
+
+
+
+maxhash_err_t maxhash_perfect_get(maxhash_table_t *table, const void *key,
+		size_t key_len, void *value, bool *valid)
+{
+	PAD_KEY(&table->tparams, key, key_len);
+	maxhash_internal_wait_for_commit(table);
+	return maxhash_internal_perfect_get(table, key, value, valid);
+}
+
+
+
+maxhash_err_t maxhash_get(const maxhash_table_t *table, const void *key, size_t
+		key_len, void *value)
+{
+	PAD_KEY(&table->tparams, key, key_len);
+	if (table->sw.read_state != NULL)
+		return concurrent_get(&table->sw, key, value) ? MAXHASH_ERR_OK :
+			MAXHASH_ERR_ERR;
+	return maxhash_internal_get(&table->sw, true, key, value);
+}
+
+
+
+static maxhash_err_t check_batch_value_stride(size_t value_stride,
+		size_t width_bytes)
+{
+	if (value_stride < width_bytes)
+	{
+		fprintf(stderr, "Error: value stride of %zu bytes is smaller than "
+				"value width of %zu bytes.\n", value_stride, width_bytes);
+		return MAXHASH_ERR_ERR;
 	}
-	else
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+/*
+ * Look up a block of hashed keys in a table with concurrent reads enabled.
+ * If the table changes meanwhile, the keys are looked up again one at a
+ * time, so that a busy writer cannot keep the whole block retrying.
+ */
+static void concurrent_get_block(const maxhash_internal_table_t *sw,
+		const void *const *keys, const uint32_t *hashes, size_t n,
+		uint8_t *values, size_t value_stride, bool *found)
+{
+	struct maxhash_read_state *rs = sw->read_state;
+
+	unsigned phase;
+	struct maxhash_reader_stripe *stripe = reader_enter(rs, &phase);
+	uint32_t seq = read_begin(rs);
+
+	size_t mask = __atomic_load_n(&sw->index_mask, __ATOMIC_ACQUIRE);
+	const maxhash_index_slot_t *index = __atomic_load_n(&sw->index,
+			__ATOMIC_ACQUIRE);
+	unsigned index_bits = __builtin_ctzll((unsigned long long)mask + 1);
+	for (size_t i = 0; i < n; i++)
+		if (keys[i] != NULL)
+			__builtin_prefetch(&index[index_home_bits(hashes[i],
+						index_bits)]);
+
+	for (size_t i = 0; i < n; i++)
 	{
-		fprintf(stderr, "Error: hash table memory type is invalid.\n");
-		return MAXHASH_ERR_ERR;
+		const maxhash_entry_t *e = NULL;
+		if (keys[i] != NULL)
+			e = concurrent_lookup(sw, keys[i], hashes[i]);
+
+		found[i] = e != NULL;
+		if (e != NULL)
+			shared_load(values + i * value_stride,
+					maxhash_entry_value(sw, e), sw->iparams.width_bytes);
 	}
 
-	snprintf(buf, sizeof(buf), "_%s_Width", mem_name);
-	int width_bits = get_maxfile_constant(es, full_hash_name, buf);
+	bool changed = read_retry(rs, seq);
+	reader_exit(stripe, phase);
 
-	if (width_bits <= 0)
+	if (!changed)
+		return;
+	for (size_t i = 0; i < n; i++)
+		found[i] = keys[i] != NULL && concurrent_get_hashed(sw, keys[i],
+				hashes[i], values + i * value_stride);
+}
+
+
+
+maxhash_err_t maxhash_get_batch(const maxhash_table_t *table,
+		const void *keys, size_t key_stride, size_t n, void *values,
+		size_t value_stride, bool *found)
+{
+	const maxhash_internal_table_t *sw = &table->sw;
+	const maxhash_table_params_t *tparams = &table->tparams;
+	size_t value_width_bytes = sw->iparams.width_bytes;
+	bool check_keys = key_stride * 8 > tparams->key_width_bits;
+
+	if (check_batch_value_stride(value_stride, value_width_bytes) !=
+			MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+
+	uint8_t *key_scratch;
+	if (batch_key_scratch(tparams, key_stride, &key_scratch) !=
+			MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+
+	const void *block_keys[BATCH_BLOCK_SIZE];
+	uint32_t hashes[BATCH_BLOCK_SIZE];
+
+	for (size_t base = 0; base < n; base += BATCH_BLOCK_SIZE)
 	{
-		fprintf(stderr, "Error: table entry width in hardware hash table "
-				"(%d) is invalid.\n", width_bits);
+		size_t block_size = n - base < BATCH_BLOCK_SIZE ? n - base :
+			BATCH_BLOCK_SIZE;
+
+		/* Hash every key in the block and prefetch its home index slot. */
+		for (size_t i = 0; i < block_size; i++)
+			block_keys[i] = batch_item(keys, key_stride, base + i,
+					tparams->key_width_bits, tparams->key_width_bytes,
+					check_keys, batch_key_slot(tparams, key_scratch, i));
+		batch_hash(table, block_keys, block_size, hashes);
+
+		if (sw->read_state != NULL)
+		{
+			concurrent_get_block(sw, block_keys, hashes, block_size,
+					(uint8_t *)values + base * value_stride, value_stride,
+					found + base);
+			continue;
+		}
+
+		for (size_t i = 0; i < block_size; i++)
+		{
+			if (block_keys[i] == NULL)
+				continue;
+			__builtin_prefetch(&sw->index[index_home(sw, hashes[i])]);
+		}
+
+		/* Prefetch the entries that the home slots point to. */
+		for (size_t i = 0; i < block_size; i++)
+		{
+			if (block_keys[i] == NULL)
+				continue;
+			uint32_t id = sw->index[index_home(sw, hashes[i])].entry_id;
+			if (id == MAXHASH_NIL)
+				continue;
+			const maxhash_entry_t *entry = maxhash_entry_get(sw, id);
+			__builtin_prefetch(entry);
+			__builtin_prefetch(maxhash_entry_value(sw, entry));
+		}
+
+		for (size_t i = 0; i < block_size; i++)
+		{
+			uint32_t id = MAXHASH_NIL;
+			if (block_keys[i] != NULL)
+				id = maxhash_internal_lookup(sw, block_keys[i], hashes[i],
+						hashes[i] % sw->iparams.num_buckets);
+
+			found[base + i] = id != MAXHASH_NIL;
+			if (id != MAXHASH_NIL)
+				memcpy((uint8_t *)values + (base + i) * value_stride,
+						maxhash_entry_value(sw, maxhash_entry_get(sw, id)),
+						value_width_bytes);
+		}
+	}
+
+	free(key_scratch);
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_perfect_get_batch(maxhash_table_t *table,
+		const void *keys, size_t key_stride, size_t n, void *values,
+		size_t value_stride, bool *found, bool *valid)
+{
+	/* Apply any deferred removals, and don't read the perfect hash tables
+	 * while a commit still owns them. */
+	if (maxhash_internal_wait_for_commit(table) != MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+
+	const maxhash_internal_table_t *inter = &table->intermediate;
+	const maxhash_internal_table_t *vtable = &table->values;
+	const maxhash_table_params_t *tparams = &table->tparams;
+	size_t value_width_bytes = vtable->iparams.width_bytes;
+	bool check_keys = key_stride * 8 > tparams->key_width_bits;
+
+	if (check_batch_value_stride(value_stride, value_width_bytes) !=
+			MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+
+	uint8_t *key_scratch;
+	if (batch_key_scratch(tparams, key_stride, &key_scratch) !=
+			MAXHASH_ERR_OK)
 		return MAXHASH_ERR_ERR;
+
+	const void *block_keys[BATCH_BLOCK_SIZE];
+	uint32_t hashes[BATCH_BLOCK_SIZE];
+	size_t bucket_ids[BATCH_BLOCK_SIZE];
+	uint32_t entry_ids[BATCH_BLOCK_SIZE];
+
+	for (size_t base = 0; base < n; base += BATCH_BLOCK_SIZE)
+	{
+		size_t block_size = n - base < BATCH_BLOCK_SIZE ? n - base :
+			BATCH_BLOCK_SIZE;
+
+		/* Each pass below reads what the previous pass prefetched and
+		 * prefetches the next level of the lookup: intermediate bucket,
+		 * intermediate entry, values bucket and finally the values entry. */
+		for (size_t i = 0; i < block_size; i++)
+			block_keys[i] = batch_item(keys, key_stride, base + i,
+					tparams->key_width_bits, tparams->key_width_bytes,
+					check_keys, batch_key_slot(tparams, key_scratch, i));
+		batch_hash(table, block_keys, block_size, hashes);
+
+		for (size_t i = 0; i < block_size; i++)
+		{
+			if (block_keys[i] == NULL)
+				continue;
+			bucket_ids[i] = hashes[i] % inter->iparams.num_buckets;
+			__builtin_prefetch(&inter->buckets[bucket_ids[i]]);
+		}
+
+		for (size_t i = 0; i < block_size; i++)
+		{
+			entry_ids[i] = MAXHASH_NIL;
+			if (block_keys[i] == NULL)
+				continue;
+			entry_ids[i] = maxhash_bucket_peek(inter, bucket_ids[i])->head;
+			if (entry_ids[i] != MAXHASH_NIL)
+				__builtin_prefetch(maxhash_entry_get(inter, entry_ids[i]));
+		}
+
+		for (size_t i = 0; i < block_size; i++)
+		{
+			if (entry_ids[i] == MAXHASH_NIL)
+				continue;
+			const maxhash_entry_t *entry = maxhash_entry_get(inter,
+					entry_ids[i]);
+			size_t index = 0;
+			memcpy(&index, maxhash_entry_value(inter, entry),
+					inter->iparams.width_bytes);
+			if (!entry->flags[FLAG_PERFECT_DIRECT])
+				maxhash_internal_get_bucket_id(vtable, &index, block_keys[i],
+						index);
+			bucket_ids[i] = index;
+			__builtin_prefetch(&vtable->buckets[index]);
+		}
+
+		for (size_t i = 0; i < block_size; i++)
+		{
+			if (entry_ids[i] == MAXHASH_NIL)
+				continue;
+			entry_ids[i] = maxhash_bucket_peek(vtable, bucket_ids[i])->head;
+			if (entry_ids[i] != MAXHASH_NIL)
+				__builtin_prefetch(maxhash_entry_get(vtable, entry_ids[i]));
+		}
+
+		for (size_t i = 0; i < block_size; i++)
+		{
+			uint32_t id = MAXHASH_NIL;
+			if (entry_ids[i] != MAXHASH_NIL)
+				id = lookup_in_bucket(vtable, block_keys[i], bucket_ids[i]);
+
+			const maxhash_entry_t *entry = id != MAXHASH_NIL ?
+				maxhash_entry_get(vtable, id) : NULL;
+			found[base + i] = entry != NULL;
+			if (valid)
+				valid[base + i] = entry != NULL && entry->flags[FLAG_VALID];
+			if (entry != NULL)
+				memcpy((uint8_t *)values + (base + i) * value_stride,
+						maxhash_entry_value(vtable, entry), value_width_bytes);
+		}
 	}
 
-	mem_backing_params->width_bits  = width_bits;
-	mem_backing_params->width_bytes = (width_bits + 7) / 8;
+	free(key_scratch);
+	return MAXHASH_ERR_OK;
+}
 
-	snprintf(buf, sizeof(buf), "_%s_NumBuckets", mem_name);
-	int num_buckets = get_maxfile_constant(es, full_hash_name, buf);
 
-	if (num_buckets <= 0)
+
+static void remove_entry(maxhash_internal_table_t *itable, uint32_t id)
+{
+	maxhash_entry_t *entry = maxhash_entry_get(itable, id);
+	maxhash_bucket_t *bucket = &itable->buckets[entry->bucket_id];
+
+	if (entry->prev == MAXHASH_NIL)
+		bucket->head = entry->next;
+	else
+		maxhash_entry_get(itable, entry->prev)->next = entry->next;
+
+	if (entry->next == MAXHASH_NIL)
+		bucket->tail = entry->prev;
+	else
+		maxhash_entry_get(itable, entry->next)->prev = entry->prev;
+
+	if (itable->index)
+		index_erase(itable, entry->hash, id);
+
+	mark_bucket_dirty(itable, entry->bucket_id);
+	entry_free(itable, id);
+	bucket->num_keys--;
+	itable->num_entries--;
+}
+
+
+
+static maxhash_err_t remove_hashed(maxhash_internal_table_t *itable,
+		const void *key, uint32_t hash, size_t bucket_id)
+{
+	/* Empty list. */
+	if (maxhash_bucket_peek(itable, bucket_id)->head == MAXHASH_NIL)
 	{
-		fprintf(stderr, "Error: number of buckets in hardware hash table "
-				"(%d) is invalid.\n", num_buckets);
+		fprintf(stderr, "Error: attempted to remove an entry that is "
+				"not present in the \"%s\" hash table.\n",
+				itable->iparams.name);
 		return MAXHASH_ERR_ERR;
 	}
 
-	mem_backing_params->num_buckets = num_buckets;
+	uint32_t id = maxhash_internal_lookup(itable, key, hash, bucket_id);
+
+	if (id == MAXHASH_NIL)
+	{
+		fprintf(stderr, "Error: attempted to remove an entry that is not "
+				"present in the requested hash table.\n");
+		return MAXHASH_ERR_ERR;
+	}
 
+	remove_entry(itable, id);
 	return MAXHASH_ERR_OK;
 }
 
 
 
-maxhash_err_t maxhash_get_hw_params(maxhash_table_params_t *tparams,
-		maxhash_engine_state_t *es,
-		const char *kernel_name,
-		const char *hash_table_name)
+maxhash_err_t maxhash_remove_from_bucket(maxhash_internal_table_t *itable,
+		const void *key, size_t bucket_id)
+{
+	uint32_t hash = itable->index ? maxhash_internal_hash(itable, key) : 0;
+	return remove_hashed(itable, key, hash, bucket_id);
+}
+
+
+
+maxhash_err_t maxhash_internal_remove(
+		maxhash_internal_table_t *itable, const void *key)
+{
+	uint32_t hash = maxhash_internal_hash(itable, key);
+	return remove_hashed(itable, key, hash,
+			hash % itable->iparams.num_buckets);
+}
+
+
+
+maxhash_err_t maxhash_perfect_values_remove(maxhash_table_t *table,
+		const void *key)
 {
 	maxhash_err_t err = MAXHASH_ERR_OK;
+	size_t old_values_bucket;
+	err |= maxhash_internal_perfect_get_index(table, key, &old_values_bucket);
+	err |= maxhash_remove_from_bucket(&table->values, key, old_values_bucket);
+	return err;
+}
+
+
+
+/*
+ * Return the entry of the values table that holds a key, or NULL if the key
+ * has not been placed in the perfect hash tables.
+ */
+static maxhash_entry_t *placed_entry(const maxhash_table_t *table,
+		const void *key, size_t *slot)
+{
+	maxhash_entry_t *entry;
+
+	if (maxhash_internal_perfect_get_index(table, key, slot) !=
+			MAXHASH_ERR_OK || *slot >= table->values.iparams.num_buckets)
+		return NULL;
+
+	if (maxhash_internal_get_entry_in_bucket(&table->values, true, key,
+				&entry, *slot) != MAXHASH_ERR_OK)
+		return NULL;
+
+	return entry;
+}
+
+
+
+/*
+ * Take a key out of the values table, or the ways of a collision-handling
+ * table, if it has been placed there.  Returns true if a slot was vacated.
+ */
+static bool vacate_slot(maxhash_table_t *table, const void *key)
+{
+	if (table->tparams.max_bucket_entries > 1)
+		return maxhash_cuckoo_vacate(table, key);
+
+	size_t slot;
+	if (placed_entry(table, key, &slot) == NULL)
+		return false;
+
+	maxhash_remove_from_bucket(&table->values, key, slot);
+	if (table->values_free_hint > slot)
+		table->values_free_hint = slot;
+	return true;
+}
+
 
-	err |= maxhash_check_version(es);
-	err |= maxhash_check_presence(es, kernel_name, hash_table_name);
 
+maxhash_err_t maxhash_remove(maxhash_table_t *table, const void *key, size_t
+		key_len)
+{
+	PAD_KEY(&table->tparams, key, key_len);
+
+	uint32_t hash = maxhash_internal_hash(&table->sw, key);
+	size_t bucket_id = hash % table->sw.iparams.num_buckets;
+
+	write_begin(&table->sw);
+	maxhash_err_t err = remove_hashed(&table->sw, key, hash, bucket_id);
+	write_end(&table->sw);
 	if (err != MAXHASH_ERR_OK)
 		return err;
 
-	char full_name[NAME_BUF_LEN] = {0};
-	snprintf(full_name, sizeof(full_name), "%s_%s", kernel_name,
-			hash_table_name);
+	/* Keys added since the last commit are also in the recent table. */
+	uint32_t id = maxhash_internal_lookup(&table->recent, key, hash,
+			bucket_id);
+	if (id != MAXHASH_NIL)
+		remove_entry(&table->recent, id);
+
+	/* While a commit is in progress the key is only taken out of the perfect
+	 * hash tables once the commit completes. */
+	if (table->pending_commit != NULL)
+		return maxhash_internal_put_hashed(&table->removed, key, hash, key,
+				bucket_id);
+
+	/* Keep the perfect hash tables in step.  The other keys of the bucket keep
+	 * their slots, which stay distinct under the same hash parameter. */
+	if (vacate_slot(table, key))
+		table->values_vacated++;
+	if (maxhash_bucket_peek(&table->sw, bucket_id)->num_keys == 0)
+		err |= maxhash_internal_clear_bucket(&table->intermediate, bucket_id);
 
-	int max_bucket_entries       = get_maxfile_constant(es, full_name,
-			"_MaxBucketEntries");
-	int perfect                  = get_maxfile_constant(es, full_name,
-			"_Perfect");
-	int is_double_buffered       = get_maxfile_constant(es, full_name,
-			"_IsDoubleBuffered");
-	int key_width_bits           = get_maxfile_constant(es, full_name,
-			"_KeyWidth");
-	int jenkins_chunk_width_bits = get_maxfile_constant(es, full_name,
-			"_JenkinsChunkWidth");
+	return err;
+}
 
-	if (max_bucket_entries <= 0)
-	{
-		fprintf(stderr, "Error: maximum bucket entries in hardware hash table "
-				"(%d) is invalid.\n", max_bucket_entries);
-		return MAXHASH_ERR_ERR;
-	}
 
-	if (perfect < 0 || perfect > 1)
+
+/*
+ * Create the table of keys whose slots in the perfect hash tables are still to
+ * be vacated, if "table" does not have one yet.
+ */
+static maxhash_err_t removed_table_init(maxhash_table_t *table)
+{
+	if (table->removed.buckets != NULL)
+		return MAXHASH_ERR_OK;
+
+	maxhash_internal_table_params_t removed_params = table->sw.iparams;
+	removed_params.width_bits = 0;
+
+	maxhash_err_t err = maxhash_internal_table_init(&table->removed, table,
+			&removed_params, "Removed");
+	if (err != MAXHASH_ERR_OK)
 	{
-		fprintf(stderr, "Error: value of perfect flag (%d) is invalid.\n",
-				perfect);
-		return MAXHASH_ERR_ERR;
+		maxhash_internal_table_free(&table->removed);
+		memset(&table->removed, 0, sizeof(table->removed));
 	}
+	return err;
+}
 
-	if (key_width_bits <= 0)
+
+
+maxhash_err_t maxhash_remove_batch(maxhash_table_t *table, const void *keys,
+		size_t key_stride, size_t n, bool *removed)
+{
+	const maxhash_table_params_t *tparams = &table->tparams;
+	bool check_keys = key_stride * 8 > tparams->key_width_bits;
+
+	if (removed_table_init(table) != MAXHASH_ERR_OK)
 	{
-		fprintf(stderr, "Error: key width in hardware hash table (%d) is "
-				"invalid.\n", key_width_bits);
+		fprintf(stderr, "Error: failed to allocate table of removed keys.\n");
 		return MAXHASH_ERR_ERR;
 	}
 
-	if (jenkins_chunk_width_bits <= 0 || jenkins_chunk_width_bits % 8 != 0)
-	{
-		fprintf(stderr, "Error: Jenkins chunk width in hardware hash table "
-				"(%d) is invalid.\n", jenkins_chunk_width_bits);
+	uint8_t *key_scratch;
+	if (batch_key_scratch(tparams, key_stride, &key_scratch) !=
+			MAXHASH_ERR_OK)
 		return MAXHASH_ERR_ERR;
-	}
+	const void *block_keys[BATCH_BLOCK_SIZE];
+	uint32_t hashes[BATCH_BLOCK_SIZE];
 
-	maxhash_internal_table_params_t *intermediate_params = &tparams->intermediate;
-	maxhash_internal_table_params_t *values_params = &tparams->values;
+	size_t num_failed = 0;
 
-	if (perfect == 1 && max_bucket_entries == 1)
+	for (size_t base = 0; base < n; base += BATCH_BLOCK_SIZE)
 	{
-		err |= maxhash_get_hw_mem_backing_params(intermediate_params, es,
-				full_name, "HashParams");
-		err |= maxhash_get_hw_mem_backing_params(values_params, es,
-				full_name, "Values");
-
-		if (intermediate_params->mem_type == MAXHASH_MEM_TYPE_LMEM
-				|| values_params->mem_type == MAXHASH_MEM_TYPE_LMEM)
-			es->lmem_burst_size_bytes = get_maxfile_global_constant(es,
-					"MemCtrlPro_DataBurstSizeInBytes");
+		size_t block_size = n - base < BATCH_BLOCK_SIZE ? n - base :
+			BATCH_BLOCK_SIZE;
 
-		int validate_results = get_maxfile_constant(es, full_name,
-				"_ValidateResults");
+		for (size_t i = 0; i < block_size; i++)
+			block_keys[i] = batch_item(keys, key_stride, base + i,
+					tparams->key_width_bits, tparams->key_width_bytes,
+					check_keys, batch_key_slot(tparams, key_scratch, i));
+		batch_hash(table, block_keys, block_size, hashes);
 
-		if (validate_results < 0 || validate_results > 1)
+		for (size_t i = 0; i < block_size; i++)
 		{
-			fprintf(stderr, "Error: validate keys value in hardware hash "
-					"table (%d) is invalid.\n", validate_results);
-			return MAXHASH_ERR_ERR;
+			if (block_keys[i] == NULL)
+				continue;
+			__builtin_prefetch(&table->sw.index[index_home(&table->sw,
+						hashes[i])]);
 		}
 
-		intermediate_params->validate_results = false;
-		values_params->validate_results = validate_results == 1 ? true : false;
+		/* Each key is only taken out of the software tables here, and noted
+		 * in the removed table.  Its slot in the perfect hash tables is
+		 * vacated when they are next needed (see apply_removals()). */
+		for (size_t i = 0; i < block_size; i++)
+		{
+			uint32_t id = MAXHASH_NIL;
+			size_t bucket_id = hashes[i] % table->sw.iparams.num_buckets;
+			if (block_keys[i] != NULL)
+				id = maxhash_internal_lookup(&table->sw, block_keys[i],
+						hashes[i], bucket_id);
+
+			if (removed)
+				removed[base + i] = id != MAXHASH_NIL;
+			if (id == MAXHASH_NIL)
+				continue;
+
+			write_begin(&table->sw);
+			remove_entry(&table->sw, id);
+			write_end(&table->sw);
+			id = maxhash_internal_lookup(&table->recent, block_keys[i],
+					hashes[i], bucket_id);
+			if (id != MAXHASH_NIL)
+				remove_entry(&table->recent, id);
+
+			if (maxhash_internal_put_hashed(&table->removed, block_keys[i],
+						hashes[i], block_keys[i], bucket_id) != MAXHASH_ERR_OK)
+				num_failed++;
+		}
 	}
-	else
+
+	free(key_scratch);
+
+	if (num_failed != 0)
 	{
-		intermediate_params->validate_results = false;
-		values_params->validate_results = true;
+		fprintf(stderr, "Error: failed to record %zu of %zu removed keys in a "
+				"batch.\n", num_failed, n);
+		return MAXHASH_ERR_ERR;
 	}
 
-	tparams->engine_state              = es;
-	tparams->max_bucket_entries        = max_bucket_entries;
-	tparams->perfect                   = perfect;
-	tparams->is_double_buffered        = is_double_buffered;
-	tparams->key_width_bits            = key_width_bits;
-	tparams->key_width_bytes           = (key_width_bits + 7) / 8;
-	tparams->jenkins_chunk_width_bytes = (jenkins_chunk_width_bits + 7) / 8;
-
-	return err;
+	return MAXHASH_ERR_OK;
 }
 
 
 
-maxhash_err_t maxhash_hw_table_init(maxhash_table_t **table,
-		const char *kernel_name, const char *hash_table_name,
-		maxhash_engine_state_t *es)
+/* Hold an LMem write on an engine's queue until the scheduler is flushed. */
+static maxhash_err_t queue_lmem_write(struct maxhash_engine_queue *queue,
+		const struct maxhash_replica *replica, size_t base_address_bursts,
+		void *data, size_t data_size_bursts)
 {
-	maxhash_err_t err = MAXHASH_ERR_OK;
-
-	maxhash_table_params_t tparams;
-	memset(&tparams, 0, sizeof(tparams));
-	strncpy(tparams.kernel_name, kernel_name, sizeof(tparams.kernel_name));
-	strncpy(tparams.hash_table_name, hash_table_name,
-			sizeof(tparams.hash_table_name));
-
-	err = maxhash_get_hw_params(&tparams, es, kernel_name, hash_table_name);
-	if (err != MAXHASH_ERR_OK)
+	if (replica->mem_access_fn == NULL)
 	{
-		fprintf(stderr, "Error: failed to access required MaxHash "
-				"information in the MaxFile.\n");
-		return err;
+		fprintf(stderr, "Error: no memory access function is set for LMem "
+				"tables.\n");
+		return MAXHASH_ERR_ERR;
 	}
 
-	err = maxhash_internal_sw_init(table, &tparams);
-	if (err != MAXHASH_ERR_OK)
+	if (queue->num_lmem_writes == queue->lmem_writes_capacity)
 	{
-		fprintf(stderr, "Error: failed to initialize MaxHash software "
-				"layer.\n");
-		return err;
+		size_t capacity = queue->lmem_writes_capacity ?
+			2 * queue->lmem_writes_capacity : 64;
+		struct maxhash_lmem_write *writes = realloc(queue->lmem_writes,
+				capacity * sizeof(struct maxhash_lmem_write));
+		if (writes == NULL)
+		{
+			fprintf(stderr, "Error: failed to allocate memory.\n");
+			return MAXHASH_ERR_ERR;
+		}
+		queue->lmem_writes = writes;
+		queue->lmem_writes_capacity = capacity;
 	}
 
+	struct maxhash_lmem_write *write =
+		&queue->lmem_writes[queue->num_lmem_writes++];
+	write->replica = replica;
+	write->base_address_bursts = base_address_bursts;
+	write->data = data;
+	write->data_size_bursts = data_size_bursts;
 	return MAXHASH_ERR_OK;
 }
 
 
 
-maxhash_err_t maxhash_set_memory_access_fn(maxhash_table_t *table,
-		void (*mem_access_fn)(void *arg, bool is_read, size_t
-			base_address_bursts, void *data, size_t data_size_bursts),
-		void *mem_access_fn_arg)
+/*
+ * Write "size_bytes" bytes of a table's memory image, starting at
+ * "offset_bytes", to the buffer that is currently being loaded, on every
+ * engine of the table.  The writes are only queued on "scheduler".  Deep
+ * FMem is loaded as a stream, so it can only be written whole.
+ */
+maxhash_err_t write_mem(maxhash_internal_table_t *itable,
+		maxhash_scheduler_t *scheduler, const char *buf_name,
+		size_t offset_bytes, size_t size_bytes)
 {
-	table->tparams.mem_access_fn = mem_access_fn;
-	table->tparams.mem_access_fn_arg = mem_access_fn_arg;
-	return MAXHASH_ERR_OK;
-}
+	const maxhash_table_params_t *tparams = &itable->table->tparams;
+	maxhash_mem_image_t *image = &itable->image;
+	size_t mem_size_bytes = image->size_bytes;
+	uint8_t *buf = image->data + offset_bytes;
+	maxhash_err_t err = MAXHASH_ERR_OK;
 
+	/* A table that is not double buffered only has the one buffer. */
+	size_t buffer = tparams->is_double_buffered ?
+		itable->table->load_buffer_select : 0;
 
+	PRINT_VAR(s, buf_name);
+	PRINT_VAR(zd, offset_bytes);
+	PRINT_VAR(zd, size_bytes);
 
-maxhash_err_t maxhash_internal_clear_bucket(maxhash_internal_table_t *itable,
-		size_t bucket_id)
-{
-	maxhash_bucket_t *bucket = &itable->buckets[bucket_id];
-	maxhash_entry_t *entry = bucket->entry_list;
+	if (false)
+		for (size_t i = 0; i < size_bytes; i += 8)
+		{
+			size_t limit = i + 8 > size_bytes ? size_bytes : i + 8;
+			for (size_t j = i; j < limit; j++)
+				printf("%02x ", buf[j]);
+			printf("\n");
+		}
 
-	while (entry)
+	for (size_t r = 0; r < tparams->num_replicas; r++)
 	{
-		maxhash_entry_t *tmp = entry;
-		entry = entry->next;
-		free(tmp->key);
-		free(tmp->value);
-		free(tmp);
+		struct maxhash_engine_queue *queue = &scheduler->queues[r];
+
+		if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_FMEM)
+			maxhash_fmem_load(&queue->fmem_loader, tparams->kernel_name,
+					buf_name, (buffer * mem_size_bytes + offset_bytes) /
+					sizeof(uint64_t), buf, size_bytes);
+		else if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_DEEP_FMEM)
+			err |= maxhash_deep_fmem_load(&queue->deep_loader,
+					tparams->kernel_name, buf_name,
+					itable->iparams.deep_fmem_id, image->data, mem_size_bytes,
+					image->entry_size_bytes, &image->deep_fmem_loads[r],
+					&image->load_seconds[r]);
+		else if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_LMEM)
+		{
+			size_t lmem_burst_size_bytes = queue->es->lmem_burst_size_bytes;
+			size_t mem_size_bursts = (mem_size_bytes + lmem_burst_size_bytes -
+					1) / lmem_burst_size_bytes;
+			size_t size_bursts = (size_bytes + lmem_burst_size_bytes - 1) /
+				lmem_burst_size_bytes;
+			err |= queue_lmem_write(queue, &tparams->replicas[r],
+					itable->iparams.base_address_bursts +
+					buffer * mem_size_bursts +
+					offset_bytes / lmem_burst_size_bytes, buf, size_bursts);
+		}
+		else
+		{
+			fprintf(stderr, "Error: hash table memory type is invalid.\n");
+			return MAXHASH_ERR_ERR;
+		}
 	}
 
-	bucket->entry_list = NULL;
-	bucket->num_keys = 0;
+	/* What is written to each engine. */
+	if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_FMEM)
+		image->bytes_written += size_bytes;
+	else if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_DEEP_FMEM)
+		image->bytes_written += mem_size_bytes;
+	else
+	{
+		size_t lmem_burst_size_bytes =
+			tparams->engine_state->lmem_burst_size_bytes;
+		image->bytes_written += (size_bytes + lmem_burst_size_bytes - 1) /
+			lmem_burst_size_bytes * lmem_burst_size_bytes;
+	}
 
-	return MAXHASH_ERR_OK;
+	return err;
 }
 
 
 
-maxhash_err_t maxhash_internal_clear(maxhash_internal_table_t *itable)
+static inline uint64_t low_bits_mask(size_t num_bits)
 {
-	for (size_t bucket_id = 0; bucket_id < itable->iparams.num_buckets;
-			bucket_id++)
-		maxhash_internal_clear_bucket(itable, bucket_id);
+	return num_bits >= 64 ? ~UINT64_C(0) : (UINT64_C(1) << num_bits) - 1;
+}
 
-	itable->num_entries = 0;
 
-	return MAXHASH_ERR_OK;
+
+/* Little-endian loads and stores of up to eight bytes. */
+static inline uint64_t load_le(const uint8_t *src, size_t num_bytes)
+{
+	uint64_t word = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(&word, src, num_bytes);
+#else
+	for (size_t byte = 0; byte < num_bytes; byte++)
+		word |= (uint64_t)src[byte] << (byte * 8);
+#endif
+	return word;
 }
 
 
 
-maxhash_err_t maxhash_clear(maxhash_table_t *table)
+static inline void store_le(uint8_t *dest, uint64_t word, size_t num_bytes)
 {
-	maxhash_internal_clear(&table->sw);
-	maxhash_internal_clear(&table->recent);
-	maxhash_internal_clear(&table->intermediate);
-	maxhash_internal_clear(&table->values);
-
-	return MAXHASH_ERR_OK;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(dest, &word, num_bytes);
+#else
+	for (size_t byte = 0; byte < num_bytes; byte++)
+		dest[byte] = word >> (byte * 8);
+#endif
 }
 
 
 
-maxhash_err_t maxhash_free(maxhash_table_t *table)
+/*
+ * OR the low "width_bits" bits of "src" into a zeroed "dest", starting at bit
+ * "offset_bits".  Bits are numbered from the least significant bit of the
+ * first byte, as in the hardware.
+ */
+static void pack_field(uint8_t *dest, size_t offset_bits, const void *src,
+		size_t width_bits)
 {
-	maxhash_clear(table); /* Free collision lists. */
-	free(table->sw.buckets);
-	free(table->intermediate.buckets);
-	free(table->values.buckets);
-	free(table);
+	const uint8_t *src_u = src;
+	unsigned shift = offset_bits % 8;
 
-	return MAXHASH_ERR_OK;
+	dest += offset_bits / 8;
+
+	if (shift == 0)
+	{
+		memcpy(dest, src_u, width_bits / 8);
+		if (width_bits % 8)
+			dest[width_bits / 8] = src_u[width_bits / 8] &
+				low_bits_mask(width_bits % 8);
+		return;
+	}
+
+	/* Seven bytes at a time, so that a shifted chunk still fits in a word.
+	 * "dest" has eight bytes of slack, so whole words can be updated. */
+	while (width_bits > 0)
+	{
+		size_t chunk_bits = width_bits < 56 ? width_bits : 56;
+		size_t src_bytes = (width_bits + 7) / 8;
+		uint64_t chunk = src_bytes >= sizeof(uint64_t) ?
+			load_le(src_u, sizeof(uint64_t)) : load_le(src_u, src_bytes);
+
+		chunk &= low_bits_mask(chunk_bits);
+		store_le(dest, load_le(dest, sizeof(uint64_t)) | chunk << shift,
+				sizeof(uint64_t));
+
+		src_u += 7;
+		dest += 7;
+		width_bits -= chunk_bits;
+	}
 }
 
 
 
-maxhash_err_t maxhash_contains_in_bucket(
-		const maxhash_internal_table_t *itable,
-		bool *present, const void *key, size_t bucket_id)
+/*
+ * Work out where the fields of an entry go: the deep FMem ID (if any), the
+ * flags, the key (if results are validated) and the value, packed from the
+ * least significant bit upwards.
+ */
+static size_t mem_image_layout(maxhash_internal_table_t *itable,
+		bool has_direct_flag)
 {
-	*present = false;
+	maxhash_mem_image_t *image = &itable->image;
+	size_t offset_bits = 0;
 
-	for (maxhash_entry_t *entry = itable->buckets[bucket_id].entry_list;
-			entry; entry = entry->next)
-		if (!memcmp(key, entry->key, itable->table->tparams.key_width_bytes))
-		{
-			*present = true;
-			break;
-		}
+	if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_DEEP_FMEM)
+		offset_bits += DEEP_FMEM_ID_BITS;
 
-	return MAXHASH_ERR_OK;
-}
+	image->num_flags = has_direct_flag ? NUM_ENTRY_FLAGS : NUM_ENTRY_FLAGS - 1;
+	image->flags_offset_bits = offset_bits;
+	offset_bits += image->num_flags;
 
+	image->key_offset_bits = offset_bits;
+	if (itable->iparams.validate_results)
+		offset_bits += itable->table->tparams.key_width_bits;
 
+	image->value_offset_bits = offset_bits;
+	offset_bits += itable->iparams.width_bits;
 
-maxhash_err_t maxhash_internal_get_bucket_id(
-		const maxhash_internal_table_t *itable, size_t *bucket_id,
-		const void *key, size_t hashparam)
-{
-	*bucket_id = maxhash_function_jenkins(key,
-			itable->table->tparams.key_width_bytes, hashparam,
-			itable->table->tparams.jenkins_chunk_width_bytes)
-		% itable->iparams.num_buckets;
-	return MAXHASH_ERR_OK;
+	image->entry_bits = offset_bits;
+	return offset_bits;
 }
 
 
 
-maxhash_err_t maxhash_contains(const maxhash_table_t *table, bool *present,
-		const void *key, size_t key_len)
+/* Mark every burst as out of date in both buffers. */
+static void mem_image_invalidate(maxhash_mem_image_t *image)
 {
-	PAD_KEY(&table->tparams, key, key_len);
-	size_t bucket_id;
-	maxhash_internal_get_bucket_id(&table->sw, &bucket_id, key, 0);
-	return maxhash_contains_in_bucket(&table->sw, present, key, bucket_id);
+	size_t num_words = (image->num_bursts + 63) / 64;
+	for (size_t buffer = 0; buffer < 2; buffer++)
+		memset(image->dirty_bursts[buffer], 0xff, num_words * sizeof(uint64_t));
+	for (size_t r = 0; r < MAXHASH_MAX_REPLICAS; r++)
+		image->deep_fmem_loads[r] = DEEP_FMEM_LOADS_UNKNOWN;
 }
 
 
 
-maxhash_err_t maxhash_internal_set_entry_flag(maxhash_internal_table_t *itable,
-		const void *key, uint8_t flag_id, bool flag_value)
+static maxhash_err_t mem_image_init(maxhash_internal_table_t *itable,
+		bool has_direct_flag)
 {
 	const maxhash_table_params_t *tparams = &itable->table->tparams;
-	size_t bucket_id;
-	maxhash_internal_get_bucket_id(itable, &bucket_id, key, 0);
-	maxhash_bucket_t *bucket = &itable->buckets[bucket_id];
+	maxhash_mem_image_t *image = &itable->image;
 
-	bool already_present;
-	maxhash_contains_in_bucket(itable, &already_present, key,
-			bucket_id);
+	size_t mem_entry_size_bits = mem_image_layout(itable, has_direct_flag);
+	size_t mem_entry_size_bytes = (mem_entry_size_bits + 7) / 8;
+
+	size_t burst_size_bytes = 0;
+	if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_FMEM)
+		burst_size_bytes = sizeof(uint64_t);
+	else if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_DEEP_FMEM)
+	{
+		/* Each entry is streamed padded to a power of two of words, as in
+		 * MaxHashUtils.padToPCIeWidth(). */
+		burst_size_bytes = sizeof(uint64_t);
+		while (burst_size_bytes < mem_entry_size_bytes)
+			burst_size_bytes *= 2;
+	}
+	else if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_LMEM)
+		burst_size_bytes = tparams->engine_state->lmem_burst_size_bytes;
+	else
+	{
+		fprintf(stderr, "Error: hash table memory type is invalid.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	const size_t PCIE_WIDTH = 16;
+	if (burst_size_bytes < PCIE_WIDTH)
+	{
+		/* Round burst size up to a power of two, if not already. */
+		size_t power = 1;
+		while (power < burst_size_bytes)
+			power *= 2;
+		burst_size_bytes = power;
+	}
+	else
+	{
+		/* Round burst size up to a multiple of the PCIe interface size, if not
+		 * already. */
+		burst_size_bytes = ((burst_size_bytes + PCIE_WIDTH - 1) / PCIE_WIDTH) *
+			PCIE_WIDTH;
+	}
+
+	/* We don't support multi-burst entries yet. */
+	if (mem_entry_size_bytes > burst_size_bytes)
+	{
+		fprintf(stderr, "Error: memory entries are too large.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	/* Deep FMem entries are streamed one per padded item, each with its own
+	 * ID, so only the other memories pack several entries into a burst. */
+	size_t entries_per_burst = 1;
+	if (itable->iparams.mem_type != MAXHASH_MEM_TYPE_DEEP_FMEM)
+	{
+		while (entries_per_burst <= burst_size_bytes / mem_entry_size_bytes
+				&& burst_size_bytes % entries_per_burst == 0)
+			entries_per_burst *= 2;
+		entries_per_burst /= 2;
+	}
+
+	image->burst_size_bytes = burst_size_bytes;
+	image->entries_per_burst = entries_per_burst;
+	image->entry_size_bytes = burst_size_bytes / entries_per_burst;
+	image->num_bursts = (itable->iparams.num_buckets + entries_per_burst - 1) /
+		entries_per_burst;
+	image->size_bytes = image->num_bursts * burst_size_bytes;
 
-	if (!already_present)
+	PRINT_VAR(zd, image->entry_size_bytes);
+	PRINT_VAR(zd, itable->iparams.num_buckets);
+	PRINT_VAR(zd, image->entries_per_burst);
+	PRINT_VAR(zd, image->num_bursts);
+	PRINT_VAR(zd, image->burst_size_bytes);
+	PRINT_VAR(zd, image->size_bytes);
+
+	size_t num_burst_words = (image->num_bursts + 63) / 64;
+	image->data = calloc(1, image->size_bytes);
+	image->dirty_buckets = calloc((itable->iparams.num_buckets + 63) / 64,
+			sizeof(uint64_t));
+	image->dirty_bursts[0] = calloc(num_burst_words, sizeof(uint64_t));
+	image->dirty_bursts[1] = calloc(num_burst_words, sizeof(uint64_t));
+
+	if (image->data == NULL || image->dirty_buckets == NULL ||
+			image->dirty_bursts[0] == NULL || image->dirty_bursts[1] == NULL)
+	{
+		fprintf(stderr, "Error: failed to allocate memory image of \"%s\" "
+				"table.\n", itable->iparams.name);
+		free(image->data);
+		free(image->dirty_buckets);
+		free(image->dirty_bursts[0]);
+		free(image->dirty_bursts[1]);
+		memset(image, 0, sizeof(*image));
 		return MAXHASH_ERR_ERR;
+	}
 
-	for (maxhash_entry_t *e = bucket->entry_list; e; e = e->next)
-		if (!memcmp(key, e->key, tparams->key_width_bytes))
-			e->flags[flag_id] = flag_value;
+	/* Nothing is known about what the hardware holds yet. */
+	image->all_buckets_dirty = true;
+	mem_image_invalidate(image);
 
 	return MAXHASH_ERR_OK;
 }
 
 
 
-maxhash_err_t maxhash_internal_put_in_bucket(maxhash_internal_table_t *itable,
-		const void *key, const void *value, size_t bucket_id)
+maxhash_err_t maxhash_internal_image_init(maxhash_internal_table_t *itable,
+		bool has_direct_flag)
 {
-	const maxhash_table_params_t *tparams = &itable->table->tparams;
-	maxhash_bucket_t *bucket = &itable->buckets[bucket_id];
+	if (itable->image.data != NULL)
+		return MAXHASH_ERR_OK;
+	return mem_image_init(itable, has_direct_flag);
+}
+
 
-	bool already_present;
-	maxhash_contains_in_bucket(itable, &already_present, key, bucket_id);
 
-	if (already_present)
+/*
+ * Serialise the entry of a bucket into the memory image, marking the burst
+ * if it changes as dirty in both buffers.  Each bucket of a memory holds at
+ * most one entry.  "entry_buf" must have room for an entry plus eight bytes.
+ */
+static void serialise_bucket(maxhash_internal_table_t *itable,
+		size_t bucket_id, bool has_direct_flag, uint8_t *entry_buf)
+{
+	const maxhash_table_params_t *tparams = &itable->table->tparams;
+	maxhash_mem_image_t *image = &itable->image;
+	bool validate = itable->iparams.validate_results;
+	size_t key_bits = validate ? tparams->key_width_bits : 0;
+	size_t value_bits = itable->iparams.width_bits;
+	uint64_t deep_fmem_id = itable->iparams.mem_type ==
+		MAXHASH_MEM_TYPE_DEEP_FMEM ? itable->iparams.deep_fmem_id &
+		low_bits_mask(DEEP_FMEM_ID_BITS) : 0;
+
+	size_t burst = bucket_id / image->entries_per_burst;
+	size_t entry_in_burst = bucket_id % image->entries_per_burst;
+	uint8_t *dest = image->data + burst * image->burst_size_bytes +
+		entry_in_burst * image->entry_size_bytes;
+
+	uint32_t id = maxhash_bucket_peek(itable, bucket_id)->head;
+	maxhash_entry_t *e = id != MAXHASH_NIL ? maxhash_entry_get(itable, id) :
+		NULL;
+
+	uint64_t flags = 0;
+	if (e && e->flags[FLAG_VALID])
 	{
-		for (maxhash_entry_t *e = bucket->entry_list; e; e = e->next)
-			if (!memcmp(key, e->key, tparams->key_width_bytes)) {
-				memcpy(e->value, value, itable->iparams.width_bytes);
-				maxhash_debug_print(itable->table, "Adding entry to \"%s\" table...\n",
-						itable->iparams.name);
-				if (itable->table->tparams.debug)
-					hash_print_entry(itable, e);
-			}
+		flags |= (uint64_t)e->flags[FLAG_VALID] << FLAG_VALID;
+		if (has_direct_flag)
+			flags |= (uint64_t)e->flags[FLAG_PERFECT_DIRECT] <<
+				FLAG_PERFECT_DIRECT;
 	}
 	else
-	{
-		if (tparams->perfect && tparams->max_bucket_entries == 1 &&
-				itable->num_entries >= tparams->values.num_buckets)
-		{
-			fprintf(stderr, "Error: perfect hash table is full.\n");
-			return MAXHASH_ERR_ERR;
-		}
-
-		bucket->num_keys++;
-		itable->num_entries++;
+		e = NULL;
 
-		maxhash_entry_t *new_entry = calloc(1, sizeof(maxhash_entry_t));
+	/* Slots can be wider than their entries, and the padding is compared and
+	 * written along with the entry. */
+	memset(entry_buf, 0, image->entry_size_bytes);
 
-		new_entry->key   = calloc(1, tparams->key_width_bytes);
-		new_entry->value = calloc(1, itable->iparams.width_bytes);
+	if (image->entry_bits <= 64)
+	{
+		/* Narrow entries are assembled in a single word.  Keys and values are
+		 * padded to whole words in entry records, so they can be read a word
+		 * at a time. */
+		uint64_t word = deep_fmem_id | flags << image->flags_offset_bits;
+		if (e && validate)
+			word |= (load_le(maxhash_entry_key(e), sizeof(uint64_t)) &
+					low_bits_mask(key_bits)) << image->key_offset_bits;
+		if (e)
+			word |= (load_le(maxhash_entry_value(itable, e),
+						sizeof(uint64_t)) & low_bits_mask(value_bits)) <<
+				image->value_offset_bits;
+		store_le(entry_buf, word, sizeof(word));
+	}
+	else
+	{
+		store_le(entry_buf, deep_fmem_id | flags << image->flags_offset_bits,
+				1);
+		if (e && validate)
+			pack_field(entry_buf, image->key_offset_bits, maxhash_entry_key(e),
+					key_bits);
+		if (e)
+			pack_field(entry_buf, image->value_offset_bits,
+					maxhash_entry_value(itable, e), value_bits);
+	}
 
-		new_entry->flags[FLAG_VALID] = true;
+	if (memcmp(dest, entry_buf, image->entry_size_bytes) != 0)
+	{
+		memcpy(dest, entry_buf, image->entry_size_bytes);
+		image->dirty_bursts[0][burst / 64] |= UINT64_C(1) << (burst % 64);
+		image->dirty_bursts[1][burst / 64] |= UINT64_C(1) << (burst % 64);
+	}
+}
 
-		memcpy(new_entry->key,   key,   tparams->key_width_bytes);
-		memcpy(new_entry->value, value, itable->iparams.width_bytes);
 
-		maxhash_debug_print(itable->table, "Adding entry to \"%s\" table...\n",
-				itable->iparams.name);
-		if (itable->table->tparams.debug)
-			hash_print_entry(itable, new_entry);
 
-		if (!bucket->entry_list)
-			bucket->entry_list = new_entry;
-		else
+/* Find the first burst from "start" that is dirty (or clean), or "end". */
+static size_t find_burst(const uint64_t *bursts, size_t start, size_t end,
+		bool dirty)
+{
+	while (start < end)
+	{
+		uint64_t word = dirty ? bursts[start / 64] : ~bursts[start / 64];
+		word &= ~UINT64_C(0) << (start % 64);
+		if (word != 0)
 		{
-			maxhash_entry_t *last_entry = bucket->entry_list;
-			while (last_entry->next)
-				last_entry = last_entry->next;
-			last_entry->next = new_entry;
+			size_t found = start / 64 * 64 + __builtin_ctzll(word);
+			return found < end ? found : end;
 		}
+		start = (start / 64 + 1) * 64;
 	}
 
-	return MAXHASH_ERR_OK;
+	return end;
 }
 
 
 
-maxhash_err_t maxhash_internal_put(maxhash_internal_table_t *itable,
-		const void *key, const void *value)
+/*
+ * Bring the buffer that is currently being loaded up to date.  Only the
+ * buckets changed since the last call are serialised, and only the bursts
+ * that differ from what the buffer already holds are written.  The writes
+ * are only queued on "scheduler", which the caller must flush.
+ */
+maxhash_err_t write_table_data(maxhash_internal_table_t *itable,
+		bool has_direct_flag, maxhash_scheduler_t *scheduler)
 {
-	size_t bucket_id;
-	maxhash_internal_get_bucket_id(itable, &bucket_id, key, 0);
-	return maxhash_internal_put_in_bucket(itable, key, value, bucket_id);
-}
+	maxhash_mem_image_t *image = &itable->image;
+	maxhash_err_t err = MAXHASH_ERR_OK;
 
+	if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_UNDEFINED)
+		return MAXHASH_ERR_OK;
 
+	if (maxhash_internal_image_init(itable, has_direct_flag) !=
+			MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
 
-maxhash_err_t maxhash_put(maxhash_table_t *table, const void *key, size_t
-		key_len, const void *value, size_t value_len)
-{
-	PAD_KEY(&table->tparams, key, key_len);
-	PAD_VAL(&table->values.iparams, value, value_len);
+	uint8_t *entry_buf = malloc(image->entry_size_bytes + sizeof(uint64_t));
+	if (entry_buf == NULL)
+	{
+		fprintf(stderr, "Error: failed to allocate memory.\n");
+		return MAXHASH_ERR_ERR;
+	}
 
-	maxhash_err_t err = MAXHASH_ERR_OK;
-	err |= maxhash_internal_put(&table->sw, key, value);
-	err |= maxhash_internal_put(&table->recent, key, value);
-	return err;
-}
+	image->bytes_written = 0;
+	double start = now_seconds();
 
+	size_t num_buckets = itable->iparams.num_buckets;
+	for (size_t word = 0; word < (num_buckets + 63) / 64; word++)
+	{
+		uint64_t dirty = image->all_buckets_dirty ? ~UINT64_C(0) :
+			image->dirty_buckets[word];
+		image->dirty_buckets[word] = 0;
 
+		for (; dirty != 0; dirty &= dirty - 1)
+		{
+			size_t bucket_id = word * 64 + __builtin_ctzll(dirty);
+			if (bucket_id >= num_buckets)
+				break;
+			serialise_bucket(itable, bucket_id, has_direct_flag, entry_buf);
+		}
+	}
+	image->all_buckets_dirty = false;
+	free(entry_buf);
 
-maxhash_err_t maxhash_internal_get_entry_in_bucket(
-		const maxhash_internal_table_t *itable, bool check_key,
-		const void *key, maxhash_entry_t *entry, size_t bucket_id)
-{
-	const maxhash_table_params_t *tparams = &itable->table->tparams;
-	maxhash_bucket_t *bucket = &itable->buckets[bucket_id];
+	double serialised = now_seconds();
+	image->serialise_seconds = serialised - start;
+
+	uint64_t *dirty_bursts =
+		image->dirty_bursts[itable->table->load_buffer_select];
+	size_t bursts_written = 0;
 
-	for (maxhash_entry_t *e = bucket->entry_list; e; e = e->next)
-		if (!check_key || !memcmp(key, e->key, tparams->key_width_bytes))
+	if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_DEEP_FMEM)
+	{
+		if (find_burst(dirty_bursts, 0, image->num_bursts, true) <
+				image->num_bursts)
 		{
-			memcpy(entry, e, sizeof(maxhash_entry_t));
-			return MAXHASH_ERR_OK;
+			err |= write_mem(itable, scheduler, itable->iparams.name, 0,
+					image->size_bytes);
+			bursts_written = image->num_bursts;
+		}
+	}
+	else
+	{
+		size_t end = 0;
+		for (size_t start = find_burst(dirty_bursts, 0, image->num_bursts,
+					true); start < image->num_bursts; start = find_burst(
+					dirty_bursts, end, image->num_bursts, true))
+		{
+			end = find_burst(dirty_bursts, start, image->num_bursts, false);
+			err |= write_mem(itable, scheduler, itable->iparams.name,
+					start * image->burst_size_bytes,
+					(end - start) * image->burst_size_bytes);
+			bursts_written += end - start;
 		}
+	}
 
-	return MAXHASH_ERR_ERR;
+	memset(dirty_bursts, 0, (image->num_bursts + 63) / 64 * sizeof(uint64_t));
+
+	image->write_seconds = now_seconds() - serialised;
+	image->bursts_written = bursts_written;
+
+	maxhash_debug_print(itable->table, "Queued %zu of %zu bursts of \"%s\" "
+			"table.\n", bursts_written, image->num_bursts, itable->iparams.name);
+
+	return err;
 }
 
 
 
-maxhash_err_t maxhash_internal_get_entry(
-		const maxhash_internal_table_t *itable, bool check_key,
-		const void *key, maxhash_entry_t *entry)
+maxhash_err_t maxhash_invalidate_hw(maxhash_table_t *table)
 {
-	size_t bucket_id;
-	maxhash_internal_get_bucket_id(itable, &bucket_id, key, 0);
-	return maxhash_internal_get_entry_in_bucket(itable, check_key, key, entry,
-			bucket_id);
+	maxhash_internal_wait_for_commit(table);
+
+	if (table->intermediate.image.data != NULL)
+		mem_image_invalidate(&table->intermediate.image);
+	if (table->values.image.data != NULL)
+		mem_image_invalidate(&table->values.image);
+	for (size_t way = 0; way < maxhash_num_ways(&table->tparams); way++)
+		if (table->ways[way].image.data != NULL)
+			mem_image_invalidate(&table->ways[way].image);
+	return MAXHASH_ERR_OK;
 }
 
 
 
-maxhash_err_t maxhash_internal_get(const maxhash_internal_table_t *itable,
-		bool check_key, const void *key, void *value)
+/* Report how long the Deep FMem loads of the last commit took. */
+static void print_load_time(const maxhash_internal_table_t *itable)
 {
-	maxhash_err_t err = MAXHASH_ERR_OK;
-	maxhash_entry_t entry;
-	err |= maxhash_internal_get_entry(itable, check_key, key, &entry);
+	if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_DEEP_FMEM &&
+			itable->image.data != NULL)
+		for (size_t r = 0; r < itable->table->tparams.num_replicas; r++)
+			maxhash_debug_print(itable->table, "Loaded \"%s\" table on engine "
+					"%zu in %.3f ms.\n", itable->iparams.name, r,
+					itable->image.load_seconds[r] * 1e3);
+}
 
-	if (err == MAXHASH_ERR_ERR)
-		return err;
 
-	memcpy(value, entry.value, itable->iparams.width_bytes);
-	return MAXHASH_ERR_OK;
+
+/* Add what the last write of a table's image did to a commit's statistics. */
+static void add_write_stats(maxhash_stats_t *stats,
+		const maxhash_internal_table_t *itable)
+{
+	const maxhash_mem_image_t *image = &itable->image;
+	if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_UNDEFINED)
+		return;
+	stats->serialise_seconds += image->serialise_seconds;
+	stats->transfer_seconds += image->write_seconds;
+	stats->bursts_written += image->bursts_written;
+	stats->bytes_transferred += image->bytes_written;
 }
 
 
 
-maxhash_err_t maxhash_internal_get_flag(const maxhash_entry_t *entry, int flag,
-		bool *value)
+/* Queue the write that switches the buffer the hardware reads a table from. */
+static void queue_buffer_switch(maxhash_table_t *table,
+		maxhash_fmem_loader_t *loader)
 {
-	memcpy(value, &entry->flags[flag], sizeof(bool));
-	return MAXHASH_ERR_OK;
+	char name_buf[NAME_BUF_LEN + sizeof("_BufferSelect")] = {0};
+	snprintf(name_buf, sizeof(name_buf), "%s_BufferSelect",
+			table->tparams.hash_table_name);
+
+	uint64_t load_buffer_select = table->load_buffer_select;
+	maxhash_fmem_load(loader, table->tparams.kernel_name, name_buf, 0,
+			&load_buffer_select, sizeof(load_buffer_select));
 }
 
 
 
-maxhash_err_t maxhash_internal_perfect_get_index(const maxhash_table_t *table,
-		const void *key, size_t *index)
+static void scheduler_reset(maxhash_scheduler_t *scheduler)
 {
-	maxhash_err_t err = MAXHASH_ERR_OK;
-	*index = 0;
-	bool perfect_direct;
+	for (size_t e = 0; e < scheduler->num_engines; e++)
+	{
+		struct maxhash_engine_queue *queue = &scheduler->queues[e];
+		maxhash_fmem_loader_init(&queue->fmem_loader, queue->es);
+		maxhash_deep_fmem_loader_init(&queue->deep_loader, queue->es);
+		queue->num_lmem_writes = 0;
+		queue->transfer_seconds = 0;
+	}
+	scheduler->num_tables = 0;
+}
 
-	maxhash_entry_t entry;
-	err |= maxhash_internal_get_entry(&table->intermediate, false, key,
-			&entry);
 
-	if (err != MAXHASH_ERR_OK)
-		return err;
 
-	memcpy(index, entry.value, table->intermediate.iparams.width_bytes);
+static void scheduler_setup(maxhash_scheduler_t *scheduler,
+		maxhash_engine_state_t *const *engine_states, size_t num_engines)
+{
+	memset(scheduler, 0, sizeof(*scheduler));
+	scheduler->num_engines = num_engines;
+	for (size_t e = 0; e < num_engines; e++)
+		scheduler->queues[e].es = engine_states[e];
+	scheduler_reset(scheduler);
+}
 
-	err |= maxhash_internal_get_flag(&entry, FLAG_PERFECT_DIRECT,
-			&perfect_direct);
 
-	if (err != MAXHASH_ERR_OK)
-		return err;
 
-	if (!perfect_direct)
-		maxhash_internal_get_bucket_id(&table->values, index, key, *index);
+/* Set up a scheduler for the engines of a table. */
+static void scheduler_setup_for_table(maxhash_scheduler_t *scheduler,
+		const maxhash_table_t *table)
+{
+	maxhash_engine_state_t *engine_states[MAXHASH_MAX_REPLICAS];
+	for (size_t r = 0; r < table->tparams.num_replicas; r++)
+		engine_states[r] = table->tparams.replicas[r].es;
+	scheduler_setup(scheduler, engine_states, table->tparams.num_replicas);
+}
 
-	//printf("key: %s, intermediate: %u, perfect_direct: %u, index: %zu\n",
-			//(char *)key, intermediate, perfect_direct, *index);
 
-	return err;
+
+static void scheduler_release(maxhash_scheduler_t *scheduler)
+{
+	for (size_t e = 0; e < scheduler->num_engines; e++)
+		free(scheduler->queues[e].lmem_writes);
 }
 
 
 
-maxhash_err_t maxhash_perfect_get_index(maxhash_table_t *table,
-		const void *key, size_t key_len, size_t *index)
+maxhash_err_t maxhash_scheduler_init(maxhash_scheduler_t **scheduler,
+		maxhash_engine_state_t *engine_state)
 {
-	PAD_KEY(&table->tparams, key, key_len);
-	return maxhash_internal_perfect_get_index(table, key, index);
+	return maxhash_scheduler_init_replicated(scheduler, &engine_state, 1);
 }
 
 
 
-maxhash_err_t maxhash_internal_perfect_get(const maxhash_table_t *table,
-		const void *key, void *value, bool *valid)
+maxhash_err_t maxhash_scheduler_init_replicated(
+		maxhash_scheduler_t **scheduler, maxhash_engine_state_t **engine_states,
+		size_t num_engines)
 {
-	maxhash_err_t err = MAXHASH_ERR_OK;
-	size_t index;
-	err |= maxhash_internal_perfect_get_index(table, key, &index);
+	if (num_engines == 0 || num_engines > MAXHASH_MAX_REPLICAS)
+	{
+		fprintf(stderr, "Error: number of engines (%zu) is invalid; at most "
+				"%d are supported.\n", num_engines, MAXHASH_MAX_REPLICAS);
+		return MAXHASH_ERR_ERR;
+	}
 
-	maxhash_entry_t entry;
-	err |= maxhash_internal_get_entry_in_bucket(&table->values, true, key,
-			&entry, index);
+	*scheduler = malloc(sizeof(maxhash_scheduler_t));
+	if (*scheduler == NULL)
+	{
+		fprintf(stderr, "Error: failed to allocate scheduler.\n");
+		return MAXHASH_ERR_ERR;
+	}
 
-	if (err != MAXHASH_ERR_OK)
-		return err;
+	scheduler_setup(*scheduler, engine_states, num_engines);
+	return MAXHASH_ERR_OK;
+}
 
-	memcpy(value, entry.value, table->values.iparams.width_bytes);
-	err |= maxhash_internal_get_flag(&entry, FLAG_VALID, valid);
 
-	//printf("index: %zu, value: %lu\n", index, *(uint64_t *)value);
 
+maxhash_err_t maxhash_scheduler_free(maxhash_scheduler_t *scheduler)
+{
+	maxhash_err_t err = maxhash_scheduler_flush(scheduler);
+	scheduler_release(scheduler);
+	free(scheduler);
 	return err;
 }
 
 
 
-maxhash_err_t maxhash_perfect_get(maxhash_table_t *table, const void *key,
-		size_t key_len, void *value, bool *valid)
+/* Whether a table is on exactly the engines of a scheduler, in order. */
+static bool scheduler_has_engines(const maxhash_scheduler_t *scheduler,
+		const maxhash_table_t *table)
 {
-	PAD_KEY(&table->tparams, key, key_len);
-	return maxhash_internal_perfect_get(table, key, value, valid);
+	if (table->tparams.num_replicas != scheduler->num_engines)
+		return false;
+	for (size_t r = 0; r < table->tparams.num_replicas; r++)
+		if (table->tparams.replicas[r].es != scheduler->queues[r].es)
+			return false;
+	return true;
 }
 
 
 
-maxhash_err_t maxhash_get(const maxhash_table_t *table, const void *key, size_t
-		key_len, void *value)
+/* The number of Deep FMem loads that writing a table's images can queue. */
+static size_t num_deep_fmem_loads(const maxhash_table_t *table)
 {
-	PAD_KEY(&table->tparams, key, key_len);
-	return maxhash_internal_get(&table->sw, true, key, value);
+	size_t num_loads = table->values.iparams.mem_type ==
+		MAXHASH_MEM_TYPE_DEEP_FMEM;
+	if (table->tparams.max_bucket_entries == 1)
+		num_loads += table->intermediate.iparams.mem_type ==
+			MAXHASH_MEM_TYPE_DEEP_FMEM;
+	for (size_t way = 0; way < maxhash_num_ways(&table->tparams); way++)
+		num_loads += table->ways[way].iparams.mem_type ==
+			MAXHASH_MEM_TYPE_DEEP_FMEM;
+	return num_loads;
 }
 
 
 
-maxhash_err_t maxhash_remove_from_bucket(maxhash_internal_table_t *itable,
-		const void *key, size_t bucket_id)
+/*
+ * Queue the changes to a table's memory images, and its buffer switch, on a
+ * scheduler, flushing the scheduler first if it has no room for them.
+ */
+static maxhash_err_t scheduler_queue(maxhash_scheduler_t *scheduler,
+		maxhash_table_t *table, bool report)
 {
-	const maxhash_table_params_t *tparams = &itable->table->tparams;
-	maxhash_bucket_t *bucket = &itable->buckets[bucket_id];
-	maxhash_entry_t *cur = bucket->entry_list;
+	maxhash_err_t err = MAXHASH_ERR_OK;
 
-	/* Empty list. */
-	if (!cur)
-	{
-		fprintf(stderr, "Error: attempted to remove an entry that is "
-				"not present in the \"%s\" hash table.\n",
-				itable->iparams.name);
-		return MAXHASH_ERR_ERR;
-	}
+	/* Every engine has the same Deep FMem loads queued. */
+	if (scheduler->num_tables == MAXHASH_SCHEDULER_MAX_TABLES ||
+			(scheduler->num_engines > 0 &&
+			 scheduler->queues[0].deep_loader.num_loads +
+			 num_deep_fmem_loads(table) > DEEP_FMEM_MAX_LOADS))
+		err |= maxhash_scheduler_flush(scheduler);
 
-	/* Delete head node? */
-	if (!memcmp(key, cur->key, tparams->key_width_bytes))
+	if (table->tparams.max_bucket_entries == 1)
 	{
-		bucket->entry_list = cur->next;
-		free(cur->key);
-		free(cur->value);
-		free(cur);
-		bucket->num_keys--;
-		itable->num_entries--;
-		return MAXHASH_ERR_OK;
+		maxhash_debug_print(table, "Writing table of hash parameters...\n");
+		err |= write_table_data(&table->intermediate, true, scheduler);
+		maxhash_debug_print(table, "Finished writing table of hash parameters.\n");
+		maxhash_debug_print(table, "Writing table of values...\n");
+		err |= write_table_data(&table->values, false, scheduler);
+		maxhash_debug_print(table, "Finished writing table of values.\n");
+		add_write_stats(&table->stats, &table->intermediate);
+		add_write_stats(&table->stats, &table->values);
 	}
-
-	maxhash_entry_t *prev = cur;
-	cur = cur->next;
-
-	/* Search for entry. */
-	while (cur)
-	{
-		if (!memcmp(key, cur->key, tparams->key_width_bytes))
+	else
+		for (size_t way = 0; way < maxhash_num_ways(&table->tparams); way++)
 		{
-			prev->next = cur->next;
-			free(cur->key);
-			free(cur->value);
-			free(cur);
-			bucket->num_keys--;
-			itable->num_entries--;
-			return MAXHASH_ERR_OK;
+			err |= write_table_data(&table->ways[way], false, scheduler);
+			add_write_stats(&table->stats, &table->ways[way]);
 		}
 
-		prev = cur;
-		cur = cur->next;
-	}
+	struct maxhash_scheduled_table *scheduled =
+		&scheduler->tables[scheduler->num_tables++];
+	scheduled->table = table;
+	scheduled->report = report;
+	table->scheduler = scheduler;
 
-	fprintf(stderr, "Error: attempted to remove an entry that is not present "
-			"in the requested hash table.\n");
-	return MAXHASH_ERR_ERR;
+	return err;
 }
 
 
 
-maxhash_err_t maxhash_internal_remove(
-		maxhash_internal_table_t *itable, const void *key)
+/* Run the writes queued for one engine and wait for them to complete. */
+static void *queue_transfer(void *arg)
 {
-	size_t bucket_id;
-	maxhash_internal_get_bucket_id(itable, &bucket_id, key, 0);
-	return maxhash_remove_from_bucket(itable, key, bucket_id);
-}
+	struct maxhash_engine_queue *queue = arg;
+	double start = now_seconds();
 
+	for (size_t i = 0; i < queue->num_lmem_writes; i++)
+	{
+		const struct maxhash_lmem_write *write = &queue->lmem_writes[i];
+		write->replica->mem_access_fn(write->replica->mem_access_fn_arg, false,
+				write->base_address_bursts, write->data,
+				write->data_size_bursts);
+	}
 
+	/* The Deep FMem loads of all the tables are streamed together. */
+	maxhash_fmem_loader_finish(&queue->fmem_loader);
+	maxhash_deep_fmem_loader_finish(&queue->deep_loader);
 
-maxhash_err_t maxhash_perfect_values_remove(maxhash_table_t *table,
-		const void *key)
-{
-	maxhash_err_t err = MAXHASH_ERR_OK;
-	size_t old_values_bucket;
-	err |= maxhash_internal_perfect_get_index(table, key, &old_values_bucket);
-	err |= maxhash_remove_from_bucket(&table->values, key, old_values_bucket);
-	return err;
+	queue->transfer_seconds = now_seconds() - start;
+	return NULL;
 }
 
 
 
-maxhash_err_t maxhash_remove(maxhash_table_t *table, const void *key, size_t
-		key_len)
+maxhash_err_t maxhash_scheduler_flush(maxhash_scheduler_t *scheduler)
 {
-	PAD_KEY(&table->tparams, key, key_len);
-
-	maxhash_err_t err = MAXHASH_ERR_OK;
-
-	err |= maxhash_internal_remove(&table->sw, key);
-
-	// FIXME
-	err |= maxhash_internal_remove(&table->recent, key);
+	if (scheduler->num_tables == 0)
+		return MAXHASH_ERR_OK;
 
-	err |= maxhash_perfect_values_remove(table, key);
+	/* Each engine of a replicated table is written on a thread of its own, or
+	 * on this one if no thread can be started. */
+	bool has_thread[MAXHASH_MAX_REPLICAS] = {false};
+	double start = now_seconds();
+	for (size_t e = 0; e < scheduler->num_engines; e++)
+	{
+		struct maxhash_engine_queue *queue = &scheduler->queues[e];
+		if (scheduler->num_engines > 1)
+			has_thread[e] = pthread_create(&queue->thread, NULL,
+					queue_transfer, queue) == 0;
+		if (!has_thread[e])
+			queue_transfer(queue);
+	}
+	for (size_t e = 0; e < scheduler->num_engines; e++)
+		if (has_thread[e])
+			pthread_join(scheduler->queues[e].thread, NULL);
+	double transfer_seconds = now_seconds() - start;
+
+	/* Every table's data is now in place on every engine, so the buffers can
+	 * be switched.  All the engines are started before any is waited for, to
+	 * keep them in step. */
+	maxhash_fmem_loader_t switches[MAXHASH_MAX_REPLICAS];
+	for (size_t e = 0; e < scheduler->num_engines; e++)
+	{
+		maxhash_fmem_loader_init(&switches[e], scheduler->queues[e].es);
+		for (size_t i = 0; i < scheduler->num_tables; i++)
+			if (scheduler->tables[i].table->tparams.is_double_buffered)
+				queue_buffer_switch(scheduler->tables[i].table, &switches[e]);
+	}
+	start = now_seconds();
+	for (size_t e = 0; e < scheduler->num_engines; e++)
+		maxhash_fmem_loader_start(&switches[e]);
+	for (size_t e = 0; e < scheduler->num_engines; e++)
+		maxhash_fmem_loader_finish(&switches[e]);
+	double switch_seconds = now_seconds() - start;
+
+	for (size_t i = 0; i < scheduler->num_tables; i++)
+	{
+		maxhash_table_t *table = scheduler->tables[i].table;
 
-	// FIXME
-	err |= maxhash_internal_remove(&table->intermediate, key);
+		if (table->tparams.is_double_buffered)
+		{
+			maxhash_debug_print(table, "Switched buffer.\n");
+			table->load_buffer_select ^= 1;
+		}
+		print_load_time(&table->intermediate);
+		print_load_time(&table->values);
+		for (size_t way = 0; way < maxhash_num_ways(&table->tparams); way++)
+			print_load_time(&table->ways[way]);
+		table->scheduler = NULL;
+
+		table->stats.transfer_seconds += transfer_seconds;
+		table->stats.switch_seconds = switch_seconds;
+		table->stats.total_seconds += transfer_seconds + switch_seconds;
+		table->stats.num_replicas = scheduler->num_engines;
+		for (size_t e = 0; e < scheduler->num_engines; e++)
+			table->stats.replica_transfer_seconds[e] =
+				scheduler->queues[e].transfer_seconds;
+		if (scheduler->tables[i].report && table->stats_fn != NULL)
+			table->stats_fn(&table->stats, table->stats_fn_arg);
+	}
 
-	return err;
+	scheduler_reset(scheduler);
+	return MAXHASH_ERR_OK;
 }
 
 
 
-maxhash_err_t write_mem(const maxhash_internal_table_t *itable,
-		const char *buf_name, void *buf, size_t mem_size_bytes)
+/*
+ * Build the perfect hash tables and queue everything that changed on
+ * "scheduler".  The commit is complete once the scheduler is flushed.
+ */
+static maxhash_err_t commit_tables(maxhash_table_t *table,
+		maxhash_scheduler_t *scheduler)
 {
-	const maxhash_table_params_t *tparams = &itable->table->tparams;
+	/* Sanity check. */
+	for (size_t i = 0; i < table->intermediate.iparams.num_buckets; i++)
+		assert((maxhash_bucket_peek(&table->values, i)->num_keys == 0 &&
+					maxhash_bucket_peek(&table->values, i)->head == MAXHASH_NIL)
+				|| (maxhash_bucket_peek(&table->values, i)->num_keys > 0 &&
+					maxhash_bucket_peek(&table->values, i)->head != MAXHASH_NIL));
 
-	PRINT_VAR(s, buf_name);
-	PRINT_VAR(zd, mem_size_bytes);
+	maxhash_err_t err = MAXHASH_ERR_OK;
+	double start = now_seconds();
+	memset(&table->stats, 0, sizeof(table->stats));
 
-	if (false)
-		for (size_t i = 0; i < mem_size_bytes; i += 8)
-		{
-			size_t limit = i + 8 > mem_size_bytes ? mem_size_bytes : i + 8;
-			for (size_t j = i; j < limit; j++)
-				printf("%02x ", ((uint8_t *)buf)[j]);
-			printf("\n");
-		}
+	if (table->tparams.debug) maxhash_print_sparse(&table->sw);
+	if (table->tparams.debug) maxhash_print_sparse(&table->recent);
 
-	if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_FMEM)
-		maxhash_write_fmem(tparams->engine_state,
-				tparams->kernel_name, buf_name,
-				itable->table->load_buffer_select * mem_size_bytes /
-				sizeof(uint64_t), buf, mem_size_bytes);
-	else if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_DEEP_FMEM)
-		maxhash_write_deep_fmem(tparams->engine_state,
-				tparams->kernel_name, buf_name,
-				buf,
-				mem_size_bytes);
-	else if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_LMEM)
+	if (table->tparams.max_bucket_entries == 1)
 	{
-		size_t lmem_burst_size_bytes =
-			tparams->engine_state->lmem_burst_size_bytes;
-		size_t mem_size_bursts = (mem_size_bytes + lmem_burst_size_bytes - 1) /
-			lmem_burst_size_bytes;
-		tparams->mem_access_fn(tparams->mem_access_fn_arg, false,
-				itable->iparams.base_address_bursts +
-				itable->table->load_buffer_select * mem_size_bursts, buf,
-				mem_size_bursts);
+		maxhash_debug_print(table, "Creating perfect hash table...\n");
+		err |= maxhash_perfect_create(table);
+		maxhash_debug_print(table, "Finished creating perfect hash table.\n");
+		if (table->tparams.debug) maxhash_print_sparse(&table->recent);
+		if (table->tparams.debug) maxhash_print_sparse(&table->intermediate);
+		if (table->tparams.debug) maxhash_print_sparse(&table->values);
 	}
 	else
 	{
-		fprintf(stderr, "Error: hash table memory type is invalid.\n");
-		return MAXHASH_ERR_ERR;
+		double place_start = now_seconds();
+		err |= maxhash_cuckoo_place(table);
+		table->stats.search_seconds = now_seconds() - place_start;
 	}
 
-	return MAXHASH_ERR_OK;
+	err |= scheduler_queue(scheduler, table, true);
+
+	/* The flush adds the time it takes. */
+	table->stats.total_seconds = now_seconds() - start;
+	return err;
 }
 
 
 
-static size_t write_entry(void *dest, size_t offset_bits, const void *src,
-		size_t size_bits)
+/* Commit a table through a scheduler of its own. */
+static maxhash_err_t commit_now(maxhash_table_t *table)
 {
-	/* Essentially a bitwise memcpy. */
+	maxhash_scheduler_t scheduler;
+	scheduler_setup_for_table(&scheduler, table);
 
-	int offset_div = offset_bits / 8;
-	int offset_mod = offset_bits % 8;
+	maxhash_err_t err = commit_tables(table, &scheduler);
+	err |= maxhash_scheduler_flush(&scheduler);
+	scheduler_release(&scheduler);
+	return err;
+}
 
-	int size_div = size_bits / 8;
-	int size_mod = size_bits % 8;
 
-	const uint8_t *src_u  = (const uint8_t *)src;
-	uint8_t       *dest_u = (uint8_t *)dest;
 
-	uint8_t carry_mask = (1 <<      offset_mod ) - 1;
-	uint8_t new_mask   = (1 << (8 - offset_mod)) - 1;
+maxhash_err_t maxhash_internal_write_tables(maxhash_table_t *table)
+{
+	maxhash_scheduler_t scheduler;
+	scheduler_setup_for_table(&scheduler, table);
 
-	uint8_t carry = dest_u[offset_div] & carry_mask;
+	maxhash_err_t err = scheduler_queue(&scheduler, table, false);
+	err |= maxhash_scheduler_flush(&scheduler);
+	scheduler_release(&scheduler);
+	return err;
+}
 
-	/* Update carry mask to read from MSBs of bytes in src. */
-	carry_mask <<= (8 - offset_mod);
 
-	int src_byte;
-	for (src_byte = 0; src_byte < size_div; src_byte++)
-	{
-		uint8_t new = (src_u[src_byte] & new_mask) << offset_mod;
-		dest_u[offset_div + src_byte] = carry | new;
-		carry = (src_u[src_byte] & carry_mask) >> (8 - offset_mod);
-	}
 
-	if (size_mod != 0)
+maxhash_err_t maxhash_commit_schedule(maxhash_table_t *table,
+		maxhash_scheduler_t *scheduler)
+{
+	if (!scheduler_has_engines(scheduler, table))
 	{
-		new_mask = (1 << size_mod) - 1;
-		uint8_t new = (src_u[src_byte] & new_mask) << offset_mod;
-		dest_u[offset_div + src_byte] = carry | new;
+		fprintf(stderr, "Error: table is not on the engines of the "
+				"scheduler.\n");
+		return MAXHASH_ERR_ERR;
 	}
 
-	return size_bits;
+	maxhash_err_t err = maxhash_internal_wait_for_commit(table);
+	return err | commit_tables(table, scheduler);
 }
 
 
 
-maxhash_err_t write_table_data(const maxhash_internal_table_t *itable,
-		bool has_direct_flag)
+maxhash_err_t maxhash_commit(maxhash_table_t *table)
 {
-	const maxhash_table_params_t *tparams = &itable->table->tparams;
+	maxhash_err_t err = maxhash_internal_wait_for_commit(table);
+	return err | commit_now(table);
+}
 
-	size_t deep_fmem_id_bits = itable->iparams.mem_type ==
-		MAXHASH_MEM_TYPE_DEEP_FMEM ? DEEP_FMEM_ID_BITS : 0;
 
-	size_t num_flags = has_direct_flag ? NUM_ENTRY_FLAGS : NUM_ENTRY_FLAGS - 1;
 
-	size_t mem_entry_size_bits = deep_fmem_id_bits + num_flags +
-		itable->iparams.width_bits;
-	if (itable->iparams.validate_results)
-		mem_entry_size_bits += tparams->key_width_bits;
+static void *commit_main(void *arg)
+{
+	maxhash_commit_t *commit = arg;
+	maxhash_err_t err = commit_now(&commit->snapshot);
 
-	size_t mem_entry_size_bytes = (mem_entry_size_bits + 7) / 8;
+	pthread_mutex_lock(&commit->lock);
+	commit->err = err;
+	commit->done = true;
+	pthread_mutex_unlock(&commit->lock);
 
-	size_t burst_size_bytes = 0;
-	if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_FMEM)
-		burst_size_bytes = sizeof(uint64_t);
-	else if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_DEEP_FMEM)
-		burst_size_bytes = mem_entry_size_bytes; // FIXME
-	else if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_LMEM)
-		burst_size_bytes = tparams->engine_state->lmem_burst_size_bytes;
-	else if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_UNDEFINED)
-		return MAXHASH_ERR_OK;
-	else
-	{
-		fprintf(stderr, "Error: hash table memory type is invalid.\n");
+	return NULL;
+}
+
+
+
+maxhash_err_t maxhash_commit_async(maxhash_table_t *table,
+		maxhash_commit_t **commit)
+{
+	*commit = NULL;
+	if (maxhash_internal_wait_for_commit(table) != MAXHASH_ERR_OK)
 		return MAXHASH_ERR_ERR;
-	}
 
-	const size_t PCIE_WIDTH = 16;
-	if (burst_size_bytes < PCIE_WIDTH)
-	{
-		/* Round burst size up to a power of two, if not already. */
-		size_t power = 1;
-		while (power < burst_size_bytes)
-			power *= 2;
-		burst_size_bytes = power;
-	}
-	else
+	maxhash_commit_t *c = calloc(1, sizeof(maxhash_commit_t));
+	if (c == NULL)
 	{
-		/* Round burst size up to a multiple of the PCIe interface size, if not
-		 * already. */
-		burst_size_bytes = ((burst_size_bytes + PCIE_WIDTH - 1) / PCIE_WIDTH) *
-			PCIE_WIDTH;
+		fprintf(stderr, "Error: failed to allocate commit.\n");
+		return MAXHASH_ERR_ERR;
 	}
 
-	/* We don't support multi-burst entries yet. */
-	if (mem_entry_size_bytes > burst_size_bytes)
+	maxhash_table_t *snapshot = &c->snapshot;
+	memcpy(snapshot, table, sizeof(maxhash_table_t));
+	snapshot->pending_commit = NULL;
+	memset(&snapshot->removed, 0, sizeof(snapshot->removed));
+	memset(&snapshot->sw, 0, sizeof(snapshot->sw));
+	memset(&snapshot->recent, 0, sizeof(snapshot->recent));
+
+	/* The commit takes the recent table as it stands and a copy of the
+	 * software table; new puts go into a fresh recent table. */
+	maxhash_internal_table_t recent;
+	memset(&recent, 0, sizeof(recent));
+
+	maxhash_err_t err = internal_table_copy(&snapshot->sw, &table->sw,
+			snapshot);
+	if (err == MAXHASH_ERR_OK)
+		err = maxhash_internal_table_init(&recent, table,
+				&table->recent.iparams, "Recent");
+	if (err == MAXHASH_ERR_OK)
+		err = removed_table_init(table);
+
+	if (err != MAXHASH_ERR_OK)
 	{
-		fprintf(stderr, "Error: memory entries are too large.\n");
+		fprintf(stderr, "Error: failed to take snapshot for commit.\n");
+		maxhash_internal_table_free(&snapshot->sw);
+		maxhash_internal_table_free(&recent);
+		free(c);
 		return MAXHASH_ERR_ERR;
 	}
 
-	size_t entries_per_burst = 1;
-	while (entries_per_burst <= burst_size_bytes / mem_entry_size_bytes
-			&& burst_size_bytes % entries_per_burst == 0)
-		entries_per_burst *= 2;
-	entries_per_burst /= 2;
+	snapshot->recent = table->recent;
+	table->recent = recent;
 
-	mem_entry_size_bytes = burst_size_bytes / entries_per_burst;
+	snapshot->recent.table = snapshot;
+	snapshot->intermediate.table = snapshot;
+	snapshot->values.table = snapshot;
+	for (size_t way = 0; way < maxhash_num_ways(&table->tparams); way++)
+		snapshot->ways[way].table = snapshot;
 
-	size_t num_bursts = (tparams->max_bucket_entries *
-			itable->iparams.num_buckets + entries_per_burst - 1) /
-		entries_per_burst;
+	c->table = table;
+	pthread_mutex_init(&c->lock, NULL);
 
-	size_t mem_size = num_bursts * burst_size_bytes;
-	void *mem_contents = calloc(1, mem_size);
+	/* Commit synchronously if no thread can be started. */
+	c->has_thread = pthread_create(&c->thread, NULL, commit_main, c) == 0;
+	if (!c->has_thread)
+		commit_main(c);
 
-	PRINT_VAR(zd, mem_entry_size_bytes);
-	PRINT_VAR(zd, itable->iparams.num_buckets);
-	PRINT_VAR(zd, entries_per_burst);
-	PRINT_VAR(zd, num_bursts);
-	PRINT_VAR(zd, burst_size_bytes);
-	PRINT_VAR(zd, mem_size);
+	table->pending_commit = c;
+	*commit = c;
+	return MAXHASH_ERR_OK;
+}
 
-	for (size_t bucket_id = 0; bucket_id < itable->iparams.num_buckets;
-			bucket_id++)
-	{
-		maxhash_bucket_t *bucket = &itable->buckets[bucket_id];
-		maxhash_entry_t *e = bucket->entry_list;
 
-		for (size_t bucket_entry = 0; bucket_entry < tparams->max_bucket_entries;
-				bucket_entry++)
-		{
-			size_t entry_id = bucket_entry * itable->iparams.num_buckets +
-				bucket_id;
 
-			size_t burst = entry_id / entries_per_burst;
-			size_t entry_in_burst = entry_id % entries_per_burst;
-			size_t offset_bits = (burst * burst_size_bytes + entry_in_burst *
-				mem_entry_size_bytes) * 8;
+/*
+ * Take the keys noted in the removed table out of the perfect hash tables, as
+ * maxhash_remove() would have done, unless they have been put back since.
+ * This marks their slots, and the hash parameters of buckets left with no
+ * keys, for rewriting at the next commit, which need not place anything.
+ */
+static maxhash_err_t apply_removals(maxhash_table_t *table)
+{
+	maxhash_internal_table_t *removed = &table->removed;
+	maxhash_err_t err = MAXHASH_ERR_OK;
 
-			if (offset_bits >= mem_size * 8)
-			{
-				fprintf(stderr, "Error: attempted to write to an invalid "
-						"memory location.\n");
-				return MAXHASH_ERR_ERR;
-			}
+	if (removed->num_entries == 0)
+		return MAXHASH_ERR_OK;
 
-			if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_DEEP_FMEM)
-			{
-				uint8_t deep_fmem_id = 0;
-				deep_fmem_id |= itable->iparams.deep_fmem_id;
-				offset_bits += write_entry(mem_contents, offset_bits,
-						&deep_fmem_id, DEEP_FMEM_ID_BITS);
-			}
+	/* Every key must be vacated before its bucket's hash parameter goes. */
+	for (uint32_t id = 1; id < removed->entries_used; id++)
+	{
+		const maxhash_entry_t *e = maxhash_entry_get(removed, id);
+		if (e->in_use && maxhash_internal_lookup(&table->sw,
+					maxhash_entry_key(e), e->hash, e->bucket_id) == MAXHASH_NIL &&
+				vacate_slot(table, maxhash_entry_key(e)))
+			table->values_vacated++;
+	}
 
-			if (e && e->flags[FLAG_VALID])
-			{
-				uint8_t flags = 0;
-				flags |= e->flags[FLAG_VALID] << FLAG_VALID;
-				if (has_direct_flag)
-					flags |= e->flags[FLAG_PERFECT_DIRECT] <<
-						FLAG_PERFECT_DIRECT;
+	for (uint32_t id = 1; id < removed->entries_used; id++)
+	{
+		const maxhash_entry_t *e = maxhash_entry_get(removed, id);
+		if (e->in_use &&
+				maxhash_bucket_peek(&table->sw, e->bucket_id)->num_keys == 0)
+			err |= maxhash_internal_clear_bucket(&table->intermediate,
+					e->bucket_id);
+	}
+	maxhash_internal_clear(removed);
 
-				offset_bits += write_entry(mem_contents, offset_bits, &flags,
-						num_flags);
+	return err;
+}
 
-				if (itable->iparams.validate_results)
-					offset_bits += write_entry(mem_contents, offset_bits,
-							e->key, tparams->key_width_bits);
 
-				offset_bits += write_entry(mem_contents, offset_bits, e->value,
-						itable->iparams.width_bits);
 
-				e = e->next;
-			}
-		}
-	}
+/*
+ * Wait for a commit's thread and hand the perfect hash tables back to its
+ * table.  Keys removed while the commit was in progress are then taken out of
+ * them.
+ */
+static maxhash_err_t commit_finish(maxhash_commit_t *commit)
+{
+	maxhash_table_t *table = commit->table;
+	maxhash_table_t *snapshot = &commit->snapshot;
 
-	if (tparams->max_bucket_entries > 1)
-		for (size_t mem_id = 0; mem_id < tparams->max_bucket_entries; mem_id++)
-		{
-			char name_buf[NAME_BUF_LEN] = {0};
-			snprintf(name_buf, sizeof(name_buf), "%s_Buckets%zu",
-					itable->iparams.name, mem_id);
-			write_mem(itable, name_buf, mem_contents, mem_size);
-		}
-	else
-		write_mem(itable, itable->iparams.name, mem_contents, mem_size);
+	if (table == NULL)
+		return commit->err;
 
-	free(mem_contents);
+	if (commit->has_thread)
+		pthread_join(commit->thread, NULL);
 
-	return MAXHASH_ERR_OK;
-}
+	table->intermediate = snapshot->intermediate;
+	table->values = snapshot->values;
+	table->intermediate.table = table;
+	table->values.table = table;
+	for (size_t way = 0; way < maxhash_num_ways(&table->tparams); way++)
+	{
+		table->ways[way] = snapshot->ways[way];
+		table->ways[way].table = table;
+	}
+	table->load_buffer_select = snapshot->load_buffer_select;
+	table->perfect_built = snapshot->perfect_built;
+	table->values_free_hint = snapshot->values_free_hint;
+	table->values_vacated = snapshot->values_vacated;
+	table->stats = snapshot->stats;
 
+	maxhash_internal_table_free(&snapshot->sw);
+	maxhash_internal_table_free(&snapshot->recent);
+	table->pending_commit = NULL;
+	commit->table = NULL;
 
+	commit->err |= apply_removals(table);
 
-maxhash_err_t maxhash_switch_buffer(maxhash_table_t *table)
-{
-	char name_buf[NAME_BUF_LEN] = {0};
-	snprintf(name_buf, sizeof(name_buf), "%s_BufferSelect",
-			table->tparams.hash_table_name);
+	return commit->err;
+}
 
-	uint64_t load_buffer_select = table->load_buffer_select;
 
-	maxhash_write_fmem(table->tparams.engine_state, table->tparams.kernel_name,
-			name_buf, 0, &load_buffer_select, 1);
 
-	table->load_buffer_select ^= 1;
+maxhash_err_t maxhash_internal_wait_for_commit(maxhash_table_t *table)
+{
+	/* A commit queued on a scheduler completes when the scheduler is
+	 * flushed. */
+	if (table->scheduler != NULL &&
+			maxhash_scheduler_flush(table->scheduler) != MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
 
-	return MAXHASH_ERR_OK;
+	if (table->pending_commit == NULL)
+		return apply_removals(table);
+	return commit_finish(table->pending_commit);
 }
 
 
 
-maxhash_err_t maxhash_commit(maxhash_table_t *table)
+maxhash_err_t maxhash_commit_poll(maxhash_commit_t *commit, bool *complete)
 {
-	/* Sanity check. */
-	for (size_t i = 0; i < table->intermediate.iparams.num_buckets; i++)
-		assert((table->values.buckets[i].num_keys == 0 &&
-					!table->values.buckets[i].entry_list)
-				|| (table->values.buckets[i].num_keys > 0 &&
-					table->values.buckets[i].entry_list));
-
-	maxhash_err_t err = MAXHASH_ERR_OK;
+	pthread_mutex_lock(&commit->lock);
+	*complete = commit->done;
+	pthread_mutex_unlock(&commit->lock);
 
-	if (table->tparams.debug) maxhash_print_sparse(&table->sw);
-	if (table->tparams.debug) maxhash_print_sparse(&table->recent);
+	return *complete ? commit_finish(commit) : MAXHASH_ERR_OK;
+}
 
-	if (table->tparams.max_bucket_entries == 1)
-	{
-		maxhash_debug_print(table, "Creating perfect hash table...\n");
-		err |= maxhash_perfect_create(table);
-		maxhash_debug_print(table, "Finished creating perfect hash table.\n");
-		if (table->tparams.debug) maxhash_print_sparse(&table->recent);
-		if (table->tparams.debug) maxhash_print_sparse(&table->intermediate);
-		if (table->tparams.debug) maxhash_print_sparse(&table->values);
-		maxhash_debug_print(table, "Writing table of hash parameters...\n");
-		err |= write_table_data(&table->intermediate, true);
-		maxhash_debug_print(table, "Finished writing table of hash parameters.\n");
-		maxhash_debug_print(table, "Writing table of values...\n");
-		err |= write_table_data(&table->values, false);
-		maxhash_debug_print(table, "Finished writing table of values.\n");
-	}
-	else
-		err |= write_table_data(&table->values, false);
 
-	if (table->tparams.is_double_buffered)
-	{
-		maxhash_debug_print(table, "Switching buffer...\n");
-		maxhash_switch_buffer(table);
-		maxhash_debug_print(table, "Finished switching buffer.\n");
-	}
 
+maxhash_err_t maxhash_commit_wait(maxhash_commit_t *commit)
+{
+	maxhash_err_t err = commit_finish(commit);
+	pthread_mutex_destroy(&commit->lock);
+	free(commit);
 	return err;
 }
 
@@ -1462,17 +4188,23 @@ maxhash_err_t maxhash_commit(maxhash_table_t *table)
 maxhash_err_t maxhash_putall(maxhash_table_t *destination, const
 		maxhash_table_t *source)
 {
-	for (size_t bucket_id = 0; bucket_id <
-			source->sw.iparams.num_buckets; bucket_id++)
+	const maxhash_internal_table_t *sw = &source->sw;
+	for (uint32_t id = 1; id < sw->entries_used; id++)
 	{
-		maxhash_bucket_t *bucket = &source->sw.buckets[bucket_id];
-		for (maxhash_entry_t *e = bucket->entry_list; e; e = e->next)
-		{
-			maxhash_err_t err = maxhash_internal_put(&destination->sw, e->key,
-					e->value);
-			if (err != MAXHASH_ERR_OK)
-				return err;
-		}
+		const maxhash_entry_t *e = maxhash_entry_get(sw, id);
+		if (!e->in_use)
+			continue;
+		maxhash_err_t err = write_reserve(&destination->sw);
+		if (err != MAXHASH_ERR_OK)
+			return err;
+		write_begin(&destination->sw);
+		err |= maxhash_internal_put(&destination->sw, maxhash_entry_key(e),
+				maxhash_entry_value(sw, e));
+		write_end(&destination->sw);
+		err |= maxhash_internal_put(&destination->recent,
+				maxhash_entry_key(e), maxhash_entry_value(sw, e));
+		if (err != MAXHASH_ERR_OK)
+			return err;
 	}
 
 	return MAXHASH_ERR_OK;
@@ -1517,17 +4249,17 @@ maxhash_err_t maxhash_get_value_width(const maxhash_table_t *table, size_t
 
 maxhash_err_t maxhash_get_keys(const maxhash_table_t *table, void *keys)
 {
+	const maxhash_internal_table_t *sw = &table->sw;
 	size_t key_width_bytes = table->tparams.key_width_bytes;
 	size_t entry_id = 0;
-	for (size_t bucket_id = 0; bucket_id < table->sw.iparams.num_buckets;
-			bucket_id++)
+	for (uint32_t id = 1; id < sw->entries_used; id++)
 	{
-		maxhash_bucket_t *bucket = &table->sw.buckets[bucket_id];
-		for (maxhash_entry_t *e = bucket->entry_list; e; e = e->next)
-		{
-			memcpy(keys + entry_id * key_width_bytes, e->key, key_width_bytes);
-			entry_id++;
-		}
+		const maxhash_entry_t *e = maxhash_entry_get(sw, id);
+		if (!e->in_use)
+			continue;
+		memcpy(keys + entry_id * key_width_bytes, maxhash_entry_key(e),
+				key_width_bytes);
+		entry_id++;
 	}
 
 	return MAXHASH_ERR_OK;
@@ -1564,10 +4296,10 @@ maxhash_err_t maxhash_entry_iterator_next(maxhash_entry_iterator_t *iterator)
 {
 	/* Reuse next entry that was found incidentally in
 	 * maxhash_entry_iterator_has_next. */
-	if (iterator->next)
+	if (iterator->next_id != MAXHASH_NIL)
 	{
-		iterator->entry = iterator->next;
-		iterator->next = NULL;
+		iterator->entry_id = iterator->next_id;
+		iterator->next_id = MAXHASH_NIL;
 		return MAXHASH_ERR_OK;
 	}
 
@@ -1578,8 +4310,8 @@ maxhash_err_t maxhash_entry_iterator_next(maxhash_entry_iterator_t *iterator)
 
 	if (has_next)
 	{
-		iterator->entry = iterator->next;
-		iterator->next = NULL;
+		iterator->entry_id = iterator->next_id;
+		iterator->next_id = MAXHASH_NIL;
 		return MAXHASH_ERR_OK;
 	}
 
@@ -1593,25 +4325,24 @@ maxhash_err_t maxhash_entry_iterator_has_next(maxhash_entry_iterator_t *iterator
 	/* Look for next entry, and if found, save it in iterator->next for use by
 	 * maxhash_entry_iterator_next. */
 
-	*has_next = true;
-	if (iterator->next && iterator->next->next)
-	{
-		iterator->next = iterator->next->next;
-		return MAXHASH_ERR_OK;
-	}
+	const maxhash_internal_table_t *itable = iterator->itable;
 
-	iterator->next = NULL;
-	while (!iterator->next &&
-			iterator->bucket_id
-			< iterator->itable->iparams.num_buckets)
+	if (iterator->next_id != MAXHASH_NIL)
 	{
-		iterator->next = iterator->itable->buckets[iterator->bucket_id].entry_list;
-		iterator->bucket_id++;
+		*has_next = true;
+		return MAXHASH_ERR_OK;
 	}
 
-	if (!iterator->next)
-		*has_next = false;
+	/* Entries are visited in slab order, skipping free records. */
+	for (uint32_t id = iterator->entry_id + 1; id < itable->entries_used; id++)
+		if (maxhash_entry_get(itable, id)->in_use)
+		{
+			iterator->next_id = id;
+			*has_next = true;
+			return MAXHASH_ERR_OK;
+		}
 
+	*has_next = false;
 	return MAXHASH_ERR_OK;
 }
 
@@ -1620,7 +4351,8 @@ maxhash_err_t maxhash_entry_iterator_has_next(maxhash_entry_iterator_t *iterator
 maxhash_err_t maxhash_entry_iterator_get_key(
 		maxhash_entry_iterator_t *iterator, const void **key)
 {
-	*key = iterator->entry->key;
+	*key = maxhash_entry_key(maxhash_entry_get(iterator->itable,
+				iterator->entry_id));
 	return MAXHASH_ERR_OK;
 }
 
@@ -1629,280 +4361,801 @@ maxhash_err_t maxhash_entry_iterator_get_key(
 maxhash_err_t maxhash_entry_iterator_get_value(
 		maxhash_entry_iterator_t *iterator, const void **value)
 {
-	*value = iterator->entry->value;
+	*value = maxhash_entry_value(iterator->itable,
+			maxhash_entry_get(iterator->itable, iterator->entry_id));
 	return MAXHASH_ERR_OK;
 }
 
 
 
 
-maxhash_err_t maxhash_perfect_create(maxhash_table_t *table)
+/* Largest number of keys in a bucket that perfect hash creation supports. */
+#define PERFECT_MAX_BUCKET_KEYS 1024
+
+/* Buckets that each thread searches speculatively between commit steps. */
+#define PERFECT_WINDOW_BUCKETS_PER_THREAD 64
+
+/* An incremental update falls back to a full rebuild if it would vacate more
+ * than this fraction of the values table, or if a bucket needs a hash
+ * parameter of PERFECT_INCREMENTAL_MAX_PARAM or more. */
+#define PERFECT_MAX_VACATED_FRACTION 8
+#define PERFECT_INCREMENTAL_MAX_PARAM (1 << 16)
+
+/* Per-thread state for the search for hash parameters. */
+struct param_search {
+	const maxhash_table_t *table;
+	const maxhash_internal_table_t *source;
+	uint64_t d_limit;
+	size_t lanes;
+	uint32_t *lane_hashes;
+};
+
+/* A range of buckets whose hash parameters are searched for in parallel. */
+struct param_window {
+	const maxhash_bucket_t *buckets;
+	size_t num_buckets;
+	size_t *slot_offsets;
+	uint32_t *slots;
+	uint32_t *params;
+	size_t *num_hashes;
+	maxhash_err_t *errors;
+};
+
+struct param_worker {
+	pthread_t thread;
+	size_t thread_id;
+	struct param_builder *builder;
+	struct param_search search;
+};
+
+struct param_builder {
+	size_t num_threads;
+	size_t num_workers;
+	struct param_worker *workers;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t finish;
+	unsigned generation;
+	size_t pending;
+	bool done;
+	struct param_window window;
+};
+
+
+
+/*
+ * Find the lowest hash parameter "d" >= "d_start" under which the keys of a
+ * bucket hash to distinct, unoccupied buckets of the values table, and write
+ * those buckets to "slots".  Fails if there is no such parameter below the
+ * search limit, or if the bucket is too large.  The values table is only read,
+ * so several searches can run concurrently between updates of the table.
+ *
+ * Candidates are tried in groups of "lanes": the hashes of each key under the
+ * whole group are computed together the first time that the key is reached.
+ */
+static maxhash_err_t find_hash_param(struct param_search *search,
+		const maxhash_bucket_t *bucket, uint32_t d_start, uint32_t *d_found,
+		uint32_t *slots, size_t *num_hashes)
 {
-	maxhash_err_t err = MAXHASH_ERR_OK;
-	struct timeval tv_start, tv_end;
-	gettimeofday(&tv_start, NULL);
-
-	maxhash_internal_table_t *source_itable;
-
-	bool enable_incremental_puts = false;
-	if (enable_incremental_puts)
-	{
-		/*
-		 * 1. We have a hash table containing all of the keys added since the
-		 * last commit, called "recent".  Each time we add a hash entry, it's
-		 * placed both in the recent table and the existing "sw" table.
-		 *
-		 * 2. Some of the new keys will collide with others in the sw table,
-		 * some won't.
-		 *
-		 * 3. We start with the keys that collide, specifically those that
-		 * collide with the greatest number of other keys, and work towards
-		 * those that don't cause any collisions.
-		 *
-		 * 4. For each key in the recent table, we add all of the colliding
-		 * entries in the sw table into the recent table and remove them from
-		 * the intermediate and values tables.
-		 *
-		 * 5. We then carry out the normal perfect hash calculation process and
-		 * re-add the removed colliding entries.
-		 *
-		 * 6. Note that if a bucket in the values table is vacated, we do not
-		 * reuse it until the next call to this function.  This simplifies the
-		 * algorithm, at the expense only of slightly longer searches to find
-		 * valid hash parameters.
-		 */
-
-		size_t moves = 0;
-		source_itable = &table->recent;
-		if (table->tparams.debug) maxhash_print_sparse(&table->intermediate);
-		if (table->tparams.debug) maxhash_print_sparse(&table->values);
+	const maxhash_table_t *table = search->table;
+	const maxhash_internal_table_t *values = &table->values;
+	size_t lanes = search->lanes;
+	const void *lane_keys[MAXHASH_SIMD_MAX_LANES];
+	uint32_t params[MAXHASH_SIMD_MAX_LANES];
 
-		for (size_t bucket_id = 0; bucket_id <
-				table->recent.iparams.num_buckets; bucket_id++)
+	if (bucket->num_keys > PERFECT_MAX_BUCKET_KEYS)
+		return MAXHASH_ERR_ERR;
+
+	for (uint64_t d_base = d_start;; d_base += lanes)
+	{
+		size_t keys_hashed = 0;
+		for (size_t lane = 0; lane < lanes; lane++)
+			params[lane] = d_base + lane;
+
+		for (size_t lane = 0; lane < lanes; lane++)
 		{
-			maxhash_bucket_t *recent_bucket = &table->recent.buckets[bucket_id];
-			maxhash_bucket_t *sw_bucket = &table->sw.buckets[bucket_id];
-			if (recent_bucket->num_keys > 0 && sw_bucket->num_keys >
-					recent_bucket->num_keys)
+			uint64_t d = d_base + lane;
+			if (d >= search->d_limit)
+				return MAXHASH_ERR_ERR;
+
+			bool found = true;
+			size_t entry_id = 0;
+
+			for (uint32_t id = bucket->head; id != MAXHASH_NIL && found;
+					entry_id++)
 			{
-				for (maxhash_entry_t *entry = sw_bucket->entry_list; entry;
-						entry = entry->next)
+				maxhash_entry_t *entry = maxhash_entry_get(search->source, id);
+				if (entry_id == keys_hashed)
 				{
-					bool is_new_entry;
-					maxhash_contains_in_bucket(&table->recent, &is_new_entry,
-							entry->key, bucket_id);
-					if (!is_new_entry)
-					{
-						/* Collision, needs to be moved. */
-						moves++;
-						err |= maxhash_perfect_values_remove(table, entry->key);
-						err |= maxhash_internal_put(&table->recent, entry->key,
-								entry->value);
-						if (err != MAXHASH_ERR_OK)
-						{
-							fprintf(stderr, "Error: incremental put failed.\n");
-							return err;
-						}
-					}
+					const void *key = maxhash_entry_key(entry);
+					for (size_t l = 0; l < lanes; l++)
+						lane_keys[l] = key;
+					maxhash_function_jenkins_multi(lane_keys,
+							table->tparams.key_width_bytes, params, lanes,
+							table->tparams.jenkins_chunk_width_bytes,
+							&search->lane_hashes[keys_hashed * lanes]);
+					keys_hashed++;
 				}
-				err |= maxhash_internal_clear_bucket(&table->intermediate,
-						bucket_id);
+
+				uint32_t slot = search->lane_hashes[entry_id * lanes + lane] %
+					values->iparams.num_buckets;
+				(*num_hashes)++;
+
+				/* Check for collisions with previously placed buckets, then
+				 * within this bucket. */
+				if (maxhash_bucket_peek(values, slot)->num_keys > 0)
+					found = false;
+				for (size_t i = 0; i < entry_id && found; i++)
+					if (slot == slots[i])
+						found = false;
+
+				slots[entry_id] = slot;
+				id = entry->next;
+			}
+
+			if (found)
+			{
+				*d_found = d;
+				return MAXHASH_ERR_OK;
 			}
 		}
+	}
+}
 
-		if (table->tparams.debug) maxhash_print_sparse(&table->recent);
 
-		printf("Incremental puts: need to move %zu entries in the values"
-				" table.\n", moves);
+
+static void search_window(struct param_builder *builder, size_t thread_id)
+{
+	struct param_window *window = &builder->window;
+	struct param_search *search = &builder->workers[thread_id].search;
+
+	for (size_t i = thread_id; i < window->num_buckets;
+			i += builder->num_threads)
+	{
+		window->num_hashes[i] = 0;
+		window->errors[i] = find_hash_param(search, &window->buckets[i], 0,
+				&window->params[i],
+				window->slots + window->slot_offsets[i],
+				&window->num_hashes[i]);
 	}
-	else
+}
+
+
+
+static void *param_worker_main(void *arg)
+{
+	struct param_worker *worker = arg;
+	struct param_builder *builder = worker->builder;
+	unsigned generation = 0;
+
+	for (;;)
 	{
-		/* Calculate/recalculate the perfect hash from scratch. */
-		source_itable = &table->sw;
-		maxhash_internal_clear(&table->intermediate);
-		maxhash_internal_clear(&table->values);
+		pthread_mutex_lock(&builder->lock);
+		while (builder->generation == generation && !builder->done)
+			pthread_cond_wait(&builder->start, &builder->lock);
+		generation = builder->generation;
+		bool done = builder->done;
+		pthread_mutex_unlock(&builder->lock);
+
+		if (done)
+			break;
+
+		search_window(builder, worker->thread_id);
+
+		pthread_mutex_lock(&builder->lock);
+		if (--builder->pending == 0)
+			pthread_cond_signal(&builder->finish);
+		pthread_mutex_unlock(&builder->lock);
 	}
 
-	/* Copy bucket list and sort in-place in reverse order of the number of
-	 * collisions. */
-	size_t buckets_size = source_itable->iparams.num_buckets *
-		sizeof(maxhash_bucket_t);
-	maxhash_bucket_t *sorted_buckets = malloc(buckets_size);
-	memcpy(sorted_buckets, source_itable->buckets, buckets_size);
-	qsort(sorted_buckets, source_itable->iparams.num_buckets,
-			sizeof(maxhash_bucket_t), compare_bucket_num_keys);
+	return NULL;
+}
 
-	size_t bucket_id = 0;
-	maxhash_bucket_t *bucket = &sorted_buckets[bucket_id];
 
-	/* Temporary array in which to store the hashes of all of the entries in a
-	 * bucket. */
-	size_t new_hashes_size = 1024;
-	uint32_t new_hashes[new_hashes_size];
-	size_t entry_id;
 
-	size_t prev_num_keys = ULLONG_MAX;
-	ssize_t prev_bucket_id = 0;
-	size_t parameter_sum = 0;
-	size_t parameter_max = 0;
-	size_t num_hashes = 0;
-	size_t total_parameter_max = 0;
-	size_t total_num_hashes = 0;
+static void param_builder_free(struct param_builder *builder)
+{
+	if (builder->num_workers > 0)
+	{
+		pthread_mutex_lock(&builder->lock);
+		builder->done = true;
+		pthread_cond_broadcast(&builder->start);
+		pthread_mutex_unlock(&builder->lock);
+
+		for (size_t i = 1; i < builder->num_workers; i++)
+			pthread_join(builder->workers[i].thread, NULL);
+
+		pthread_mutex_destroy(&builder->lock);
+		pthread_cond_destroy(&builder->start);
+		pthread_cond_destroy(&builder->finish);
+	}
+
+	for (size_t i = 0; builder->workers && i < builder->num_threads; i++)
+		free(builder->workers[i].search.lane_hashes);
+	free(builder->workers);
+
+	free(builder->window.slot_offsets);
+	free(builder->window.slots);
+	free(builder->window.params);
+	free(builder->window.num_hashes);
+	free(builder->window.errors);
+}
+
+
+
+static maxhash_err_t param_builder_init(struct param_builder *builder,
+		const maxhash_table_t *table, const maxhash_internal_table_t *source,
+		const maxhash_bucket_t *sorted_buckets, size_t num_buckets,
+		uint64_t d_limit)
+{
+	size_t num_threads = table->tparams.num_threads ?
+		table->tparams.num_threads : 1;
+	size_t window_size = num_threads == 1 ? 1 :
+		num_threads * PERFECT_WINDOW_BUCKETS_PER_THREAD;
+	size_t lanes = maxhash_simd_lanes(maxhash_simd_level());
+
+	memset(builder, 0, sizeof(*builder));
+	builder->num_threads = num_threads;
+	builder->workers = calloc(num_threads, sizeof(struct param_worker));
+
+	/* Buckets are sorted by decreasing size, so the first window needs the
+	 * most space for slots. */
+	size_t max_window_keys = 0;
+	for (size_t i = 0; i < window_size && i < num_buckets; i++)
+		max_window_keys += sorted_buckets[i].num_keys;
+
+	struct param_window *window = &builder->window;
+	window->slot_offsets = malloc(window_size * sizeof(size_t));
+	window->slots = malloc((max_window_keys + 1) * sizeof(uint32_t));
+	window->params = malloc(window_size * sizeof(uint32_t));
+	window->num_hashes = malloc(window_size * sizeof(size_t));
+	window->errors = malloc(window_size * sizeof(maxhash_err_t));
+
+	bool alloc_failed = builder->workers == NULL ||
+		window->slot_offsets == NULL || window->slots == NULL ||
+		window->params == NULL || window->num_hashes == NULL ||
+		window->errors == NULL;
+
+	for (size_t i = 0; i < num_threads && !alloc_failed; i++)
+	{
+		struct param_worker *worker = &builder->workers[i];
+		worker->thread_id = i;
+		worker->builder = builder;
+		worker->search.table = table;
+		worker->search.source = source;
+		worker->search.d_limit = d_limit;
+		worker->search.lanes = lanes;
+		worker->search.lane_hashes = malloc(PERFECT_MAX_BUCKET_KEYS * lanes *
+				sizeof(uint32_t));
+		alloc_failed = worker->search.lane_hashes == NULL;
+	}
+
+	if (alloc_failed)
+	{
+		fprintf(stderr, "Error: failed to allocate memory for perfect hash "
+				"creation.\n");
+		param_builder_free(builder);
+		return MAXHASH_ERR_ERR;
+	}
 
-	const char *columns[] = {"Collisions", "Buckets", "Max. attempts",
-		"Avg. attempts", "Num. hashes"};
+	if (num_threads == 1)
+		return MAXHASH_ERR_OK;
+
+	/* The calling thread acts as worker 0. */
+	pthread_mutex_init(&builder->lock, NULL);
+	pthread_cond_init(&builder->start, NULL);
+	pthread_cond_init(&builder->finish, NULL);
+	builder->num_workers = 1;
+	for (size_t i = 1; i < num_threads; i++)
+	{
+		if (pthread_create(&builder->workers[i].thread, NULL,
+					param_worker_main, &builder->workers[i]) != 0)
+		{
+			fprintf(stderr, "Error: failed to create thread for perfect "
+					"hash creation.\n");
+			param_builder_free(builder);
+			return MAXHASH_ERR_ERR;
+		}
+		builder->num_workers++;
+	}
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+/*
+ * Search for the hash parameters of the next window of buckets, starting at
+ * "bucket_id", against the current state of the values table.
+ */
+static void param_builder_search(struct param_builder *builder,
+		const maxhash_bucket_t *sorted_buckets, size_t bucket_id,
+		size_t num_buckets)
+{
+	struct param_window *window = &builder->window;
+	size_t window_size = builder->num_threads == 1 ? 1 :
+		builder->num_threads * PERFECT_WINDOW_BUCKETS_PER_THREAD;
 
-	if (bucket->num_keys >= 2)
+	window->buckets = &sorted_buckets[bucket_id];
+	window->num_buckets = num_buckets - bucket_id < window_size ?
+		num_buckets - bucket_id : window_size;
+
+	size_t offset = 0;
+	for (size_t i = 0; i < window->num_buckets; i++)
+	{
+		window->slot_offsets[i] = offset;
+		offset += window->buckets[i].num_keys;
+	}
+
+	if (builder->num_threads == 1)
 	{
-		for (size_t col = 0; col < sizeof(columns) / sizeof(char *); col++)
-			printf("  %s", columns[col]);
-		printf("\n");
+		search_window(builder, 0);
+		return;
 	}
 
-	/* Iterate through all of the buckets with at least two entries. */
-	while (bucket_id < table->intermediate.iparams.num_buckets &&
-			bucket->num_keys >= 2)
+	pthread_mutex_lock(&builder->lock);
+	builder->pending = builder->num_threads - 1;
+	builder->generation++;
+	pthread_cond_broadcast(&builder->start);
+	pthread_mutex_unlock(&builder->lock);
+
+	search_window(builder, 0);
+
+	pthread_mutex_lock(&builder->lock);
+	while (builder->pending != 0)
+		pthread_cond_wait(&builder->finish, &builder->lock);
+	pthread_mutex_unlock(&builder->lock);
+}
+
+
+
+/*
+ * Place buckets of the software table in the intermediate and values tables.
+ * The buckets must be sorted in order of decreasing size.  Buckets with
+ * several keys are given the smallest hash parameter below "d_limit" that maps
+ * their keys to free slots.  Single keys are mapped directly to the first free
+ * slot at or after table->values_free_hint.  If "quiet" is set, running out of
+ * parameters or slots is left for the caller to report.
+ */
+static maxhash_err_t place_buckets(maxhash_table_t *table,
+		const maxhash_bucket_t *sorted_buckets, size_t num_buckets,
+		uint64_t d_limit, bool quiet, maxhash_stats_t *stats)
+{
+	const maxhash_internal_table_t *sw = &table->sw;
+	size_t bucket_id = 0;
+	const maxhash_bucket_t *bucket = &sorted_buckets[bucket_id];
+
+	/* Buckets with at least two entries need a hash parameter. */
+	size_t num_param_buckets = 0;
+	while (num_param_buckets < num_buckets &&
+			sorted_buckets[num_param_buckets].num_keys >= 2)
+		num_param_buckets++;
+
+	struct param_builder builder;
+	if (param_builder_init(&builder, table, sw, sorted_buckets,
+				num_param_buckets, d_limit) != MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+
+	for (size_t i = 0; i < num_buckets; i++)
+		stats->bucket_sizes[sorted_buckets[i].num_keys <
+			MAXHASH_STATS_MAX_BUCKET_KEYS ? sorted_buckets[i].num_keys :
+			MAXHASH_STATS_MAX_BUCKET_KEYS]++;
+
+	size_t prev_bucket_id = 0;
+	size_t parameter_sum = 0;
+	size_t parameter_max = 0;
+	size_t num_hashes = 0;
+
+	if (num_param_buckets > 0)
+		maxhash_debug_print(table, "  Collisions  Buckets  Max. attempts  "
+				"Avg. attempts  Num. hashes\n");
+
+	/*
+	 * Iterate through all of the buckets with at least two entries, a window
+	 * at a time.  The parameters for a window are searched for in parallel
+	 * against the values table as it was before the window, and then committed
+	 * in order.  A parameter found this way is the smallest that works against
+	 * that older state, so if its slots are still free it is also the
+	 * smallest that works now, which is what a sequential search finds.  If
+	 * an earlier bucket in the window has taken one of its slots, the search
+	 * continues sequentially from the next parameter.  Either way the result
+	 * matches the single-threaded build exactly.
+	 */
+	struct param_window *window = &builder.window;
+	while (bucket_id < num_param_buckets)
 	{
-		uint32_t d = 0;
-		bool found = false;
+		param_builder_search(&builder, sorted_buckets, bucket_id,
+				num_param_buckets);
 
-		/* Search for a value of 'd' that assigns keys to unique slots. */
-		while (!found)
+		for (size_t i = 0; i < window->num_buckets; i++)
 		{
-			if ((size_t)d >= (1ul << table->intermediate.iparams.width_bytes *
-						8) - 1)
+			uint32_t d = window->params[i];
+			uint32_t *slots = window->slots + window->slot_offsets[i];
+
+			maxhash_err_t search_err = window->errors[i];
+			if (search_err == MAXHASH_ERR_OK)
 			{
-				fprintf(stderr, "Error: failed to find a hash parameter "
-						"(d: %d, bucket: %zd).\n", d, bucket_id);
-				return MAXHASH_ERR_ERR;
+				bool slots_free = true;
+				for (size_t k = 0; k < bucket->num_keys && slots_free; k++)
+					slots_free = !maxhash_bucket_peek(&table->values,
+							slots[k])->num_keys;
+				if (!slots_free)
+					search_err = find_hash_param(&builder.workers[0].search,
+							bucket, d + 1, &d, slots, &window->num_hashes[i]);
 			}
 
-			maxhash_entry_t *entry = bucket->entry_list;
-			found = true;
-			entry_id = 0;
-
-			while (entry && found)
+			if (search_err != MAXHASH_ERR_OK)
 			{
-				uint32_t new_hash = maxhash_function_jenkins(entry->key,
-						table->tparams.key_width_bytes, d,
-						table->tparams.jenkins_chunk_width_bytes)
-					% table->values.iparams.num_buckets;
-				num_hashes++;
-
-				/* Check for collisions with previously placed buckets. */
-				if (table->values.buckets[new_hash].num_keys > 0)
-					found = false;
+				if (quiet)
+					;
+				else if (bucket->num_keys > PERFECT_MAX_BUCKET_KEYS)
+					fprintf(stderr, "Error: this implementation only supports "
+							"up to %d collisions per hash bucket.\n",
+							PERFECT_MAX_BUCKET_KEYS);
 				else
-					/* Check for collisions within this bucket. */
-					for (size_t i = 0; i < entry_id; i++)
-						if (new_hash == new_hashes[i])
-							found = false;
+					fprintf(stderr, "Error: failed to find a hash parameter "
+							"(bucket: %zu).\n", bucket_id);
+				param_builder_free(&builder);
+				return search_err;
+			}
 
-				if (found)
-				{
-					if (entry_id >= new_hashes_size)
-					{
-						fprintf(stderr, "Error: this implementation only "
-								"supports up to %zu collisions per hash "
-								"bucket.\n", new_hashes_size);
-						return MAXHASH_ERR_ERR;
-					}
-					new_hashes[entry_id++] = new_hash;
-					entry = entry->next;
-				}
+			num_hashes += window->num_hashes[i];
+
+			/* Populate the correct locations in the hardware tables. */
+			size_t entry_id = 0;
+			for (uint32_t id = bucket->head; id != MAXHASH_NIL;)
+			{
+				maxhash_entry_t *entry = maxhash_entry_get(sw, id);
+				maxhash_internal_put_in_bucket(&table->values,
+						maxhash_entry_key(entry),
+						maxhash_entry_value(sw, entry), slots[entry_id++]);
+				id = entry->next;
 			}
 
-			if (!found)
-				d++;
-		}
+			maxhash_internal_put(&table->intermediate, maxhash_entry_key(
+						maxhash_entry_get(sw, bucket->head)), &d);
 
-		/* Populate the correct locations in the hardware tables. */
-		entry_id = 0;
-		for (maxhash_entry_t *entry = bucket->entry_list; entry; entry =
-				entry->next)
-			maxhash_internal_put_in_bucket(&table->values, entry->key,
-					entry->value, new_hashes[entry_id++]);
+			/* Gather statistics for each size of bucket. */
+			if (parameter_max < d) parameter_max = d;
+			parameter_sum += d;
+			bucket_id++;
 
-		maxhash_internal_put(&table->intermediate,
-				bucket->entry_list->key, &d);
+			if (bucket_id == num_param_buckets ||
+					sorted_buckets[bucket_id].num_keys != bucket->num_keys)
+			{
+				double average_searches = (double)parameter_sum / (bucket_id -
+						prev_bucket_id);
+
+				maxhash_debug_print(table, "  %10u  %7zu  %13zu  %13.1f  %11zu\n",
+						bucket->num_keys, bucket_id - prev_bucket_id,
+						parameter_max, average_searches, num_hashes);
+
+				prev_bucket_id = bucket_id;
+				parameter_sum = 0;
+				if (stats->parameter_max < parameter_max)
+					stats->parameter_max = parameter_max;
+				parameter_max = 0;
+				stats->num_hashes += num_hashes;
+				num_hashes = 0;
+			}
 
-		/* Print statistics. */
-		if (parameter_max < d) parameter_max = d;
-		parameter_sum += d;
-		bucket_id++;
+			bucket = &sorted_buckets[bucket_id];
+		}
+	}
 
-		if (bucket->num_keys != prev_num_keys)
-		{
-			double average_searches = (double)parameter_sum / (bucket_id -
-					prev_bucket_id);
-
-			printf("  %*zu",  (int)strlen(columns[0]), bucket->num_keys);
-			printf("  %*zu",  (int)strlen(columns[1]), bucket_id - prev_bucket_id);
-			printf("  %*zu",  (int)strlen(columns[2]), parameter_max);
-			printf("  %*.1f", (int)strlen(columns[3]), average_searches);
-			printf("  %*zu",  (int)strlen(columns[4]), num_hashes);
-			printf("\n");
+	param_builder_free(&builder);
 
-			prev_num_keys = bucket->num_keys;
-			prev_bucket_id = bucket_id;
-			parameter_sum = 0;
-			if (total_parameter_max < parameter_max)
-				total_parameter_max = parameter_max;
-			parameter_max = 0;
-			total_num_hashes += num_hashes;
-			num_hashes = 0;
+	/* Assign the remaining single entries directly to free buckets in the
+	 * values table rather than searching for a hash parameter.  Every bucket
+	 * below the free hint is occupied. */
+	size_t values_bucket_id = table->values_free_hint;
+	for (; bucket_id < num_buckets && sorted_buckets[bucket_id].num_keys;
+			bucket_id++, values_bucket_id++)
+	{
+		while (values_bucket_id < table->values.iparams.num_buckets &&
+				maxhash_bucket_peek(&table->values, values_bucket_id)->num_keys)
+			values_bucket_id++;
+
+		if (values_bucket_id == table->values.iparams.num_buckets)
+		{
+			if (!quiet)
+				fprintf(stderr, "Error: the table of values is full (%zu "
+						"entries).\n", table->values.iparams.num_buckets);
+			table->values_free_hint = values_bucket_id;
+			return MAXHASH_ERR_ERR;
 		}
 
-		bucket = &sorted_buckets[bucket_id];
+		maxhash_entry_t *entry = maxhash_entry_get(sw,
+				sorted_buckets[bucket_id].head);
+		const void *key = maxhash_entry_key(entry);
+		maxhash_err_t err = MAXHASH_ERR_OK;
+		err |= maxhash_internal_put(&table->intermediate, key,
+				&values_bucket_id);
+		err |= maxhash_internal_set_entry_flag(&table->intermediate, key,
+				FLAG_PERFECT_DIRECT, true);
+		err |= maxhash_internal_put_in_bucket(&table->values, key,
+				maxhash_entry_value(sw, entry), values_bucket_id);
+		if (err != MAXHASH_ERR_OK)
+			return err;
+		stats->direct_buckets++;
+	}
+	table->values_free_hint = values_bucket_id;
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+/*
+ * Calculate the perfect hash of every key in the software table from
+ * scratch.  If "quiet" is set, failing to is left for the caller to report.
+ */
+static maxhash_err_t perfect_rebuild(maxhash_table_t *table,
+		bool quiet, maxhash_stats_t *stats)
+{
+	maxhash_internal_clear(&table->intermediate);
+	maxhash_internal_clear(&table->values);
+	table->values_free_hint = 0;
+
+	/* Copy bucket list and sort in-place in reverse order of the number of
+	 * collisions. */
+	size_t num_buckets = table->sw.iparams.num_buckets;
+	maxhash_bucket_t *sorted_buckets = malloc(num_buckets *
+			sizeof(maxhash_bucket_t));
+	if (sorted_buckets == NULL)
+	{
+		fprintf(stderr, "Error: failed to allocate memory for perfect hash "
+				"creation.\n");
+		return MAXHASH_ERR_ERR;
 	}
+	for (size_t i = 0; i < num_buckets; i++)
+		sorted_buckets[i] = *maxhash_bucket_peek(&table->sw, i);
+	qsort(sorted_buckets, num_buckets, sizeof(maxhash_bucket_t),
+			compare_bucket_num_keys);
+
+	uint64_t d_limit = (UINT64_C(1) << table->intermediate.iparams.width_bytes
+			* 8) - 1;
+	maxhash_err_t err = place_buckets(table, sorted_buckets, num_buckets,
+			d_limit, quiet, stats);
+
+	free(sorted_buckets);
+	return err;
+}
+
+
+
+static int compare_bucket_ids(const void *first, const void *second)
+{
+	size_t f = *(const size_t *)first;
+	size_t s = *(const size_t *)second;
+	return f < s ? -1 : f > s;
+}
+
+
+
+/*
+ * Bring the perfect hash tables up to date with the keys added since they
+ * were last calculated (those in the "recent" table).
+ *
+ * Keys that are already placed only have their values updated.  Every bucket
+ * that has gained keys loses its hash parameter and the slots of its existing
+ * keys, and is then placed again as a whole, largest first, among the
+ * remaining occupied slots.  Keys removed since the last commit have already
+ * vacated their slots (see maxhash_remove()).  The work is proportional to the
+ * number of changed buckets.
+ *
+ * Fails without reporting an error if the update would vacate too many slots
+ * or cannot place a bucket, in which case the caller should rebuild the
+ * tables from scratch.
+ */
+static maxhash_err_t perfect_update(maxhash_table_t *table,
+		maxhash_stats_t *stats)
+{
+	maxhash_internal_table_t *recent = &table->recent;
+	maxhash_err_t err = MAXHASH_ERR_OK;
+
+	if (recent->num_entries == 0)
+		return MAXHASH_ERR_OK;
 
-	uint32_t values_bucket_id = 0;
-	maxhash_bucket_t *values_bucket =
-		&table->values.buckets[values_bucket_id];
+	size_t *dirty = malloc(recent->num_entries * sizeof(size_t));
+	if (dirty == NULL)
+		return MAXHASH_ERR_ERR;
+	size_t num_dirty = 0;
 
-	/* Iterate through the rest of the occupied buckets, assigning entries
-	 * directly to buckets in the new table rather than searching for a hash
-	 * parameter. */
-	while (bucket_id < table->intermediate.iparams.num_buckets
-			&& values_bucket_id < table->values.iparams.num_buckets
-			&& bucket->num_keys)
+	for (uint32_t id = 1; id < recent->entries_used; id++)
 	{
-		if (!values_bucket->num_keys)
+		const maxhash_entry_t *entry = maxhash_entry_get(recent, id);
+		if (!entry->in_use)
+			continue;
+
+		size_t slot;
+		maxhash_entry_t *placed = placed_entry(table, maxhash_entry_key(entry),
+				&slot);
+		if (placed != NULL)
 		{
-			err |= maxhash_internal_put(&table->intermediate,
-					bucket->entry_list->key, &values_bucket_id);
-			err |= maxhash_internal_set_entry_flag(&table->intermediate,
-					bucket->entry_list->key, FLAG_PERFECT_DIRECT, true);
-			err |= maxhash_internal_put_in_bucket(&table->values,
-					bucket->entry_list->key, bucket->entry_list->value,
-					values_bucket_id);
-			bucket = &sorted_buckets[++bucket_id];
+			memcpy(maxhash_entry_value(&table->values, placed),
+					maxhash_entry_value(recent, entry),
+					table->values.iparams.width_bytes);
+			mark_bucket_dirty(&table->values, slot);
 		}
+		else
+			dirty[num_dirty++] = entry->bucket_id;
+	}
+
+	/* Each bucket that has gained keys is listed once per new key. */
+	qsort(dirty, num_dirty, sizeof(size_t), compare_bucket_ids);
+	size_t num_buckets = 0;
+	size_t moves = 0;
+	for (size_t i = 0; i < num_dirty;)
+	{
+		size_t bucket_id = dirty[i];
+		size_t num_new_keys = 0;
+		for (; i < num_dirty && dirty[i] == bucket_id; i++)
+			num_new_keys++;
+		moves += maxhash_bucket_peek(&table->sw, bucket_id)->num_keys -
+			num_new_keys;
+		dirty[num_buckets++] = bucket_id;
+	}
+
+	size_t vacated = moves + table->values_vacated;
+	size_t max_vacated = table->values.iparams.num_buckets /
+		PERFECT_MAX_VACATED_FRACTION;
+	if (vacated > max_vacated)
+	{
+		maxhash_debug_print(table, "Incremental update would vacate %zu slots "
+				"(limit: %zu).\n", vacated, max_vacated);
+		free(dirty);
+		return MAXHASH_ERR_ERR;
+	}
+
+	maxhash_debug_print(table, "Incremental update: placing %zu bucket(s), "
+			"moving %zu entries in the values table.\n", num_buckets, moves);
+	stats->moved_entries = moves;
+
+	maxhash_bucket_t *sorted_buckets = malloc(num_buckets *
+			sizeof(maxhash_bucket_t));
+	if (sorted_buckets == NULL)
+	{
+		free(dirty);
+		return MAXHASH_ERR_ERR;
+	}
 
-		values_bucket = &table->values.buckets[++values_bucket_id];
+	for (size_t i = 0; i < num_buckets; i++)
+	{
+		const maxhash_bucket_t *bucket = maxhash_bucket_peek(&table->sw,
+				dirty[i]);
+		for (uint32_t id = bucket->head; id != MAXHASH_NIL;
+				id = maxhash_entry_get(&table->sw, id)->next)
+			vacate_slot(table, maxhash_entry_key(maxhash_entry_get(
+							&table->sw, id)));
+		err |= maxhash_internal_clear_bucket(&table->intermediate, dirty[i]);
+		sorted_buckets[i] = *bucket;
 	}
+	qsort(sorted_buckets, num_buckets, sizeof(maxhash_bucket_t),
+			compare_bucket_num_keys);
+
+	if (err == MAXHASH_ERR_OK)
+		err = place_buckets(table, sorted_buckets, num_buckets,
+				PERFECT_INCREMENTAL_MAX_PARAM, true, stats);
 
 	free(sorted_buckets);
+	free(dirty);
+	return err;
+}
+
+
+
+/* The number of bits needed to hold a hash parameter, at least one. */
+static size_t bits_needed(size_t parameter)
+{
+	size_t bits = 1;
+	while (parameter >>= 1)
+		bits++;
+	return bits;
+}
+
+
+
+maxhash_err_t maxhash_perfect_create(maxhash_table_t *table)
+{
+	maxhash_internal_wait_for_commit(table);
+
+	maxhash_err_t err = MAXHASH_ERR_ERR;
+	double start = now_seconds();
+
+	maxhash_stats_t *stats = &table->stats;
+	memset(stats, 0, sizeof(*stats));
+
+	if (table->tparams.incremental_puts && table->perfect_built)
+	{
+		err = perfect_update(table, stats);
+		if (err != MAXHASH_ERR_OK)
+			maxhash_debug_print(table, "Recalculating the perfect hash "
+					"table from scratch.\n");
+		stats->incremental = err == MAXHASH_ERR_OK;
+	}
+
+	if (err != MAXHASH_ERR_OK)
+	{
+		memset(stats, 0, sizeof(*stats));
+		err = perfect_rebuild(table, false, stats);
+	}
 
+	table->perfect_built = err == MAXHASH_ERR_OK;
+	table->values_vacated = 0;
 	err |= maxhash_internal_clear(&table->recent);
 
-	/* Print statistics. */
-	gettimeofday(&tv_end, NULL);
+	stats->search_seconds = now_seconds() - start;
+	stats->parameter_bits = bits_needed(stats->parameter_max);
+
+	maxhash_debug_print(table, "Mapped entries directly in %zu bucket(s) with 1 collision.\n",
+			stats->direct_buckets);
+	maxhash_debug_print(table, "Perfect hash table creation took %.3f seconds.\n",
+			stats->search_seconds);
+	maxhash_debug_print(table, "Largest hash parameter:  %zu.\n", stats->parameter_max);
+	maxhash_debug_print(table, "Number of bits required: %zu.\n", stats->parameter_bits);
+	maxhash_debug_print(table, "Total number of hashes:  %zu.\n", stats->num_hashes);
+
+	return err;
+}
+
+
 
-	maxhash_debug_print(table, "Mapped entries directly in %ld bucket(s) with 1 collision.\n",
-			bucket_id - prev_bucket_id);
+maxhash_err_t maxhash_perfect_advise(const maxhash_table_params_t *tparams,
+		const void *keys, size_t key_stride, size_t num_keys,
+		const size_t *num_intermediate_entries, size_t num_sizes,
+		maxhash_perfect_advice_t *advice)
+{
+	maxhash_table_params_t params = *tparams;
+	params.incremental_puts = false;
+	params.concurrent_reads = false;
+
+	size_t key_width_bytes = (tparams->key_width_bits + 7) / 8;
+	uint8_t *value = calloc(1, (tparams->values.width_bits + 7) / 8 + 1);
+	if (value == NULL)
+	{
+		fprintf(stderr, "Error: failed to allocate memory.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	maxhash_err_t err = MAXHASH_ERR_OK;
+	for (size_t i = 0; i < num_sizes && err == MAXHASH_ERR_OK; i++)
+	{
+		memset(&advice[i], 0, sizeof(advice[i]));
+		advice[i].num_intermediate_entries = num_intermediate_entries[i];
+		if (num_intermediate_entries[i] == 0)
+		{
+			fprintf(stderr, "Error: number of intermediate entries cannot be "
+					"zero.\n");
+			err = MAXHASH_ERR_ERR;
+			break;
+		}
+		params.intermediate.num_buckets = num_intermediate_entries[i];
+
+		maxhash_table_t *table;
+		err = maxhash_sw_table_init(&table, &params);
+		if (err != MAXHASH_ERR_OK)
+			break;
 
-	uint64_t time_diff = (tv_end.tv_sec * 1000000 + tv_end.tv_usec) -
-		(tv_start.tv_sec * 1000000 + tv_start.tv_usec);
-	maxhash_debug_print(table, "Perfect hash table creation took %lu.%02lu seconds.\n",
-			time_diff / 1000000, (time_diff % 1000000) / 10000);
-	maxhash_debug_print(table, "Largest hash parameter:  %zu.\n", total_parameter_max);
+		/* Only the keys matter to the perfect hash. */
+		for (size_t k = 0; k < num_keys && err == MAXHASH_ERR_OK; k++)
+			err = maxhash_put(table, (const uint8_t *)keys + k * key_stride,
+					key_width_bytes, value, (tparams->values.width_bits + 7) /
+					8);
 
-	uint8_t num_param_bits = 1;
-	while (total_parameter_max >>= 1 != 0) num_param_bits++;
-	maxhash_debug_print(table, "Number of bits required: %u.\n", num_param_bits);
+		if (err == MAXHASH_ERR_OK)
+		{
+			maxhash_stats_t *stats = &advice[i].stats;
+			double start = now_seconds();
+			advice[i].built = perfect_rebuild(table, true, stats) ==
+				MAXHASH_ERR_OK;
+			stats->search_seconds = now_seconds() - start;
+			stats->parameter_bits = bits_needed(stats->parameter_max);
+		}
 
-	maxhash_debug_print(table, "Total number of hashes:  %zu.\n", total_num_hashes);
+		maxhash_free(table);
+	}
 
+	free(value);
 	return err;
 }
@@ -0,0 +1,228 @@
+/*
+ * maxhash_cuckoo.c
+ *
+ * Placement of keys in the ways of a collision-handling table, as read by
+ * CollisionHandlingHashMap.  This is d-ary cuckoo hashing with one key per
+ * bucket: way "w" is indexed by Jenkins' hash of the key with "w" as its
+ * parameter, and a key may be in its bucket of any way.  A key whose buckets
+ * are all taken moves other keys to their buckets in other ways, along the
+ * shortest chain of moves that ends in an empty bucket.
+ */
+
+#include "maxhash_internal.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Most buckets that the search for room for one key visits. */
+#define CUCKOO_MAX_SEARCH 1024
+
+#define NO_PARENT SIZE_MAX
+
+/*
+ * A bucket visited by the search.  The key in the bucket of "parent" can
+ * move here; the buckets of the key being placed have no parent.
+ */
+struct cuckoo_node {
+	size_t way;
+	size_t bucket_id;
+	size_t parent;
+};
+
+
+
+static size_t way_bucket(const maxhash_table_t *table, const void *key,
+		size_t way)
+{
+	const maxhash_table_params_t *tparams = &table->tparams;
+	uint32_t hash = maxhash_function_jenkins(key, tparams->key_width_bytes,
+			way, tparams->jenkins_chunk_width_bytes);
+	return hash % table->ways[way].iparams.num_buckets;
+}
+
+
+
+/* Find the way that holds a key, if any. */
+static bool find_key(const maxhash_table_t *table, const void *key,
+		size_t *way, size_t *bucket_id)
+{
+	for (*way = 0; *way < maxhash_num_ways(&table->tparams); (*way)++)
+	{
+		maxhash_entry_t *entry;
+		*bucket_id = way_bucket(table, key, *way);
+		if (maxhash_internal_get_entry_in_bucket(&table->ways[*way], true, key,
+					&entry, *bucket_id) == MAXHASH_ERR_OK)
+			return true;
+	}
+
+	return false;
+}
+
+
+
+static bool visited(const struct cuckoo_node *nodes, size_t num_nodes,
+		size_t way, size_t bucket_id)
+{
+	for (size_t n = 0; n < num_nodes; n++)
+		if (nodes[n].way == way && nodes[n].bucket_id == bucket_id)
+			return true;
+	return false;
+}
+
+
+
+/*
+ * Move each key on the chain that ends in the empty bucket of node "last" one
+ * step along it, last first, and put the new key in the bucket at its start.
+ */
+static maxhash_err_t move_chain(maxhash_table_t *table,
+		const struct cuckoo_node *nodes, size_t last, const void *key,
+		const void *value, size_t *moved)
+{
+	maxhash_err_t err = MAXHASH_ERR_OK;
+	size_t to = last;
+
+	for (; nodes[to].parent != NO_PARENT; to = nodes[to].parent)
+	{
+		const struct cuckoo_node *from = &nodes[nodes[to].parent];
+		maxhash_internal_table_t *from_way = &table->ways[from->way];
+		maxhash_entry_t *entry = maxhash_entry_get(from_way,
+				maxhash_bucket_peek(from_way, from->bucket_id)->head);
+
+		err |= maxhash_internal_put_in_bucket(&table->ways[nodes[to].way],
+				maxhash_entry_key(entry), maxhash_entry_value(from_way, entry),
+				nodes[to].bucket_id);
+		err |= maxhash_remove_from_bucket(from_way, maxhash_entry_key(entry),
+				from->bucket_id);
+		(*moved)++;
+	}
+
+	return err | maxhash_internal_put_in_bucket(&table->ways[nodes[to].way],
+			key, value, nodes[to].bucket_id);
+}
+
+
+
+/*
+ * Place a key that is in none of the ways, by a breadth-first search from its
+ * buckets for an empty one.  Nothing changes if none is found within
+ * CUCKOO_MAX_SEARCH buckets.
+ */
+static bool insert_key(maxhash_table_t *table, struct cuckoo_node *nodes,
+		const void *key, const void *value, size_t *moved)
+{
+	size_t num_ways = maxhash_num_ways(&table->tparams);
+	size_t num_nodes = 0;
+
+	for (size_t way = 0; way < num_ways; way++)
+		nodes[num_nodes++] = (struct cuckoo_node) { way,
+			way_bucket(table, key, way), NO_PARENT };
+
+	for (size_t n = 0; n < num_nodes; n++)
+	{
+		const maxhash_internal_table_t *way = &table->ways[nodes[n].way];
+		uint32_t id = maxhash_bucket_peek(way, nodes[n].bucket_id)->head;
+
+		if (id == MAXHASH_NIL)
+			return move_chain(table, nodes, n, key, value, moved) ==
+				MAXHASH_ERR_OK;
+
+		/* The key here could move to its bucket in any other way. */
+		const void *occupant = maxhash_entry_key(maxhash_entry_get(way, id));
+		for (size_t other = 0; other < num_ways &&
+				num_nodes < CUCKOO_MAX_SEARCH; other++)
+		{
+			if (other == nodes[n].way)
+				continue;
+
+			size_t bucket_id = way_bucket(table, occupant, other);
+			if (!visited(nodes, num_nodes, other, bucket_id))
+				nodes[num_nodes++] = (struct cuckoo_node) { other, bucket_id,
+					n };
+		}
+	}
+
+	return false;
+}
+
+
+
+maxhash_err_t maxhash_cuckoo_place(maxhash_table_t *table)
+{
+	maxhash_stats_t *stats = &table->stats;
+	bool rebuild = !table->tparams.incremental_puts || !table->perfect_built;
+	maxhash_internal_table_t *source = rebuild ? &table->sw : &table->recent;
+	maxhash_err_t err = MAXHASH_ERR_OK;
+	size_t num_unplaced = 0;
+
+	struct cuckoo_node *nodes = malloc(CUCKOO_MAX_SEARCH * sizeof(*nodes));
+	if (nodes == NULL)
+	{
+		fprintf(stderr, "Error: failed to allocate memory for placing keys.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	/* A rebuild places every key afresh. */
+	if (rebuild)
+	{
+		for (size_t way = 0; way < maxhash_num_ways(&table->tparams); way++)
+			err |= maxhash_internal_clear(&table->ways[way]);
+		err |= maxhash_internal_clear(&table->recent);
+	}
+	stats->incremental = !rebuild;
+
+	for (uint32_t id = 1; id < source->entries_used; id++)
+	{
+		const maxhash_entry_t *entry = maxhash_entry_get(source, id);
+		if (!entry->in_use)
+			continue;
+
+		const void *key = maxhash_entry_key(entry);
+		const void *value = maxhash_entry_value(source, entry);
+		size_t way, bucket_id;
+
+		/* Keys already placed only have their values updated. */
+		bool placed = find_key(table, key, &way, &bucket_id);
+		if (placed)
+			err |= maxhash_internal_put_in_bucket(&table->ways[way], key, value,
+					bucket_id);
+		else
+			placed = insert_key(table, nodes, key, value,
+					&stats->moved_entries);
+
+		if (placed && !rebuild)
+			err |= maxhash_internal_remove(&table->recent, key);
+		num_unplaced += !placed;
+	}
+
+	/* Keys left out are placed at the next commit, which starts afresh, as
+	 * the recent table does not outlive an asynchronous commit. */
+	free(nodes);
+	table->perfect_built = err == MAXHASH_ERR_OK && num_unplaced == 0;
+
+	maxhash_debug_print(table, "Placed keys in %zu ways, moving %zu entries.\n",
+			maxhash_num_ways(&table->tparams), stats->moved_entries);
+
+	if (num_unplaced > 0)
+	{
+		fprintf(stderr, "Error: no room for %zu key(s) in the ways of the "
+				"\"%s\" table; remove keys and commit again.\n", num_unplaced,
+				table->tparams.hash_table_name);
+		return MAXHASH_ERR_ERR;
+	}
+
+	return err;
+}
+
+
+
+bool maxhash_cuckoo_vacate(maxhash_table_t *table, const void *key)
+{
+	size_t way, bucket_id;
+	if (!find_key(table, key, &way, &bucket_id))
+		return false;
+
+	maxhash_remove_from_bucket(&table->ways[way], key, bucket_id);
+	return true;
+}
@@ -0,0 +1,578 @@
+/*
+ * maxhash_file.c
+ *
+ * Saving and loading the contents of a MaxHash table, so that a restarted
+ * process can have the perfect hash tables back in hardware without putting
+ * every key again and rebuilding them.
+ */
+
+#include "maxhash_internal.h"
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * A file starts with a header recording the geometry of the table, followed
+ * by sections holding the entries of each internal table and the memory
+ * images of those with hardware backing.  Every item is a multiple of eight
+ * bytes long, and everything after the checksum is covered by it.  Numbers
+ * are stored in host byte order.
+ */
+#define MAXHASH_FILE_MAGIC   "MAXHASH"
+#define MAXHASH_FILE_VERSION 1
+
+enum maxhash_file_section_type {
+	SECTION_ENTRIES = 1,
+	SECTION_IMAGE = 2
+};
+
+enum maxhash_file_table_id {
+	TABLE_SW,
+	TABLE_RECENT,
+	TABLE_INTERMEDIATE,
+	TABLE_VALUES,
+	NUM_TABLES
+};
+
+struct maxhash_file_header {
+	char magic[8];
+	uint64_t checksum;
+	uint64_t file_bytes;
+	uint32_t version;
+	uint32_t num_sections;
+	uint64_t key_width_bits;
+	uint64_t value_width_bits;
+	uint64_t intermediate_width_bits;
+	uint64_t intermediate_num_buckets;
+	uint64_t values_num_buckets;
+	uint64_t max_bucket_entries;
+	uint64_t jenkins_chunk_width_bytes;
+	uint64_t perfect_built;
+	uint64_t values_free_hint;
+	uint64_t values_vacated;
+};
+
+/*
+ * An entries section holds "num_items" records of "item_bytes" bytes: the
+ * bucket ID and flags of an entry, then its key and its value, each padded
+ * to eight bytes.  Entries appear in bucket order.  An image section holds
+ * the memory image, followed by a bitmap of the buckets that have changed
+ * since it was serialised.
+ */
+struct maxhash_file_section {
+	uint32_t type;
+	uint32_t table_id;
+	uint64_t size_bytes;
+	uint64_t num_items;
+	uint64_t item_bytes;
+	uint64_t entry_bits;
+	uint64_t entries_per_burst;
+};
+
+struct maxhash_file_record {
+	uint32_t bucket_id;
+	uint8_t flags[NUM_ENTRY_FLAGS];
+	uint8_t padding[2];
+};
+
+#define ROUND_UP_8(n) (((n) + 7) & ~(size_t)7)
+
+struct file_writer {
+	FILE *file;
+	uint64_t checksum;
+	bool failed;
+};
+
+
+
+/* FNV-1a, a word at a time. */
+static uint64_t checksum_update(uint64_t checksum, const void *data,
+		size_t size_bytes)
+{
+	const uint8_t *bytes = data;
+	for (size_t i = 0; i < size_bytes; i += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, bytes + i, sizeof(word));
+		checksum = (checksum ^ word) * UINT64_C(0x100000001B3);
+	}
+	return checksum;
+}
+
+
+
+static void file_write(struct file_writer *w, const void *data,
+		size_t size_bytes)
+{
+	w->checksum = checksum_update(w->checksum, data, size_bytes);
+	if (!w->failed && fwrite(data, 1, size_bytes, w->file) != size_bytes)
+		w->failed = true;
+}
+
+
+
+static maxhash_internal_table_t *file_table(maxhash_table_t *table,
+		uint32_t table_id)
+{
+	switch (table_id)
+	{
+		case TABLE_SW:           return &table->sw;
+		case TABLE_RECENT:       return &table->recent;
+		case TABLE_INTERMEDIATE: return &table->intermediate;
+		case TABLE_VALUES:       return &table->values;
+		default:                 return NULL;
+	}
+}
+
+
+
+static size_t record_bytes(const maxhash_internal_table_t *itable)
+{
+	return sizeof(struct maxhash_file_record) +
+		ROUND_UP_8(itable->table->tparams.key_width_bytes) +
+		ROUND_UP_8(itable->iparams.width_bytes);
+}
+
+
+
+static void entries_section(const maxhash_internal_table_t *itable,
+		uint32_t table_id, struct maxhash_file_section *section)
+{
+	memset(section, 0, sizeof(*section));
+	section->type = SECTION_ENTRIES;
+	section->table_id = table_id;
+	section->num_items = itable->num_entries;
+	section->item_bytes = record_bytes(itable);
+	section->size_bytes = section->num_items * section->item_bytes;
+}
+
+
+
+static void image_section(const maxhash_internal_table_t *itable,
+		uint32_t table_id, struct maxhash_file_section *section)
+{
+	const maxhash_mem_image_t *image = &itable->image;
+
+	memset(section, 0, sizeof(*section));
+	section->type = SECTION_IMAGE;
+	section->table_id = table_id;
+	section->num_items = image->num_bursts;
+	section->item_bytes = image->burst_size_bytes;
+	section->entry_bits = image->entry_bits;
+	section->entries_per_burst = image->entries_per_burst;
+	section->size_bytes = image->size_bytes +
+		(itable->iparams.num_buckets + 63) / 64 * sizeof(uint64_t);
+}
+
+
+
+static void write_entries(struct file_writer *w,
+		const maxhash_internal_table_t *itable,
+		const struct maxhash_file_section *section)
+{
+	size_t key_bytes = ROUND_UP_8(itable->table->tparams.key_width_bytes);
+	size_t value_bytes = ROUND_UP_8(itable->iparams.width_bytes);
+
+	file_write(w, section, sizeof(*section));
+
+	/* Keys and values are padded to whole words in entry records. */
+	for (size_t bucket_id = 0; bucket_id < itable->iparams.num_buckets;
+			bucket_id++)
+	{
+		for (uint32_t id = maxhash_bucket_peek(itable, bucket_id)->head;
+				id != MAXHASH_NIL;)
+		{
+			const maxhash_entry_t *e = maxhash_entry_get(itable, id);
+			struct maxhash_file_record record;
+			memset(&record, 0, sizeof(record));
+			record.bucket_id = e->bucket_id;
+			for (size_t flag = 0; flag < NUM_ENTRY_FLAGS; flag++)
+				record.flags[flag] = e->flags[flag];
+
+			file_write(w, &record, sizeof(record));
+			file_write(w, maxhash_entry_key(e), key_bytes);
+			file_write(w, maxhash_entry_value(itable, e), value_bytes);
+			id = e->next;
+		}
+	}
+}
+
+
+
+static void write_image(struct file_writer *w,
+		const maxhash_internal_table_t *itable,
+		const struct maxhash_file_section *section)
+{
+	const maxhash_mem_image_t *image = &itable->image;
+	size_t num_bucket_words = (itable->iparams.num_buckets + 63) / 64;
+
+	file_write(w, section, sizeof(*section));
+
+	file_write(w, image->data, image->size_bytes);
+	for (size_t word = 0; word < num_bucket_words; word++)
+	{
+		uint64_t dirty = image->all_buckets_dirty ? ~UINT64_C(0) :
+			image->dirty_buckets[word];
+		file_write(w, &dirty, sizeof(dirty));
+	}
+}
+
+
+
+maxhash_err_t maxhash_save(maxhash_table_t *table, const char *path)
+{
+	maxhash_internal_wait_for_commit(table);
+
+	const maxhash_table_params_t *tparams = &table->tparams;
+	struct maxhash_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MAXHASH_FILE_MAGIC, sizeof(MAXHASH_FILE_MAGIC));
+	header.version = MAXHASH_FILE_VERSION;
+	header.key_width_bits = tparams->key_width_bits;
+	header.value_width_bits = tparams->values.width_bits;
+	header.intermediate_width_bits = tparams->intermediate.width_bits;
+	header.intermediate_num_buckets = tparams->intermediate.num_buckets;
+	header.values_num_buckets = tparams->values.num_buckets;
+	header.max_bucket_entries = tparams->max_bucket_entries;
+	header.jenkins_chunk_width_bytes = tparams->jenkins_chunk_width_bytes;
+	header.perfect_built = table->perfect_built;
+	header.values_free_hint = table->values_free_hint;
+	header.values_vacated = table->values_vacated;
+
+	/* Lay out the sections first, so that the header is complete before
+	 * anything is written. */
+	struct maxhash_file_section sections[NUM_TABLES + 2];
+	const maxhash_internal_table_t *section_tables[NUM_TABLES + 2];
+	header.file_bytes = sizeof(header);
+
+	for (uint32_t table_id = 0; table_id < NUM_TABLES; table_id++)
+	{
+		section_tables[header.num_sections] = file_table(table, table_id);
+		entries_section(section_tables[header.num_sections], table_id,
+				&sections[header.num_sections]);
+		header.num_sections++;
+	}
+	for (uint32_t table_id = TABLE_INTERMEDIATE; table_id < NUM_TABLES;
+			table_id++)
+	{
+		const maxhash_internal_table_t *itable = file_table(table, table_id);
+		if (itable->image.data == NULL)
+			continue;
+		section_tables[header.num_sections] = itable;
+		image_section(itable, table_id, &sections[header.num_sections]);
+		header.num_sections++;
+	}
+	for (uint32_t i = 0; i < header.num_sections; i++)
+		header.file_bytes += sizeof(sections[i]) + sections[i].size_bytes;
+
+	/* Write to a temporary file and rename it over "path", so that a crash
+	 * part way through does not leave a damaged file behind. */
+	char tmp_path[strlen(path) + 5];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	struct file_writer w = { fopen(tmp_path, "wb"), 0, false };
+	if (w.file == NULL)
+	{
+		fprintf(stderr, "Error: failed to open \"%s\" for writing.\n",
+				tmp_path);
+		return MAXHASH_ERR_ERR;
+	}
+
+	size_t checked_offset = offsetof(struct maxhash_file_header, checksum) +
+		sizeof(header.checksum);
+	file_write(&w, &header, sizeof(header));
+	w.checksum = checksum_update(0, (uint8_t *)&header + checked_offset,
+			sizeof(header) - checked_offset);
+
+	for (uint32_t i = 0; i < header.num_sections; i++)
+	{
+		if (sections[i].type == SECTION_ENTRIES)
+			write_entries(&w, section_tables[i], &sections[i]);
+		else
+			write_image(&w, section_tables[i], &sections[i]);
+	}
+
+	if (!w.failed && (fseek(w.file, offsetof(struct maxhash_file_header,
+						checksum), SEEK_SET) != 0 || fwrite(&w.checksum,
+						sizeof(w.checksum), 1, w.file) != 1))
+		w.failed = true;
+	if (fclose(w.file) != 0)
+		w.failed = true;
+
+	if (w.failed || rename(tmp_path, path) != 0)
+	{
+		fprintf(stderr, "Error: failed to write \"%s\".\n", path);
+		remove(tmp_path);
+		return MAXHASH_ERR_ERR;
+	}
+
+	maxhash_debug_print(table, "Saved \"%s\" (%" PRIu64 " bytes).\n", path,
+			header.file_bytes);
+	return MAXHASH_ERR_OK;
+}
+
+
+
+static maxhash_err_t check_geometry(const maxhash_table_t *table,
+		const struct maxhash_file_header *header, const char *path)
+{
+	const maxhash_table_params_t *tparams = &table->tparams;
+	struct {
+		const char *name;
+		uint64_t saved;
+		uint64_t expected;
+	} fields[] = {
+		{ "key width (bits)", header->key_width_bits,
+			tparams->key_width_bits },
+		{ "value width (bits)", header->value_width_bits,
+			tparams->values.width_bits },
+		{ "hash parameter width (bits)", header->intermediate_width_bits,
+			tparams->intermediate.width_bits },
+		{ "number of hash parameter buckets",
+			header->intermediate_num_buckets,
+			tparams->intermediate.num_buckets },
+		{ "number of value buckets", header->values_num_buckets,
+			tparams->values.num_buckets },
+		{ "maximum entries per bucket", header->max_bucket_entries,
+			tparams->max_bucket_entries },
+		{ "Jenkins chunk width (bytes)", header->jenkins_chunk_width_bytes,
+			tparams->jenkins_chunk_width_bytes },
+	};
+
+	maxhash_err_t err = MAXHASH_ERR_OK;
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+	{
+		if (fields[i].saved == fields[i].expected)
+			continue;
+		fprintf(stderr, "Error: \"%s\" was saved with a %s of %" PRIu64
+				", but the table has %" PRIu64 ".\n", path, fields[i].name,
+				fields[i].saved, fields[i].expected);
+		err = MAXHASH_ERR_ERR;
+	}
+
+	return err;
+}
+
+
+
+static maxhash_err_t load_entries(maxhash_internal_table_t *itable,
+		const struct maxhash_file_section *section, const uint8_t *data)
+{
+	size_t key_bytes = ROUND_UP_8(itable->table->tparams.key_width_bytes);
+
+	if (section->item_bytes != record_bytes(itable) ||
+			section->size_bytes / section->item_bytes != section->num_items)
+	{
+		fprintf(stderr, "Error: entries of \"%s\" table do not match its "
+				"widths.\n", itable->iparams.name);
+		return MAXHASH_ERR_ERR;
+	}
+
+	for (size_t i = 0; i < section->num_items; i++)
+	{
+		const uint8_t *item = data + i * section->item_bytes;
+		struct maxhash_file_record record;
+		memcpy(&record, item, sizeof(record));
+		const void *key = item + sizeof(record);
+		const void *value = item + sizeof(record) + key_bytes;
+
+		maxhash_entry_t *e;
+		if (record.bucket_id >= itable->iparams.num_buckets ||
+				maxhash_internal_put_in_bucket(itable, key, value,
+					record.bucket_id) != MAXHASH_ERR_OK ||
+				maxhash_internal_get_entry_in_bucket(itable, true, key, &e,
+					record.bucket_id) != MAXHASH_ERR_OK)
+		{
+			fprintf(stderr, "Error: failed to restore entry %zu of \"%s\" "
+					"table.\n", i, itable->iparams.name);
+			return MAXHASH_ERR_ERR;
+		}
+
+		for (size_t flag = 0; flag < NUM_ENTRY_FLAGS; flag++)
+			e->flags[flag] = record.flags[flag];
+	}
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+static maxhash_err_t load_image(maxhash_internal_table_t *itable,
+		uint32_t table_id, const struct maxhash_file_section *section,
+		const uint8_t *data)
+{
+	if (itable->iparams.mem_type == MAXHASH_MEM_TYPE_UNDEFINED)
+	{
+		fprintf(stderr, "Error: saved memory image of \"%s\" table, but the "
+				"table has no hardware backing.\n", itable->iparams.name);
+		return MAXHASH_ERR_ERR;
+	}
+
+	if (maxhash_internal_image_init(itable, table_id == TABLE_INTERMEDIATE) !=
+			MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+
+	maxhash_mem_image_t *image = &itable->image;
+	size_t num_bucket_words = (itable->iparams.num_buckets + 63) / 64;
+
+	if (section->num_items != image->num_bursts ||
+			section->item_bytes != image->burst_size_bytes ||
+			section->entry_bits != image->entry_bits ||
+			section->entries_per_burst != image->entries_per_burst ||
+			section->size_bytes != image->size_bytes + num_bucket_words *
+				sizeof(uint64_t))
+	{
+		fprintf(stderr, "Error: saved memory layout of \"%s\" table does not "
+				"match the MaxFile.\n", itable->iparams.name);
+		return MAXHASH_ERR_ERR;
+	}
+
+	memcpy(image->data, data, image->size_bytes);
+	memcpy(image->dirty_buckets, data + image->size_bytes, num_bucket_words *
+			sizeof(uint64_t));
+	image->all_buckets_dirty = false;
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+static maxhash_err_t load_sections(maxhash_table_t *table,
+		const uint8_t *data, size_t file_bytes)
+{
+	const struct maxhash_file_header *header = (const void *)data;
+	size_t offset = sizeof(*header);
+
+	for (uint32_t i = 0; i < header->num_sections; i++)
+	{
+		struct maxhash_file_section section;
+		if (file_bytes - offset < sizeof(section))
+			return MAXHASH_ERR_ERR;
+		memcpy(&section, data + offset, sizeof(section));
+		offset += sizeof(section);
+
+		maxhash_internal_table_t *itable = file_table(table,
+				section.table_id);
+		if (itable == NULL || section.size_bytes > file_bytes - offset ||
+				section.item_bytes == 0)
+			return MAXHASH_ERR_ERR;
+
+		maxhash_err_t err = MAXHASH_ERR_ERR;
+		if (section.type == SECTION_ENTRIES)
+			err = load_entries(itable, &section, data + offset);
+		else if (section.type == SECTION_IMAGE &&
+				section.table_id >= TABLE_INTERMEDIATE)
+			err = load_image(itable, section.table_id, &section,
+					data + offset);
+		if (err != MAXHASH_ERR_OK)
+			return err;
+
+		offset += section.size_bytes;
+	}
+
+	return offset == file_bytes ? MAXHASH_ERR_OK : MAXHASH_ERR_ERR;
+}
+
+
+
+maxhash_err_t maxhash_load(maxhash_table_t *table, const char *path)
+{
+	maxhash_internal_wait_for_commit(table);
+
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		fprintf(stderr, "Error: failed to open \"%s\".\n", path);
+		if (fd >= 0)
+			close(fd);
+		return MAXHASH_ERR_ERR;
+	}
+
+	size_t file_bytes = st.st_size;
+	const struct maxhash_file_header *header = NULL;
+	if (file_bytes >= sizeof(*header))
+		header = mmap(NULL, file_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (header == NULL || header == MAP_FAILED)
+	{
+		fprintf(stderr, "Error: \"%s\" is not a MaxHash file.\n", path);
+		return MAXHASH_ERR_ERR;
+	}
+
+	const uint8_t *data = (const uint8_t *)header;
+	size_t checked_offset = offsetof(struct maxhash_file_header, checksum) +
+		sizeof(header->checksum);
+	maxhash_err_t err = MAXHASH_ERR_OK;
+
+	if (memcmp(header->magic, MAXHASH_FILE_MAGIC,
+				sizeof(MAXHASH_FILE_MAGIC)) != 0)
+	{
+		fprintf(stderr, "Error: \"%s\" is not a MaxHash file.\n", path);
+		err = MAXHASH_ERR_ERR;
+	}
+	else if (header->version != MAXHASH_FILE_VERSION)
+	{
+		fprintf(stderr, "Error: \"%s\" has format version %u, but only "
+				"version %u is supported.\n", path, header->version,
+				MAXHASH_FILE_VERSION);
+		err = MAXHASH_ERR_ERR;
+	}
+	else if (header->file_bytes != file_bytes || file_bytes % 8 != 0 ||
+			checksum_update(0, data + checked_offset, file_bytes -
+				checked_offset) != header->checksum)
+	{
+		fprintf(stderr, "Error: \"%s\" is truncated or corrupt.\n", path);
+		err = MAXHASH_ERR_ERR;
+	}
+	else
+		err = check_geometry(table, header, path);
+
+	if (err == MAXHASH_ERR_OK)
+	{
+		maxhash_clear(table);
+		err = load_sections(table, data, file_bytes);
+		if (err != MAXHASH_ERR_OK)
+		{
+			fprintf(stderr, "Error: failed to load \"%s\".\n", path);
+			maxhash_clear(table);
+		}
+	}
+
+	if (err == MAXHASH_ERR_OK)
+	{
+		table->perfect_built = header->perfect_built;
+		table->values_free_hint = header->values_free_hint;
+		table->values_vacated = header->values_vacated;
+	}
+
+	munmap((void *)header, file_bytes);
+	if (err != MAXHASH_ERR_OK)
+		return err;
+
+	/* Nothing is known about what the hardware holds, so the whole of each
+	 * image goes to the engine, without rebuilding the perfect hash.  The ways
+	 * of a collision-handling table are not saved: its keys are placed again
+	 * and committed. */
+	maxhash_invalidate_hw(table);
+	if (table->tparams.max_bucket_entries > 1)
+	{
+		table->perfect_built = false;
+		if (table->tparams.engine_state != NULL)
+			err = maxhash_commit(table);
+	}
+	else if (table->tparams.engine_state != NULL && table->perfect_built)
+		err = maxhash_internal_write_tables(table);
+
+	maxhash_debug_print(table, "Loaded \"%s\" (%zu keys).\n", path,
+			table->sw.num_entries);
+	return err;
+}
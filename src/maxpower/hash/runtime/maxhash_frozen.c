@@ -0,0 +1,395 @@
+/*
+ * maxhash_frozen.c
+ *
+ * Read-only copy of the committed perfect hash tables of a table, for lookups
+ * in software that give the kernel's results.  The internal tables keep
+ * their entries in linked buckets, so that they can be changed cheaply; the
+ * copy is laid out as flat arrays instead, like the memories that the kernel
+ * reads: the hash parameter of each intermediate bucket, and a slot of
+ * {key, value, valid} for each values bucket (or for each bucket of each way
+ * of a collision-handling table).
+ */
+
+#include "maxhash_internal.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Number of keys that are hashed and prefetched together in a batch. */
+#define FROZEN_BLOCK_SIZE 64
+
+/* The hash parameter of an intermediate bucket, as the kernel reads it: all
+ * zeros for a bucket that has no keys. */
+struct frozen_param {
+	uint32_t param;
+	uint32_t direct;
+};
+
+/*
+ * "slots" holds the slots of each way in turn; a perfect hash table has one
+ * way, its values table.  Slots are a power of two bytes long, up to a cache
+ * line, so that none straddles two.
+ */
+struct maxhash_frozen {
+	size_t key_width_bits;
+	size_t key_width_bytes;
+	size_t value_width_bytes;
+	size_t jenkins_chunk_width_bytes;
+	bool validate_results;
+	bool perfect;
+
+	struct frozen_param *params;
+	size_t num_params;
+
+	uint8_t *slots;
+	size_t num_ways;
+	size_t num_slots;
+	size_t slot_bytes;
+	size_t value_offset;
+	size_t valid_offset;
+};
+
+
+
+static void *alloc_cache_aligned(size_t size)
+{
+	void *ptr;
+	if (posix_memalign(&ptr, CACHE_LINE_BYTES, size) != 0)
+		return NULL;
+	return ptr;
+}
+
+
+
+static void freeze_params(maxhash_frozen_t *frozen,
+		const maxhash_internal_table_t *intermediate)
+{
+	for (size_t b = 0; b < frozen->num_params; b++)
+	{
+		uint32_t id = maxhash_bucket_peek(intermediate, b)->head;
+		const maxhash_entry_t *e = id != MAXHASH_NIL ?
+			maxhash_entry_get(intermediate, id) : NULL;
+		if (e == NULL || !e->flags[FLAG_VALID])
+			continue;
+
+		size_t param = 0;
+		memcpy(&param, maxhash_entry_value(intermediate, e),
+				intermediate->iparams.width_bytes);
+		frozen->params[b].param = param;
+		frozen->params[b].direct = e->flags[FLAG_PERFECT_DIRECT];
+	}
+}
+
+
+
+/* Copy the head entry of each bucket, which is what a commit serialises. */
+static void freeze_slots(maxhash_frozen_t *frozen,
+		const maxhash_internal_table_t *itable, uint8_t *slots)
+{
+	for (size_t b = 0; b < frozen->num_slots; b++)
+	{
+		uint32_t id = maxhash_bucket_peek(itable, b)->head;
+		const maxhash_entry_t *e = id != MAXHASH_NIL ?
+			maxhash_entry_get(itable, id) : NULL;
+		if (e == NULL || !e->flags[FLAG_VALID])
+			continue;
+
+		uint8_t *slot = slots + b * frozen->slot_bytes;
+		if (frozen->validate_results)
+			memcpy(slot, maxhash_entry_key(e), frozen->key_width_bytes);
+		memcpy(slot + frozen->value_offset, maxhash_entry_value(itable, e),
+				frozen->value_width_bytes);
+		slot[frozen->valid_offset] = 1;
+	}
+}
+
+
+
+maxhash_err_t maxhash_freeze(maxhash_table_t *table, maxhash_frozen_t **frozen)
+{
+	*frozen = NULL;
+	if (maxhash_internal_wait_for_commit(table) != MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+
+	if (!table->perfect_built)
+	{
+		fprintf(stderr, "Error: table \"%s\" has not been committed.\n",
+				table->tparams.hash_table_name);
+		return MAXHASH_ERR_ERR;
+	}
+
+	const maxhash_table_params_t *tparams = &table->tparams;
+	size_t num_ways = maxhash_num_ways(tparams);
+	const maxhash_internal_table_t *first = num_ways > 0 ? &table->ways[0] :
+		&table->values;
+
+	maxhash_frozen_t *f = calloc(1, sizeof(maxhash_frozen_t));
+	if (f == NULL)
+	{
+		fprintf(stderr, "Error: failed to allocate frozen table.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	f->key_width_bits = tparams->key_width_bits;
+	f->key_width_bytes = tparams->key_width_bytes;
+	f->value_width_bytes = first->iparams.width_bytes;
+	f->jenkins_chunk_width_bytes = tparams->jenkins_chunk_width_bytes;
+	f->perfect = num_ways == 0;
+	f->num_ways = num_ways > 0 ? num_ways : 1;
+	f->num_slots = first->iparams.num_buckets;
+	f->num_params = f->perfect ? table->intermediate.iparams.num_buckets : 0;
+
+	/* With no kernel to match, keys are always checked. */
+	f->validate_results = first->iparams.validate_results ||
+		tparams->engine_state == NULL;
+
+	f->value_offset = f->validate_results ? f->key_width_bytes : 0;
+	f->valid_offset = f->value_offset + f->value_width_bytes;
+	f->slot_bytes = 1;
+	while (f->slot_bytes < f->valid_offset + 1)
+		f->slot_bytes *= 2;
+	if (f->slot_bytes > CACHE_LINE_BYTES)
+		f->slot_bytes = (f->valid_offset + CACHE_LINE_BYTES) /
+			CACHE_LINE_BYTES * CACHE_LINE_BYTES;
+
+	size_t params_bytes = f->num_params * sizeof(struct frozen_param);
+	size_t slots_bytes = f->num_ways * f->num_slots * f->slot_bytes;
+	if (f->num_params > 0)
+		f->params = alloc_cache_aligned(params_bytes);
+	f->slots = alloc_cache_aligned(slots_bytes);
+	if ((f->num_params > 0 && f->params == NULL) || f->slots == NULL)
+	{
+		fprintf(stderr, "Error: failed to allocate frozen table.\n");
+		maxhash_frozen_free(f);
+		return MAXHASH_ERR_ERR;
+	}
+
+	memset(f->slots, 0, slots_bytes);
+	if (f->perfect)
+	{
+		memset(f->params, 0, params_bytes);
+		freeze_params(f, &table->intermediate);
+		freeze_slots(f, &table->values, f->slots);
+	}
+	else
+		for (size_t way = 0; way < num_ways; way++)
+			freeze_slots(f, &table->ways[way],
+					f->slots + way * f->num_slots * f->slot_bytes);
+
+	*frozen = f;
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_frozen_free(maxhash_frozen_t *frozen)
+{
+	free(frozen->params);
+	free(frozen->slots);
+	free(frozen);
+	return MAXHASH_ERR_OK;
+}
+
+
+
+static const uint8_t *frozen_slot(const maxhash_frozen_t *frozen, size_t way,
+		uint32_t hash)
+{
+	return frozen->slots + (way * frozen->num_slots + hash %
+			frozen->num_slots) * frozen->slot_bytes;
+}
+
+
+
+static const struct frozen_param *frozen_param(const maxhash_frozen_t *frozen,
+		uint32_t hash)
+{
+	return &frozen->params[hash % frozen->num_params];
+}
+
+
+
+static bool slot_matches(const maxhash_frozen_t *frozen, const uint8_t *slot,
+		const void *key)
+{
+	return slot[frozen->valid_offset] && (!frozen->validate_results ||
+			memcmp(slot, key, frozen->key_width_bytes) == 0);
+}
+
+
+
+/*
+ * The kernel's output for a key, given the slot that a perfect hash table
+ * reads, or the slots of every way of a collision-handling table.  A
+ * collision-handling table outputs zero unless a way matches.
+ */
+static bool frozen_output(const maxhash_frozen_t *frozen,
+		const uint8_t *const *slots, const void *key, void *value)
+{
+	if (frozen->perfect)
+	{
+		memcpy(value, slots[0] + frozen->value_offset,
+				frozen->value_width_bytes);
+		return slot_matches(frozen, slots[0], key);
+	}
+
+	for (size_t way = 0; way < frozen->num_ways; way++)
+		if (slot_matches(frozen, slots[way], key))
+		{
+			memcpy(value, slots[way] + frozen->value_offset,
+					frozen->value_width_bytes);
+			return true;
+		}
+
+	memset(value, 0, frozen->value_width_bytes);
+	return false;
+}
+
+
+
+maxhash_err_t maxhash_frozen_get(const maxhash_frozen_t *frozen,
+		const void *key, size_t key_len, void *value, bool *contains_key)
+{
+	uint8_t key_padded[frozen->key_width_bytes];
+	if (pad(&key, key_padded, key_len, frozen->key_width_bits,
+				frozen->key_width_bytes, false) != MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+
+	const uint8_t *slots[MAXHASH_MAX_WAYS];
+	if (frozen->perfect)
+	{
+		const struct frozen_param *p = frozen_param(frozen,
+				maxhash_function_jenkins(key, frozen->key_width_bytes, 0,
+					frozen->jenkins_chunk_width_bytes));
+		slots[0] = frozen_slot(frozen, 0, p->direct ? p->param :
+				maxhash_function_jenkins(key, frozen->key_width_bytes,
+					p->param, frozen->jenkins_chunk_width_bytes));
+	}
+	else
+		for (size_t way = 0; way < frozen->num_ways; way++)
+			slots[way] = frozen_slot(frozen, way, maxhash_function_jenkins(key,
+						frozen->key_width_bytes, way,
+						frozen->jenkins_chunk_width_bytes));
+
+	*contains_key = frozen_output(frozen, slots, key, value);
+	return MAXHASH_ERR_OK;
+}
+
+
+
+/*
+ * Copy key "i" of a batch to "key", padded to the key width.  Returns false if
+ * it has bits set beyond the key width.
+ */
+static bool batch_key(const maxhash_frozen_t *frozen, const void *keys,
+		size_t key_stride, size_t i, uint8_t *key)
+{
+	const uint8_t *item = (const uint8_t *)keys + i * key_stride;
+	size_t key_bytes = frozen->key_width_bytes;
+	size_t copy_bytes = key_stride < key_bytes ? key_stride : key_bytes;
+
+	for (size_t b = key_bytes; b < key_stride; b++)
+		if (item[b] != 0)
+			return false;
+
+	memset(key, 0, key_bytes);
+	memcpy(key, item, copy_bytes);
+
+	size_t top_bits = frozen->key_width_bits % 8;
+	return top_bits == 0 || (key[key_bytes - 1] >> top_bits) == 0;
+}
+
+
+
+maxhash_err_t maxhash_frozen_get_batch(const maxhash_frozen_t *frozen,
+		const void *keys, size_t key_stride, size_t n, void *values,
+		size_t value_stride, bool *contains_key)
+{
+	size_t key_bytes = frozen->key_width_bytes;
+	size_t chunk_bytes = frozen->jenkins_chunk_width_bytes;
+
+	if (value_stride < frozen->value_width_bytes)
+	{
+		fprintf(stderr, "Error: value stride of %zu bytes is smaller than "
+				"value width of %zu bytes.\n", value_stride,
+				frozen->value_width_bytes);
+		return MAXHASH_ERR_ERR;
+	}
+
+	uint8_t *key_buf = malloc(FROZEN_BLOCK_SIZE * key_bytes);
+	if (key_buf == NULL)
+	{
+		fprintf(stderr, "Error: failed to allocate memory for batch.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	const void *block_keys[FROZEN_BLOCK_SIZE];
+	bool key_ok[FROZEN_BLOCK_SIZE];
+	uint32_t params[FROZEN_BLOCK_SIZE];
+	uint32_t hashes[FROZEN_BLOCK_SIZE];
+	const struct frozen_param *block_params[FROZEN_BLOCK_SIZE];
+	const uint8_t *slots[FROZEN_BLOCK_SIZE][MAXHASH_MAX_WAYS];
+
+	for (size_t base = 0; base < n; base += FROZEN_BLOCK_SIZE)
+	{
+		size_t block_size = n - base < FROZEN_BLOCK_SIZE ? n - base :
+			FROZEN_BLOCK_SIZE;
+
+		/* Keys that are not valid are hashed too, and their results
+		 * dropped. */
+		for (size_t i = 0; i < block_size; i++)
+		{
+			block_keys[i] = key_buf + i * key_bytes;
+			key_ok[i] = batch_key(frozen, keys, key_stride, base + i,
+					key_buf + i * key_bytes);
+		}
+
+		/* Each way, or each level of the perfect hash, is hashed for the
+		 * whole block and its slots prefetched before any are read. */
+		if (frozen->perfect)
+		{
+			memset(params, 0, block_size * sizeof(uint32_t));
+			maxhash_function_jenkins_multi(block_keys, key_bytes, params,
+					block_size, chunk_bytes, hashes);
+			for (size_t i = 0; i < block_size; i++)
+			{
+				block_params[i] = frozen_param(frozen, hashes[i]);
+				__builtin_prefetch(block_params[i]);
+			}
+
+			for (size_t i = 0; i < block_size; i++)
+				params[i] = block_params[i]->param;
+			maxhash_function_jenkins_multi(block_keys, key_bytes, params,
+					block_size, chunk_bytes, hashes);
+			for (size_t i = 0; i < block_size; i++)
+			{
+				slots[i][0] = frozen_slot(frozen, 0, block_params[i]->direct ?
+						params[i] : hashes[i]);
+				__builtin_prefetch(slots[i][0]);
+			}
+		}
+		else
+			for (size_t way = 0; way < frozen->num_ways; way++)
+			{
+				for (size_t i = 0; i < block_size; i++)
+					params[i] = way;
+				maxhash_function_jenkins_multi(block_keys, key_bytes, params,
+						block_size, chunk_bytes, hashes);
+				for (size_t i = 0; i < block_size; i++)
+				{
+					slots[i][way] = frozen_slot(frozen, way, hashes[i]);
+					__builtin_prefetch(slots[i][way]);
+				}
+			}
+
+		for (size_t i = 0; i < block_size; i++)
+			contains_key[base + i] = key_ok[i] && frozen_output(frozen,
+					slots[i], block_keys[i],
+					(uint8_t *)values + (base + i) * value_stride);
+	}
+
+	free(key_buf);
+	return MAXHASH_ERR_OK;
+}
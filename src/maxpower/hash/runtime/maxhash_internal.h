@@ -10,12 +10,25 @@
 
 #include "maxhash.h"
 
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
 #define NUM_ENTRY_FLAGS     2
 #define FLAG_VALID          0
 #define FLAG_PERFECT_DIRECT 1
 
 #define UNRELEASED_VERSION_STRING "0"
 
+/* Entry IDs are indices into an internal table's entry slab.  ID 0 is never
+ * handed out, so that zero-initialised buckets and index slots are empty. */
+#define MAXHASH_NIL         0
+
+#define CACHE_LINE_BYTES    64
+
+/* Most ways (MaxBucketEntries) a collision-handling table can have. */
+#define MAXHASH_MAX_WAYS    8
+
 //#define PRINT_VAR(type, var) if (global_debug) printf("%-25s %-15s %" #type "\n", __func__, #var ":", var)
 #define PRINT_VAR(type, var)
 
@@ -23,6 +36,21 @@
 extern "C" {
 #endif
 
+/* A cheap, monotonic cycle count for timing short operations: the TSC on x86,
+ * and nanoseconds elsewhere.  Callers calibrate it against the clock. */
+static inline uint64_t maxhash_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t hi, lo;
+	__asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
 struct maxhash_engine_state;
 
 enum maxhash_mem_type {
@@ -41,13 +69,134 @@ struct maxhash_internal_table_params {
 	uint8_t deep_fmem_id;
 	size_t base_address_bursts;
 	bool validate_results;
+	bool is_indexed;
+};
+
+/*
+ * Slot in the open-addressing (linear probing) index of an internal table.
+ * The hash is kept alongside the entry ID so that most mismatching probes
+ * are rejected without touching the entry itself.
+ */
+struct maxhash_index_slot {
+	uint32_t hash;
+	uint32_t entry_id;
+};
+
+/*
+ * Copy of the memory contents last serialised for a table with hardware
+ * backing, and the bit layout of its entries.  Changes to buckets are
+ * recorded as they happen, so that a commit only re-serialises the buckets
+ * that changed and only writes the bursts whose contents differ from those
+ * already in each (double) buffer.
+ */
+struct maxhash_mem_image {
+	uint8_t *data;
+	size_t size_bytes;
+	size_t burst_size_bytes;
+	size_t entry_size_bytes;
+	size_t entries_per_burst;
+	size_t num_bursts;
+	size_t num_flags;
+	size_t flags_offset_bits;
+	size_t key_offset_bits;
+	size_t value_offset_bits;
+	size_t entry_bits;
+	uint64_t *dirty_buckets;
+	bool all_buckets_dirty;
+	uint64_t *dirty_bursts[2];
+	uint64_t deep_fmem_loads[MAXHASH_MAX_REPLICAS];
+	double load_seconds[MAXHASH_MAX_REPLICAS];
+
+	/* What the last write of the image did, for maxhash_stats_t. */
+	size_t bursts_written;
+	size_t bytes_written;
+	double serialise_seconds;
+	double write_seconds;
 };
 
+/*
+ * State shared with lookups on other threads, for a software table with
+ * concurrent reads enabled.  The writer makes "seq" odd for the duration of
+ * each change to a single key, and a lookup that sees it odd or changed
+ * retries.  Anything a lookup reads while the writer may be changing it is
+ * read and written with atomic accesses.
+ *
+ * Old indexes and slab arrays are retired rather than freed, since lookups
+ * may still be reading them.  Each lookup counts itself in its thread's
+ * stripe under the current phase.  Memory retired during a phase is freed
+ * once the phase has been flipped and its count has drained to zero; the
+ * phase is only flipped once the other phase has drained, so no lookup from
+ * before the previous flip can still be running.
+ */
+#define MAXHASH_READER_STRIPES 64
+
+struct maxhash_reader_stripe {
+	uint64_t active[2];
+} __attribute__((aligned(CACHE_LINE_BYTES)));
+
+struct maxhash_retired {
+	void **ptrs;
+	size_t num;
+	size_t capacity;
+};
+
+struct maxhash_read_state {
+	uint32_t seq;
+	unsigned phase;
+	struct maxhash_retired retired[2];
+	struct maxhash_reader_stripe stripes[MAXHASH_READER_STRIPES];
+};
+
+/*
+ * Each internal table stores its entries as fixed-stride records in an arena
+ * of cache-line-aligned slabs.  A record consists of a maxhash_entry header,
+ * followed by the key and then the value.  Slabs are never moved or freed
+ * until the table is freed; clearing the table just rewinds the arena and
+ * moves to a new bucket generation, so it takes constant time.
+ *
+ * Buckets are doubly-linked lists of entry IDs threaded through the headers,
+ * which preserves the bucket semantics required to build the perfect hash.  A
+ * bucket whose generation differs from that of the table is empty.  Tables
+ * with hash-derived buckets (is_indexed) additionally keep an open-addressing
+ * index from key to entry ID, so lookups do not have to walk long bucket
+ * chains.  The index grows with the table rather than with its buckets, and
+ * is rehashed incrementally: when it doubles, the previous index is kept as
+ * "old_index" and its slots are moved across a few at a time by later
+ * inserts, while lookups probe both.
+ */
 struct maxhash_internal_table {
 	struct maxhash_internal_table_params iparams;
 	const struct maxhash_table *table;
 	struct maxhash_bucket *buckets;
+	uint32_t generation;
 	size_t num_entries;
+
+	uint8_t **slabs;
+	size_t num_slabs;
+	unsigned slab_shift;
+	size_t entry_stride;
+	size_t value_offset;
+	uint32_t entries_used;
+	uint32_t free_list;
+
+	struct maxhash_index_slot *index;
+	size_t index_mask;
+	unsigned index_bits;
+	struct maxhash_index_slot *old_index;
+	size_t old_index_mask;
+	size_t migrate_pos;
+
+	struct maxhash_read_state *read_state;
+
+	struct maxhash_mem_image image;
+};
+
+/* One of the engines that a table with hardware backing is committed to. */
+struct maxhash_replica {
+	struct maxhash_engine_state *es;
+	void (*mem_access_fn)(void *arg, bool is_read, size_t base_address_bursts,
+			void *data, size_t data_size_bursts);
+	void *mem_access_fn_arg;
 };
 
 struct maxhash_table_params {
@@ -60,24 +209,37 @@ struct maxhash_table_params {
 	struct maxhash_engine_state *engine_state;
 	size_t key_width_bits;
 	size_t key_width_bytes;
-	void (*mem_access_fn)(void *arg, bool is_read, size_t base_address_bursts,
-			void *data, size_t data_size_bursts);
-	void *mem_access_fn_arg;
+	struct maxhash_replica replicas[MAXHASH_MAX_REPLICAS];
+	size_t num_replicas;
 	struct maxhash_internal_table_params values;
 	struct maxhash_internal_table_params intermediate;
+	/* The memory of each way of a collision-handling table, which has
+	 * max_bucket_entries of them.  "values" gives their common geometry and
+	 * has no memory of its own. */
+	struct maxhash_internal_table_params ways[MAXHASH_MAX_WAYS];
+	size_t num_threads;
+	bool incremental_puts;
+	bool concurrent_reads;
 	bool debug;
 };
 
+/* Header of an entry record.  The key and the value follow the header. */
 struct maxhash_entry {
-	void *key;
-	void *value;
+	uint32_t hash;
+	uint32_t bucket_id;
+	uint32_t next;
+	uint32_t prev;
+	bool in_use;
 	bool flags[NUM_ENTRY_FLAGS];
-	struct maxhash_entry *next;
 };
 
+#define ENTRY_HEADER_BYTES ((sizeof(struct maxhash_entry) + 7) & ~(size_t)7)
+
 struct maxhash_bucket {
-	size_t num_keys;
-	struct maxhash_entry *entry_list;
+	uint32_t num_keys;
+	uint32_t generation;
+	uint32_t head;
+	uint32_t tail;
 };
 
 struct maxhash_table {
@@ -87,34 +249,239 @@ struct maxhash_table {
 	struct maxhash_internal_table intermediate;
 	struct maxhash_internal_table values;
 	bool load_buffer_select;
+
+	/* The ways of a collision-handling table.  Each bucket of a way holds at
+	 * most one key, in one of the buckets its hash picks in the ways. */
+	struct maxhash_internal_table ways[MAXHASH_MAX_WAYS];
+
+	/* State of the perfect hash tables (or of the ways) between commits. */
+	bool perfect_built;
+	size_t values_free_hint;
+	size_t values_vacated;
+
+	/* Asynchronous commit in progress, and the keys removed since it began,
+	 * which leave the perfect hash tables once it completes. */
+	struct maxhash_commit *pending_commit;
+	struct maxhash_internal_table removed;
+
+	/* Statistics of the last commit, and who to give them to. */
+	maxhash_stats_t stats;
+	maxhash_stats_fn_t stats_fn;
+	void *stats_fn_arg;
+
+	/* Scheduler holding writes and a buffer switch for this table that have
+	 * not been flushed yet. */
+	struct maxhash_scheduler *scheduler;
+};
+
+/*
+ * An asynchronous commit works on "snapshot", which holds a copy of the
+ * software table, the recent table as it was when the commit began and the
+ * perfect hash tables, which are handed back to "table" when it completes.
+ * "table" is NULL once that has happened.
+ */
+struct maxhash_commit {
+	maxhash_table_t *table;
+	struct maxhash_table snapshot;
+	pthread_t thread;
+	bool has_thread;
+	pthread_mutex_t lock;
+	bool done;
+	maxhash_err_t err;
 };
 
 struct maxhash_entry_iterator {
 	const struct maxhash_internal_table *itable;
-	size_t bucket_id;
-	struct maxhash_entry *entry;
-	struct maxhash_entry *next;
+	uint32_t entry_id;
+	uint32_t next_id;
 };
 
 typedef struct maxhash_internal_table        maxhash_internal_table_t;
 typedef struct maxhash_internal_table_params maxhash_internal_table_params_t;
 typedef struct maxhash_entry                 maxhash_entry_t;
 typedef struct maxhash_bucket                maxhash_bucket_t;
+typedef struct maxhash_index_slot            maxhash_index_slot_t;
+typedef struct maxhash_mem_image             maxhash_mem_image_t;
 typedef enum   maxhash_mem_type              maxhash_mem_type_t;
 
 
 
+static inline maxhash_entry_t *maxhash_entry_get(
+		const maxhash_internal_table_t *itable, uint32_t entry_id)
+{
+	size_t slab_mask = ((size_t)1 << itable->slab_shift) - 1;
+	return (maxhash_entry_t *)(itable->slabs[entry_id >> itable->slab_shift] +
+			(entry_id & slab_mask) * itable->entry_stride);
+}
+
+/* Read-only view of a bucket.  Buckets from earlier generations read as empty. */
+static inline const maxhash_bucket_t *maxhash_bucket_peek(
+		const maxhash_internal_table_t *itable, size_t bucket_id)
+{
+	static const maxhash_bucket_t empty_bucket;
+	const maxhash_bucket_t *bucket = &itable->buckets[bucket_id];
+	return bucket->generation == itable->generation ? bucket : &empty_bucket;
+}
+
+static inline void *maxhash_entry_key(const maxhash_entry_t *entry)
+{
+	return (uint8_t *)entry + ENTRY_HEADER_BYTES;
+}
+
+static inline void *maxhash_entry_value(const maxhash_internal_table_t *itable,
+		const maxhash_entry_t *entry)
+{
+	return (uint8_t *)entry + itable->value_offset;
+}
+
+/* The number of ways of a collision-handling table, or zero for others. */
+static inline size_t maxhash_num_ways(const maxhash_table_params_t *tparams)
+{
+	return tparams->max_bucket_entries > 1 ? tparams->max_bucket_entries : 0;
+}
+
+
 /**
  * Create a minimal perfect hash table.
  */
 maxhash_err_t maxhash_create_mph(maxhash_table_t *source);
 
+/**
+ * Copy an item of "item_size_bytes" bytes to "padded_item", padded with zeros
+ * to "max_size_bytes", and point "item" at the copy.  Fails if the item has
+ * bits set beyond "max_size_bits".
+ */
+maxhash_err_t pad(const void **item, void *padded_item, size_t item_size_bytes,
+		size_t max_size_bits, size_t max_size_bytes, bool is_value);
+
+/**
+ * Hash a key for lookup in an internal table (Jenkins hash with parameter 0).
+ */
+uint32_t maxhash_internal_hash(const maxhash_internal_table_t *itable,
+		const void *key);
+
+/**
+ * Find the ID of the entry with the specified key in the specified bucket,
+ * or MAXHASH_NIL if there is no such entry.
+ */
+uint32_t maxhash_internal_lookup(const maxhash_internal_table_t *itable,
+		const void *key, uint32_t hash, size_t bucket_id);
+
+/**
+ * Print a message to stdout if debug mode is enabled for the table.
+ */
+void maxhash_debug_print(const maxhash_table_t *table, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/**
+ * Put a key-value pair in a specific bucket of an internal table.
+ */
+maxhash_err_t maxhash_internal_put_in_bucket(maxhash_internal_table_t *itable,
+		const void *key, const void *value, size_t bucket_id);
+
+/**
+ * Find the entry with the specified key in a specific bucket of an internal
+ * table (or the bucket's first entry, if "check_key" is false).
+ */
+maxhash_err_t maxhash_internal_get_entry_in_bucket(
+		const maxhash_internal_table_t *itable, bool check_key,
+		const void *key, maxhash_entry_t **entry, size_t bucket_id);
+
+/**
+ * Remove a key from an internal table, from the bucket its hash picks.
+ */
+maxhash_err_t maxhash_internal_remove(maxhash_internal_table_t *itable,
+		const void *key);
+
+/**
+ * Remove a key from a specific bucket of an internal table.
+ */
+maxhash_err_t maxhash_remove_from_bucket(maxhash_internal_table_t *itable,
+		const void *key, size_t bucket_id);
+
+/**
+ * Remove every entry from an internal table.
+ */
+maxhash_err_t maxhash_internal_clear(maxhash_internal_table_t *itable);
+
+/**
+ * Place the keys of a collision-handling table in its ways: every key after
+ * a clear, a load or a failed placement, or else those put since the last
+ * commit.  Fails if any key does not fit.
+ */
+maxhash_err_t maxhash_cuckoo_place(maxhash_table_t *table);
+
+/**
+ * Take a key out of the ways of a collision-handling table, if it has been
+ * placed there.  Returns true if a slot was vacated.
+ */
+bool maxhash_cuckoo_vacate(maxhash_table_t *table, const void *key);
+
+/**
+ * Wait for any asynchronous commit of a table to complete, and hand the
+ * perfect hash tables back to it.
+ */
+maxhash_err_t maxhash_internal_wait_for_commit(maxhash_table_t *table);
+
+/**
+ * Allocate the memory image of a table with hardware backing, if it does not
+ * have one yet.  Until written, every burst of both buffers is out of date.
+ */
+maxhash_err_t maxhash_internal_image_init(maxhash_internal_table_t *itable,
+		bool has_direct_flag);
+
+/**
+ * Write the perfect hash tables to the buffer that is being loaded, as they
+ * stand, and switch buffers, through a scheduler of its own that is flushed
+ * straight away.  This is a commit without the perfect hash build.
+ */
+maxhash_err_t maxhash_internal_write_tables(maxhash_table_t *table);
+
+/* Widest Jenkins chunk that the hardware hash and the C model agree on. */
+#define MAXHASH_JENKINS_MAX_CHUNK_BYTES 4
+
+/* Largest number of hashes computed in one step by any SIMD implementation. */
+#define MAXHASH_SIMD_MAX_LANES 16
+
+typedef enum {
+	MAXHASH_SIMD_SCALAR = 0,
+	MAXHASH_SIMD_AVX2,
+	MAXHASH_SIMD_AVX512
+} maxhash_simd_t;
+
 /**
  * Apply Jenkins' 32-bit "one-at-a-time" hash function.
  */
 uint32_t maxhash_function_jenkins(const void *data, size_t data_len, uint32_t
 		hash, size_t chunk_width);
 
+/**
+ * Compute hashes[i] = maxhash_function_jenkins(data[i], data_len,
+ * hashparams[i], chunk_width) for "n" keys at once, using the widest SIMD
+ * implementation that the CPU supports.  To hash one key under several
+ * parameters, repeat its pointer in "data".
+ */
+void maxhash_function_jenkins_multi(const void *const *data, size_t data_len,
+		const uint32_t *hashparams, size_t n, size_t chunk_width,
+		uint32_t *hashes);
+
+/**
+ * As maxhash_function_jenkins_multi(), but with an explicit implementation.
+ * Fails if the CPU does not support it.
+ */
+maxhash_err_t maxhash_function_jenkins_multi_simd(maxhash_simd_t simd,
+		const void *const *data, size_t data_len, const uint32_t *hashparams,
+		size_t n, size_t chunk_width, uint32_t *hashes);
+
+bool maxhash_simd_supported(maxhash_simd_t simd);
+
+/**
+ * The SIMD implementation used by maxhash_function_jenkins_multi(), and the
+ * number of hashes it computes per step.
+ */
+maxhash_simd_t maxhash_simd_level(void);
+size_t maxhash_simd_lanes(maxhash_simd_t simd);
+
 bool has_constant_uint64t(maxhash_engine_state_t *es,
 		const char *hash_table_name, const char *constant_name);
 bool has_constant_string(maxhash_engine_state_t *es,
@@ -132,16 +499,147 @@ int get_maxfile_global_constant(maxhash_engine_state_t *es,
 const char *get_maxfile_global_string_constant(maxhash_engine_state_t *es,
 		const char *constant_name);
 
+/*
+ * Mapped memory writes are batched into SLiC action sets of up to
+ * FMEM_LOAD_CHUNK_WORDS words (or MAXHASH_FMEM_CHUNK_WORDS from the
+ * environment).  A load that fits in one action set is run directly; larger
+ * loads are pipelined, keeping up to FMEM_LOADS_IN_FLIGHT action sets running
+ * while the next one is built.
+ */
+#define FMEM_LOAD_CHUNK_WORDS 4096
+#define FMEM_LOADS_IN_FLIGHT  2
+
+struct maxhash_fmem_loader {
+	maxhash_engine_state_t *es;
+	size_t chunk_words;
+	max_actions_t *actions;
+	size_t num_words;
+	bool pipelined;
+	max_actions_t *in_flight[FMEM_LOADS_IN_FLIGHT];
+	max_run_t *runs[FMEM_LOADS_IN_FLIGHT];
+	size_t num_in_flight;
+	size_t next_slot;
+};
+
+typedef struct maxhash_fmem_loader maxhash_fmem_loader_t;
+
+void maxhash_fmem_loader_init(maxhash_fmem_loader_t *loader,
+		maxhash_engine_state_t *es);
+
+void maxhash_fmem_load(maxhash_fmem_loader_t *loader, const char *kernel_name,
+		const char *mem_name, size_t base_entry, const void *data,
+		size_t data_size_bytes);
+
+/* Start running the writes queued so far, without waiting for them. */
+void maxhash_fmem_loader_start(maxhash_fmem_loader_t *loader);
+
+/* Run any remaining writes and wait for all of them to complete. */
+void maxhash_fmem_loader_finish(maxhash_fmem_loader_t *loader);
+
 void maxhash_write_fmem(maxhash_engine_state_t *es, const char *kernel_name,
 		const char *mem_name, size_t base_entry, void *data_buf, size_t
 		data_size_bytes);
 
-void maxhash_write_deep_fmem(maxhash_engine_state_t *es, const char
-		*kernel_name, const char *mem_name, void *data, size_t
-		data_size_bytes);
+/*
+ * Deep FMem loads share the DeepFMemWriteCPUData stream, and each entry on it
+ * carries the ID of the Deep FMem it is for.  A loader collects the loads of
+ * a commit and streams them back to back, then waits for the <mem>_LoadCount
+ * counter of every memory to advance, reading all of them with a single
+ * action set that is re-run until the loads are complete.
+ *
+ * Every memory the stream is routed to reads it in entries of its own width,
+ * so only loads with entries of the same width are streamed together.
+ */
+#define DEEP_FMEM_MAX_LOADS     16
+#define DEEP_FMEM_LOADS_UNKNOWN UINT64_MAX
+
+struct maxhash_deep_fmem_load {
+	const char *kernel_name;
+	char count_name[NAME_BUF_LEN];
+	uint8_t deep_fmem_id;
+	const void *data;
+	size_t data_size_bytes;
+	size_t entry_size_bytes;
+	uint64_t *load_count;
+	double *load_seconds;
+	uint64_t observed_count;
+	max_actions_t *actions;
+	max_run_t *run;
+	bool started;
+	bool complete;
+};
+
+struct maxhash_deep_fmem_loader {
+	maxhash_engine_state_t *es;
+	struct maxhash_deep_fmem_load loads[DEEP_FMEM_MAX_LOADS];
+	size_t num_loads;
+};
+
+typedef struct maxhash_deep_fmem_loader maxhash_deep_fmem_loader_t;
+
+void maxhash_deep_fmem_loader_init(maxhash_deep_fmem_loader_t *loader,
+		maxhash_engine_state_t *es);
+
+/*
+ * Queue a load of a whole Deep FMem, made of entries of "entry_size_bytes"
+ * bytes (including the ID).  "load_count" holds the number of loads of the
+ * memory completed so far, or DEEP_FMEM_LOADS_UNKNOWN, and is updated when
+ * the load completes; "load_seconds" receives the time the load took.
+ * The data must stay valid until maxhash_deep_fmem_loader_finish() returns.
+ */
+maxhash_err_t maxhash_deep_fmem_load(maxhash_deep_fmem_loader_t *loader,
+		const char *kernel_name, const char *mem_name, uint8_t deep_fmem_id,
+		const void *data, size_t data_size_bytes, size_t entry_size_bytes,
+		uint64_t *load_count, double *load_seconds);
+
+/* Stream all the queued loads and wait for all of them to complete. */
+void maxhash_deep_fmem_loader_finish(maxhash_deep_fmem_loader_t *loader);
 
-void maxhash_init_deep_fmem_fanout(maxhash_engine_state_t *es, uint8_t
-		deep_fmem_id);
+/*
+ * Writes queued by tables on the same engines, which are run together when
+ * the scheduler is flushed: on each engine, FMem writes share the loader's
+ * action sets, and Deep FMem loads are streamed together.  Only once all of
+ * them are complete on every engine are the tables' buffers switched, in one
+ * action set per engine.  A table's buffer switch is queued with its writes,
+ * and "report" is set for tables whose statistics are passed on by the flush.
+ * Every Deep FMem on an engine has its own ID, so the tables of a scheduler
+ * have at most DEEP_FMEM_MAX_LOADS Deep FMem loads between them.
+ *
+ * LMem writes are held as the address and extent of the data in the table's
+ * memory image, which is left alone until the flush.
+ */
+#define MAXHASH_SCHEDULER_MAX_TABLES 16
+
+struct maxhash_scheduled_table {
+	struct maxhash_table *table;
+	bool report;
+};
+
+struct maxhash_lmem_write {
+	const struct maxhash_replica *replica;
+	size_t base_address_bursts;
+	void *data;
+	size_t data_size_bursts;
+};
+
+/* The writes to one engine, which a flush runs on a thread of its own. */
+struct maxhash_engine_queue {
+	maxhash_engine_state_t *es;
+	maxhash_fmem_loader_t fmem_loader;
+	maxhash_deep_fmem_loader_t deep_loader;
+	struct maxhash_lmem_write *lmem_writes;
+	size_t num_lmem_writes;
+	size_t lmem_writes_capacity;
+	pthread_t thread;
+	double transfer_seconds;
+};
+
+struct maxhash_scheduler {
+	struct maxhash_engine_queue queues[MAXHASH_MAX_REPLICAS];
+	size_t num_engines;
+	struct maxhash_scheduled_table tables[MAXHASH_SCHEDULER_MAX_TABLES];
+	size_t num_tables;
+};
 
 #ifdef __cplusplus
 }
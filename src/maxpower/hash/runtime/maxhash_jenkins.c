@@ -0,0 +1,345 @@
+/*
+ * maxhash_jenkins.c
+ *
+ * Jenkins' 32-bit "one-at-a-time" hash, bit-exact with
+ * src/maxpower/hash/functions/JenkinsHash.maxj.  The key is split into chunks
+ * of chunk_width bytes, least significant chunk first, and the last chunk is
+ * zero-padded at its most significant end, exactly as the hardware pads the
+ * key.
+ *
+ * Besides the scalar function, several hashes can be computed at once with
+ * AVX2 (8 lanes) or AVX-512 (16 lanes) when the CPU supports them.
+ */
+
+#include "maxhash_internal.h"
+
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MAXHASH_JENKINS_X86
+#include <immintrin.h>
+#endif
+
+
+
+/*
+ * Read chunk "offset" of a key as an integer, zero-padding the bytes beyond
+ * the end of the key.
+ */
+static inline uint32_t jenkins_chunk(const uint8_t *data, size_t data_len,
+		size_t offset, size_t chunk_width)
+{
+	uint32_t value = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (offset + sizeof(value) <= data_len)
+	{
+		memcpy(&value, data + offset, sizeof(value));
+		return chunk_width < sizeof(value) ?
+			value & ((UINT32_C(1) << (chunk_width * 8)) - 1) : value;
+	}
+#endif
+
+	for (size_t octet = 0; octet < chunk_width; octet++)
+		if (offset + octet < data_len)
+			value += (uint32_t)data[offset + octet] << (octet * 8);
+
+	return value;
+}
+
+
+
+uint32_t maxhash_function_jenkins(const void *data, size_t data_len, uint32_t
+		hashparam, size_t chunk_width)
+{
+	bool debug = false;
+	uint32_t hash = hashparam;
+
+	if (debug) printf("key: %*s\n", (int)data_len, (char *)data);
+	if (debug) printf("param: %x\n", hashparam);
+	if (debug) printf("data_len: %lx\n", data_len);
+
+	for (size_t chunk = 0; chunk < data_len; chunk += chunk_width)
+	{
+		hash += jenkins_chunk(data, data_len, chunk, chunk_width);
+		hash += hash << 10;
+		hash ^= hash >> 6;
+		if (debug) printf("hash: %x\n", hash);
+	}
+
+	hash += hash << 3;
+	hash ^= hash >> 11;
+	hash += hash << 15;
+
+	if (debug) printf("final hash: %x\n", hash);
+
+	return hash;
+}
+
+
+
+static void jenkins_multi_scalar(const void *const *data, size_t data_len,
+		const uint32_t *hashparams, size_t n, size_t chunk_width,
+		uint32_t *hashes)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		uint32_t hash = hashparams[i];
+
+		for (size_t chunk = 0; chunk < data_len; chunk += chunk_width)
+		{
+			hash += jenkins_chunk(data[i], data_len, chunk, chunk_width);
+			hash += hash << 10;
+			hash ^= hash >> 6;
+		}
+
+		hash += hash << 3;
+		hash ^= hash >> 11;
+		hash += hash << 15;
+		hashes[i] = hash;
+	}
+}
+
+
+
+#ifdef MAXHASH_JENKINS_X86
+
+/*
+ * When every lane hashes the same key (under different parameters), each chunk
+ * is read once and broadcast.
+ */
+static inline bool lanes_share_key(const void *const *data, size_t lanes)
+{
+	for (size_t lane = 1; lane < lanes; lane++)
+		if (data[lane] != data[0])
+			return false;
+	return true;
+}
+
+
+
+__attribute__((target("avx2")))
+static void jenkins_multi_avx2(const void *const *data, size_t data_len,
+		const uint32_t *hashparams, size_t n, size_t chunk_width,
+		uint32_t *hashes)
+{
+	const size_t lanes = 8;
+	size_t i = 0;
+
+	for (; i + lanes <= n; i += lanes)
+	{
+		__m256i hash = _mm256_loadu_si256((const __m256i *)&hashparams[i]);
+		bool same_key = lanes_share_key(data + i, lanes);
+
+		for (size_t chunk = 0; chunk < data_len; chunk += chunk_width)
+		{
+			uint32_t values[8];
+			if (same_key)
+				hash = _mm256_add_epi32(hash, _mm256_set1_epi32(jenkins_chunk(
+								data[i], data_len, chunk, chunk_width)));
+			else
+			{
+				for (size_t lane = 0; lane < lanes; lane++)
+					values[lane] = jenkins_chunk(data[i + lane], data_len,
+							chunk, chunk_width);
+				hash = _mm256_add_epi32(hash,
+						_mm256_loadu_si256((const __m256i *)values));
+			}
+			hash = _mm256_add_epi32(hash, _mm256_slli_epi32(hash, 10));
+			hash = _mm256_xor_si256(hash, _mm256_srli_epi32(hash, 6));
+		}
+
+		hash = _mm256_add_epi32(hash, _mm256_slli_epi32(hash, 3));
+		hash = _mm256_xor_si256(hash, _mm256_srli_epi32(hash, 11));
+		hash = _mm256_add_epi32(hash, _mm256_slli_epi32(hash, 15));
+		_mm256_storeu_si256((__m256i *)&hashes[i], hash);
+	}
+
+	jenkins_multi_scalar(data + i, data_len, hashparams + i, n - i,
+			chunk_width, hashes + i);
+}
+
+
+
+__attribute__((target("avx512f")))
+static void jenkins_multi_avx512(const void *const *data, size_t data_len,
+		const uint32_t *hashparams, size_t n, size_t chunk_width,
+		uint32_t *hashes)
+{
+	const size_t lanes = 16;
+	size_t i = 0;
+
+	for (; i + lanes <= n; i += lanes)
+	{
+		__m512i hash = _mm512_loadu_si512(&hashparams[i]);
+		bool same_key = lanes_share_key(data + i, lanes);
+
+		for (size_t chunk = 0; chunk < data_len; chunk += chunk_width)
+		{
+			uint32_t values[16];
+			if (same_key)
+				hash = _mm512_add_epi32(hash, _mm512_set1_epi32(jenkins_chunk(
+								data[i], data_len, chunk, chunk_width)));
+			else
+			{
+				for (size_t lane = 0; lane < lanes; lane++)
+					values[lane] = jenkins_chunk(data[i + lane], data_len,
+							chunk, chunk_width);
+				hash = _mm512_add_epi32(hash, _mm512_loadu_si512(values));
+			}
+			hash = _mm512_add_epi32(hash, _mm512_slli_epi32(hash, 10));
+			hash = _mm512_xor_si512(hash, _mm512_srli_epi32(hash, 6));
+		}
+
+		hash = _mm512_add_epi32(hash, _mm512_slli_epi32(hash, 3));
+		hash = _mm512_xor_si512(hash, _mm512_srli_epi32(hash, 11));
+		hash = _mm512_add_epi32(hash, _mm512_slli_epi32(hash, 15));
+		_mm512_storeu_si512(&hashes[i], hash);
+	}
+
+	jenkins_multi_avx2(data + i, data_len, hashparams + i, n - i,
+			chunk_width, hashes + i);
+}
+
+#endif
+
+
+
+bool maxhash_simd_supported(maxhash_simd_t simd)
+{
+	switch (simd)
+	{
+		case MAXHASH_SIMD_SCALAR:
+			return true;
+#ifdef MAXHASH_JENKINS_X86
+		case MAXHASH_SIMD_AVX2:
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2");
+		case MAXHASH_SIMD_AVX512:
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx512f") &&
+				__builtin_cpu_supports("avx2");
+#endif
+		default:
+			return false;
+	}
+}
+
+
+
+/*
+ * Pick the widest implementation supported by the CPU.  Setting the
+ * MAXHASH_SIMD environment variable to "scalar", "avx2" or "avx512" caps the
+ * choice.
+ */
+static maxhash_simd_t detect_simd(void)
+{
+	maxhash_simd_t limit = MAXHASH_SIMD_AVX512;
+	const char *env = getenv("MAXHASH_SIMD");
+
+	if (env != NULL && !strcmp(env, "scalar"))
+		limit = MAXHASH_SIMD_SCALAR;
+	else if (env != NULL && !strcmp(env, "avx2"))
+		limit = MAXHASH_SIMD_AVX2;
+
+	for (maxhash_simd_t simd = limit; simd > MAXHASH_SIMD_SCALAR; simd--)
+		if (maxhash_simd_supported(simd))
+			return simd;
+
+	return MAXHASH_SIMD_SCALAR;
+}
+
+
+
+maxhash_simd_t maxhash_simd_level(void)
+{
+	/* Detection is idempotent, so racing threads at worst repeat it. */
+	static int level = -1;
+	int cached = __atomic_load_n(&level, __ATOMIC_RELAXED);
+
+	if (cached < 0)
+	{
+		cached = detect_simd();
+		__atomic_store_n(&level, cached, __ATOMIC_RELAXED);
+	}
+
+	return cached;
+}
+
+
+
+size_t maxhash_simd_lanes(maxhash_simd_t simd)
+{
+	switch (simd)
+	{
+		case MAXHASH_SIMD_AVX2:
+			return 8;
+		case MAXHASH_SIMD_AVX512:
+			return 16;
+		default:
+			return 1;
+	}
+}
+
+
+
+static void jenkins_multi(maxhash_simd_t simd, const void *const *data,
+		size_t data_len, const uint32_t *hashparams, size_t n,
+		size_t chunk_width, uint32_t *hashes)
+{
+	switch (simd)
+	{
+#ifdef MAXHASH_JENKINS_X86
+		case MAXHASH_SIMD_AVX2:
+			jenkins_multi_avx2(data, data_len, hashparams, n, chunk_width,
+					hashes);
+			break;
+		case MAXHASH_SIMD_AVX512:
+			jenkins_multi_avx512(data, data_len, hashparams, n, chunk_width,
+					hashes);
+			break;
+#endif
+		default:
+			jenkins_multi_scalar(data, data_len, hashparams, n, chunk_width,
+					hashes);
+			break;
+	}
+}
+
+
+
+maxhash_err_t maxhash_function_jenkins_multi_simd(maxhash_simd_t simd,
+		const void *const *data, size_t data_len, const uint32_t *hashparams,
+		size_t n, size_t chunk_width, uint32_t *hashes)
+{
+	if (chunk_width < 1 || chunk_width > MAXHASH_JENKINS_MAX_CHUNK_BYTES)
+	{
+		fprintf(stderr, "Error: Jenkins chunk width of %zu bytes is not "
+				"supported.\n", chunk_width);
+		return MAXHASH_ERR_ERR;
+	}
+
+	if (!maxhash_simd_supported(simd))
+	{
+		fprintf(stderr, "Error: SIMD level %d is not supported by this "
+				"CPU.\n", simd);
+		return MAXHASH_ERR_ERR;
+	}
+
+	jenkins_multi(simd, data, data_len, hashparams, n, chunk_width, hashes);
+	return MAXHASH_ERR_OK;
+}
+
+
+
+void maxhash_function_jenkins_multi(const void *const *data, size_t data_len,
+		const uint32_t *hashparams, size_t n, size_t chunk_width,
+		uint32_t *hashes)
+{
+	assert(chunk_width >= 1 && chunk_width <= MAXHASH_JENKINS_MAX_CHUNK_BYTES);
+	jenkins_multi(maxhash_simd_level(), data, data_len, hashparams, n,
+			chunk_width, hashes);
+}
@@ -0,0 +1,326 @@
+/*
+ * maxhash_shard.c
+ *
+ * One logical table whose keys are split between several hash tables, so
+ * that it can hold more keys than fit in one hardware instance.  Each key is
+ * kept in the shard picked by a hash of the key that a kernel can compute
+ * too, and only the shards that have changed are committed.
+ */
+
+#include "maxhash_internal.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_SCHEDULER SIZE_MAX
+
+/*
+ * Shards on the same engines share a scheduler, so scheduler_ids[i] is the
+ * index in "schedulers" of the one for shard "i", or NO_SCHEDULER for a
+ * software-only shard.
+ */
+struct maxhash_sharded_table {
+	maxhash_table_t **shards;
+	size_t num_shards;
+	bool *changed;
+	size_t *scheduler_ids;
+	maxhash_scheduler_t **schedulers;
+	size_t num_schedulers;
+};
+
+
+
+/* Whether two tables are on the same engines, in the same order. */
+static bool same_engines(const maxhash_table_t *first,
+		const maxhash_table_t *second)
+{
+	if (first->tparams.num_replicas != second->tparams.num_replicas)
+		return false;
+	for (size_t r = 0; r < first->tparams.num_replicas; r++)
+		if (first->tparams.replicas[r].es != second->tparams.replicas[r].es)
+			return false;
+	return true;
+}
+
+
+
+static void sharded_free(maxhash_sharded_table_t *sharded)
+{
+	for (size_t s = 0; s < sharded->num_schedulers; s++)
+		maxhash_scheduler_free(sharded->schedulers[s]);
+	free(sharded->schedulers);
+	free(sharded->scheduler_ids);
+	free(sharded->changed);
+	free(sharded->shards);
+	free(sharded);
+}
+
+
+
+/* Give a shard the scheduler of an earlier shard on the same engines, or a
+ * new one. */
+static maxhash_err_t assign_scheduler(maxhash_sharded_table_t *sharded,
+		size_t shard)
+{
+	const maxhash_table_t *table = sharded->shards[shard];
+
+	sharded->scheduler_ids[shard] = NO_SCHEDULER;
+	if (table->tparams.num_replicas == 0)
+		return MAXHASH_ERR_OK;
+
+	for (size_t i = 0; i < shard; i++)
+		if (sharded->scheduler_ids[i] != NO_SCHEDULER &&
+				same_engines(sharded->shards[i], table))
+		{
+			sharded->scheduler_ids[shard] = sharded->scheduler_ids[i];
+			return MAXHASH_ERR_OK;
+		}
+
+	maxhash_engine_state_t *engine_states[MAXHASH_MAX_REPLICAS];
+	for (size_t r = 0; r < table->tparams.num_replicas; r++)
+		engine_states[r] = table->tparams.replicas[r].es;
+
+	maxhash_scheduler_t **scheduler =
+		&sharded->schedulers[sharded->num_schedulers];
+	if (maxhash_scheduler_init_replicated(scheduler, engine_states,
+				table->tparams.num_replicas) != MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+
+	sharded->scheduler_ids[shard] = sharded->num_schedulers++;
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_sharded_table_init(maxhash_sharded_table_t **sharded,
+		maxhash_table_t **shards, size_t num_shards)
+{
+	*sharded = NULL;
+
+	if (num_shards == 0)
+	{
+		fprintf(stderr, "Error: a sharded table needs at least one shard.\n");
+		return MAXHASH_ERR_ERR;
+	}
+
+	for (size_t i = 1; i < num_shards; i++)
+		if (shards[i]->tparams.key_width_bits !=
+				shards[0]->tparams.key_width_bits ||
+				shards[i]->tparams.jenkins_chunk_width_bytes !=
+				shards[0]->tparams.jenkins_chunk_width_bytes)
+		{
+			fprintf(stderr, "Error: shard %zu has a different key width or "
+					"Jenkins chunk width from shard 0.\n", i);
+			return MAXHASH_ERR_ERR;
+		}
+
+	maxhash_sharded_table_t *s = calloc(1, sizeof(maxhash_sharded_table_t));
+	if (s != NULL)
+	{
+		s->shards = malloc(num_shards * sizeof(maxhash_table_t *));
+		s->changed = calloc(num_shards, sizeof(bool));
+		s->scheduler_ids = calloc(num_shards, sizeof(size_t));
+		s->schedulers = calloc(num_shards, sizeof(maxhash_scheduler_t *));
+	}
+	if (s == NULL || s->shards == NULL || s->changed == NULL ||
+			s->scheduler_ids == NULL || s->schedulers == NULL)
+	{
+		fprintf(stderr, "Error: failed to allocate sharded table.\n");
+		if (s != NULL)
+			sharded_free(s);
+		return MAXHASH_ERR_ERR;
+	}
+
+	memcpy(s->shards, shards, num_shards * sizeof(maxhash_table_t *));
+	s->num_shards = num_shards;
+
+	for (size_t i = 0; i < num_shards; i++)
+		if (assign_scheduler(s, i) != MAXHASH_ERR_OK)
+		{
+			sharded_free(s);
+			return MAXHASH_ERR_ERR;
+		}
+
+	*sharded = s;
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_sharded_free(maxhash_sharded_table_t *sharded)
+{
+	maxhash_err_t err = MAXHASH_ERR_OK;
+
+	/* Anything still queued is written before the shards go. */
+	for (size_t s = 0; s < sharded->num_schedulers; s++)
+		err |= maxhash_scheduler_flush(sharded->schedulers[s]);
+	for (size_t i = 0; i < sharded->num_shards; i++)
+		err |= maxhash_free(sharded->shards[i]);
+
+	sharded_free(sharded);
+	return err;
+}
+
+
+
+maxhash_err_t maxhash_sharded_shard_of(const maxhash_sharded_table_t *sharded,
+		const void *key, size_t key_len, size_t *shard)
+{
+	const maxhash_table_params_t *tparams = &sharded->shards[0]->tparams;
+	uint8_t key_padded[tparams->key_width_bytes];
+
+	if (pad(&key, key_padded, key_len, tparams->key_width_bits,
+				tparams->key_width_bytes, false) != MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+
+	uint32_t hash = maxhash_function_jenkins(key, tparams->key_width_bytes,
+			MAXHASH_SHARD_HASH_PARAM, tparams->jenkins_chunk_width_bytes);
+	*shard = ((uint64_t)hash * sharded->num_shards) >> 32;
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_sharded_get_shard(
+		const maxhash_sharded_table_t *sharded, size_t shard,
+		maxhash_table_t **table)
+{
+	if (shard >= sharded->num_shards)
+	{
+		fprintf(stderr, "Error: sharded table has no shard %zu.\n", shard);
+		return MAXHASH_ERR_ERR;
+	}
+
+	*table = sharded->shards[shard];
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_sharded_put(maxhash_sharded_table_t *sharded,
+		const void *key, size_t key_len, const void *value, size_t value_len)
+{
+	size_t shard;
+	if (maxhash_sharded_shard_of(sharded, key, key_len, &shard) !=
+			MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+
+	sharded->changed[shard] = true;
+	return maxhash_put(sharded->shards[shard], key, key_len, value,
+			value_len);
+}
+
+
+
+maxhash_err_t maxhash_sharded_get(const maxhash_sharded_table_t *sharded,
+		const void *key, size_t key_len, void *value)
+{
+	size_t shard;
+	if (maxhash_sharded_shard_of(sharded, key, key_len, &shard) !=
+			MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+
+	return maxhash_get(sharded->shards[shard], key, key_len, value);
+}
+
+
+
+maxhash_err_t maxhash_sharded_contains(const maxhash_sharded_table_t *sharded,
+		bool *present, const void *key, size_t key_len)
+{
+	size_t shard;
+	if (maxhash_sharded_shard_of(sharded, key, key_len, &shard) !=
+			MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+
+	return maxhash_contains(sharded->shards[shard], present, key, key_len);
+}
+
+
+
+maxhash_err_t maxhash_sharded_remove(maxhash_sharded_table_t *sharded,
+		const void *key, size_t key_len)
+{
+	size_t shard;
+	if (maxhash_sharded_shard_of(sharded, key, key_len, &shard) !=
+			MAXHASH_ERR_OK)
+		return MAXHASH_ERR_ERR;
+
+	maxhash_err_t err = maxhash_remove(sharded->shards[shard], key, key_len);
+	if (err == MAXHASH_ERR_OK)
+		sharded->changed[shard] = true;
+	return err;
+}
+
+
+
+maxhash_err_t maxhash_sharded_clear(maxhash_sharded_table_t *sharded)
+{
+	maxhash_err_t err = MAXHASH_ERR_OK;
+
+	for (size_t i = 0; i < sharded->num_shards; i++)
+	{
+		err |= maxhash_clear(sharded->shards[i]);
+		sharded->changed[i] = true;
+	}
+
+	return err;
+}
+
+
+
+maxhash_err_t maxhash_sharded_size(const maxhash_sharded_table_t *sharded,
+		size_t *size)
+{
+	*size = 0;
+
+	for (size_t i = 0; i < sharded->num_shards; i++)
+	{
+		size_t shard_size;
+		if (maxhash_size(sharded->shards[i], &shard_size) != MAXHASH_ERR_OK)
+			return MAXHASH_ERR_ERR;
+		*size += shard_size;
+	}
+
+	return MAXHASH_ERR_OK;
+}
+
+
+
+maxhash_err_t maxhash_sharded_commit(maxhash_sharded_table_t *sharded,
+		size_t *num_committed)
+{
+	maxhash_err_t err = MAXHASH_ERR_OK;
+	size_t committed = 0;
+
+	/* Each perfect hash is built as its shard is queued, and the writes of
+	 * shards on the same engines are run together. */
+	for (size_t i = 0; i < sharded->num_shards; i++)
+	{
+		if (!sharded->changed[i])
+			continue;
+
+		maxhash_err_t shard_err;
+		if (sharded->scheduler_ids[i] == NO_SCHEDULER)
+			shard_err = maxhash_commit(sharded->shards[i]);
+		else
+			shard_err = maxhash_commit_schedule(sharded->shards[i],
+					sharded->schedulers[sharded->scheduler_ids[i]]);
+
+		if (shard_err != MAXHASH_ERR_OK)
+			fprintf(stderr, "Error: failed to commit shard %zu.\n", i);
+		else
+			sharded->changed[i] = false;
+		err |= shard_err;
+		committed++;
+	}
+
+	for (size_t s = 0; s < sharded->num_schedulers; s++)
+		err |= maxhash_scheduler_flush(sharded->schedulers[s]);
+
+	if (num_committed != NULL)
+		*num_committed = committed;
+	return err;
+}
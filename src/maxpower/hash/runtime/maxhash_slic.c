@@ -5,14 +5,24 @@
  *      Author: tperry
  */
 
+/* glibc 2.20 and later warn about _BSD_SOURCE on its own; older ones only
+ * know it. */
+#define _DEFAULT_SOURCE
 #define _BSD_SOURCE
 
 #include "maxhash_internal.h"
 
+#include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <time.h>
+
+/* Maxfile constants are named after the kernel, the table and the memory, so
+ * their names can be much longer than any one of those. */
+#define CONSTANT_NAME_LEN 1024
 
 
 
@@ -20,15 +30,15 @@ bool has_constant_uint64t(maxhash_engine_state_t *es,
 		const char *hash_table_name,
 		const char *constant_name)
 {
-	char name_buf[NAME_BUF_LEN] = {0};
-	strncpy(name_buf, hash_table_name, NAME_BUF_LEN);
+	char name_buf[CONSTANT_NAME_LEN];
+	snprintf(name_buf, sizeof(name_buf), "%s%s", hash_table_name,
+			constant_name);
 
 	assert(max_ok(es->maxfile->errors));
 	bool has_constant = true;
 
 	max_errors_mode(es->maxfile->errors, 0);
-	max_get_constant_uint64t(es->maxfile, strcat(name_buf,
-			constant_name));
+	max_get_constant_uint64t(es->maxfile, name_buf);
 
 	if (!max_ok(es->maxfile->errors))
 	{
@@ -47,15 +57,15 @@ bool has_constant_string(maxhash_engine_state_t *es,
 		const char *hash_table_name,
 		const char *constant_name)
 {
-	char name_buf[NAME_BUF_LEN] = {0};
-	strncpy(name_buf, hash_table_name, NAME_BUF_LEN);
+	char name_buf[CONSTANT_NAME_LEN];
+	snprintf(name_buf, sizeof(name_buf), "%s%s", hash_table_name,
+			constant_name);
 
 	assert(max_ok(es->maxfile->errors));
 	bool has_constant = true;
 
 	max_errors_mode(es->maxfile->errors, 0);
-	max_get_constant_string(es->maxfile, strcat(name_buf,
-			constant_name));
+	max_get_constant_string(es->maxfile, name_buf);
 
 	if (!max_ok(es->maxfile->errors))
 	{
@@ -81,11 +91,11 @@ int get_maxfile_global_constant(maxhash_engine_state_t *es,
 int get_maxfile_constant(maxhash_engine_state_t *es,
 		const char *hash_table_name, const char *constant_name)
 {
-	char name_buf[NAME_BUF_LEN] = {0};
-	strncpy(name_buf, hash_table_name, NAME_BUF_LEN);
+	char name_buf[CONSTANT_NAME_LEN];
+	snprintf(name_buf, sizeof(name_buf), "%s%s", hash_table_name,
+			constant_name);
 
-	return (int)max_get_constant_uint64t(es->maxfile, strcat(name_buf,
-				constant_name));
+	return (int)max_get_constant_uint64t(es->maxfile, name_buf);
 }
 
 
@@ -93,24 +103,112 @@ int get_maxfile_constant(maxhash_engine_state_t *es,
 const char *get_maxfile_string_constant(maxhash_engine_state_t *es,
 		const char *hash_table_name, const char *constant_name)
 {
-	char name_buf[NAME_BUF_LEN] = {0};
-	strncpy(name_buf, hash_table_name, NAME_BUF_LEN);
+	char name_buf[CONSTANT_NAME_LEN];
+	snprintf(name_buf, sizeof(name_buf), "%s%s", hash_table_name,
+			constant_name);
 
-	return max_get_constant_string(es->maxfile, strcat(name_buf,
-				constant_name));
+	return max_get_constant_string(es->maxfile, name_buf);
 }
 
 
 
-void maxhash_init_deep_fmem_fanout(maxhash_engine_state_t *es,
-		uint8_t deep_fmem_id)
+void maxhash_fmem_loader_init(maxhash_fmem_loader_t *loader,
+		maxhash_engine_state_t *es)
 {
-	max_actions_t *actions = max_actions_init(es->maxfile, NULL);
-	char name_buf[NAME_BUF_LEN] = {0};
-	snprintf(name_buf, sizeof(name_buf), "%u", deep_fmem_id);
-	max_route(actions, "DeepFMemFanout", name_buf);
-	max_run(es->engine, actions);
-	max_actions_free(actions);
+	memset(loader, 0, sizeof(*loader));
+	loader->es = es;
+	loader->chunk_words = FMEM_LOAD_CHUNK_WORDS;
+
+	const char *env = getenv("MAXHASH_FMEM_CHUNK_WORDS");
+	if (env != NULL && strtoul(env, NULL, 0) > 0)
+		loader->chunk_words = strtoul(env, NULL, 0);
+}
+
+
+
+/* Wait for the oldest action set in flight to complete. */
+static void fmem_loader_retire(maxhash_fmem_loader_t *loader)
+{
+	size_t oldest = (loader->next_slot + FMEM_LOADS_IN_FLIGHT -
+			loader->num_in_flight) % FMEM_LOADS_IN_FLIGHT;
+
+	max_wait(loader->runs[oldest]);
+	max_actions_free(loader->in_flight[oldest]);
+	loader->num_in_flight--;
+}
+
+
+
+/* Start running the current action set without waiting for it. */
+static void fmem_loader_dispatch(maxhash_fmem_loader_t *loader)
+{
+	if (loader->num_in_flight == FMEM_LOADS_IN_FLIGHT)
+		fmem_loader_retire(loader);
+
+	size_t slot = loader->next_slot;
+	loader->in_flight[slot] = loader->actions;
+	loader->runs[slot] = max_run_nonblock(loader->es->engine,
+			loader->actions);
+	loader->next_slot = (slot + 1) % FMEM_LOADS_IN_FLIGHT;
+	loader->num_in_flight++;
+
+	loader->actions = NULL;
+	loader->num_words = 0;
+	loader->pipelined = true;
+}
+
+
+
+void maxhash_fmem_load(maxhash_fmem_loader_t *loader, const char *kernel_name,
+		const char *mem_name, size_t base_entry, const void *data,
+		size_t data_size_bytes)
+{
+	const uint64_t *words = data;
+
+	for (size_t entry = 0; entry < data_size_bytes / sizeof(uint64_t); entry++)
+	{
+		if (loader->actions == NULL)
+		{
+			loader->actions = max_actions_init(loader->es->maxfile, NULL);
+			max_disable_validation(loader->actions); /* Because we only set some
+			                                            mapped memories. */
+		}
+
+		max_set_mem_uint64t(loader->actions, kernel_name, mem_name,
+				base_entry + entry, words[entry]);
+
+		if (++loader->num_words == loader->chunk_words)
+			fmem_loader_dispatch(loader);
+	}
+}
+
+
+
+void maxhash_fmem_loader_start(maxhash_fmem_loader_t *loader)
+{
+	if (loader->actions != NULL)
+		fmem_loader_dispatch(loader);
+}
+
+
+
+void maxhash_fmem_loader_finish(maxhash_fmem_loader_t *loader)
+{
+	if (loader->actions != NULL)
+	{
+		/* Loads that fit in one action set are run directly. */
+		if (loader->pipelined)
+			fmem_loader_dispatch(loader);
+		else
+		{
+			max_run(loader->es->engine, loader->actions);
+			max_actions_free(loader->actions);
+			loader->actions = NULL;
+		}
+	}
+
+	while (loader->num_in_flight > 0)
+		fmem_loader_retire(loader);
 }
 
 
@@ -119,53 +217,193 @@ void maxhash_write_fmem(maxhash_engine_state_t *es, const char *kernel_name,
 		const char *mem_name, size_t base_entry, void *data,
 		size_t data_size_bytes)
 {
-	max_actions_t *actions = max_actions_init(es->maxfile, NULL);
+	maxhash_fmem_loader_t loader;
+	maxhash_fmem_loader_init(&loader, es);
+	maxhash_fmem_load(&loader, kernel_name, mem_name, base_entry, data,
+			data_size_bytes);
+	maxhash_fmem_loader_finish(&loader);
+}
+
+
+
+void maxhash_deep_fmem_loader_init(maxhash_deep_fmem_loader_t *loader,
+		maxhash_engine_state_t *es)
+{
+	memset(loader, 0, sizeof(*loader));
+	loader->es = es;
+}
 
-	for (size_t offset = 0; offset < data_size_bytes; offset +=
-			sizeof(uint64_t))
+
+
+maxhash_err_t maxhash_deep_fmem_load(maxhash_deep_fmem_loader_t *loader,
+		const char *kernel_name, const char *mem_name, uint8_t deep_fmem_id,
+		const void *data, size_t data_size_bytes, size_t entry_size_bytes,
+		uint64_t *load_count, double *load_seconds)
+{
+	if (loader->num_loads == DEEP_FMEM_MAX_LOADS)
 	{
-		size_t entry = offset / sizeof(uint64_t);
-		max_set_mem_uint64t(actions, kernel_name, mem_name, base_entry + entry,
-				((uint64_t *)data)[entry]);
+		fprintf(stderr, "Error: too many Deep FMem loads in one commit.\n");
+		return MAXHASH_ERR_ERR;
 	}
 
-	max_disable_validation(actions); /* Because we only set one mapped memory at
-	                                    a time. */
-	max_run(es->engine, actions);
-	max_actions_free(actions);
+	struct maxhash_deep_fmem_load *load = &loader->loads[loader->num_loads++];
+	memset(load, 0, sizeof(*load));
+	load->kernel_name = kernel_name;
+	snprintf(load->count_name, sizeof(load->count_name), "%s_LoadCount",
+			mem_name);
+	load->deep_fmem_id = deep_fmem_id;
+	load->data = data;
+	load->data_size_bytes = data_size_bytes;
+	load->entry_size_bytes = entry_size_bytes;
+	load->load_count = load_count;
+	load->load_seconds = load_seconds;
+
+	return MAXHASH_ERR_OK;
 }
 
 
 
-void maxhash_write_deep_fmem(maxhash_engine_state_t *es, const char
-		*kernel_name, const char *mem_name, void *data, size_t data_size_bytes)
+static double elapsed_seconds(const struct timespec *start)
 {
-	char mem_name_buf[NAME_BUF_LEN] = {0};
-	snprintf(mem_name_buf, sizeof(mem_name_buf), "%s_Complete", mem_name);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
 
-	//printf("Loading %zu bytes.\n", data_size_bytes);
 
-	max_actions_t *actions = max_actions_init(es->maxfile, NULL);
+/*
+ * Read the load counters of the loads that satisfy "unknown_only" and, if
+ * "entry_size_bytes" is not zero, have entries of that size.
+ */
+static max_actions_t *deep_fmem_read_counts(maxhash_deep_fmem_loader_t *loader,
+		bool unknown_only, size_t entry_size_bytes)
+{
+	max_actions_t *actions = max_actions_init(loader->es->maxfile, NULL);
 	max_disable_validation(actions);
-	max_queue_input(actions, "DeepFMemWriteCPUData", data, data_size_bytes);
-	max_run(es->engine, actions);
-	max_actions_free(actions);
 
-	uint64_t complete = 0;
-	while (!complete)
+	for (size_t i = 0; i < loader->num_loads; i++)
+	{
+		struct maxhash_deep_fmem_load *load = &loader->loads[i];
+		if ((!unknown_only || *load->load_count == DEEP_FMEM_LOADS_UNKNOWN) &&
+				(entry_size_bytes == 0 ||
+				 load->entry_size_bytes == entry_size_bytes))
+			max_get_mem_uint64t(actions, load->kernel_name, load->count_name,
+					0, &load->observed_count);
+	}
+
+	return actions;
+}
+
+
+
+/*
+ * Stream the loads with entries of "entry_size_bytes" and wait for them to
+ * complete.  Every one of them is routed to all of their memories, so that
+ * the fanout does not have to be switched while data is still in flight.
+ */
+static void deep_fmem_load_group(maxhash_deep_fmem_loader_t *loader,
+		size_t entry_size_bytes, const struct timespec *start)
+{
+	size_t num_loads = 0;
+
+	for (size_t i = 0; i < loader->num_loads; i++)
+	{
+		struct maxhash_deep_fmem_load *load = &loader->loads[i];
+		if (load->entry_size_bytes != entry_size_bytes)
+			continue;
+
+		load->actions = max_actions_init(loader->es->maxfile, NULL);
+		max_disable_validation(load->actions);
+
+		for (size_t j = 0; j < loader->num_loads; j++)
+		{
+			if (loader->loads[j].entry_size_bytes != entry_size_bytes)
+				continue;
+
+			char name_buf[NAME_BUF_LEN] = {0};
+			snprintf(name_buf, sizeof(name_buf), "%u",
+					loader->loads[j].deep_fmem_id);
+			max_route(load->actions, "DeepFMemFanout", name_buf);
+		}
+
+		max_queue_input(load->actions, "DeepFMemWriteCPUData", load->data,
+				load->data_size_bytes);
+		load->run = max_run_nonblock(loader->es->engine, load->actions);
+		load->started = true;
+		num_loads++;
+	}
+
+	for (size_t i = 0; i < loader->num_loads; i++)
+	{
+		struct maxhash_deep_fmem_load *load = &loader->loads[i];
+		if (load->entry_size_bytes == entry_size_bytes)
+		{
+			max_wait(load->run);
+			max_actions_free(load->actions);
+		}
+	}
+
+	/* Each memory's counter advances once it has taken its last entry. */
+	max_actions_t *poll = deep_fmem_read_counts(loader, false,
+			entry_size_bytes);
+	size_t num_complete = 0;
+
+	while (num_complete < num_loads)
+	{
+		max_run(loader->es->engine, poll);
+
+		for (size_t i = 0; i < loader->num_loads; i++)
+		{
+			struct maxhash_deep_fmem_load *load = &loader->loads[i];
+			if (load->entry_size_bytes == entry_size_bytes &&
+					!load->complete &&
+					load->observed_count != *load->load_count)
+			{
+				load->complete = true;
+				*load->load_count = load->observed_count;
+				*load->load_seconds = elapsed_seconds(start);
+				num_complete++;
+			}
+		}
+
+		if (num_complete < num_loads)
+			usleep(10);
+	}
+
+	max_actions_free(poll);
+}
+
+
+
+void maxhash_deep_fmem_loader_finish(maxhash_deep_fmem_loader_t *loader)
+{
+	if (loader->num_loads == 0)
+		return;
+
+	/* Find out where the counters of memories not loaded before stand. */
+	bool any_unknown = false;
+	for (size_t i = 0; i < loader->num_loads; i++)
+		any_unknown |= *loader->loads[i].load_count == DEEP_FMEM_LOADS_UNKNOWN;
+
+	if (any_unknown)
 	{
-		max_actions_t *actions = max_actions_init(es->maxfile, NULL);
-		max_disable_validation(actions);
-		max_get_mem_uint64t(actions, kernel_name, mem_name_buf, 0, &complete);
-		max_run(es->engine, actions);
+		max_actions_t *actions = deep_fmem_read_counts(loader, true, 0);
+		max_run(loader->es->engine, actions);
 		max_actions_free(actions);
-		usleep(10);
-		//printf("mem is %lu\n", complete);
+
+		for (size_t i = 0; i < loader->num_loads; i++)
+			if (*loader->loads[i].load_count == DEEP_FMEM_LOADS_UNKNOWN)
+				*loader->loads[i].load_count = loader->loads[i].observed_count;
 	}
 
-	actions = max_actions_init(es->maxfile, NULL);
-	max_disable_validation(actions);
-	max_set_mem_uint64t(actions, kernel_name, mem_name_buf, 0, 0);
-	max_run(es->engine, actions);
-	max_actions_free(actions);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t i = 0; i < loader->num_loads; i++)
+		if (!loader->loads[i].started)
+			deep_fmem_load_group(loader,
+					loader->loads[i].entry_size_bytes, &start);
+
+	loader->num_loads = 0;
 }
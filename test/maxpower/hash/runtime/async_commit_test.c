@@ -0,0 +1,204 @@
+/*
+ * async_commit_test.c
+ *
+ * Keeps changing a MaxHash table while asynchronous commits of it are in
+ * progress, and checks that each commit holds exactly the keys and values
+ * that were in the table when it started, minus those removed before it
+ * completed, and that software lookups see every change straight away.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <maxhash.h>
+
+#include "maxhash_test.h"
+
+#define NUM_COMMITS 30
+
+
+struct model {
+	uint64_t *values;
+	bool *present;
+	size_t num_present;
+};
+
+
+/* Apply "num_changes" random puts and removes to the table and the model. */
+static size_t change(maxhash_table_t *table, struct model *m, size_t max_keys,
+		size_t num_changes)
+{
+	size_t failures = 0;
+
+	for (size_t n = 0; n < num_changes; n++)
+	{
+		size_t i = (size_t)rand() % max_keys;
+		uint64_t key = key_of(i);
+
+		if (m->present[i] && rand() % 2)
+		{
+			if (maxhash_remove(table, &key, sizeof(key)) != MAXHASH_ERR_OK)
+			{
+				fprintf(stderr, "Failed to remove key %zu.\n", i);
+				failures++;
+			}
+			m->present[i] = false;
+			m->num_present--;
+			continue;
+		}
+
+		if (!m->present[i] && m->num_present == max_keys)
+			continue;
+
+		m->values[i] = ((uint64_t)rand() << 32) | rand();
+		if (maxhash_put(table, &key, sizeof(key), &m->values[i],
+					sizeof(m->values[i])) != MAXHASH_ERR_OK)
+		{
+			fprintf(stderr, "Failed to put key %zu.\n", i);
+			failures++;
+		}
+		if (!m->present[i])
+			m->num_present++;
+		m->present[i] = true;
+	}
+
+	return failures;
+}
+
+
+/* Check software lookups against "current". */
+static size_t check_sw(const maxhash_table_t *table, const struct model *m,
+		size_t max_keys)
+{
+	size_t failures = 0;
+
+	for (size_t i = 0; i < max_keys; i++)
+	{
+		uint64_t key = key_of(i);
+		uint64_t value = 0;
+		bool found = maxhash_get(table, &key, sizeof(key), &value) ==
+			MAXHASH_ERR_OK;
+
+		if ((found != m->present[i] || (found && value != m->values[i])) &&
+				failures++ < 10)
+			fprintf(stderr, "Software lookup mismatch (key: %zu).\n", i);
+	}
+
+	return failures;
+}
+
+
+/*
+ * Check perfect lookups: keys in "committed" and still in "current" must have
+ * their committed values; all other keys must be absent.
+ */
+static size_t check_perfect(maxhash_table_t *table,
+		const struct model *committed, const struct model *current,
+		size_t max_keys, size_t commit)
+{
+	size_t failures = 0;
+
+	for (size_t i = 0; i < max_keys; i++)
+	{
+		uint64_t key = key_of(i);
+		uint64_t value = 0;
+		bool valid = false;
+		bool found = maxhash_perfect_get(table, &key, sizeof(key), &value,
+				&valid) == MAXHASH_ERR_OK && valid;
+
+		bool expected = committed->present[i] && current->present[i];
+		bool ok = found == expected &&
+			(!found || value == committed->values[i]);
+
+		if (!ok && failures++ < 10)
+			fprintf(stderr, "Perfect lookup mismatch (commit: %zu, key: %zu): "
+					"%d/%016llx, expected %d/%016llx\n", commit, i, found,
+					(unsigned long long)value, expected,
+					(unsigned long long)committed->values[i]);
+	}
+
+	return failures;
+}
+
+
+static size_t run(size_t size, size_t max_keys, size_t max_changes)
+{
+	maxhash_table_params_t *params = sw_table_params(size, 64);
+	maxhash_table_params_set_num_threads(params, 2);
+	maxhash_table_t *table = create_table(params);
+	struct model current, committed;
+	size_t failures = 0;
+
+	current.values = calloc(max_keys, sizeof(uint64_t));
+	current.present = calloc(max_keys, sizeof(bool));
+	current.num_present = 0;
+	committed.values = calloc(max_keys, sizeof(uint64_t));
+	committed.present = calloc(max_keys, sizeof(bool));
+
+	if (table == NULL || current.values == NULL || current.present == NULL ||
+			committed.values == NULL || committed.present == NULL)
+		return 1;
+
+	failures += change(table, &current, max_keys, max_keys * 3 / 4);
+
+	for (size_t commit = 0; commit < NUM_COMMITS; commit++)
+	{
+		memcpy(committed.values, current.values, max_keys * sizeof(uint64_t));
+		memcpy(committed.present, current.present, max_keys * sizeof(bool));
+
+		maxhash_commit_t *handle;
+		if (maxhash_commit_async(table, &handle) != MAXHASH_ERR_OK)
+		{
+			fprintf(stderr, "Failed to start commit %zu.\n", commit);
+			return failures + 1;
+		}
+
+		/* The next generation of changes goes in while the commit runs. */
+		failures += change(table, &current, max_keys,
+				(size_t)rand() % max_changes + 1);
+		failures += check_sw(table, &current, max_keys);
+
+		bool complete;
+		failures += maxhash_commit_poll(handle, &complete) != MAXHASH_ERR_OK;
+
+		if (maxhash_commit_wait(handle) != MAXHASH_ERR_OK)
+		{
+			fprintf(stderr, "Commit %zu failed.\n", commit);
+			return failures + 1;
+		}
+
+		failures += check_perfect(table, &committed, &current, max_keys,
+				commit);
+	}
+
+	/* A synchronous commit picks up the last generation. */
+	if (maxhash_commit(table) != MAXHASH_ERR_OK)
+		failures++;
+	failures += check_perfect(table, &current, &current, max_keys,
+			NUM_COMMITS);
+
+	maxhash_free(table);
+	free(current.values);
+	free(current.present);
+	free(committed.values);
+	free(committed.present);
+	return failures;
+}
+
+
+int main(void)
+{
+	size_t failures = 0;
+
+	srand(1);
+
+	failures += run(4096, 2048, 16);
+	failures += run(4096, 4000, 600);
+	failures += run(65536, 60000, 5000);
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,143 @@
+#!/usr/bin/python
+
+import os
+import sys
+
+try:
+	from fabricate import *
+except ImportError, e:
+	print "Couldn't find the fabricate module. Make sure you have sourced config.sh"
+	sys.exit(1)
+
+
+def get_maxpower_dir():
+	dir = os.environ.get('MAXPOWERDIR')
+	if dir == None:
+		dir = os.getcwd() + "/../../../.."
+		print "MAXPOWERDIR undefined, using: %s" % (dir)
+	return dir
+
+
+
+# Only the DFE builds need the Maxeler toolchain; the mock build runs anywhere.
+MAXOSDIR = os.environ.get('MAXELEROSDIR')
+MAXCOMPILERDIR = os.environ.get('MAXCOMPILERDIR')
+MAXPOWERDIR=get_maxpower_dir()
+
+
+sources = ['put_batch_test.c', 'get_batch_test.c', 'jenkins_test.c',
+		'incremental_test.c', 'async_commit_test.c', 'concurrent_read_test.c',
+		'save_load_test.c', 'perfect_advise_test.c', 'index_growth_test.c',
+		'clear_test.c']
+targets = [s.replace('.c', '') for s in sources]
+includes = ['-I%s/src/maxpower/hash/runtime/' % (MAXPOWERDIR),
+			'-I%s/src/maxpower/hash/runtime/include/' % (MAXPOWERDIR)]
+MAXPOWER_LIBS = ['-L%s/src/maxpower/hash/runtime/' % (MAXPOWERDIR), '-lmaxhash-slic']
+
+# The benchmarks run on a DFE, against a maxfile containing a MaxHash table.
+BENCH_MAXFILE = os.environ.get('MAXHASH_BENCH_MAXFILE', 'MaxHashBench.max')
+BENCH_DESIGN_NAME = os.path.basename(BENCH_MAXFILE).replace('.max', '')
+bench_sources = ['fmem_load_bench.c']
+bench_targets = [s.replace('.c', '') for s in bench_sources]
+# Software-only benchmarks need no maxfile.
+sw_bench_sources = ['read_scaling_bench.c']
+sw_bench_targets = [s.replace('.c', '') for s in sw_bench_sources]
+# Tests and benchmarks of commits run against the mock SLiC engine in
+# slic_mock/, with the runtime rebuilt against it, so they need no DFE.
+RUNTIME_DIR = '%s/src/maxpower/hash/runtime/' % (MAXPOWERDIR)
+runtime_sources = ['maxhash.c', 'maxhash_cuckoo.c', 'maxhash_file.c',
+		'maxhash_frozen.c', 'maxhash_jenkins.c', 'maxhash_shard.c',
+		'maxhash_slic.c']
+# The software-only tests need no DFE either, so they run there too.
+mock_sources = sources + ['slic_mock_test.c', 'stats_test.c',
+		'remove_batch_test.c', 'scheduler_test.c', 'replicate_test.c',
+		'shard_test.c', 'cuckoo_test.c', 'frozen_test.c',
+		'serialise_test.c']
+mock_targets = [s.replace('.c', '') for s in mock_sources]
+mock_bench_sources = ['commit_bench.c', 'runtime_bench.c']
+mock_bench_targets = [s.replace('.c', '') for s in mock_bench_sources]
+
+
+def require_maxcompiler():
+	"""Exit unless the Maxeler toolchain has been set up."""
+	if MAXOSDIR == None or MAXCOMPILERDIR == None:
+		print "MAXELEROSDIR and MAXCOMPILERDIR must be set to build for a DFE. Make sure you have sourced config.sh"
+		sys.exit(1)
+
+def get_maxcompiler_inc():
+    """Return the includes to be used in the compilation."""
+    require_maxcompiler()
+    return ['-I.', '-I%s/include' % MAXOSDIR, '-I%s/include/slic' % MAXCOMPILERDIR]
+
+def get_maxcompiler_libs():
+    """Return the libraries to be used in linking."""
+    require_maxcompiler()
+    return ['-L%s/lib' % MAXCOMPILERDIR, '-L%s/lib' % MAXOSDIR, '-lslic', '-lmaxeleros', '-lm', '-lpthread']
+
+def get_ld_libs():
+    """Returns the libraries to be used for linking."""
+    return MAXPOWER_LIBS + get_maxcompiler_libs()
+
+
+cflags = ['-ggdb', '-O2', '-fPIC', '-std=gnu99', '-Wall', '-Werror'] + includes
+mock_cflags = ['-ggdb', '-O2', '-fPIC', '-std=gnu99', '-Wall', '-Werror', '-Islic_mock/'] + includes
+
+def build():
+    compile()
+    link()
+
+def compile():
+	for source in sources:
+		run('gcc', cflags, get_maxcompiler_inc(), '-c', source, '-o',
+			source.replace('.c', '.o'))
+
+def link():
+	for target in targets:
+		run('gcc', target + '.o', get_ld_libs(), '-o', target)
+
+def test():
+	build()
+	for target in targets:
+		run('./' + target)
+
+def bench():
+	for source in sw_bench_sources:
+		run('gcc', cflags, get_maxcompiler_inc(), '-c', source, '-o',
+			source.replace('.c', '.o'))
+	for target in sw_bench_targets:
+		run('gcc', target + '.o', get_ld_libs(), '-o', target)
+	run("%s/bin/sliccompile" % (MAXCOMPILERDIR), BENCH_MAXFILE,
+		BENCH_DESIGN_NAME + '.o')
+	for source in bench_sources:
+		run('gcc', cflags, get_maxcompiler_inc(),
+			'-DDESIGN_NAME=%s' % (BENCH_DESIGN_NAME), '-c', source, '-o',
+			source.replace('.c', '.o'))
+	for target in bench_targets:
+		run('gcc', target + '.o', BENCH_DESIGN_NAME + '.o', get_ld_libs(),
+			'-o', target)
+
+def mock_build():
+	objects = []
+	for source in [RUNTIME_DIR + s for s in runtime_sources] + ['slic_mock/slic_mock.c']:
+		obj = 'slic_mock/' + os.path.basename(source).replace('.c', '.o')
+		run('gcc', mock_cflags, '-c', source, '-o', obj)
+		objects.append(obj)
+	for source in mock_sources + mock_bench_sources:
+		run('gcc', mock_cflags, source, objects, '-lm', '-lpthread', '-o',
+			source.replace('.c', ''))
+
+def mock():
+	mock_build()
+	for target in mock_targets:
+		run('./' + target)
+
+def mock_bench():
+	mock_build()
+	for target in mock_bench_targets:
+		run('./' + target)
+
+def clean():
+    autoclean()
+
+
+main()
@@ -0,0 +1,169 @@
+/*
+ * clear_test.c
+ *
+ * Clears a MaxHash table many times while its bucket generations wrap
+ * around, with buckets left over from before the wrap that would read as
+ * full again if they were not wiped.  After every clear puts a new set of
+ * keys and checks that lookups, iteration and the perfect hash see exactly
+ * those keys.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <maxhash.h>
+#include <maxhash_internal.h>
+
+#include "maxhash_test.h"
+
+#define NUM_VALUES 1024
+#define NUM_KEYS   600
+#define NUM_ROUNDS 8
+/* Clears before the generations wrap, less than NUM_ROUNDS. */
+#define WRAP_AFTER 3
+/* First of the keys put before the wrap, apart from those of every round. */
+#define STALE_BASE (NUM_ROUNDS * NUM_KEYS)
+
+
+static uint64_t value_of(size_t round, size_t i)
+{
+	return key_of(i) ^ round;
+}
+
+
+/* Move every internal table of "table" to "generation", as if it had been
+ * cleared that many times. */
+static void set_generation(maxhash_table_t *table, uint32_t generation)
+{
+	table->sw.generation = generation;
+	table->recent.generation = generation;
+	table->intermediate.generation = generation;
+	table->values.generation = generation;
+	for (size_t way = 0; way < maxhash_num_ways(&table->tparams); way++)
+		table->ways[way].generation = generation;
+}
+
+
+/* Put NUM_KEYS keys from key "base" with the values of "round". */
+static size_t put_keys(maxhash_table_t *table, size_t base, size_t round)
+{
+	size_t failures = 0;
+
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		uint64_t key = key_of(base + i);
+		uint64_t value = value_of(round, i);
+		failures += maxhash_put(table, &key, sizeof(key), &value,
+				sizeof(value)) != MAXHASH_ERR_OK;
+	}
+
+	return failures;
+}
+
+
+/* Check that the table holds the keys of "round" and no others.  The keys
+ * of each round overlap half of those of the round before it. */
+static size_t check_keys(maxhash_table_t *table, size_t round)
+{
+	char step[64];
+	size_t failures = 0;
+
+	snprintf(step, sizeof(step), "round %zu (generation %" PRIu32 ")", round,
+			table->sw.generation);
+
+	/* The keys of this round, those only of the round before, and those in
+	 * the buckets left over from before the wrap. */
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		uint64_t key = key_of(round * NUM_KEYS / 2 + i);
+		uint64_t value = 0;
+		CHECK(maxhash_get(table, &key, sizeof(key), &value) ==
+				MAXHASH_ERR_OK && value == value_of(round, i));
+
+		key = key_of(round * NUM_KEYS / 2 - NUM_KEYS / 2 + i);
+		if (round > 0 && i < NUM_KEYS / 2)
+			CHECK(maxhash_get(table, &key, sizeof(key), &value) !=
+					MAXHASH_ERR_OK);
+
+		key = key_of(STALE_BASE + i);
+		CHECK(maxhash_get(table, &key, sizeof(key), &value) !=
+				MAXHASH_ERR_OK);
+	}
+
+	size_t size;
+	CHECK(maxhash_size(table, &size) == MAXHASH_ERR_OK &&
+			size == NUM_KEYS);
+
+	maxhash_entry_iterator_t *iterator;
+	size_t num_iterated = 0;
+	CHECK(maxhash_entry_iterator_init(&iterator, table) == MAXHASH_ERR_OK);
+	for (bool has_next; maxhash_entry_iterator_has_next(iterator,
+				&has_next) == MAXHASH_ERR_OK && has_next; num_iterated++)
+	{
+		const uint64_t *key;
+		const uint64_t *value;
+		maxhash_entry_iterator_next(iterator);
+		maxhash_entry_iterator_get_key(iterator, (const void **)&key);
+		maxhash_entry_iterator_get_value(iterator, (const void **)&value);
+
+		bool ours = false;
+		for (size_t i = 0; i < NUM_KEYS && !ours; i++)
+			ours = *key == key_of(round * NUM_KEYS / 2 + i) &&
+				*value == value_of(round, i);
+		CHECK(ours);
+	}
+	maxhash_entry_iterator_free(iterator);
+	CHECK(num_iterated == NUM_KEYS);
+
+	CHECK(maxhash_perfect_create(table) == MAXHASH_ERR_OK);
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		uint64_t key = key_of(round * NUM_KEYS / 2 + i);
+		uint64_t value = 0;
+		bool valid;
+		CHECK(maxhash_perfect_get(table, &key, sizeof(key), &value, &valid) ==
+				MAXHASH_ERR_OK && valid && value == value_of(round, i));
+	}
+
+	return failures;
+}
+
+
+int main(void)
+{
+	maxhash_table_t *table = create_table(sw_table_params(NUM_VALUES, 64));
+	if (table == NULL)
+	{
+		fprintf(stderr, "Failed to create table.\n");
+		return 1;
+	}
+
+	size_t failures = 0;
+
+	/* Fill buckets at generation zero, which they keep through the clear,
+	 * so that they would come back when the generations wrap to zero. */
+	failures += put_keys(table, STALE_BASE, NUM_ROUNDS);
+	failures += maxhash_perfect_create(table) != MAXHASH_ERR_OK;
+	maxhash_clear(table);
+	set_generation(table, UINT32_MAX - WRAP_AFTER + 1);
+
+	for (size_t round = 0; round < NUM_ROUNDS; round++)
+	{
+		failures += put_keys(table, round * NUM_KEYS / 2, round);
+		failures += check_keys(table, round);
+		maxhash_clear(table);
+	}
+
+	/* Each round clears the perfect hash tables twice. */
+	const char *step = "end";
+	CHECK(table->sw.generation == NUM_ROUNDS - WRAP_AFTER);
+	CHECK(table->values.generation == 2 * NUM_ROUNDS - WRAP_AFTER);
+
+	maxhash_free(table);
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
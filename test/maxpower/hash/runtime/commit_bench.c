@@ -0,0 +1,136 @@
+/*
+ * commit_bench.c
+ *
+ * Measures the host side of maxhash_commit() against the mock SLiC engine:
+ * how long a full first commit and incremental commits of increasing numbers
+ * of changes take for each memory type, and what they ask of the engine.
+ *
+ * Usage: commit_bench [<values buckets (a power of two)> [<commits>]]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <maxhash.h>
+
+#include "slic_mock.h"
+
+#include "maxhash_test.h"
+
+#define KERNEL_NAME "BenchKernel"
+#define TABLE_NAME  "BenchTable"
+
+
+static void print_row(const char *mem_type, size_t changes, size_t commits,
+		double seconds, const slic_mock_stats_t *before,
+		const slic_mock_stats_t *after)
+{
+	printf("%-10s %10zu %12.3f %14.0f %12.1f %14.1f %14.1f\n", mem_type,
+			changes, seconds / commits * 1e3, changes * commits / seconds,
+			(double)(after->num_runs - before->num_runs) / commits,
+			(double)(after->num_mem_writes - before->num_mem_writes) / commits,
+			(double)(after->num_stream_bytes - before->num_stream_bytes +
+				(after->num_lmem_bursts_written -
+				 before->num_lmem_bursts_written) * LMEM_BURST_BYTES) /
+			commits / 1024);
+}
+
+
+static int run(const char *name, slic_mock_mem_type_t mem_type,
+		size_t num_buckets, size_t num_commits)
+{
+	slic_mock_perfect_params_t params = {
+		.kernel_name = KERNEL_NAME,
+		.hash_table_name = TABLE_NAME,
+		.key_width_bits = 32,
+		.value_width_bits = 24,
+		.jenkins_chunk_width_bits = 8,
+		.num_intermediate_buckets = num_buckets / 4,
+		.num_values_buckets = num_buckets,
+		.intermediate_mem_type = mem_type,
+		.values_mem_type = mem_type,
+		.double_buffered = true,
+		.validate_results = true,
+	};
+
+	maxhash_engine_state_t es;
+	maxhash_table_t *table = create_mock_perfect_table(&params, &es);
+	if (table == NULL)
+		return 1;
+
+	size_t num_keys = num_buckets * 3 / 4;
+	slic_mock_stats_t before, after;
+
+	for (size_t i = 0; i < num_keys; i++)
+	{
+		uint32_t key = key_of(i);
+		uint32_t value = i;
+		if (maxhash_put(table, &key, sizeof(key), &value, 3) != MAXHASH_ERR_OK)
+			return 1;
+	}
+
+	slic_mock_get_stats(es.engine, &before);
+	double start = now_seconds();
+	if (maxhash_commit(table) != MAXHASH_ERR_OK)
+		return 1;
+	double elapsed = now_seconds() - start;
+	slic_mock_get_stats(es.engine, &after);
+	print_row(name, num_keys, 1, elapsed, &before, &after);
+
+	/* Each change moves a key to a new value, or swaps it for another. */
+	for (size_t changes = 1; changes <= num_keys / 4; changes *= 16)
+	{
+		slic_mock_get_stats(es.engine, &before);
+		start = now_seconds();
+
+		for (size_t commit = 0; commit < num_commits; commit++)
+		{
+			for (size_t change = 0; change < changes; change++)
+			{
+				size_t i = (size_t)rand() % num_keys;
+				uint32_t key = key_of(i);
+				uint32_t value = rand();
+
+				if (rand() % 2)
+				{
+					maxhash_remove(table, &key, sizeof(key));
+					key = key_of(i + num_buckets);
+				}
+				maxhash_put(table, &key, sizeof(key), &value, 3);
+			}
+
+			if (maxhash_commit(table) != MAXHASH_ERR_OK)
+				return 1;
+		}
+
+		elapsed = now_seconds() - start;
+		slic_mock_get_stats(es.engine, &after);
+		print_row(name, changes, num_commits, elapsed, &before, &after);
+	}
+
+	free_mock_perfect_table(table, &es);
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	size_t num_buckets = argc > 1 ? strtoul(argv[1], NULL, 0) : 65536;
+	size_t num_commits = argc > 2 ? strtoul(argv[2], NULL, 0) : 20;
+
+	srand(1);
+	printf("%-10s %10s %12s %14s %12s %14s %14s\n", "memory", "changes",
+			"ms/commit", "changes/s", "runs/commit", "writes/commit",
+			"KiB/commit");
+
+	int err = 0;
+	err |= run("FMem", SLIC_MOCK_FMEM, num_buckets, num_commits);
+	err |= run("DeepFMem", SLIC_MOCK_DEEP_FMEM, num_buckets, num_commits);
+	err |= run("LMem", SLIC_MOCK_LMEM, num_buckets, num_commits);
+	return err;
+}
@@ -0,0 +1,273 @@
+/*
+ * concurrent_read_test.c
+ *
+ * Looks keys up from several threads while another thread puts, removes and
+ * overwrites keys, one at a time and in batches, growing the table's index
+ * and slab arena as it goes, and checks that lookups never see a torn or
+ * stale value: keys that have been put and not removed are always found, and
+ * the values of every key only ever move forward.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <maxhash.h>
+
+#include "maxhash_test.h"
+
+#define NUM_READERS  4
+#define NUM_STABLE   100000
+#define NUM_CHURN    20000
+#define NUM_CHANGES  400000
+#define BATCH_SIZE   64
+
+
+/* Values carry the index of their key and a version that only increases. */
+static uint64_t value_of(size_t i, uint32_t version)
+{
+	return ((uint64_t)version << 32) | i;
+}
+
+
+struct shared {
+	maxhash_table_t *table;
+	size_t num_stable;
+	bool done;
+};
+
+
+struct reader {
+	pthread_t thread;
+	struct shared *shared;
+	unsigned seed;
+	uint32_t last_version[NUM_CHURN];
+	size_t num_lookups;
+	size_t failures;
+};
+
+
+/* Check a value read for key "i", and that its version has not gone back. */
+static void check_value(struct reader *r, size_t i, uint64_t value)
+{
+	uint32_t version = (uint32_t)(value >> 32);
+
+	if ((uint32_t)value != i)
+	{
+		if (r->failures++ < 10)
+			fprintf(stderr, "Key %zu has the value of key %u.\n", i,
+					(unsigned)(uint32_t)value);
+		return;
+	}
+
+	if (i < NUM_STABLE)
+		return;
+
+	if (version < r->last_version[i - NUM_STABLE] && r->failures++ < 10)
+		fprintf(stderr, "Key %zu went back from version %u to %u.\n", i,
+				r->last_version[i - NUM_STABLE], version);
+	r->last_version[i - NUM_STABLE] = version;
+}
+
+
+static size_t random_key(struct reader *r)
+{
+	size_t num_stable = __atomic_load_n(&r->shared->num_stable,
+			__ATOMIC_ACQUIRE);
+
+	if (num_stable > 0 && rand_r(&r->seed) % 2)
+		return (size_t)rand_r(&r->seed) % num_stable;
+	return NUM_STABLE + (size_t)rand_r(&r->seed) % NUM_CHURN;
+}
+
+
+static void *reader_main(void *arg)
+{
+	struct reader *r = arg;
+	maxhash_table_t *table = r->shared->table;
+
+	while (!__atomic_load_n(&r->shared->done, __ATOMIC_ACQUIRE))
+	{
+		/* Stable keys must be found if they were put before we looked. */
+		size_t num_stable = __atomic_load_n(&r->shared->num_stable,
+				__ATOMIC_ACQUIRE);
+		size_t i = random_key(r);
+		uint64_t key = key_of(i);
+		uint64_t value;
+		bool present;
+
+		if (maxhash_get(table, &key, sizeof(key), &value) == MAXHASH_ERR_OK)
+			check_value(r, i, value);
+		else if (i < num_stable && r->failures++ < 10)
+			fprintf(stderr, "Stable key %zu not found.\n", i);
+
+		i = random_key(r);
+		key = key_of(i);
+		maxhash_contains(table, &present, &key, sizeof(key));
+		if (!present && i < num_stable && r->failures++ < 10)
+			fprintf(stderr, "Stable key %zu not contained.\n", i);
+
+		size_t indices[BATCH_SIZE];
+		uint64_t keys[BATCH_SIZE];
+		uint64_t values[BATCH_SIZE];
+		bool found[BATCH_SIZE];
+
+		num_stable = __atomic_load_n(&r->shared->num_stable,
+				__ATOMIC_ACQUIRE);
+		for (size_t j = 0; j < BATCH_SIZE; j++)
+		{
+			indices[j] = random_key(r);
+			keys[j] = key_of(indices[j]);
+		}
+		maxhash_get_batch(table, keys, sizeof(keys[0]), BATCH_SIZE, values,
+				sizeof(values[0]), found);
+		for (size_t j = 0; j < BATCH_SIZE; j++)
+		{
+			if (found[j])
+				check_value(r, indices[j], values[j]);
+			else if (indices[j] < num_stable && r->failures++ < 10)
+				fprintf(stderr, "Stable key %zu not found in batch.\n",
+						indices[j]);
+		}
+
+		r->num_lookups += 2 + BATCH_SIZE;
+	}
+
+	return NULL;
+}
+
+
+static size_t write_changes(struct shared *shared, uint32_t *versions,
+		bool *present)
+{
+	maxhash_table_t *table = shared->table;
+	size_t failures = 0;
+
+	for (size_t n = 0; n < NUM_CHANGES; n++)
+	{
+		/* Interleave the stable keys with the churn, so that the index and
+		 * the arena grow while lookups are running. */
+		if (shared->num_stable < NUM_STABLE && n % 2 == 0)
+		{
+			size_t i = shared->num_stable;
+			uint64_t key = key_of(i);
+			uint64_t value = value_of(i, 0);
+			failures += maxhash_put(table, &key, sizeof(key), &value,
+					sizeof(value)) != MAXHASH_ERR_OK;
+			__atomic_store_n(&shared->num_stable, i + 1, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		size_t c = (size_t)rand() % NUM_CHURN;
+		uint64_t key = key_of(NUM_STABLE + c);
+
+		if (present[c] && rand() % 4 == 0)
+		{
+			if (n % 3 == 0)
+				failures += maxhash_remove_batch(table, &key, sizeof(key), 1,
+						NULL) != MAXHASH_ERR_OK;
+			else
+				failures += maxhash_remove(table, &key, sizeof(key)) !=
+					MAXHASH_ERR_OK;
+			present[c] = false;
+			continue;
+		}
+
+		uint64_t value = value_of(NUM_STABLE + c, ++versions[c]);
+		if (n % 3 == 0)
+			failures += maxhash_put_batch(table, &key, sizeof(key), &value,
+					sizeof(value), 1, NULL) != MAXHASH_ERR_OK;
+		else
+			failures += maxhash_put(table, &key, sizeof(key), &value,
+					sizeof(value)) != MAXHASH_ERR_OK;
+		present[c] = true;
+	}
+
+	return failures;
+}
+
+
+static size_t check_final(maxhash_table_t *table, const uint32_t *versions,
+		const bool *present)
+{
+	size_t failures = 0;
+
+	for (size_t i = 0; i < NUM_STABLE + NUM_CHURN; i++)
+	{
+		uint64_t key = key_of(i);
+		uint64_t value = 0;
+		bool found = maxhash_get(table, &key, sizeof(key), &value) ==
+			MAXHASH_ERR_OK;
+		bool expected = i < NUM_STABLE || present[i - NUM_STABLE];
+		uint64_t expected_value = i < NUM_STABLE ? value_of(i, 0) :
+			value_of(i, versions[i - NUM_STABLE]);
+
+		if ((found != expected || (found && value != expected_value)) &&
+				failures++ < 10)
+			fprintf(stderr, "Final lookup mismatch (key: %zu).\n", i);
+	}
+
+	return failures;
+}
+
+
+int main(void)
+{
+	maxhash_table_params_t *params = sw_table_params(262144, 64);
+	maxhash_table_params_set_concurrent_reads(params, true);
+
+	struct shared shared = { create_table(params), 0, false };
+	if (shared.table == NULL)
+		return 1;
+
+	uint32_t *versions = calloc(NUM_CHURN, sizeof(uint32_t));
+	bool *present = calloc(NUM_CHURN, sizeof(bool));
+	struct reader *readers = calloc(NUM_READERS, sizeof(struct reader));
+	if (versions == NULL || present == NULL || readers == NULL)
+		return 1;
+
+	srand(1);
+	for (size_t t = 0; t < NUM_READERS; t++)
+	{
+		readers[t].shared = &shared;
+		readers[t].seed = t + 1;
+		if (pthread_create(&readers[t].thread, NULL, reader_main,
+					&readers[t]) != 0)
+			return 1;
+	}
+
+	size_t failures = write_changes(&shared, versions, present);
+
+	__atomic_store_n(&shared.done, true, __ATOMIC_RELEASE);
+	for (size_t t = 0; t < NUM_READERS; t++)
+	{
+		pthread_join(readers[t].thread, NULL);
+		failures += readers[t].failures;
+		printf("Reader %zu: %zu lookups.\n", t, readers[t].num_lookups);
+	}
+
+	failures += check_final(shared.table, versions, present);
+
+	/* Clearing keeps the index, and the table stays usable. */
+	failures += maxhash_clear(shared.table) != MAXHASH_ERR_OK;
+	memset(present, 0, NUM_CHURN * sizeof(bool));
+	for (size_t i = 0; i < NUM_STABLE; i++)
+	{
+		uint64_t key = key_of(i);
+		uint64_t value = value_of(i, 0);
+		failures += maxhash_put(shared.table, &key, sizeof(key), &value,
+				sizeof(value)) != MAXHASH_ERR_OK;
+	}
+	failures += check_final(shared.table, versions, present);
+
+	maxhash_free(shared.table);
+	free(versions);
+	free(present);
+	free(readers);
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
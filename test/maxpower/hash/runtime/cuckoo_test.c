@@ -0,0 +1,205 @@
+/*
+ * cuckoo_test.c
+ *
+ * Fills three-way collision-handling tables in FMem, Deep FMem and LMem on a
+ * mock SLiC engine to 90% of their slots, and checks that the kernel finds
+ * every key in exactly one way, with its value, and finds no other key,
+ * through incremental updates, asynchronous commits, a clear, and a commit
+ * that has more keys than slots.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <maxhash.h>
+
+#include "slic_mock.h"
+
+#include "maxhash_test.h"
+
+#define KERNEL_NAME      "CuckooKernel"
+#define NUM_TABLES       3
+#define NUM_WAYS         3
+#define NUM_BUCKETS      1024
+#define NUM_SLOTS        (NUM_WAYS * NUM_BUCKETS)
+#define NUM_KEYS         (NUM_SLOTS * 9 / 10)
+#define NUM_ABSENT       2000
+
+
+static const char *const table_names[NUM_TABLES] = {
+	"CuckooFMem", "CuckooDeepFMem", "CuckooLMem",
+};
+
+static const slic_mock_mem_type_t mem_types[NUM_TABLES] = {
+	SLIC_MOCK_FMEM, SLIC_MOCK_DEEP_FMEM, SLIC_MOCK_LMEM,
+};
+
+
+/* Check the kernel's lookups of the first "num_keys" keys, and of keys that
+ * were never put. */
+static size_t check(const char *step, max_engine_t *engine, size_t t,
+		size_t num_keys, const bool *present, const uint16_t *values)
+{
+	size_t failures = 0;
+
+	for (size_t i = 0; i < num_keys + NUM_ABSENT; i++)
+	{
+		uint32_t key = key_of(i < num_keys ? i : NUM_SLOTS * 2 + i);
+		bool expected = i < num_keys && present[i];
+		uint16_t value = 0;
+		bool contains_key;
+
+		if (!slic_mock_collision_get(engine, KERNEL_NAME, table_names[t], &key,
+					&value, &contains_key))
+			return failures + 1;
+
+		if ((contains_key != expected || (expected && value != values[i])) &&
+				failures++ < 5)
+			fprintf(stderr, "%s: %s: key %zu: found: %d (expected %d), value: "
+					"%u (expected %u).\n", step, table_names[t], i,
+					contains_key, expected, value, expected ? values[i] : 0);
+	}
+
+	return failures;
+}
+
+
+int main(void)
+{
+	max_file_t *maxfile = slic_mock_maxfile_init(LMEM_BURST_BYTES);
+	maxhash_table_t *tables[NUM_TABLES];
+	size_t failures = 0;
+	const char *step = "init";
+
+	if (maxfile == NULL)
+		return 1;
+
+	for (size_t t = 0; t < NUM_TABLES; t++)
+	{
+		slic_mock_collision_params_t params = {
+			.kernel_name = KERNEL_NAME,
+			.hash_table_name = table_names[t],
+			.key_width_bits = 32,
+			.value_width_bits = 16,
+			.jenkins_chunk_width_bits = 8,
+			.max_bucket_entries = NUM_WAYS,
+			.num_buckets = NUM_BUCKETS,
+			.mem_type = mem_types[t],
+			.double_buffered = t != 1,
+		};
+		if (!slic_mock_add_collision(maxfile, &params))
+			return 1;
+	}
+
+	max_engine_t *engine = max_load(maxfile, "*");
+	maxhash_engine_state_t es = { maxfile, engine, 0 };
+
+	for (size_t t = 0; t < NUM_TABLES; t++)
+	{
+		tables[t] = create_mock_table(KERNEL_NAME, table_names[t], &es);
+		if (tables[t] == NULL)
+			return 1;
+	}
+
+	static bool present[NUM_SLOTS + 1];
+	static uint16_t values[NUM_SLOTS + 1];
+	maxhash_stats_t stats;
+
+	for (size_t t = 0; t < NUM_TABLES; t++)
+	{
+		maxhash_table_t *table = tables[t];
+
+		/* Filling 90% of the slots needs keys to be moved between ways. */
+		step = "fill";
+		for (size_t i = 0; i < NUM_KEYS; i++)
+		{
+			uint32_t key = key_of(i);
+			values[i] = i;
+			present[i] = true;
+			failures += maxhash_put(table, &key, sizeof(key), &values[i], 2) !=
+				MAXHASH_ERR_OK;
+		}
+		CHECK(maxhash_commit(table) == MAXHASH_ERR_OK);
+		maxhash_get_stats(table, &stats);
+		CHECK(!stats.incremental && stats.moved_entries > 0);
+		failures += check(step, engine, t, NUM_KEYS, present, values);
+
+		/* Updates move only the keys that have changed. */
+		step = "update";
+		for (size_t i = 0; i < NUM_KEYS; i++)
+		{
+			uint32_t key = key_of(i);
+			if (i % 7 == 0)
+			{
+				CHECK(maxhash_remove(table, &key, sizeof(key)) ==
+						MAXHASH_ERR_OK);
+				present[i] = false;
+			}
+			else if (i % 7 == 1)
+			{
+				values[i] = i + 1;
+				failures += maxhash_put(table, &key, sizeof(key), &values[i],
+						2) != MAXHASH_ERR_OK;
+			}
+		}
+		CHECK(maxhash_commit(table) == MAXHASH_ERR_OK);
+		maxhash_get_stats(table, &stats);
+		CHECK(stats.incremental);
+		failures += check(step, engine, t, NUM_KEYS, present, values);
+
+		/* Keys put back while an asynchronous commit is running go into the
+		 * next one. */
+		step = "async";
+		maxhash_commit_t *commit;
+		CHECK(maxhash_commit_async(table, &commit) == MAXHASH_ERR_OK);
+		for (size_t i = 0; i < NUM_KEYS; i += 7)
+		{
+			uint32_t key = key_of(i);
+			present[i] = true;
+			failures += maxhash_put(table, &key, sizeof(key), &values[i], 2) !=
+				MAXHASH_ERR_OK;
+		}
+		CHECK(maxhash_commit_wait(commit) == MAXHASH_ERR_OK);
+		CHECK(maxhash_commit(table) == MAXHASH_ERR_OK);
+		failures += check(step, engine, t, NUM_KEYS, present, values);
+
+		/* With more keys than slots the commit fails, and the table is
+		 * committed in full once there is room again. */
+		step = "overfull";
+		for (size_t i = NUM_KEYS; i <= NUM_SLOTS; i++)
+		{
+			uint32_t key = key_of(i);
+			values[i] = i;
+			present[i] = true;
+			failures += maxhash_put(table, &key, sizeof(key), &values[i], 2) !=
+				MAXHASH_ERR_OK;
+		}
+		fprintf(stderr, "Expect an error about keys with no room:\n");
+		CHECK(maxhash_commit(table) != MAXHASH_ERR_OK);
+		for (size_t i = NUM_KEYS; i <= NUM_SLOTS; i++)
+		{
+			uint32_t key = key_of(i);
+			CHECK(maxhash_remove(table, &key, sizeof(key)) == MAXHASH_ERR_OK);
+			present[i] = false;
+		}
+		CHECK(maxhash_commit(table) == MAXHASH_ERR_OK);
+		failures += check(step, engine, t, NUM_SLOTS + 1, present, values);
+
+		step = "clear";
+		CHECK(maxhash_clear(table) == MAXHASH_ERR_OK);
+		memset(present, 0, sizeof(present));
+		CHECK(maxhash_commit(table) == MAXHASH_ERR_OK);
+		failures += check(step, engine, t, NUM_KEYS, present, values);
+	}
+
+	for (size_t t = 0; t < NUM_TABLES; t++)
+		maxhash_free(tables[t]);
+	max_unload(engine);
+	max_file_free(maxfile);
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
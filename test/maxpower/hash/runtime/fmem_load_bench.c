@@ -0,0 +1,102 @@
+/*
+ * fmem_load_bench.c
+ *
+ * Measures how long it takes to load a mapped memory of a given depth,
+ * comparing a single action set holding every word (the old commit path)
+ * with the chunked, pipelined loader used by maxhash_commit().
+ *
+ * Usage: fmem_load_bench <kernel name> <mapped memory name> <depth>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <MaxSLiCInterface.h>
+
+#include <maxhash_internal.h>
+
+#include "maxhash_test.h"
+
+#define _CONCAT(x, y) x ## y
+#define CONCAT(x, y) _CONCAT(x, y)
+#define MAXFILE_INIT CONCAT(DESIGN_NAME, _init)
+
+#define NUM_REPEATS 5
+
+max_file_t *MAXFILE_INIT(void);
+
+
+/* Returns the best of NUM_REPEATS load times, in seconds. */
+static double time_load(maxhash_engine_state_t *es, const char *kernel_name,
+		const char *mem_name, const uint64_t *data, size_t num_words,
+		size_t chunk_words)
+{
+	double best = 0;
+
+	for (size_t repeat = 0; repeat < NUM_REPEATS; repeat++)
+	{
+		double start = now_seconds();
+
+		maxhash_fmem_loader_t loader;
+		maxhash_fmem_loader_init(&loader, es);
+		loader.chunk_words = chunk_words;
+		maxhash_fmem_load(&loader, kernel_name, mem_name, 0, data,
+				num_words * sizeof(uint64_t));
+		maxhash_fmem_loader_finish(&loader);
+
+		double elapsed = now_seconds() - start;
+		if (repeat == 0 || elapsed < best)
+			best = elapsed;
+	}
+
+	return best;
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (argc != 4)
+	{
+		fprintf(stderr, "Usage: %s <kernel name> <mapped memory name> "
+				"<depth>\n", argv[0]);
+		return 1;
+	}
+
+	const char *kernel_name = argv[1];
+	const char *mem_name = argv[2];
+	size_t depth = strtoul(argv[3], NULL, 0);
+
+	maxhash_engine_state_t es;
+	es.maxfile = MAXFILE_INIT();
+	es.engine = max_load(es.maxfile, "*");
+
+	uint64_t *data = malloc(depth * sizeof(uint64_t));
+	if (data == NULL)
+		return 1;
+	for (size_t i = 0; i < depth; i++)
+		data[i] = i * UINT64_C(0x9E3779B97F4A7C15);
+
+	printf("%10s %14s %14s %14s\n", "depth", "single (ms)", "chunked (ms)",
+			"speedup");
+
+	for (size_t num_words = 256; num_words <= depth; num_words *= 2)
+	{
+		double single = time_load(&es, kernel_name, mem_name, data,
+				num_words, num_words);
+		double chunked = time_load(&es, kernel_name, mem_name, data,
+				num_words, FMEM_LOAD_CHUNK_WORDS);
+
+		printf("%10zu %14.3f %14.3f %13.2fx\n", num_words, single * 1e3,
+				chunked * 1e3, single / chunked);
+	}
+
+	free(data);
+	max_unload(es.engine);
+	max_file_free(es.maxfile);
+
+	return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * frozen_test.c
+ *
+ * Freezes perfect hash tables, with and without validated results, and a
+ * collision-handling table on a mock SLiC engine, and checks that lookups in
+ * the frozen copies, one at a time, in batches and from several threads at
+ * once, give what the kernel gives, for keys that were put and keys that
+ * were not.  A frozen copy keeps giving the results of its commit while the
+ * table changes, as the kernel does.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <maxhash.h>
+
+#include "slic_mock.h"
+
+#include "maxhash_test.h"
+
+#define KERNEL_NAME      "FrozenKernel"
+#define NUM_TABLES       3
+#define NUM_KEYS         1500
+#define NUM_LOOKUPS      (NUM_KEYS * 2)
+#define KEY_STRIDE       8
+#define NUM_THREADS      4
+
+enum { VALIDATED, UNVALIDATED, COLLISION };
+
+static const char *const table_names[NUM_TABLES] = {
+	"Validated", "Unvalidated", "Collision",
+};
+
+static const size_t key_bits[NUM_TABLES] = { 32, 40, 32 };
+
+
+/* Keys from NUM_KEYS on are never put. */
+static uint64_t table_key(size_t table, size_t i)
+{
+	return key_of(i) & ((UINT64_C(1) << key_bits[table]) - 1);
+}
+
+
+static bool kernel_get(max_engine_t *engine, size_t t, const void *key,
+		void *value, bool *contains_key)
+{
+	if (t == COLLISION)
+		return slic_mock_collision_get(engine, KERNEL_NAME, table_names[t],
+				key, value, contains_key);
+	return slic_mock_perfect_get(engine, KERNEL_NAME, table_names[t], key,
+			value, contains_key);
+}
+
+
+/* Check single and batch lookups in a frozen copy against the kernel. */
+static size_t check(const char *step, max_engine_t *engine, size_t t,
+		const maxhash_frozen_t *frozen)
+{
+	static uint64_t keys[NUM_LOOKUPS];
+	static uint32_t values[NUM_LOOKUPS];
+	static bool found[NUM_LOOKUPS];
+	size_t failures = 0;
+
+	for (size_t i = 0; i < NUM_LOOKUPS; i++)
+		keys[i] = table_key(t, i);
+
+	CHECK(maxhash_frozen_get_batch(frozen, keys, KEY_STRIDE, NUM_LOOKUPS,
+				values, sizeof(uint32_t), found) == MAXHASH_ERR_OK);
+
+	for (size_t i = 0; i < NUM_LOOKUPS; i++)
+	{
+		uint32_t expected = 0, value = 0;
+		bool expected_found, contains_key;
+
+		if (!kernel_get(engine, t, &keys[i], &expected, &expected_found))
+			return failures + 1;
+		CHECK(maxhash_frozen_get(frozen, &keys[i], KEY_STRIDE, &value,
+					&contains_key) == MAXHASH_ERR_OK);
+
+		if ((contains_key != expected_found || value != expected ||
+					found[i] != expected_found || values[i] != expected) &&
+				failures++ < 5)
+			fprintf(stderr, "%s: %s: key %zu: found: %d/%d (expected %d), "
+					"value: %u/%u (expected %u).\n", step, table_names[t], i,
+					contains_key, found[i], expected_found, value, values[i],
+					expected);
+	}
+
+	return failures;
+}
+
+
+struct reader {
+	const maxhash_frozen_t *frozen;
+	size_t table;
+	size_t mismatches;
+};
+
+
+/* Look every key up over and over, against a single-threaded lookup. */
+static void *reader_main(void *arg)
+{
+	struct reader *r = arg;
+	uint64_t keys[64];
+	uint32_t values[64];
+	bool found[64];
+
+	for (size_t pass = 0; pass < 20; pass++)
+		for (size_t base = 0; base < NUM_LOOKUPS; base += 64)
+		{
+			for (size_t i = 0; i < 64; i++)
+				keys[i] = table_key(r->table, (base + i + pass) % NUM_LOOKUPS);
+			maxhash_frozen_get_batch(r->frozen, keys, KEY_STRIDE, 64, values,
+					sizeof(uint32_t), found);
+
+			for (size_t i = 0; i < 64; i++)
+			{
+				uint32_t value = 0;
+				bool contains_key;
+				maxhash_frozen_get(r->frozen, &keys[i], KEY_STRIDE, &value,
+						&contains_key);
+				r->mismatches += contains_key != found[i] ||
+					value != values[i];
+			}
+		}
+
+	return NULL;
+}
+
+
+int main(void)
+{
+	max_file_t *maxfile = slic_mock_maxfile_init(LMEM_BURST_BYTES);
+	maxhash_table_t *tables[NUM_TABLES];
+	size_t failures = 0;
+	const char *step = "init";
+
+	if (maxfile == NULL)
+		return 1;
+
+	slic_mock_perfect_params_t perfect_params[2] = {
+		{
+			.kernel_name = KERNEL_NAME,
+			.hash_table_name = table_names[VALIDATED],
+			.key_width_bits = key_bits[VALIDATED],
+			.value_width_bits = 24,
+			.jenkins_chunk_width_bits = 8,
+			.num_intermediate_buckets = 512,
+			.num_values_buckets = 2048,
+			.intermediate_mem_type = SLIC_MOCK_FMEM,
+			.values_mem_type = SLIC_MOCK_FMEM,
+			.double_buffered = true,
+			.validate_results = true,
+		},
+		{
+			.kernel_name = KERNEL_NAME,
+			.hash_table_name = table_names[UNVALIDATED],
+			.key_width_bits = key_bits[UNVALIDATED],
+			.value_width_bits = 16,
+			.jenkins_chunk_width_bits = 16,
+			.num_intermediate_buckets = 1024,
+			.num_values_buckets = 2048,
+			.intermediate_mem_type = SLIC_MOCK_LMEM,
+			.values_mem_type = SLIC_MOCK_LMEM,
+			.double_buffered = true,
+			.validate_results = false,
+		},
+	};
+	slic_mock_collision_params_t collision_params = {
+		.kernel_name = KERNEL_NAME,
+		.hash_table_name = table_names[COLLISION],
+		.key_width_bits = key_bits[COLLISION],
+		.value_width_bits = 16,
+		.jenkins_chunk_width_bits = 8,
+		.max_bucket_entries = 4,
+		.num_buckets = 512,
+		.mem_type = SLIC_MOCK_DEEP_FMEM,
+		.double_buffered = true,
+	};
+
+	if (!slic_mock_add_perfect(maxfile, &perfect_params[0]) ||
+			!slic_mock_add_perfect(maxfile, &perfect_params[1]) ||
+			!slic_mock_add_collision(maxfile, &collision_params))
+		return 1;
+
+	max_engine_t *engine = max_load(maxfile, "*");
+	maxhash_engine_state_t es = { maxfile, engine, 0 };
+
+	for (size_t t = 0; t < NUM_TABLES; t++)
+	{
+		tables[t] = create_mock_table(KERNEL_NAME, table_names[t], &es);
+		if (tables[t] == NULL)
+			return 1;
+	}
+
+	for (size_t t = 0; t < NUM_TABLES; t++)
+	{
+		maxhash_table_t *table = tables[t];
+		maxhash_frozen_t *frozen;
+
+		step = "uncommitted";
+		fprintf(stderr, "Expect an error about an uncommitted table:\n");
+		CHECK(maxhash_freeze(table, &frozen) != MAXHASH_ERR_OK);
+
+		step = "freeze";
+		for (size_t i = 0; i < NUM_KEYS; i++)
+		{
+			uint64_t key = table_key(t, i);
+			uint32_t value = i * 3 + t;
+			failures += maxhash_put(table, &key, KEY_STRIDE, &value, 2) !=
+				MAXHASH_ERR_OK;
+		}
+		CHECK(maxhash_commit(table) == MAXHASH_ERR_OK);
+		CHECK(maxhash_freeze(table, &frozen) == MAXHASH_ERR_OK);
+		failures += check(step, engine, t, frozen);
+
+		/* Keys with bits set beyond the key width are not found. */
+		step = "excess bits";
+		uint64_t bad_key = table_key(t, 0) | UINT64_C(1) << key_bits[t];
+		uint32_t value = 12345;
+		bool contains_key = true;
+		CHECK(maxhash_frozen_get_batch(frozen, &bad_key, KEY_STRIDE, 1,
+					&value, sizeof(value), &contains_key) == MAXHASH_ERR_OK);
+		CHECK(!contains_key && value == 12345);
+
+		/* The copy can be read from several threads at once. */
+		step = "threads";
+		pthread_t threads[NUM_THREADS];
+		struct reader readers[NUM_THREADS];
+		for (size_t r = 0; r < NUM_THREADS; r++)
+		{
+			readers[r] = (struct reader) { frozen, t, 0 };
+			CHECK(pthread_create(&threads[r], NULL, reader_main,
+						&readers[r]) == 0);
+		}
+		for (size_t r = 0; r < NUM_THREADS; r++)
+		{
+			pthread_join(threads[r], NULL);
+			CHECK(readers[r].mismatches == 0);
+		}
+
+		/* Until the next commit, the kernel and the copy are unchanged by
+		 * puts and removes; after it, a new copy gives the kernel's new
+		 * results. */
+		step = "changed";
+		for (size_t i = 0; i < NUM_KEYS; i++)
+		{
+			uint64_t key = table_key(t, i);
+			uint32_t new_value = i * 5 + t;
+			if (i % 4 == 0)
+				CHECK(maxhash_remove(table, &key, KEY_STRIDE) ==
+						MAXHASH_ERR_OK);
+			else if (i % 4 == 1)
+				failures += maxhash_put(table, &key, KEY_STRIDE, &new_value,
+						2) != MAXHASH_ERR_OK;
+		}
+		failures += check(step, engine, t, frozen);
+		CHECK(maxhash_frozen_free(frozen) == MAXHASH_ERR_OK);
+
+		step = "refrozen";
+		CHECK(maxhash_commit(table) == MAXHASH_ERR_OK);
+		CHECK(maxhash_freeze(table, &frozen) == MAXHASH_ERR_OK);
+		failures += check(step, engine, t, frozen);
+
+		/* The copy outlives the table. */
+		step = "outlives";
+		CHECK(maxhash_free(table) == MAXHASH_ERR_OK);
+		failures += check(step, engine, t, frozen);
+		CHECK(maxhash_frozen_free(frozen) == MAXHASH_ERR_OK);
+	}
+
+	max_unload(engine);
+	max_file_free(maxfile);
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,266 @@
+/*
+ * get_batch_test.c
+ *
+ * Checks maxhash_get_batch() and maxhash_perfect_get_batch() against
+ * maxhash_get() and maxhash_perfect_get() for the same keys: hits, misses and
+ * keys with bits set beyond the key width, laid out with several strides and
+ * looked up in batches of every size around a block boundary.  Then removes
+ * some keys and checks that perfect batch lookups miss them straight away,
+ * and while a commit is in progress.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <maxhash.h>
+
+#include "maxhash_test.h"
+
+#define NUM_VALUES   4096
+#define NUM_KEYS     3000
+#define KEY_BITS     40
+#define VALUE_BITS   24
+#define VALUE_BYTES  (VALUE_BITS / 8)
+#define MAX_LOOKUPS  600
+#define MAX_STRIDE   16
+/* Keys removed one by one and in a batch, out of the first MAX_LOOKUPS. */
+#define NUM_REMOVED  150
+/* Left in the value buffers, to show which bytes the lookups write. */
+#define FILL         0xA5
+
+
+static uint64_t key_bits_of(size_t i)
+{
+	return key_of(i) & ((UINT64_C(1) << KEY_BITS) - 1);
+}
+
+
+/* Lay out MAX_LOOKUPS keys with "stride", about half of which were put.
+ * Where the stride has room, every 50th key has a bit set beyond the key
+ * width. */
+static void fill_keys(uint8_t *keys, size_t stride)
+{
+	for (size_t j = 0; j < MAX_LOOKUPS; j++)
+	{
+		uint64_t key = key_bits_of(j * 7 % (NUM_KEYS * 2));
+		uint8_t *item = keys + j * stride;
+
+		memset(item, 0, stride);
+		for (size_t byte = 0; byte < stride && byte < 8; byte++)
+			item[byte] = key >> (byte * 8);
+		if (j % 50 == 49 && stride * 8 > KEY_BITS)
+			item[KEY_BITS / 8] |= 1;
+	}
+}
+
+
+/* Check one batch lookup against the single-key results: the value of a hit
+ * fills the first VALUE_BYTES of its slot, and nothing else is written. */
+static size_t check_lookup(const char *stage, size_t j, bool found,
+		const uint8_t *value, size_t value_stride, bool expected_found,
+		const uint8_t *expected_value)
+{
+	bool ok = found == expected_found;
+
+	for (size_t byte = 0; byte < value_stride; byte++)
+		if (found && byte < VALUE_BYTES ? value[byte] != expected_value[byte] :
+				value[byte] != FILL)
+			ok = false;
+
+	if (!ok)
+		fprintf(stderr, "Mismatch (%s, lookup: %zu): batch %d, single %d\n",
+				stage, j, found, expected_found);
+	return !ok;
+}
+
+
+static size_t run(maxhash_table_t *table, size_t key_stride,
+		size_t value_stride, size_t n)
+{
+	uint8_t keys[MAX_LOOKUPS * MAX_STRIDE];
+	uint8_t values[MAX_LOOKUPS * MAX_STRIDE];
+	bool found[MAX_LOOKUPS];
+	bool valid[MAX_LOOKUPS];
+	size_t failures = 0;
+	char stage[64];
+
+	fill_keys(keys, key_stride);
+
+	/* Software lookups. */
+	snprintf(stage, sizeof(stage), "software, strides: %zu/%zu, n: %zu",
+			key_stride, value_stride, n);
+	memset(values, FILL, sizeof(values));
+	memset(found, true, sizeof(found));
+	if (maxhash_get_batch(table, keys, key_stride, n, values, value_stride,
+				found) != MAXHASH_ERR_OK)
+	{
+		fprintf(stderr, "maxhash_get_batch() failed (%s).\n", stage);
+		return 1;
+	}
+
+	for (size_t j = 0; j < n && failures < 10; j++)
+	{
+		uint8_t value[8];
+		memset(value, 0, sizeof(value));
+		bool expected = maxhash_get(table, keys + j * key_stride, key_stride,
+				value) == MAXHASH_ERR_OK;
+		failures += check_lookup(stage, j, found[j], values + j * value_stride,
+				value_stride, expected, value);
+	}
+
+	/* Perfect lookups, with and without valid flags. */
+	for (size_t with_valid = 0; with_valid < 2; with_valid++)
+	{
+		snprintf(stage, sizeof(stage), "perfect, strides: %zu/%zu, n: %zu%s",
+				key_stride, value_stride, n, with_valid ? ", valid" : "");
+		memset(values, FILL, sizeof(values));
+		memset(found, true, sizeof(found));
+		memset(valid, true, sizeof(valid));
+		if (maxhash_perfect_get_batch(table, keys, key_stride, n, values,
+					value_stride, found, with_valid ? valid : NULL) !=
+				MAXHASH_ERR_OK)
+		{
+			fprintf(stderr, "maxhash_perfect_get_batch() failed (%s).\n",
+					stage);
+			return failures + 1;
+		}
+
+		for (size_t j = 0; j < n && failures < 10; j++)
+		{
+			uint8_t value[8];
+			bool expected_valid = false;
+			memset(value, 0, sizeof(value));
+			bool expected = maxhash_perfect_get(table, keys + j * key_stride,
+					key_stride, value, &expected_valid) == MAXHASH_ERR_OK;
+			failures += check_lookup(stage, j, found[j],
+					values + j * value_stride, value_stride, expected, value);
+
+			if (with_valid && valid[j] != (expected && expected_valid))
+			{
+				fprintf(stderr, "Wrong valid flag (%s, lookup: %zu): %d\n",
+						stage, j, valid[j]);
+				failures++;
+			}
+		}
+	}
+
+	/* Nothing beyond the last key is written. */
+	for (size_t byte = n * value_stride; byte < sizeof(values); byte++)
+		if (values[byte] != FILL)
+		{
+			fprintf(stderr, "Value byte %zu written (strides: %zu/%zu, n: "
+					"%zu).\n", byte, key_stride, value_stride, n);
+			return failures + 1;
+		}
+
+	return failures;
+}
+
+
+/* Look up the first MAX_LOOKUPS keys, of which the first NUM_REMOVED have
+ * been removed. */
+static size_t check_removed(maxhash_table_t *table, const char *stage)
+{
+	uint64_t keys[MAX_LOOKUPS];
+	uint32_t values[MAX_LOOKUPS];
+	bool found[MAX_LOOKUPS];
+	size_t failures = 0;
+
+	for (size_t j = 0; j < MAX_LOOKUPS; j++)
+		keys[j] = key_bits_of(j);
+	if (maxhash_perfect_get_batch(table, keys, sizeof(keys[0]), MAX_LOOKUPS,
+				values, sizeof(values[0]), found, NULL) != MAXHASH_ERR_OK)
+	{
+		fprintf(stderr, "maxhash_perfect_get_batch() failed (%s).\n", stage);
+		return 1;
+	}
+
+	for (size_t j = 0; j < MAX_LOOKUPS; j++)
+	{
+		bool expected = j >= NUM_REMOVED;
+		uint32_t value = key_of(NUM_KEYS + j) & ((1 << VALUE_BITS) - 1);
+
+		if ((found[j] != expected || (expected && (values[j] &
+				((1 << VALUE_BITS) - 1)) != value)) && failures++ < 10)
+			fprintf(stderr, "Mismatch (%s, key: %zu): found %d, expected "
+					"%d\n", stage, j, found[j], expected);
+	}
+
+	return failures;
+}
+
+
+static size_t run_removals(maxhash_table_t *table)
+{
+	uint64_t keys[NUM_REMOVED];
+	size_t failures = 0;
+
+	/* Half are removed in a batch, whose perfect hash slots are only freed
+	 * when they are next needed. */
+	for (size_t j = 0; j < NUM_REMOVED; j++)
+		keys[j] = key_bits_of(j);
+	if (maxhash_remove_batch(table, keys, sizeof(keys[0]), NUM_REMOVED / 2,
+				NULL) != MAXHASH_ERR_OK)
+		return 1;
+	for (size_t j = NUM_REMOVED / 2; j < NUM_REMOVED; j++)
+		if (maxhash_remove(table, &keys[j], sizeof(keys[j])) !=
+				MAXHASH_ERR_OK)
+			return 1;
+
+	failures += check_removed(table, "removed");
+
+	maxhash_commit_t *commit;
+	if (maxhash_commit_async(table, &commit) != MAXHASH_ERR_OK)
+		return failures + 1;
+	failures += check_removed(table, "during commit");
+	if (maxhash_commit_wait(commit) != MAXHASH_ERR_OK)
+		return failures + 1;
+
+	failures += check_removed(table, "committed");
+	return failures;
+}
+
+
+int main(void)
+{
+	static const size_t key_strides[] = { 3, KEY_BITS / 8, 8, 13 };
+	static const size_t value_strides[] = { VALUE_BYTES, 4, 8, MAX_STRIDE };
+	/* Around the batch block size of 256 keys, and more than a block. */
+	static const size_t sizes[] = { 0, 1, 255, 256, 257, MAX_LOOKUPS };
+	size_t failures = 0;
+
+	maxhash_table_params_t *params = sw_table_params(NUM_VALUES, VALUE_BITS);
+	maxhash_table_params_set_key_width_bits(params, KEY_BITS);
+	maxhash_table_t *table = create_table(params);
+	if (table == NULL)
+		return 1;
+
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		uint64_t key = key_bits_of(i);
+		uint32_t value = key_of(NUM_KEYS + i) & ((1 << VALUE_BITS) - 1);
+		if (maxhash_put(table, &key, sizeof(key), &value, sizeof(value)) !=
+				MAXHASH_ERR_OK)
+			return 1;
+	}
+
+	if (maxhash_perfect_create(table) != MAXHASH_ERR_OK)
+		return 1;
+
+	for (size_t k = 0; k < sizeof(key_strides) / sizeof(key_strides[0]); k++)
+		for (size_t v = 0; v < sizeof(value_strides) /
+				sizeof(value_strides[0]); v++)
+			for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+				failures += run(table, key_strides[k], value_strides[v],
+						sizes[s]);
+
+	failures += run_removals(table);
+
+	maxhash_free(table);
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
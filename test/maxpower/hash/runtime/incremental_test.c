@@ -0,0 +1,140 @@
+/*
+ * incremental_test.c
+ *
+ * Applies the same random puts, updates and removes to two MaxHash tables,
+ * one committed incrementally and one rebuilt from scratch on every commit,
+ * and checks that perfect hash lookups give the same results in both.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <maxhash.h>
+
+#include "maxhash_test.h"
+
+#define NUM_COMMITS 40
+
+
+/*
+ * Run a workload in which each commit changes up to "max_changes" keys of a
+ * table with "size" slots, holding at most "max_keys" keys.  Returns the
+ * number of mismatched lookups.
+ */
+static size_t run(size_t size, size_t max_keys, size_t max_changes)
+{
+	maxhash_table_t *incremental = create_table(sw_table_params(size, 64));
+	maxhash_table_params_t *params = sw_table_params(size, 64);
+	maxhash_table_params_set_incremental_puts(params, false);
+	maxhash_table_t *rebuilt = create_table(params);
+	uint64_t *values = calloc(max_keys, sizeof(uint64_t));
+	bool *present = calloc(max_keys, sizeof(bool));
+	size_t num_present = 0;
+	size_t failures = 0;
+
+	if (incremental == NULL || rebuilt == NULL || values == NULL ||
+			present == NULL)
+		return 1;
+
+	for (size_t commit = 0; commit < NUM_COMMITS; commit++)
+	{
+		/* The first commit fills most of the table. */
+		size_t num_changes = commit == 0 ? max_keys * 3 / 4 :
+			(size_t)rand() % max_changes + 1;
+
+		for (size_t change = 0; change < num_changes; change++)
+		{
+			size_t i = (size_t)rand() % max_keys;
+			uint64_t key = key_of(i);
+
+			if (present[i] && rand() % 2)
+			{
+				if (maxhash_remove(incremental, &key, sizeof(key)) !=
+						MAXHASH_ERR_OK ||
+						maxhash_remove(rebuilt, &key, sizeof(key)) !=
+						MAXHASH_ERR_OK)
+				{
+					fprintf(stderr, "Failed to remove key %zu.\n", i);
+					failures++;
+				}
+				present[i] = false;
+				num_present--;
+				continue;
+			}
+
+			if (!present[i] && num_present == max_keys)
+				continue;
+
+			values[i] = ((uint64_t)rand() << 32) | rand();
+			maxhash_put(incremental, &key, sizeof(key), &values[i],
+					sizeof(values[i]));
+			maxhash_put(rebuilt, &key, sizeof(key), &values[i],
+					sizeof(values[i]));
+			if (!present[i])
+				num_present++;
+			present[i] = true;
+		}
+
+		if (maxhash_perfect_create(incremental) != MAXHASH_ERR_OK ||
+				maxhash_perfect_create(rebuilt) != MAXHASH_ERR_OK)
+		{
+			fprintf(stderr, "Failed to create perfect hash (commit %zu).\n",
+					commit);
+			return failures + 1;
+		}
+
+		for (size_t i = 0; i < max_keys; i++)
+		{
+			uint64_t key = key_of(i);
+			uint64_t value[2] = {0, 0};
+			bool valid[2] = {false, false};
+			bool found[2];
+
+			found[0] = maxhash_perfect_get(incremental, &key, sizeof(key),
+					&value[0], &valid[0]) == MAXHASH_ERR_OK && valid[0];
+			found[1] = maxhash_perfect_get(rebuilt, &key, sizeof(key),
+					&value[1], &valid[1]) == MAXHASH_ERR_OK && valid[1];
+
+			bool ok = found[0] == found[1] && found[0] == present[i];
+			if (ok && present[i])
+				ok = value[0] == values[i] && value[1] == values[i];
+
+			if (!ok && failures++ < 10)
+				fprintf(stderr, "Mismatch (size: %zu, commit: %zu, key: %zu): "
+						"incremental %d/%016llx, rebuilt %d/%016llx, expected "
+						"%d/%016llx\n", size, commit, i, found[0],
+						(unsigned long long)value[0], found[1],
+						(unsigned long long)value[1], present[i],
+						(unsigned long long)values[i]);
+		}
+	}
+
+	maxhash_free(incremental);
+	maxhash_free(rebuilt);
+	free(values);
+	free(present);
+	return failures;
+}
+
+
+int main(void)
+{
+	size_t failures = 0;
+
+	srand(1);
+
+	/* Sparse and dense tables, with small and large deltas.  The last case
+	 * moves enough keys to exercise the fallback to a full rebuild. */
+	failures += run(4096, 2048, 16);
+	failures += run(4096, 2048, 600);
+	failures += run(4096, 4000, 16);
+	failures += run(4096, 4096, 64);
+	failures += run(65536, 60000, 200);
+	failures += run(4096, 4000, 3000);
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * index_growth_test.c
+ *
+ * Puts, overwrites and removes keys in a MaxHash table with far fewer hash
+ * parameter buckets than keys, so that every bucket holds thousands of keys
+ * and the software index grows many times, and checks after every change
+ * that lookups, single and batched, agree with a plain array, including
+ * while the index is part way through being rehashed and after the table is
+ * cleared in the middle of it.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <maxhash.h>
+
+#include "maxhash_test.h"
+
+#define NUM_VALUES       (1 << 18)
+#define NUM_INTERMEDIATE 16
+#define MAX_KEYS         100000
+#define BATCH_SIZE       256
+
+
+struct model {
+	bool present[MAX_KEYS];
+	uint64_t values[MAX_KEYS];
+	size_t num_present;
+};
+
+
+/* Look up key "i", and report whether the table agrees with the model. */
+static size_t check_key(const maxhash_table_t *table,
+		const struct model *model, size_t i)
+{
+	uint64_t key = key_of(i);
+	uint64_t value = 0;
+	bool found = maxhash_get(table, &key, sizeof(key), &value) ==
+		MAXHASH_ERR_OK;
+
+	if (found == model->present[i] && (!found || value == model->values[i]))
+		return 0;
+
+	fprintf(stderr, "Key %zu: found: %d (expected %d), value: %" PRIu64
+			" (expected %" PRIu64 ").\n", i, found, model->present[i], value,
+			model->values[i]);
+	return 1;
+}
+
+
+/* Look up every key that has been used, in batches. */
+static size_t check_all(const maxhash_table_t *table,
+		const struct model *model, size_t num_used)
+{
+	uint64_t keys[BATCH_SIZE];
+	uint64_t values[BATCH_SIZE];
+	bool found[BATCH_SIZE];
+	size_t failures = 0;
+
+	for (size_t base = 0; base < num_used; base += BATCH_SIZE)
+	{
+		size_t n = num_used - base < BATCH_SIZE ? num_used - base :
+			BATCH_SIZE;
+		for (size_t i = 0; i < n; i++)
+			keys[i] = key_of(base + i);
+
+		if (maxhash_get_batch(table, keys, sizeof(keys[0]), n, values,
+					sizeof(values[0]), found) != MAXHASH_ERR_OK)
+			return failures + 1;
+
+		for (size_t i = 0; i < n; i++)
+			failures += found[i] != model->present[base + i] ||
+				(found[i] && values[i] != model->values[base + i]);
+	}
+
+	size_t size;
+	failures += maxhash_size(table, &size) != MAXHASH_ERR_OK ||
+		size != model->num_present;
+	return failures;
+}
+
+
+/*
+ * Put keys 0 to "num_keys" - 1, overwriting and removing earlier keys along
+ * the way, and check lookups as the index grows.
+ */
+static size_t fill(maxhash_table_t *table, struct model *model,
+		size_t num_keys)
+{
+	size_t failures = 0;
+
+	for (size_t i = 0; i < num_keys; i++)
+	{
+		uint64_t key = key_of(i);
+		uint64_t value = (uint64_t)rand() << 16 | i;
+
+		failures += maxhash_put(table, &key, sizeof(key), &value,
+				sizeof(value)) != MAXHASH_ERR_OK;
+		if (!model->present[i])
+			model->num_present++;
+		model->present[i] = true;
+		model->values[i] = value;
+
+		/* Change an earlier key: overwrite it, remove it or put it back. */
+		size_t j = (size_t)rand() % (i + 1);
+		key = key_of(j);
+		if (model->present[j] && rand() % 2)
+		{
+			failures += maxhash_remove(table, &key, sizeof(key)) !=
+				MAXHASH_ERR_OK;
+			model->present[j] = false;
+			model->num_present--;
+		}
+		else
+		{
+			value = rand();
+			failures += maxhash_put(table, &key, sizeof(key), &value,
+					sizeof(value)) != MAXHASH_ERR_OK;
+			if (!model->present[j])
+				model->num_present++;
+			model->present[j] = true;
+			model->values[j] = value;
+		}
+
+		failures += check_key(table, model, i);
+		failures += check_key(table, model, j);
+		failures += check_key(table, model, (size_t)rand() % num_keys);
+
+		if ((i & (i - 1)) == 0 || i % 8192 == 0)
+			failures += check_all(table, model, i + 1);
+
+		if (failures > 10)
+			break;
+	}
+
+	return failures + check_all(table, model, num_keys);
+}
+
+
+int main(void)
+{
+	maxhash_table_params_t *params = sw_table_params(NUM_VALUES, 64);
+	size_t failures = 0;
+
+	maxhash_table_params_set_num_intermediate_entries(params,
+			NUM_INTERMEDIATE);
+	maxhash_table_t *table = create_table(params);
+	if (table == NULL)
+		return 1;
+
+	struct model *model = calloc(1, sizeof(struct model));
+	srand(1);
+	failures += fill(table, model, MAX_KEYS);
+
+	/* Clear the table part way through growing its index, and fill it
+	 * again. */
+	for (size_t num_keys = 3000; num_keys <= MAX_KEYS; num_keys *= 5)
+	{
+		failures += fill(table, model, num_keys);
+		failures += maxhash_clear(table) != MAXHASH_ERR_OK;
+		memset(model, 0, sizeof(struct model));
+		failures += check_all(table, model, num_keys);
+	}
+	failures += fill(table, model, MAX_KEYS / 2);
+
+	free(model);
+	maxhash_free(table);
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * jenkins_test.c
+ *
+ * Checks that every Jenkins hash implementation in the MaxHash runtime is
+ * bit-exact with the hardware hash (src/maxpower/hash/functions/JenkinsHash.maxj)
+ * for all supported chunk widths.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <maxhash_internal.h>
+
+#define MAX_KEY_BITS 256
+#define NUM_KEYS 67
+#define NUM_PARAMS 5
+
+
+/*
+ * Model of JenkinsHash.hash() working bit by bit: the key is padded with
+ * zeros at its most significant end to a whole number of chunks, and the
+ * chunks are consumed starting with the least significant one.
+ */
+static uint32_t model_jenkins(const uint8_t *key, size_t key_bits,
+		uint32_t param, size_t chunk_bits)
+{
+	size_t num_chunks = (key_bits + chunk_bits - 1) / chunk_bits;
+	uint32_t hash = param;
+
+	for (size_t chunk = 0; chunk < num_chunks; chunk++)
+	{
+		uint32_t value = 0;
+		for (size_t bit = 0; bit < chunk_bits; bit++)
+		{
+			size_t key_bit = chunk * chunk_bits + bit;
+			if (key_bit < key_bits && (key[key_bit / 8] >> (key_bit % 8) & 1))
+				value |= UINT32_C(1) << bit;
+		}
+		hash += value;
+		hash += hash << 10;
+		hash ^= hash >> 6;
+	}
+
+	hash += hash << 3;
+	hash ^= hash >> 11;
+	hash += hash << 15;
+	return hash;
+}
+
+
+static void random_key(uint8_t *key, size_t key_bits)
+{
+	size_t key_bytes = (key_bits + 7) / 8;
+	for (size_t i = 0; i < key_bytes; i++)
+		key[i] = rand();
+	/* Keys never have bits set beyond their width. */
+	if (key_bits % 8)
+		key[key_bytes - 1] &= (1 << (key_bits % 8)) - 1;
+}
+
+
+int main(void)
+{
+	const char *simd_names[] = {"scalar", "avx2", "avx512"};
+	static uint8_t keys[NUM_KEYS][MAX_KEY_BITS / 8];
+	const void *key_ptrs[NUM_KEYS];
+	uint32_t params[NUM_KEYS];
+	uint32_t expected[NUM_KEYS];
+	uint32_t hashes[NUM_KEYS];
+	size_t failures = 0;
+	size_t checks = 0;
+
+	srand(1);
+
+	for (maxhash_simd_t simd = MAXHASH_SIMD_SCALAR; simd <= MAXHASH_SIMD_AVX512;
+			simd++)
+	{
+		if (!maxhash_simd_supported(simd))
+		{
+			printf("Skipping %s: not supported by this CPU.\n",
+					simd_names[simd]);
+			continue;
+		}
+
+		for (size_t chunk_bytes = 1; chunk_bytes <=
+				MAXHASH_JENKINS_MAX_CHUNK_BYTES; chunk_bytes++)
+		{
+			for (size_t key_bits = 1; key_bits <= MAX_KEY_BITS; key_bits++)
+			{
+				size_t key_bytes = (key_bits + 7) / 8;
+
+				/* Many keys under random parameters, then one key under
+				 * many parameters, as perfect hash creation uses it. */
+				for (size_t mode = 0; mode < 2; mode++)
+				{
+					uint32_t base_param = rand();
+					for (size_t i = 0; i < NUM_KEYS; i++)
+					{
+						if (mode == 0 || i == 0)
+							random_key(keys[i], key_bits);
+						key_ptrs[i] = mode == 0 ? keys[i] : keys[0];
+						params[i] = mode == 0 ?
+							(i < NUM_PARAMS ? i : (uint32_t)rand()) :
+							base_param + i;
+						expected[i] = model_jenkins(key_ptrs[i], key_bits,
+								params[i], chunk_bytes * 8);
+					}
+
+					if (maxhash_function_jenkins_multi_simd(simd, key_ptrs,
+								key_bytes, params, NUM_KEYS, chunk_bytes,
+								hashes) != MAXHASH_ERR_OK)
+						return 1;
+
+					for (size_t i = 0; i < NUM_KEYS; i++)
+					{
+						uint32_t scalar = maxhash_function_jenkins(
+								key_ptrs[i], key_bytes, params[i],
+								chunk_bytes);
+						checks++;
+						if (hashes[i] != expected[i] || scalar != expected[i])
+						{
+							if (failures++ < 10)
+								fprintf(stderr, "Mismatch (%s, chunk: %zu "
+										"bytes, key: %zu bits, lane: %zu): "
+										"model %08x, multi %08x, scalar "
+										"%08x\n", simd_names[simd],
+										chunk_bytes, key_bits, i, expected[i],
+										hashes[i], scalar);
+						}
+					}
+				}
+			}
+		}
+
+		printf("Checked %s implementation.\n", simd_names[simd]);
+	}
+
+	if (maxhash_function_jenkins_multi_simd(MAXHASH_SIMD_SCALAR, key_ptrs, 8,
+				params, 1, MAXHASH_JENKINS_MAX_CHUNK_BYTES + 1, hashes) ==
+			MAXHASH_ERR_OK)
+	{
+		fprintf(stderr, "Unsupported chunk width was accepted.\n");
+		failures++;
+	}
+
+	printf("%zu of %zu hashes mismatched.\n", failures, checks);
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
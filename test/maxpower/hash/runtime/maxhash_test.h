@@ -0,0 +1,137 @@
+/*
+ * maxhash_test.h
+ *
+ * Helpers shared by the MaxHash runtime tests and benchmarks.  Those for the
+ * mock SLiC engine are only defined if slic_mock.h is included first.
+ */
+
+#ifndef MAXHASH_TEST_H_
+#define MAXHASH_TEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <maxhash.h>
+
+
+/* Distinct keys, also in their low 32 bits, spread over the whole word. */
+static inline uint64_t key_of(size_t i)
+{
+	return i * UINT64_C(0x9E3779B97F4A7C15) + 1;
+}
+
+
+static inline double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/* Parameters for a software table of "size" values with 64-bit keys. */
+static inline maxhash_table_params_t *sw_table_params(size_t size,
+		size_t value_width_bits)
+{
+	maxhash_table_params_t *params;
+
+	maxhash_table_params_init(&params);
+	maxhash_table_params_set_size(params, size);
+	maxhash_table_params_set_key_width_bits(params, 64);
+	maxhash_table_params_set_value_width_bits(params, value_width_bits);
+	return params;
+}
+
+
+/* Create a software table and free its parameters.  Returns NULL if the table
+ * could not be created. */
+static inline maxhash_table_t *create_table(maxhash_table_params_t *params)
+{
+	maxhash_table_t *table;
+
+	if (maxhash_sw_table_init(&table, params) != MAXHASH_ERR_OK)
+		table = NULL;
+
+	maxhash_table_params_free(params);
+	return table;
+}
+
+
+/* Count a failure in "failures", and report it with "step", unless "cond"
+ * holds. */
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s: check failed: %s\n", step, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+/* As CHECK(), but reports the name of the configuration too. */
+#define CHECK_NAMED(cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s, %s: check failed: %s\n", name, step, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+
+#ifdef SLIC_MOCK_H_
+
+#define LMEM_BURST_BYTES 384
+
+
+/* Create the hardware table "hash_table_name" of "kernel_name" on the engine
+ * of "es", with its LMem accessed through the mock engine.  Returns NULL if
+ * the table could not be created. */
+static inline maxhash_table_t *create_mock_table(const char *kernel_name,
+		const char *hash_table_name, maxhash_engine_state_t *es)
+{
+	maxhash_table_t *table;
+
+	if (maxhash_hw_table_init(&table, kernel_name, hash_table_name, es) !=
+			MAXHASH_ERR_OK)
+		return NULL;
+
+	maxhash_set_memory_access_fn(table, slic_mock_lmem_access, es->engine);
+	return table;
+}
+
+
+/* Create a mock maxfile with a single MinimalPerfectHashMap, load it into
+ * "es" and create the table on it.  Returns NULL on failure. */
+static inline maxhash_table_t *create_mock_perfect_table(
+		const slic_mock_perfect_params_t *params, maxhash_engine_state_t *es)
+{
+	max_file_t *maxfile = slic_mock_maxfile_init(LMEM_BURST_BYTES);
+	if (maxfile == NULL)
+		return NULL;
+	if (!slic_mock_add_perfect(maxfile, params))
+	{
+		max_file_free(maxfile);
+		return NULL;
+	}
+
+	*es = (maxhash_engine_state_t) { maxfile, max_load(maxfile, "*"), 0 };
+	return create_mock_table(params->kernel_name, params->hash_table_name,
+			es);
+}
+
+
+/* Free a table made by create_mock_perfect_table(), and its engine. */
+static inline void free_mock_perfect_table(maxhash_table_t *table,
+		maxhash_engine_state_t *es)
+{
+	maxhash_free(table);
+	max_unload(es->engine);
+	max_file_free(es->maxfile);
+}
+
+#endif /* SLIC_MOCK_H_ */
+
+#endif /* MAXHASH_TEST_H_ */
@@ -0,0 +1,133 @@
+/*
+ * perfect_advise_test.c
+ *
+ * Checks maxhash_perfect_advise() against perfect hash tables built with
+ * maxhash_perfect_create(): each intermediate size must report the same
+ * largest hash parameter and number of hashes as a table of that size, and
+ * sizes for which there is no perfect hash must be reported as not built.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <maxhash.h>
+
+#include "maxhash_test.h"
+
+#define NUM_VALUES 8192
+#define NUM_KEYS   6000
+
+
+static maxhash_table_params_t *create_params(size_t chunk_width_bits)
+{
+	maxhash_table_params_t *params = sw_table_params(NUM_VALUES, 32);
+
+	maxhash_table_params_set_jenkins_chunk_width_bits(params,
+			chunk_width_bits);
+	maxhash_table_params_set_num_threads(params, 2);
+	return params;
+}
+
+
+/* Build a table of the given size the usual way and check "advice". */
+static size_t check(maxhash_table_params_t *params, const uint64_t *keys,
+		const maxhash_perfect_advice_t *advice)
+{
+	maxhash_table_t *table;
+	size_t failures = 0;
+
+	maxhash_table_params_set_num_intermediate_entries(params,
+			advice->num_intermediate_entries);
+	if (maxhash_sw_table_init(&table, params) != MAXHASH_ERR_OK)
+		return 1;
+
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		uint32_t value = i;
+		failures += maxhash_put(table, &keys[i], sizeof(keys[i]), &value,
+				sizeof(value)) != MAXHASH_ERR_OK;
+	}
+
+	bool built = maxhash_perfect_create(table) == MAXHASH_ERR_OK;
+	maxhash_stats_t stats;
+	maxhash_get_stats(table, &stats);
+
+	if (built != advice->built || (built &&
+				(stats.parameter_max != advice->stats.parameter_max ||
+				 stats.parameter_bits != advice->stats.parameter_bits ||
+				 stats.num_hashes != advice->stats.num_hashes)))
+	{
+		fprintf(stderr, "%zu intermediate entries: built: %d (advised: %d), "
+				"largest parameter: %zu (advised: %zu), hashes: %zu (advised: "
+				"%zu).\n", advice->num_intermediate_entries, built,
+				advice->built, stats.parameter_max,
+				advice->stats.parameter_max, stats.num_hashes,
+				advice->stats.num_hashes);
+		failures++;
+	}
+
+	maxhash_free(table);
+	return failures;
+}
+
+
+int main(void)
+{
+	size_t failures = 0;
+	uint64_t *keys = malloc(NUM_KEYS * sizeof(uint64_t));
+	for (size_t i = 0; i < NUM_KEYS; i++)
+		keys[i] = key_of(i);
+
+	const size_t sizes[] = { 8192, 4096, 2048, 1024, 512 };
+	const size_t num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+	maxhash_perfect_advice_t advice[num_sizes];
+
+	for (size_t chunk_width_bits = 8; chunk_width_bits <= 32;
+			chunk_width_bits *= 4)
+	{
+		maxhash_table_params_t *params = create_params(chunk_width_bits);
+
+		if (maxhash_perfect_advise(params, keys, sizeof(keys[0]), NUM_KEYS,
+					sizes, num_sizes, advice) != MAXHASH_ERR_OK)
+		{
+			fprintf(stderr, "Error: maxhash_perfect_advise() failed.\n");
+			failures++;
+			break;
+		}
+
+		for (size_t i = 0; i < num_sizes; i++)
+		{
+			printf("chunk width: %2zu bits, intermediate entries: %5zu, "
+					"built: %d, %.3f s, largest parameter: %zu (%zu bits)\n",
+					chunk_width_bits, advice[i].num_intermediate_entries,
+					advice[i].built, advice[i].stats.search_seconds,
+					advice[i].stats.parameter_max,
+					advice[i].stats.parameter_bits);
+			failures += advice[i].num_intermediate_entries != sizes[i];
+			failures += check(params, keys, &advice[i]);
+		}
+
+		/* Smaller intermediate tables put more keys in each bucket. */
+		failures += !advice[0].built || advice[0].stats.parameter_max >
+			advice[num_sizes - 1].stats.parameter_max;
+
+		maxhash_table_params_free(params);
+	}
+
+	/* With a single intermediate entry, every key is in one bucket, which is
+	 * more than a hash parameter can be searched for. */
+	const size_t one = 1;
+	maxhash_table_params_t *params = create_params(32);
+	if (maxhash_perfect_advise(params, keys, sizeof(keys[0]), NUM_KEYS, &one,
+				1, advice) != MAXHASH_ERR_OK || advice[0].built)
+		failures++;
+	failures += check(params, keys, &advice[0]);
+	maxhash_table_params_free(params);
+
+	free(keys);
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,209 @@
+/*
+ * put_batch_test.c
+ *
+ * Puts the same keys and values in two MaxHash tables, one with
+ * maxhash_put_batch() and one with maxhash_put() in a loop, and checks that
+ * both report the same error for every pair and end up with the same
+ * contents.  Keys and values are laid out with strides narrower than, equal
+ * to and wider than the table's widths, and some of them have bits set
+ * beyond those widths.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <maxhash.h>
+
+#include "maxhash_test.h"
+
+#define NUM_VALUES 2048
+/* More than one block of a batch, and not a whole number of blocks. */
+#define NUM_KEYS   600
+#define MAX_STRIDE 16
+
+
+struct config {
+	size_t key_width_bits;
+	size_t value_width_bits;
+};
+
+static const struct config configs[] = {
+	/* Widths that are a whole number of bytes, so that items whose strides
+	 * match them are used in place. */
+	{ 32, 32 },
+	/* Widths that are not, so that even those items are checked. */
+	{ 20, 28 },
+};
+
+
+static size_t width_bytes(size_t width_bits)
+{
+	return (width_bits + 7) / 8;
+}
+
+
+/* Write the low "stride" bytes of "word", limited to "width_bits" bits, to
+ * item "i" of "items".  Items with "excess" set also get the first bit
+ * beyond the width, if the stride has room for it. */
+static void set_item(uint8_t *items, size_t stride, size_t i, uint64_t word,
+		size_t width_bits, bool excess)
+{
+	uint8_t *item = items + i * stride;
+
+	if (width_bits < 64)
+		word &= (UINT64_C(1) << width_bits) - 1;
+	memset(item, 0, stride);
+	for (size_t byte = 0; byte < stride && byte < 8; byte++)
+		item[byte] = word >> (byte * 8);
+
+	if (excess && stride * 8 > width_bits)
+		item[width_bits / 8] |= 1 << (width_bits % 8);
+}
+
+
+/* Check that both tables give the same answers for every key of the batch,
+ * looked up with the key's own stride. */
+static size_t compare(maxhash_table_t *batch, maxhash_table_t *single,
+		const uint8_t *keys, size_t key_stride, const char *stage)
+{
+	size_t failures = 0;
+
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		const uint8_t *key = keys + i * key_stride;
+		uint64_t value[2] = { 0, 0 };
+		maxhash_err_t err[2];
+
+		err[0] = maxhash_get(batch, key, key_stride, &value[0]);
+		err[1] = maxhash_get(single, key, key_stride, &value[1]);
+
+		if ((err[0] != err[1] || value[0] != value[1]) && failures++ < 10)
+			fprintf(stderr, "Mismatch (%s, key: %zu): batch %d/%016llx, "
+					"single %d/%016llx\n", stage, i, err[0],
+					(unsigned long long)value[0], err[1],
+					(unsigned long long)value[1]);
+	}
+
+	return failures;
+}
+
+
+/*
+ * Put NUM_KEYS pairs with the given strides in a table with the widths of
+ * "config", both ways.  If "bad_items" is set, some keys and values have
+ * excess bits and some keys are repeated, and the per-key errors are
+ * compared; otherwise every put must succeed and no errors are asked for.
+ */
+static size_t run(const struct config *config, size_t key_stride,
+		size_t value_stride, bool bad_items)
+{
+	maxhash_table_t *tables[2];
+	uint8_t *keys = calloc(NUM_KEYS, key_stride);
+	uint8_t *values = calloc(NUM_KEYS, value_stride);
+	maxhash_err_t *errors = malloc(NUM_KEYS * sizeof(maxhash_err_t));
+	size_t num_failed = 0;
+	size_t failures = 0;
+	char stage[64];
+
+	snprintf(stage, sizeof(stage), "widths: %zu/%zu, strides: %zu/%zu%s",
+			config->key_width_bits, config->value_width_bits, key_stride,
+			value_stride, bad_items ? ", bad items" : "");
+
+	for (size_t t = 0; t < 2; t++)
+	{
+		maxhash_table_params_t *params = sw_table_params(NUM_VALUES,
+				config->value_width_bits);
+		maxhash_table_params_set_key_width_bits(params,
+				config->key_width_bits);
+		tables[t] = create_table(params);
+	}
+	if (tables[0] == NULL || tables[1] == NULL || keys == NULL ||
+			values == NULL || errors == NULL)
+		return 1;
+
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		/* Repeated keys update the value put earlier in the batch. */
+		size_t k = bad_items && i % 13 == 5 ? i - 1 : i;
+		set_item(keys, key_stride, i, key_of(k), config->key_width_bits,
+				bad_items && i % 7 == 3);
+		set_item(values, value_stride, i, key_of(NUM_KEYS + i),
+				config->value_width_bits, bad_items && i % 11 == 4);
+	}
+
+	/* Neither error, so that any left unwritten show up. */
+	memset(errors, 0xff, NUM_KEYS * sizeof(maxhash_err_t));
+	maxhash_err_t err = maxhash_put_batch(tables[0], keys, key_stride,
+			values, value_stride, NUM_KEYS, bad_items ? errors : NULL);
+
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		maxhash_err_t expected = maxhash_put(tables[1], keys + i * key_stride,
+				key_stride, values + i * value_stride, value_stride);
+		num_failed += expected != MAXHASH_ERR_OK;
+
+		if (bad_items && errors[i] != expected && failures++ < 10)
+			fprintf(stderr, "Wrong error (%s, key: %zu): %d, expected %d\n",
+					stage, i, errors[i], expected);
+	}
+
+	/* Only the bad items fail, and then only where the strides have room
+	 * for excess bits. */
+	size_t expected_failed = 0;
+	for (size_t i = 0; bad_items && i < NUM_KEYS; i++)
+		expected_failed += (key_stride * 8 > config->key_width_bits &&
+				i % 7 == 3) || (value_stride * 8 > config->value_width_bits &&
+				i % 11 == 4);
+	if (num_failed != expected_failed)
+	{
+		fprintf(stderr, "%zu puts failed (%s), expected %zu\n", num_failed,
+				stage, expected_failed);
+		failures++;
+	}
+
+	if (err != (num_failed ? MAXHASH_ERR_ERR : MAXHASH_ERR_OK))
+	{
+		fprintf(stderr, "maxhash_put_batch() returned %d (%s) with %zu puts "
+				"failed\n", err, stage, num_failed);
+		failures++;
+	}
+
+	failures += compare(tables[0], tables[1], keys, key_stride, stage);
+
+	maxhash_free(tables[0]);
+	maxhash_free(tables[1]);
+	free(keys);
+	free(values);
+	free(errors);
+	return failures;
+}
+
+
+int main(void)
+{
+	size_t failures = 0;
+
+	for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++)
+	{
+		size_t key_bytes = width_bytes(configs[c].key_width_bits);
+		size_t value_bytes = width_bytes(configs[c].value_width_bits);
+		/* Narrower than, equal to and wider than the widths. */
+		size_t key_strides[] = { key_bytes - 1, key_bytes, MAX_STRIDE - 3 };
+		size_t value_strides[] = { value_bytes - 2, value_bytes, MAX_STRIDE };
+
+		for (size_t k = 0; k < 3; k++)
+			for (size_t v = 0; v < 3; v++)
+			{
+				failures += run(&configs[c], key_strides[k], value_strides[v],
+						false);
+				failures += run(&configs[c], key_strides[k], value_strides[v],
+						true);
+			}
+	}
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
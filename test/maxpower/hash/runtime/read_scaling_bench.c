@@ -0,0 +1,173 @@
+/*
+ * read_scaling_bench.c
+ *
+ * Measures the lookup throughput of a software MaxHash table with concurrent
+ * reads enabled, for increasing numbers of reader threads, with and without
+ * a writer overwriting keys at the same time.
+ *
+ * Usage: read_scaling_bench [<num keys> [<max threads>]]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <maxhash.h>
+
+#include "maxhash_test.h"
+
+#define RUN_SECONDS 1.0
+#define BATCH_SIZE  64
+
+
+struct run {
+	maxhash_table_t *table;
+	size_t num_keys;
+	bool batched;
+	bool stop;
+};
+
+
+struct worker {
+	pthread_t thread;
+	struct run *run;
+	unsigned seed;
+	size_t num_ops;
+};
+
+
+static void *reader_main(void *arg)
+{
+	struct worker *w = arg;
+	struct run *run = w->run;
+	uint64_t keys[BATCH_SIZE];
+	uint64_t values[BATCH_SIZE];
+	bool found[BATCH_SIZE];
+
+	while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED))
+	{
+		for (size_t i = 0; i < BATCH_SIZE; i++)
+			keys[i] = key_of((size_t)rand_r(&w->seed) % run->num_keys);
+
+		if (run->batched)
+			maxhash_get_batch(run->table, keys, sizeof(keys[0]), BATCH_SIZE,
+					values, sizeof(values[0]), found);
+		else
+			for (size_t i = 0; i < BATCH_SIZE; i++)
+				maxhash_get(run->table, &keys[i], sizeof(keys[i]), &values[i]);
+
+		w->num_ops += BATCH_SIZE;
+	}
+
+	return NULL;
+}
+
+
+static void *writer_main(void *arg)
+{
+	struct worker *w = arg;
+	struct run *run = w->run;
+
+	while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED))
+	{
+		uint64_t key = key_of((size_t)rand_r(&w->seed) % run->num_keys);
+		uint64_t value = w->num_ops;
+		maxhash_put(run->table, &key, sizeof(key), &value, sizeof(value));
+		w->num_ops++;
+	}
+
+	return NULL;
+}
+
+
+/* Returns the total lookups per second, and the writer's puts per second. */
+static double measure(struct run *run, size_t num_readers, bool with_writer,
+		double *puts_per_second)
+{
+	struct worker workers[num_readers + 1];
+	double start = now_seconds();
+
+	run->stop = false;
+	for (size_t t = 0; t <= num_readers; t++)
+	{
+		workers[t].run = run;
+		workers[t].seed = t + 1;
+		workers[t].num_ops = 0;
+		if (t < num_readers)
+			pthread_create(&workers[t].thread, NULL, reader_main, &workers[t]);
+		else if (with_writer)
+			pthread_create(&workers[t].thread, NULL, writer_main, &workers[t]);
+	}
+
+	while (now_seconds() - start < RUN_SECONDS)
+		usleep(10000);
+	__atomic_store_n(&run->stop, true, __ATOMIC_RELAXED);
+
+	size_t num_lookups = 0;
+	for (size_t t = 0; t <= num_readers; t++)
+		if (t < num_readers || with_writer)
+			pthread_join(workers[t].thread, NULL);
+	for (size_t t = 0; t < num_readers; t++)
+		num_lookups += workers[t].num_ops;
+
+	double elapsed = now_seconds() - start;
+	*puts_per_second = with_writer ? workers[num_readers].num_ops / elapsed : 0;
+	return num_lookups / elapsed;
+}
+
+
+int main(int argc, char *argv[])
+{
+	size_t num_keys = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+	size_t max_threads = argc > 2 ? strtoul(argv[2], NULL, 0) :
+		(size_t)sysconf(_SC_NPROCESSORS_ONLN);
+
+	maxhash_table_params_t *params = sw_table_params(num_keys, 64);
+	maxhash_table_params_set_concurrent_reads(params, true);
+
+	struct run run = { create_table(params), num_keys, false, false };
+	if (run.table == NULL)
+		return 1;
+
+	for (size_t i = 0; i < num_keys; i++)
+	{
+		uint64_t key = key_of(i);
+		if (maxhash_put(run.table, &key, sizeof(key), &i, sizeof(i)) !=
+				MAXHASH_ERR_OK)
+			return 1;
+	}
+
+	printf("%8s %8s %16s %10s %16s\n", "lookup", "threads", "lookups/s",
+			"scaling", "writer puts/s");
+
+	for (int batched = 0; batched < 2; batched++)
+	{
+		for (int with_writer = 0; with_writer < 2; with_writer++)
+		{
+			double single = 0;
+			run.batched = batched;
+
+			for (size_t threads = 1; threads <= max_threads; threads *= 2)
+			{
+				double puts_per_second;
+				double rate = measure(&run, threads, with_writer,
+						&puts_per_second);
+				if (threads == 1)
+					single = rate;
+
+				printf("%8s %8zu %16.0f %9.2fx %16.0f\n",
+						batched ? "batch" : "single", threads, rate,
+						rate / single, puts_per_second);
+			}
+		}
+	}
+
+	maxhash_free(run.table);
+	return 0;
+}
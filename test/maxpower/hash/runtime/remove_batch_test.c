@@ -0,0 +1,189 @@
+/*
+ * remove_batch_test.c
+ *
+ * Removes keys in batches from MaxHash tables backed by the mock SLiC engine,
+ * some of them put back or removed while a commit is in progress, and checks
+ * that the next commit stops the kernel's lookup from finding them without
+ * placing any keys again, while every other key is still found with its
+ * value.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <maxhash.h>
+
+#include "slic_mock.h"
+
+#include "maxhash_test.h"
+
+#define KERNEL_NAME      "RemoveKernel"
+#define TABLE_NAME       "RemoveTable"
+#define NUM_VALUES       8192
+#define NUM_INTERMEDIATE 2048
+#define NUM_KEYS         6000
+
+
+/* Check that the kernel finds exactly the keys that are present. */
+static size_t check(const char *name, const char *step, max_engine_t *engine,
+		const bool *present, const uint32_t *values)
+{
+	size_t failures = 0;
+
+	for (size_t i = 0; i < NUM_KEYS + NUM_KEYS / 4; i++)
+	{
+		uint32_t key = key_of(i);
+		uint32_t value = 0;
+		bool contains_key;
+
+		if (!slic_mock_perfect_get(engine, KERNEL_NAME, TABLE_NAME, &key,
+					&value, &contains_key))
+			return failures + 1;
+
+		bool expected = i < NUM_KEYS && present[i];
+		bool ok = contains_key == expected &&
+			(!expected || value == values[i]);
+		if (!ok && failures++ < 10)
+			fprintf(stderr, "%s, %s: key %zu: found: %d (expected %d), value: "
+					"%u (expected %u).\n", name, step, i, contains_key,
+					expected, value, expected ? values[i] : 0);
+	}
+
+	return failures;
+}
+
+
+/* Remove every "stride"th key from "first" on, and some keys never put. */
+static size_t remove_keys(const char *name, const char *step,
+		maxhash_table_t *table, bool *present, size_t first, size_t stride)
+{
+	uint32_t keys[NUM_KEYS / 2];
+	bool removed[NUM_KEYS / 2];
+	size_t n = 0;
+	size_t failures = 0;
+
+	for (size_t i = first; i < NUM_KEYS + NUM_KEYS / 4 && n < NUM_KEYS / 2;
+			i += stride)
+		keys[n++] = key_of(i);
+
+	CHECK_NAMED(maxhash_remove_batch(table, keys, sizeof(keys[0]), n,
+				removed) == MAXHASH_ERR_OK);
+
+	for (size_t k = 0, i = first; k < n; k++, i += stride)
+	{
+		CHECK_NAMED(removed[k] == (i < NUM_KEYS && present[i]));
+		if (i < NUM_KEYS)
+			present[i] = false;
+	}
+
+	return failures;
+}
+
+
+static size_t run(const char *name, slic_mock_mem_type_t mem_type)
+{
+	slic_mock_perfect_params_t params = {
+		.kernel_name = KERNEL_NAME,
+		.hash_table_name = TABLE_NAME,
+		.key_width_bits = 32,
+		.value_width_bits = 24,
+		.jenkins_chunk_width_bits = 8,
+		.num_intermediate_buckets = NUM_INTERMEDIATE,
+		.num_values_buckets = NUM_VALUES,
+		.intermediate_mem_type = mem_type,
+		.values_mem_type = mem_type,
+		.double_buffered = true,
+		.validate_results = true,
+	};
+
+	maxhash_engine_state_t es;
+	maxhash_table_t *table = create_mock_perfect_table(&params, &es);
+	if (table == NULL)
+		return 1;
+
+	static bool present[NUM_KEYS];
+	static uint32_t values[NUM_KEYS];
+	maxhash_stats_t full, stats;
+	size_t failures = 0;
+	const char *step = "full commit";
+
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		uint32_t key = key_of(i);
+		values[i] = i;
+		present[i] = true;
+		failures += maxhash_put(table, &key, sizeof(key), &values[i], 3) !=
+			MAXHASH_ERR_OK;
+	}
+	CHECK_NAMED(maxhash_commit(table) == MAXHASH_ERR_OK);
+	maxhash_get_stats(table, &full);
+	failures += check(name, step, es.engine, present, values);
+
+	/* Fill the other buffer too, so that later commits only write changes. */
+	CHECK_NAMED(maxhash_commit(table) == MAXHASH_ERR_OK);
+
+	/* Removing keys places nothing, and a few removals write less, except to
+	 * Deep FMem, which can only be written whole. */
+	step = "remove";
+	failures += remove_keys(name, step, table, present, 0, 64);
+	size_t size;
+	maxhash_size(table, &size);
+	CHECK_NAMED(size == NUM_KEYS - (NUM_KEYS + 63) / 64);
+	CHECK_NAMED(maxhash_commit(table) == MAXHASH_ERR_OK);
+	maxhash_get_stats(table, &stats);
+	CHECK_NAMED(stats.incremental);
+	CHECK_NAMED(stats.moved_entries == 0);
+	CHECK_NAMED(stats.num_hashes == 0);
+	CHECK_NAMED(mem_type == SLIC_MOCK_DEEP_FMEM ||
+			stats.bytes_transferred < full.bytes_transferred);
+	failures += check(name, step, es.engine, present, values);
+
+	/* Keys put back before the commit keep or regain their slots. */
+	step = "remove and put back";
+	failures += remove_keys(name, step, table, present, 1, 4);
+	for (size_t i = 1; i < NUM_KEYS; i += 8)
+	{
+		uint32_t key = key_of(i);
+		values[i] = i + 1;
+		present[i] = true;
+		failures += maxhash_put(table, &key, sizeof(key), &values[i], 3) !=
+			MAXHASH_ERR_OK;
+	}
+	CHECK_NAMED(maxhash_commit(table) == MAXHASH_ERR_OK);
+	failures += check(name, step, es.engine, present, values);
+
+	/* Keys removed while a commit is in progress go in the next one. */
+	step = "remove during commit";
+	maxhash_commit_t *c;
+	CHECK_NAMED(maxhash_commit_async(table, &c) == MAXHASH_ERR_OK);
+	failures += remove_keys(name, step, table, present, 2, 4);
+	CHECK_NAMED(maxhash_commit_wait(c) == MAXHASH_ERR_OK);
+	CHECK_NAMED(maxhash_commit(table) == MAXHASH_ERR_OK);
+	failures += check(name, step, es.engine, present, values);
+
+	/* Both buffers end up without the removed keys. */
+	step = "catch up";
+	CHECK_NAMED(maxhash_commit(table) == MAXHASH_ERR_OK);
+	failures += check(name, step, es.engine, present, values);
+
+	free_mock_perfect_table(table, &es);
+
+	printf("%-20s %s\n", name, failures ? "FAILED" : "passed");
+	return failures;
+}
+
+
+int main(void)
+{
+	size_t failures = 0;
+
+	failures += run("FMem", SLIC_MOCK_FMEM);
+	failures += run("Deep FMem", SLIC_MOCK_DEEP_FMEM);
+	failures += run("LMem", SLIC_MOCK_LMEM);
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * replicate_test.c
+ *
+ * Commits a MaxHash table replicated on four mock SLiC engines, with plain,
+ * asynchronous and scheduled commits, and checks that the kernel on every
+ * engine finds every key with its value afterwards, that the statistics
+ * report each engine, and that a table cannot be replicated on engines whose
+ * MaxFiles differ.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <maxhash.h>
+
+#include "slic_mock.h"
+
+#include "maxhash_test.h"
+
+#define KERNEL_NAME      "ReplicateKernel"
+#define TABLE_NAME       "ReplicateTable"
+#define NUM_ENGINES      4
+#define NUM_VALUES       4096
+#define NUM_INTERMEDIATE 1024
+#define NUM_KEYS         3000
+#define NUM_ROUNDS       6
+
+
+/* Check that the kernel on an engine finds exactly the keys present. */
+static size_t check(const char *name, const char *step, size_t engine_id,
+		max_engine_t *engine, const bool *present, const uint32_t *values)
+{
+	size_t failures = 0;
+
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		uint32_t key = key_of(i);
+		uint32_t value = 0;
+		bool contains_key;
+
+		if (!slic_mock_perfect_get(engine, KERNEL_NAME, TABLE_NAME, &key,
+					&value, &contains_key))
+			return failures + 1;
+
+		if ((contains_key != present[i] || (present[i] &&
+						value != values[i])) && failures++ < 5)
+			fprintf(stderr, "%s, %s, engine %zu: key %zu: found: %d (expected "
+					"%d), value: %u (expected %u).\n", name, step, engine_id, i,
+					contains_key, present[i], value, values[i]);
+	}
+
+	return failures;
+}
+
+
+static max_file_t *create_maxfile(slic_mock_mem_type_t mem_type,
+		size_t num_values)
+{
+	slic_mock_perfect_params_t params = {
+		.kernel_name = KERNEL_NAME,
+		.hash_table_name = TABLE_NAME,
+		.key_width_bits = 32,
+		.value_width_bits = 24,
+		.jenkins_chunk_width_bits = 8,
+		.num_intermediate_buckets = NUM_INTERMEDIATE,
+		.num_values_buckets = num_values,
+		.intermediate_mem_type = mem_type,
+		.values_mem_type = mem_type,
+		.double_buffered = true,
+		.validate_results = true,
+	};
+
+	max_file_t *maxfile = slic_mock_maxfile_init(LMEM_BURST_BYTES);
+	if (maxfile != NULL && !slic_mock_add_perfect(maxfile, &params))
+	{
+		max_file_free(maxfile);
+		return NULL;
+	}
+	return maxfile;
+}
+
+
+static size_t run(const char *name, slic_mock_mem_type_t mem_type)
+{
+	max_file_t *maxfiles[NUM_ENGINES + 1];
+	maxhash_engine_state_t es[NUM_ENGINES + 1];
+	maxhash_engine_state_t *engine_states[NUM_ENGINES + 1];
+
+	/* Each engine has its own copy of the MaxFile loaded, and the last one
+	 * has a table of a different size. */
+	for (size_t e = 0; e <= NUM_ENGINES; e++)
+	{
+		maxfiles[e] = create_maxfile(mem_type, e < NUM_ENGINES ? NUM_VALUES :
+				NUM_VALUES / 2);
+		if (maxfiles[e] == NULL)
+			return 1;
+		es[e] = (maxhash_engine_state_t) { maxfiles[e],
+			max_load(maxfiles[e], "*"), 0 };
+		engine_states[e] = &es[e];
+	}
+
+	size_t failures = 0;
+	const char *step = "mismatched engine";
+	maxhash_table_t *table;
+	CHECK_NAMED(maxhash_hw_table_init_replicated(&table, KERNEL_NAME,
+				TABLE_NAME, &engine_states[1], NUM_ENGINES) != MAXHASH_ERR_OK);
+
+	if (maxhash_hw_table_init_replicated(&table, KERNEL_NAME, TABLE_NAME,
+				engine_states, NUM_ENGINES) != MAXHASH_ERR_OK)
+		return failures + 1;
+	for (size_t e = 0; e < NUM_ENGINES; e++)
+		maxhash_set_replica_memory_access_fn(table, e, slic_mock_lmem_access,
+				es[e].engine);
+
+	maxhash_scheduler_t *scheduler;
+	if (maxhash_scheduler_init_replicated(&scheduler, engine_states,
+				NUM_ENGINES) != MAXHASH_ERR_OK)
+		return failures + 1;
+
+	static bool present[NUM_KEYS];
+	static uint32_t values[NUM_KEYS];
+	memset(present, 0, sizeof(present));
+	srand(1);
+
+	for (size_t round = 0; round < NUM_ROUNDS; round++)
+	{
+		/* Fill the table, then change some of it in each round. */
+		for (size_t i = 0; i < NUM_KEYS; i++)
+		{
+			if (round > 0 && rand() % 8 != 0)
+				continue;
+
+			uint32_t key = key_of(i);
+			if (present[i] && rand() % 4 == 0)
+			{
+				failures += maxhash_remove(table, &key, sizeof(key)) !=
+					MAXHASH_ERR_OK;
+				present[i] = false;
+			}
+			else
+			{
+				values[i] = rand() & 0xffffff;
+				present[i] = true;
+				failures += maxhash_put(table, &key, sizeof(key), &values[i],
+						3) != MAXHASH_ERR_OK;
+			}
+		}
+
+		maxhash_commit_t *commit;
+		if (round % 3 == 0)
+		{
+			step = "commit";
+			CHECK_NAMED(maxhash_commit(table) == MAXHASH_ERR_OK);
+		}
+		else if (round % 3 == 1)
+		{
+			step = "asynchronous commit";
+			CHECK_NAMED(maxhash_commit_async(table, &commit) == MAXHASH_ERR_OK);
+			CHECK_NAMED(maxhash_commit_wait(commit) == MAXHASH_ERR_OK);
+		}
+		else
+		{
+			step = "scheduled commit";
+			CHECK_NAMED(maxhash_commit_schedule(table, scheduler) ==
+					MAXHASH_ERR_OK);
+			CHECK_NAMED(maxhash_scheduler_flush(scheduler) == MAXHASH_ERR_OK);
+		}
+
+		maxhash_stats_t stats;
+		maxhash_get_stats(table, &stats);
+		CHECK_NAMED(stats.num_replicas == NUM_ENGINES);
+		for (size_t e = 0; e < NUM_ENGINES; e++)
+		{
+			CHECK_NAMED(stats.replica_transfer_seconds[e] > 0);
+			CHECK_NAMED(stats.replica_transfer_seconds[e] <=
+					stats.transfer_seconds);
+			failures += check(name, step, e, es[e].engine, present, values);
+		}
+	}
+
+	/* A scheduler for other engines does not take the table. */
+	maxhash_scheduler_t *other;
+	step = "other scheduler";
+	CHECK_NAMED(maxhash_scheduler_init(&other, &es[0]) == MAXHASH_ERR_OK);
+	CHECK_NAMED(maxhash_commit_schedule(table, other) != MAXHASH_ERR_OK);
+	CHECK_NAMED(maxhash_scheduler_free(other) == MAXHASH_ERR_OK);
+
+	maxhash_scheduler_free(scheduler);
+	maxhash_free(table);
+	for (size_t e = 0; e <= NUM_ENGINES; e++)
+	{
+		max_unload(es[e].engine);
+		max_file_free(maxfiles[e]);
+	}
+
+	printf("%-20s %s\n", name, failures ? "FAILED" : "passed");
+	return failures;
+}
+
+
+int main(void)
+{
+	size_t failures = 0;
+
+	failures += run("FMem", SLIC_MOCK_FMEM);
+	failures += run("Deep FMem", SLIC_MOCK_DEEP_FMEM);
+	failures += run("LMem", SLIC_MOCK_LMEM);
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,546 @@
+/*
+ * runtime_bench.c
+ *
+ * Measures the latency and throughput of the MaxHash runtime's hot paths --
+ * put, get, contains, perfect_get, frozen_get, iteration, commit and remove
+ * -- on LMem tables backed by the mock SLiC engine, for a sweep of key
+ * widths, value widths and table sizes.  Every operation is timed
+ * individually with maxhash_cycles() into a log-linear histogram, from which
+ * the p50, p99 and p99.9 latencies are read.
+ *
+ * Results are written as one JSON object per line, per configuration and
+ * operation, to the output file (runtime_bench.jsonl by default).
+ *
+ * Usage: runtime_bench [-k <key bytes,...>] [-v <value bytes,...>]
+ *                      [-s <table sizes,...>] [-n <ops>] [-c <commits>]
+ *                      [-m <max memory MiB>] [-H] [-o <output file>]
+ *
+ * Table sizes are numbers of values buckets and are rounded up to powers of
+ * two; each table is filled to three quarters of its size.  Commits are
+ * timed once in full, then -c times each for 1, 16, 256 and 4096 changes.
+ * Configurations that would need more than the memory limit are skipped.  -H
+ * adds the non-empty histogram buckets to each result.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <maxhash.h>
+#include <maxhash_internal.h>
+
+#include "slic_mock.h"
+
+#include "maxhash_test.h"
+
+#define KERNEL_NAME     "BenchKernel"
+#define TABLE_NAME      "BenchTable"
+#define MAX_LIST        16
+#define MAX_WIDTH_BYTES 64
+
+/* Latencies below 2^HIST_SUB_BITS cycles get a bucket each; above that, each
+ * power of two is split into 2^HIST_SUB_BITS buckets, for a relative error of
+ * at most about 6%. */
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (64 * HIST_SUB)
+
+
+struct histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t num_samples;
+	uint64_t total_cycles;
+	uint64_t max_cycles;
+};
+
+
+struct options {
+	size_t key_bytes[MAX_LIST];
+	size_t num_key_bytes;
+	size_t value_bytes[MAX_LIST];
+	size_t num_value_bytes;
+	size_t sizes[MAX_LIST];
+	size_t num_sizes;
+	size_t num_ops;
+	size_t num_commits;
+	size_t max_memory_mib;
+	bool histograms;
+	const char *output;
+};
+
+
+struct config {
+	size_t key_bytes;
+	size_t value_bytes;
+	size_t size;
+	size_t num_keys;
+};
+
+
+static double cycles_per_ns;
+static uint64_t timer_overhead;
+static uint64_t rng_state = 1;
+static FILE *out;
+
+
+static uint64_t rng_next(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+
+/* Keys are distinct in their first eight bytes. */
+static void key_bytes_of(size_t i, size_t width_bytes, uint8_t *key)
+{
+	uint64_t word = key_of(i);
+
+	for (size_t byte = 0; byte < width_bytes; byte++)
+		key[byte] = word >> (byte % 8 * 8) ^ byte / 8;
+}
+
+
+static void value_of(size_t width_bytes, uint8_t *value)
+{
+	for (size_t byte = 0; byte < width_bytes; byte++)
+		value[byte] = rng_next();
+}
+
+
+static void calibrate(void)
+{
+	uint64_t c0 = maxhash_cycles();
+	double t0 = now_seconds();
+	while (now_seconds() - t0 < 0.05)
+		;
+	cycles_per_ns = (maxhash_cycles() - c0) / ((now_seconds() - t0) * 1e9);
+
+	timer_overhead = UINT64_MAX;
+	for (size_t i = 0; i < 10000; i++)
+	{
+		uint64_t start = maxhash_cycles();
+		uint64_t cycles = maxhash_cycles() - start;
+		if (cycles < timer_overhead)
+			timer_overhead = cycles;
+	}
+}
+
+
+static size_t hist_bucket(uint64_t cycles)
+{
+	if (cycles < HIST_SUB)
+		return cycles;
+	unsigned shift = 63 - __builtin_clzll(cycles) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (cycles >> shift & (HIST_SUB - 1));
+}
+
+
+/* The largest number of cycles that falls in a bucket. */
+static uint64_t hist_bucket_max(size_t bucket)
+{
+	if (bucket < HIST_SUB)
+		return bucket;
+	unsigned shift = bucket / HIST_SUB - 1;
+	return ((uint64_t)(HIST_SUB + bucket % HIST_SUB + 1) << shift) - 1;
+}
+
+
+static void hist_add(struct histogram *hist, uint64_t start)
+{
+	uint64_t cycles = maxhash_cycles() - start;
+	cycles = cycles > timer_overhead ? cycles - timer_overhead : 0;
+
+	hist->counts[hist_bucket(cycles)]++;
+	hist->num_samples++;
+	hist->total_cycles += cycles;
+	if (cycles > hist->max_cycles)
+		hist->max_cycles = cycles;
+}
+
+
+static double hist_percentile_ns(const struct histogram *hist, double p)
+{
+	uint64_t rank = (uint64_t)(hist->num_samples * p);
+	if (rank == 0)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (size_t bucket = 0; bucket < HIST_BUCKETS; bucket++)
+	{
+		seen += hist->counts[bucket];
+		if (seen >= rank)
+			return hist_bucket_max(bucket) / cycles_per_ns;
+	}
+	return hist->max_cycles / cycles_per_ns;
+}
+
+
+static void report(const struct config *config, const char *op,
+		size_t changes, const struct histogram *hist, bool histograms)
+{
+	if (hist->num_samples == 0)
+		return;
+
+	double total_ns = hist->total_cycles / cycles_per_ns;
+	fprintf(out, "{\"op\": \"%s\", \"key_bytes\": %zu, \"value_bytes\": %zu, "
+			"\"table_size\": %zu, \"entries\": %zu, \"changes\": %zu, "
+			"\"ops\": %" PRIu64 ", \"ops_per_sec\": %.0f, \"mean_ns\": %.1f, "
+			"\"p50_ns\": %.1f, \"p99_ns\": %.1f, \"p999_ns\": %.1f, "
+			"\"max_ns\": %.1f", op, config->key_bytes, config->value_bytes,
+			config->size, config->num_keys, changes, hist->num_samples,
+			total_ns > 0 ? hist->num_samples / (total_ns * 1e-9) : 0,
+			total_ns / hist->num_samples, hist_percentile_ns(hist, 0.5),
+			hist_percentile_ns(hist, 0.99), hist_percentile_ns(hist, 0.999),
+			hist->max_cycles / cycles_per_ns);
+
+	if (histograms)
+	{
+		/* Pairs of the largest latency in a bucket and its count. */
+		fprintf(out, ", \"histogram\": [");
+		const char *sep = "";
+		for (size_t bucket = 0; bucket < HIST_BUCKETS; bucket++)
+		{
+			if (hist->counts[bucket] == 0)
+				continue;
+			fprintf(out, "%s[%.1f, %" PRIu64 "]", sep,
+					hist_bucket_max(bucket) / cycles_per_ns,
+					hist->counts[bucket]);
+			sep = ", ";
+		}
+		fprintf(out, "]");
+	}
+
+	fprintf(out, "}\n");
+	fflush(out);
+}
+
+
+static size_t next_power_of_two(size_t n)
+{
+	size_t p = 1;
+	while (p < n)
+		p *= 2;
+	return p;
+}
+
+
+/* A rough upper bound on the memory that a configuration needs: the software
+ * entries and their index, and the engine's LMem and the runtime's image of
+ * it, for two buffers of values. */
+static size_t estimate_memory(const struct config *config)
+{
+	size_t entry_bytes = config->key_bytes + config->value_bytes;
+	return config->num_keys * (entry_bytes + 64) +
+		config->size * next_power_of_two(entry_bytes + 1) * 3;
+}
+
+
+static int run(const struct config *config, const struct options *opts)
+{
+	size_t key_bytes = config->key_bytes;
+	size_t value_bytes = config->value_bytes;
+	size_t num_keys = config->num_keys;
+	size_t num_ops = opts->num_ops;
+	bool hist = opts->histograms;
+	uint8_t key[MAX_WIDTH_BYTES];
+	uint8_t value[MAX_WIDTH_BYTES];
+	struct histogram *h = malloc(sizeof(*h));
+	if (h == NULL)
+		return 1;
+
+	slic_mock_perfect_params_t params = {
+		.kernel_name = KERNEL_NAME,
+		.hash_table_name = TABLE_NAME,
+		.key_width_bits = key_bytes * 8,
+		.value_width_bits = value_bytes * 8,
+		.jenkins_chunk_width_bits = 8,
+		.num_intermediate_buckets = config->size / 4,
+		.num_values_buckets = config->size,
+		.intermediate_mem_type = SLIC_MOCK_LMEM,
+		.values_mem_type = SLIC_MOCK_LMEM,
+		.double_buffered = true,
+		.validate_results = true,
+	};
+
+	maxhash_engine_state_t es;
+	maxhash_table_t *table = create_mock_perfect_table(&params, &es);
+	if (table == NULL)
+		return 1;
+
+	memset(h, 0, sizeof(*h));
+	for (size_t i = 0; i < num_keys; i++)
+	{
+		key_bytes_of(i, key_bytes, key);
+		value_of(value_bytes, value);
+		uint64_t start = maxhash_cycles();
+		if (maxhash_put(table, key, key_bytes, value, value_bytes) !=
+				MAXHASH_ERR_OK)
+			return 1;
+		hist_add(h, start);
+	}
+	report(config, "put", 0, h, hist);
+
+	memset(h, 0, sizeof(*h));
+	uint64_t start = maxhash_cycles();
+	if (maxhash_commit(table) != MAXHASH_ERR_OK)
+		return 1;
+	hist_add(h, start);
+	report(config, "commit", num_keys, h, hist);
+
+	memset(h, 0, sizeof(*h));
+	for (size_t op = 0; op < num_ops; op++)
+	{
+		key_bytes_of(rng_next() % num_keys, key_bytes, key);
+		start = maxhash_cycles();
+		if (maxhash_get(table, key, key_bytes, value) != MAXHASH_ERR_OK)
+			return 1;
+		hist_add(h, start);
+	}
+	report(config, "get", 0, h, hist);
+
+	/* Half of the keys looked up are absent. */
+	memset(h, 0, sizeof(*h));
+	for (size_t op = 0; op < num_ops; op++)
+	{
+		bool present;
+		key_bytes_of(rng_next() % (num_keys * 2), key_bytes, key);
+		start = maxhash_cycles();
+		maxhash_contains(table, &present, key, key_bytes);
+		hist_add(h, start);
+	}
+	report(config, "contains", 0, h, hist);
+
+	memset(h, 0, sizeof(*h));
+	for (size_t op = 0; op < num_ops; op++)
+	{
+		bool valid;
+		key_bytes_of(rng_next() % num_keys, key_bytes, key);
+		start = maxhash_cycles();
+		if (maxhash_perfect_get(table, key, key_bytes, value, &valid) !=
+				MAXHASH_ERR_OK)
+			return 1;
+		hist_add(h, start);
+	}
+	report(config, "perfect_get", 0, h, hist);
+
+	maxhash_frozen_t *frozen;
+	if (maxhash_freeze(table, &frozen) != MAXHASH_ERR_OK)
+		return 1;
+	memset(h, 0, sizeof(*h));
+	for (size_t op = 0; op < num_ops; op++)
+	{
+		bool contains_key;
+		key_bytes_of(rng_next() % num_keys, key_bytes, key);
+		start = maxhash_cycles();
+		if (maxhash_frozen_get(frozen, key, key_bytes, value, &contains_key) !=
+				MAXHASH_ERR_OK)
+			return 1;
+		hist_add(h, start);
+	}
+	maxhash_frozen_free(frozen);
+	report(config, "frozen_get", 0, h, hist);
+
+	/* One sample per entry visited, of has_next(), next() and getting its
+	 * key and value. */
+	memset(h, 0, sizeof(*h));
+	maxhash_entry_iterator_t *it;
+	if (maxhash_entry_iterator_init(&it, table) != MAXHASH_ERR_OK)
+		return 1;
+	for (;;)
+	{
+		bool has_next;
+		const void *k, *v;
+		start = maxhash_cycles();
+		maxhash_entry_iterator_has_next(it, &has_next);
+		if (!has_next)
+			break;
+		maxhash_entry_iterator_next(it);
+		maxhash_entry_iterator_get_key(it, &k);
+		maxhash_entry_iterator_get_value(it, &v);
+		hist_add(h, start);
+	}
+	maxhash_entry_iterator_free(it);
+	report(config, "iterator", 0, h, hist);
+
+	/* Each change moves a key to a new value, or swaps it for another. */
+	for (size_t changes = 1; changes <= num_keys / 4 && changes <= 4096;
+			changes *= 16)
+	{
+		memset(h, 0, sizeof(*h));
+		for (size_t commit = 0; commit < opts->num_commits; commit++)
+		{
+			for (size_t change = 0; change < changes; change++)
+			{
+				size_t i = rng_next() % num_keys;
+				key_bytes_of(i, key_bytes, key);
+				value_of(value_bytes, value);
+				bool present;
+				maxhash_contains(table, &present, key, key_bytes);
+				if (present && rng_next() % 2)
+				{
+					maxhash_remove(table, key, key_bytes);
+					key_bytes_of(i + num_keys * 2, key_bytes, key);
+				}
+				maxhash_put(table, key, key_bytes, value, value_bytes);
+			}
+
+			start = maxhash_cycles();
+			if (maxhash_commit(table) != MAXHASH_ERR_OK)
+				return 1;
+			hist_add(h, start);
+		}
+		report(config, "commit", changes, h, hist);
+	}
+
+	/* Keys that the incremental commits swapped out are skipped. */
+	memset(h, 0, sizeof(*h));
+	for (size_t i = 0; i < num_keys && h->num_samples < num_ops; i++)
+	{
+		bool present;
+		key_bytes_of(i, key_bytes, key);
+		maxhash_contains(table, &present, key, key_bytes);
+		if (!present)
+			continue;
+		start = maxhash_cycles();
+		if (maxhash_remove(table, key, key_bytes) != MAXHASH_ERR_OK)
+			return 1;
+		hist_add(h, start);
+	}
+	report(config, "remove", 0, h, hist);
+
+	free_mock_perfect_table(table, &es);
+	free(h);
+	return 0;
+}
+
+
+/* Parse a comma-separated list of numbers, with optional K or M suffixes. */
+static size_t parse_list(const char *arg, size_t *list)
+{
+	size_t n = 0;
+
+	while (n < MAX_LIST)
+	{
+		char *end;
+		list[n] = strtoul(arg, &end, 0);
+		if (end == arg)
+			break;
+		if (*end == 'K' || *end == 'k')
+			list[n] <<= 10, end++;
+		else if (*end == 'M' || *end == 'm')
+			list[n] <<= 20, end++;
+		n++;
+		if (*end != ',')
+			break;
+		arg = end + 1;
+	}
+
+	return n;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct options opts = {
+		.key_bytes = { 8, 16, 32, 64 },
+		.num_key_bytes = 4,
+		.value_bytes = { 8, 32 },
+		.num_value_bytes = 2,
+		.sizes = { 64 << 10, 256 << 10, 1 << 20, 4 << 20, 16 << 20,
+			64 << 20 },
+		.num_sizes = 6,
+		.num_ops = 1000000,
+		.num_commits = 20,
+		.max_memory_mib = 2048,
+		.histograms = false,
+		.output = "runtime_bench.jsonl",
+	};
+
+	int opt;
+	while ((opt = getopt(argc, argv, "k:v:s:n:c:m:Ho:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'k': opts.num_key_bytes = parse_list(optarg, opts.key_bytes); break;
+			case 'v': opts.num_value_bytes = parse_list(optarg, opts.value_bytes); break;
+			case 's': opts.num_sizes = parse_list(optarg, opts.sizes); break;
+			case 'n': opts.num_ops = strtoul(optarg, NULL, 0); break;
+			case 'c': opts.num_commits = strtoul(optarg, NULL, 0); break;
+			case 'm': opts.max_memory_mib = strtoul(optarg, NULL, 0); break;
+			case 'H': opts.histograms = true; break;
+			case 'o': opts.output = optarg; break;
+			default:
+				fprintf(stderr, "Usage: %s [-k <key bytes,...>] "
+						"[-v <value bytes,...>] [-s <table sizes,...>] "
+						"[-n <ops>] [-c <commits>] [-m <max memory MiB>] [-H] "
+						"[-o <output file>]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	out = fopen(opts.output, "w");
+	if (out == NULL)
+	{
+		fprintf(stderr, "Error: failed to open '%s' for writing.\n",
+				opts.output);
+		return 1;
+	}
+
+	calibrate();
+	fprintf(stderr, "%.3f cycles/ns, timer overhead: %" PRIu64 " cycles\n",
+			cycles_per_ns, timer_overhead);
+
+	int err = 0;
+	for (size_t s = 0; s < opts.num_sizes; s++)
+		for (size_t k = 0; k < opts.num_key_bytes; k++)
+			for (size_t v = 0; v < opts.num_value_bytes; v++)
+			{
+				struct config config = {
+					.key_bytes = opts.key_bytes[k],
+					.value_bytes = opts.value_bytes[v],
+					.size = next_power_of_two(opts.sizes[s]),
+				};
+				config.num_keys = config.size * 3 / 4;
+
+				if (config.key_bytes == 0 || config.value_bytes == 0 ||
+						config.key_bytes > MAX_WIDTH_BYTES ||
+						config.value_bytes > MAX_WIDTH_BYTES ||
+						config.size < 16)
+				{
+					fprintf(stderr, "Skipping key bytes: %zu, value bytes: "
+							"%zu, size: %zu: unsupported.\n", config.key_bytes,
+							config.value_bytes, config.size);
+					continue;
+				}
+
+				size_t mib = estimate_memory(&config) >> 20;
+				if (mib > opts.max_memory_mib)
+				{
+					fprintf(stderr, "Skipping key bytes: %zu, value bytes: "
+							"%zu, size: %zu: needs about %zu MiB.\n",
+							config.key_bytes, config.value_bytes, config.size,
+							mib);
+					continue;
+				}
+
+				fprintf(stderr, "Key bytes: %zu, value bytes: %zu, size: %zu\n",
+						config.key_bytes, config.value_bytes, config.size);
+				if (run(&config, &opts))
+				{
+					fprintf(stderr, "Error: benchmark failed.\n");
+					err = 1;
+				}
+			}
+
+	fclose(out);
+	return err;
+}
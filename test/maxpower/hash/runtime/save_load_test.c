@@ -0,0 +1,164 @@
+/*
+ * save_load_test.c
+ *
+ * Saves a committed MaxHash table with further uncommitted changes, loads it
+ * into a new table and checks that software and perfect lookups give the
+ * same results as in the original, before and after the next commit.  Also
+ * checks that damaged files and files for tables of a different geometry are
+ * rejected.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <maxhash.h>
+
+#include "maxhash_test.h"
+
+#define NUM_KEYS 5000
+#define PATH     "save_load_test.maxhash"
+
+
+/* Check that both tables give the same answers for every key. */
+static size_t compare(maxhash_table_t *a, maxhash_table_t *b,
+		const char *stage)
+{
+	size_t failures = 0;
+
+	for (size_t i = 0; i < NUM_KEYS + NUM_KEYS / 10; i++)
+	{
+		uint64_t key = key_of(i);
+		uint64_t value_a = 0, value_b = 0;
+		bool found_a = maxhash_get(a, &key, sizeof(key), &value_a) ==
+			MAXHASH_ERR_OK;
+		bool found_b = maxhash_get(b, &key, sizeof(key), &value_b) ==
+			MAXHASH_ERR_OK;
+
+		bool valid_a = false, valid_b = false;
+		uint64_t perfect_a = 0, perfect_b = 0;
+		maxhash_perfect_get(a, &key, sizeof(key), &perfect_a, &valid_a);
+		maxhash_perfect_get(b, &key, sizeof(key), &perfect_b, &valid_b);
+
+		bool ok = found_a == found_b && value_a == value_b &&
+			valid_a == valid_b && (!valid_a || perfect_a == perfect_b);
+		if (!ok && failures++ < 10)
+			fprintf(stderr, "Mismatch %s (key: %zu).\n", stage, i);
+	}
+
+	size_t size_a, size_b;
+	maxhash_size(a, &size_a);
+	maxhash_size(b, &size_b);
+	if (size_a != size_b)
+	{
+		fprintf(stderr, "Size mismatch %s: %zu vs %zu.\n", stage, size_a,
+				size_b);
+		failures++;
+	}
+
+	return failures;
+}
+
+
+/* Flip a byte of the saved file and check that it no longer loads. */
+static size_t check_corruption(maxhash_table_t *table, long offset)
+{
+	FILE *file = fopen(PATH, "r+b");
+	if (file == NULL)
+		return 1;
+
+	fseek(file, offset, SEEK_SET);
+	int byte = fgetc(file);
+	fseek(file, offset, SEEK_SET);
+	fputc(byte ^ 0x10, file);
+	fclose(file);
+
+	bool rejected = maxhash_load(table, PATH) != MAXHASH_ERR_OK;
+
+	file = fopen(PATH, "r+b");
+	fseek(file, offset, SEEK_SET);
+	fputc(byte, file);
+	fclose(file);
+
+	if (!rejected)
+		fprintf(stderr, "Corruption at offset %ld not detected.\n", offset);
+	return rejected ? 0 : 1;
+}
+
+
+int main(void)
+{
+	maxhash_table_t *original = create_table(sw_table_params(8192, 64));
+	maxhash_table_t *restored = create_table(sw_table_params(8192, 64));
+	size_t failures = 0;
+
+	if (original == NULL || restored == NULL)
+		return 1;
+
+	srand(1);
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		uint64_t key = key_of(i);
+		uint64_t value = ((uint64_t)rand() << 32) | rand();
+		failures += maxhash_put(original, &key, sizeof(key), &value,
+				sizeof(value)) != MAXHASH_ERR_OK;
+	}
+	failures += maxhash_commit(original) != MAXHASH_ERR_OK;
+
+	/* Changes since the commit must survive too. */
+	for (size_t i = 0; i < NUM_KEYS / 10; i++)
+	{
+		uint64_t key = key_of(i * 7);
+		failures += maxhash_remove(original, &key, sizeof(key)) !=
+			MAXHASH_ERR_OK;
+		key = key_of(NUM_KEYS + i);
+		uint64_t value = i;
+		failures += maxhash_put(original, &key, sizeof(key), &value,
+				sizeof(value)) != MAXHASH_ERR_OK;
+	}
+
+	failures += maxhash_save(original, PATH) != MAXHASH_ERR_OK;
+	failures += maxhash_load(restored, PATH) != MAXHASH_ERR_OK;
+	failures += compare(original, restored, "after loading");
+
+	failures += maxhash_commit(original) != MAXHASH_ERR_OK;
+	failures += maxhash_commit(restored) != MAXHASH_ERR_OK;
+	failures += compare(original, restored, "after committing");
+
+	/* Damage in the header or the entries is detected. */
+	maxhash_save(original, PATH);
+	failures += check_corruption(restored, 0);
+	failures += check_corruption(restored, 40);
+	failures += check_corruption(restored, 1000);
+	failures += compare(original, restored, "after failed loads");
+
+	/* So is a table of a different geometry. */
+	maxhash_table_t *narrow = create_table(sw_table_params(8192, 32));
+	maxhash_table_t *small = create_table(sw_table_params(4096, 64));
+	if (maxhash_load(narrow, PATH) == MAXHASH_ERR_OK ||
+			maxhash_load(small, PATH) == MAXHASH_ERR_OK)
+	{
+		fprintf(stderr, "Loaded a file into a table of another geometry.\n");
+		failures++;
+	}
+
+	/* A truncated file is rejected. */
+	if (truncate(PATH, 512) != 0 ||
+			maxhash_load(restored, PATH) == MAXHASH_ERR_OK)
+	{
+		fprintf(stderr, "Loaded a truncated file.\n");
+		failures++;
+	}
+
+	unlink(PATH);
+	maxhash_free(original);
+	maxhash_free(restored);
+	maxhash_free(narrow);
+	maxhash_free(small);
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,229 @@
+/*
+ * scheduler_test.c
+ *
+ * Commits eight MaxHash tables on one mock SLiC engine through a scheduler
+ * and checks that the kernel keeps reading every table as last flushed until
+ * the next flush, then reads each as committed; that committing a table
+ * again before a flush first flushes the commits queued before it; and
+ * that a round of scheduled commits takes fewer engine runs than committing
+ * the tables one by one.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <maxhash.h>
+
+#include "slic_mock.h"
+
+#include "maxhash_test.h"
+
+#define KERNEL_NAME      "SchedulerKernel"
+#define NUM_TABLES       8
+#define NUM_VALUES       1024
+#define NUM_INTERMEDIATE 256
+#define NUM_KEYS         600
+#define NUM_ROUNDS       6
+
+
+static const slic_mock_mem_type_t mem_types[NUM_TABLES] = {
+	SLIC_MOCK_FMEM, SLIC_MOCK_FMEM, SLIC_MOCK_FMEM, SLIC_MOCK_FMEM,
+	SLIC_MOCK_DEEP_FMEM, SLIC_MOCK_DEEP_FMEM, SLIC_MOCK_LMEM, SLIC_MOCK_LMEM,
+};
+
+
+struct table {
+	char name[32];
+	maxhash_table_t *table;
+	uint32_t values[NUM_KEYS];
+	uint32_t committed[NUM_KEYS];
+};
+
+
+/* Check that the kernel reads "expected" as the value of every key. */
+static size_t check(max_engine_t *engine, const struct table *t,
+		const uint32_t *expected, const char *step, size_t round)
+{
+	size_t failures = 0;
+
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		uint32_t key = key_of(i);
+		uint32_t value = 0;
+		bool contains_key;
+
+		if (!slic_mock_perfect_get(engine, KERNEL_NAME, t->name, &key, &value,
+					&contains_key))
+			return failures + 1;
+
+		if ((!contains_key || value != expected[i]) && failures++ < 5)
+			fprintf(stderr, "%s, %s, round %zu: key %zu: found: %d, value: %u "
+					"(expected %u).\n", t->name, step, round, i, contains_key,
+					value, expected[i]);
+	}
+
+	return failures;
+}
+
+
+/* Change "num_changes" values of a table. */
+static size_t change(struct table *t, size_t num_changes)
+{
+	size_t failures = 0;
+
+	for (size_t c = 0; c < num_changes; c++)
+	{
+		size_t i = (size_t)rand() % NUM_KEYS;
+		uint32_t key = key_of(i);
+		t->values[i] = rand() & 0xffffff;
+		failures += maxhash_put(t->table, &key, sizeof(key), &t->values[i],
+				3) != MAXHASH_ERR_OK;
+	}
+
+	return failures;
+}
+
+
+int main(void)
+{
+	max_file_t *maxfile = slic_mock_maxfile_init(LMEM_BURST_BYTES);
+	struct table *tables = calloc(NUM_TABLES, sizeof(struct table));
+	size_t failures = 0;
+
+	for (size_t t = 0; t < NUM_TABLES; t++)
+	{
+		snprintf(tables[t].name, sizeof(tables[t].name), "Table%zu", t);
+		slic_mock_perfect_params_t params = {
+			.kernel_name = KERNEL_NAME,
+			.hash_table_name = tables[t].name,
+			.key_width_bits = 32,
+			.value_width_bits = 24,
+			.jenkins_chunk_width_bits = 8,
+			.num_intermediate_buckets = NUM_INTERMEDIATE,
+			.num_values_buckets = NUM_VALUES,
+			.intermediate_mem_type = mem_types[t],
+			.values_mem_type = mem_types[t],
+			.double_buffered = true,
+			.validate_results = true,
+			.base_address_bursts = t * 1024,
+		};
+		if (maxfile == NULL || !slic_mock_add_perfect(maxfile, &params))
+			return 1;
+	}
+
+	maxhash_engine_state_t es = { maxfile, max_load(maxfile, "*"), 0 };
+	maxhash_scheduler_t *scheduler;
+	if (maxhash_scheduler_init(&scheduler, &es) != MAXHASH_ERR_OK)
+		return 1;
+
+	for (size_t t = 0; t < NUM_TABLES; t++)
+	{
+		tables[t].table = create_mock_table(KERNEL_NAME, tables[t].name, &es);
+		if (tables[t].table == NULL)
+			return 1;
+
+		for (size_t i = 0; i < NUM_KEYS; i++)
+			tables[t].values[i] = i;
+		for (size_t i = 0; i < NUM_KEYS; i++)
+		{
+			uint32_t key = key_of(i);
+			failures += maxhash_put(tables[t].table, &key, sizeof(key),
+					&tables[t].values[i], 3) != MAXHASH_ERR_OK;
+		}
+		failures += maxhash_commit(tables[t].table) != MAXHASH_ERR_OK;
+		memcpy(tables[t].committed, tables[t].values,
+				sizeof(tables[t].values));
+	}
+
+	srand(1);
+	size_t scheduled_runs = 0;
+	size_t individual_runs = 0;
+	slic_mock_stats_t before, after;
+
+	for (size_t round = 0; round < NUM_ROUNDS; round++)
+	{
+		/* Commit every table through the scheduler.  Nothing changes in the
+		 * hardware until the flush. */
+		slic_mock_get_stats(es.engine, &before);
+		for (size_t t = 0; t < NUM_TABLES; t++)
+		{
+			failures += change(&tables[t], 8);
+			failures += maxhash_commit_schedule(tables[t].table, scheduler) !=
+				MAXHASH_ERR_OK;
+		}
+
+		/* Committing a table again first flushes every commit queued so
+		 * far. */
+		if (round % 2 == 1)
+		{
+			for (size_t t = 0; t < NUM_TABLES; t++)
+				memcpy(tables[t].committed, tables[t].values,
+						sizeof(tables[t].values));
+			failures += change(&tables[0], 8);
+			failures += maxhash_commit_schedule(tables[0].table, scheduler) !=
+				MAXHASH_ERR_OK;
+		}
+
+		for (size_t t = 0; t < NUM_TABLES; t++)
+			failures += check(es.engine, &tables[t], tables[t].committed,
+					"before flush", round);
+
+		failures += maxhash_scheduler_flush(scheduler) != MAXHASH_ERR_OK;
+		slic_mock_get_stats(es.engine, &after);
+		scheduled_runs += after.num_runs - before.num_runs;
+
+		for (size_t t = 0; t < NUM_TABLES; t++)
+		{
+			failures += check(es.engine, &tables[t], tables[t].values,
+					"after flush", round);
+			memcpy(tables[t].committed, tables[t].values,
+					sizeof(tables[t].values));
+		}
+
+		/* The same changes, committed one table at a time. */
+		slic_mock_get_stats(es.engine, &before);
+		for (size_t t = 0; t < NUM_TABLES; t++)
+		{
+			failures += change(&tables[t], 8);
+			failures += maxhash_commit(tables[t].table) != MAXHASH_ERR_OK;
+		}
+		slic_mock_get_stats(es.engine, &after);
+		individual_runs += after.num_runs - before.num_runs;
+
+		for (size_t t = 0; t < NUM_TABLES; t++)
+		{
+			failures += check(es.engine, &tables[t], tables[t].values,
+					"committed", round);
+			memcpy(tables[t].committed, tables[t].values,
+					sizeof(tables[t].values));
+		}
+	}
+
+	printf("Engine runs: %zu scheduled, %zu committed one by one.\n",
+			scheduled_runs, individual_runs);
+	if (scheduled_runs >= individual_runs)
+	{
+		fprintf(stderr, "Scheduled commits took no fewer runs.\n");
+		failures++;
+	}
+
+	/* Freeing a table flushes any commit of it still queued. */
+	failures += change(&tables[0], 8);
+	failures += maxhash_commit_schedule(tables[0].table, scheduler) !=
+		MAXHASH_ERR_OK;
+	failures += maxhash_scheduler_free(scheduler) != MAXHASH_ERR_OK;
+	failures += check(es.engine, &tables[0], tables[0].values, "freed",
+			NUM_ROUNDS);
+
+	for (size_t t = 0; t < NUM_TABLES; t++)
+		maxhash_free(tables[t].table);
+	free(tables);
+	max_unload(es.engine);
+	max_file_free(maxfile);
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,257 @@
+/*
+ * serialise_test.c
+ *
+ * Commits MaxHash tables with a range of key and value widths, with and
+ * without validation, to FMem, Deep FMem and LMem, and checks the memory
+ * image of every bucket against a reference serialiser that packs each entry
+ * one bit at a time.  The widths are picked so that fields start at every
+ * bit offset and span the word boundaries of the word-wide packing.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <maxhash.h>
+#include <maxhash_internal.h>
+
+#include "slic_mock.h"
+
+#include "maxhash_test.h"
+
+#define KERNEL_NAME       "SerialiseKernel"
+#define TABLE_NAME        "SerialiseTable"
+#define NUM_VALUES        64
+#define NUM_INTERMEDIATE  16
+#define NUM_KEYS          40
+#define NUM_ADDED         8
+#define MAX_WIDTH_BYTES   32
+/* Width of the Deep FMem ID at the start of each entry, as in the kernel. */
+#define DEEP_FMEM_ID_BITS 4
+
+static const size_t key_widths[] = {
+	7, 9, 15, 24, 31, 33, 55, 57, 63, 64, 65, 100, 127, 129, 200, 256,
+};
+
+static const size_t value_widths[] = {
+	7, 8, 9, 17, 23, 40, 49, 56, 57, 63, 64, 65, 71, 120, 128, 129, 193, 255,
+	256,
+};
+
+static const struct {
+	const char *name;
+	slic_mock_mem_type_t mem_type;
+} mem_types[] = {
+	{ "FMem", SLIC_MOCK_FMEM },
+	{ "Deep FMem", SLIC_MOCK_DEEP_FMEM },
+	{ "LMem", SLIC_MOCK_LMEM },
+};
+
+
+static bool get_bit(const uint8_t *buf, size_t bit)
+{
+	return buf[bit / 8] >> (bit % 8) & 1;
+}
+
+
+static void set_bit(uint8_t *buf, size_t bit, bool value)
+{
+	if (value)
+		buf[bit / 8] |= 1 << (bit % 8);
+}
+
+
+/* Distinct in the low 7 bits, so that keys of every width are distinct. */
+static void make_key(size_t i, size_t width_bits, uint8_t *key)
+{
+	uint64_t word = key_of(i);
+
+	memset(key, 0, MAX_WIDTH_BYTES);
+	for (size_t bit = 0; bit < width_bits; bit++)
+		set_bit(key, bit, (word >> (bit % 64) ^ bit / 64) & 1);
+}
+
+
+/* Random, with the top bit set in every other value so that the last bit of
+ * the field is always exercised. */
+static void make_value(size_t i, size_t width_bits, uint8_t *value)
+{
+	memset(value, 0, MAX_WIDTH_BYTES);
+	for (size_t bit = 0; bit < width_bits; bit++)
+		set_bit(value, bit, rand() & 1);
+	if (i % 2)
+		set_bit(value, width_bits - 1, true);
+}
+
+
+/* Serialise one bucket the slow way: the Deep FMem ID, the flags, the key if
+ * results are validated, and the value, from the least significant bit of
+ * the first byte upwards. */
+static void reference_entry(const maxhash_internal_table_t *itable,
+		size_t key_width_bits, size_t num_flags, size_t bucket_id,
+		uint8_t *entry)
+{
+	const maxhash_internal_table_params_t *iparams = &itable->iparams;
+	size_t bit = 0;
+
+	memset(entry, 0, itable->image.entry_size_bytes);
+
+	if (iparams->mem_type == MAXHASH_MEM_TYPE_DEEP_FMEM)
+		for (size_t i = 0; i < DEEP_FMEM_ID_BITS; i++)
+			set_bit(entry, bit++, iparams->deep_fmem_id >> i & 1);
+
+	uint32_t id = maxhash_bucket_peek(itable, bucket_id)->head;
+	const maxhash_entry_t *e = id != MAXHASH_NIL ?
+		maxhash_entry_get(itable, id) : NULL;
+	if (e != NULL && !e->flags[FLAG_VALID])
+		e = NULL;
+
+	for (size_t f = 0; f < num_flags; f++)
+		set_bit(entry, bit++, e != NULL && e->flags[f]);
+
+	if (iparams->validate_results)
+		for (size_t i = 0; i < key_width_bits; i++)
+			set_bit(entry, bit++, e != NULL &&
+					get_bit(maxhash_entry_key(e), i));
+
+	for (size_t i = 0; i < iparams->width_bits; i++)
+		set_bit(entry, bit++, e != NULL &&
+				get_bit(maxhash_entry_value(itable, e), i));
+}
+
+
+static size_t check_image(const char *name, const char *step,
+		const maxhash_internal_table_t *itable, size_t key_width_bits,
+		size_t num_flags)
+{
+	const maxhash_mem_image_t *image = &itable->image;
+	uint8_t expected[image->entry_size_bytes];
+
+	for (size_t b = 0; b < itable->iparams.num_buckets; b++)
+	{
+		const uint8_t *actual = image->data +
+			b / image->entries_per_burst * image->burst_size_bytes +
+			b % image->entries_per_burst * image->entry_size_bytes;
+
+		reference_entry(itable, key_width_bits, num_flags, b, expected);
+		for (size_t bit = 0; bit < image->entry_size_bytes * 8; bit++)
+			if (get_bit(actual, bit) != get_bit(expected, bit))
+			{
+				fprintf(stderr, "%s, %s: bit %zu of bucket %zu of \"%s\" is "
+						"%d, expected %d\n", name, step, bit, b,
+						itable->iparams.name, get_bit(actual, bit),
+						get_bit(expected, bit));
+				return 1;
+			}
+	}
+
+	return 0;
+}
+
+
+static size_t check(const char *name, const char *step,
+		maxhash_table_t *table, size_t key_width_bits)
+{
+	size_t failures = 0;
+
+	if (maxhash_commit(table) != MAXHASH_ERR_OK)
+	{
+		fprintf(stderr, "%s, %s: commit failed\n", name, step);
+		return 1;
+	}
+
+	failures += check_image(name, step, &table->intermediate, key_width_bits,
+			NUM_ENTRY_FLAGS);
+	failures += check_image(name, step, &table->values, key_width_bits,
+			NUM_ENTRY_FLAGS - 1);
+	return failures;
+}
+
+
+static size_t run(size_t m, bool validate, size_t key_width_bits,
+		size_t value_width_bits)
+{
+	slic_mock_perfect_params_t params = {
+		.kernel_name = KERNEL_NAME,
+		.hash_table_name = TABLE_NAME,
+		.key_width_bits = key_width_bits,
+		.value_width_bits = value_width_bits,
+		.jenkins_chunk_width_bits = 8,
+		.num_intermediate_buckets = NUM_INTERMEDIATE,
+		.num_values_buckets = NUM_VALUES,
+		.intermediate_mem_type = mem_types[m].mem_type,
+		.values_mem_type = mem_types[m].mem_type,
+		.double_buffered = true,
+		.validate_results = validate,
+	};
+
+	/* FMem entries are a single word. */
+	if (mem_types[m].mem_type == SLIC_MOCK_FMEM && 1 + (validate ?
+				key_width_bits : 0) + value_width_bits > 64)
+		return 0;
+
+	char name[64];
+	snprintf(name, sizeof(name), "%s%s, widths: %zu/%zu", mem_types[m].name,
+			validate ? "" : ", unvalidated", key_width_bits,
+			value_width_bits);
+
+	maxhash_engine_state_t es;
+	maxhash_table_t *table = create_mock_perfect_table(&params, &es);
+	if (table == NULL)
+	{
+		fprintf(stderr, "%s: failed to create table\n", name);
+		return 1;
+	}
+
+	size_t key_bytes = (key_width_bits + 7) / 8;
+	size_t value_bytes = (value_width_bits + 7) / 8;
+	uint8_t key[MAX_WIDTH_BYTES];
+	uint8_t value[MAX_WIDTH_BYTES];
+	size_t failures = 0;
+
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		make_key(i, key_width_bits, key);
+		make_value(i, value_width_bits, value);
+		failures += maxhash_put(table, key, key_bytes, value, value_bytes) !=
+			MAXHASH_ERR_OK;
+	}
+	failures += check(name, "full", table, key_width_bits);
+
+	/* Buckets that change are serialised again over what they held. */
+	for (size_t i = 0; i < NUM_KEYS + NUM_ADDED; i++)
+	{
+		make_key(i, key_width_bits, key);
+		make_value(i + 1, value_width_bits, value);
+		if (i < NUM_KEYS && i % 4 == 1)
+			failures += maxhash_remove(table, key, key_bytes) !=
+				MAXHASH_ERR_OK;
+		else if (i >= NUM_KEYS || i % 3 == 0)
+			failures += maxhash_put(table, key, key_bytes, value,
+					value_bytes) != MAXHASH_ERR_OK;
+	}
+	failures += check(name, "incremental", table, key_width_bits);
+
+	free_mock_perfect_table(table, &es);
+	return failures;
+}
+
+
+int main(void)
+{
+	size_t failures = 0;
+
+	for (size_t m = 0; m < sizeof(mem_types) / sizeof(mem_types[0]); m++)
+		for (size_t validate = 0; validate < 2; validate++)
+			for (size_t k = 0; k < sizeof(key_widths) /
+					sizeof(key_widths[0]); k++)
+				for (size_t v = 0; v < sizeof(value_widths) /
+						sizeof(value_widths[0]); v++)
+					failures += run(m, validate, key_widths[k],
+							value_widths[v]);
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
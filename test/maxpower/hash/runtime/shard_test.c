@@ -0,0 +1,248 @@
+/*
+ * shard_test.c
+ *
+ * Splits a MaxHash table across four instances on two mock SLiC engines, two
+ * in one kernel on each, and checks that every key goes to the shard that
+ * the MaxJ shard function would pick, that the kernel finds each key in its
+ * shard and in no other, and that a commit only writes the shards that have
+ * changed.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <maxhash.h>
+
+#include "slic_mock.h"
+
+#include "maxhash_test.h"
+
+#define KERNEL_NAME      "ShardKernel"
+#define NUM_ENGINES      2
+#define NUM_SHARDS       4
+#define NUM_VALUES       2048
+#define NUM_INTERMEDIATE 512
+#define NUM_KEYS         6000
+
+
+static const char *const table_names[NUM_SHARDS] = {
+	"Shard0", "Shard1", "Shard2", "Shard3",
+};
+
+
+/* The shard of a 32-bit key, computed as MaxHashShardFunction does for a
+ * Jenkins chunk width of 8 bits. */
+static size_t reference_shard(uint32_t key)
+{
+	uint32_t hash = MAXHASH_SHARD_HASH_PARAM;
+
+	for (size_t i = 0; i < sizeof(key); i++)
+	{
+		hash += (key >> (8 * i)) & 0xff;
+		hash += hash << 10;
+		hash ^= hash >> 6;
+	}
+	hash += hash << 3;
+	hash ^= hash >> 11;
+	hash += hash << 15;
+
+	return ((uint64_t)hash * NUM_SHARDS) >> 32;
+}
+
+
+/* Check that the kernel finds each key in its shard only. */
+static size_t check(const char *step, max_engine_t **engines,
+		const bool *present, const uint32_t *values)
+{
+	size_t failures = 0;
+
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		uint32_t key = key_of(i);
+		size_t shard = reference_shard(key);
+
+		for (size_t s = 0; s < NUM_SHARDS; s++)
+		{
+			uint32_t value = 0;
+			bool contains_key;
+
+			if (!slic_mock_perfect_get(engines[s / 2], KERNEL_NAME,
+						table_names[s], &key, &value, &contains_key))
+				return failures + 1;
+
+			bool expected = present[i] && s == shard;
+			if ((contains_key != expected || (expected && value != values[i]))
+					&& failures++ < 5)
+				fprintf(stderr, "%s: key %zu in shard %zu: found: %d (expected "
+						"%d), value: %u (expected %u).\n", step, i, s,
+						contains_key, expected, value, values[i]);
+		}
+	}
+
+	return failures;
+}
+
+
+int main(void)
+{
+	max_file_t *maxfiles[NUM_ENGINES];
+	maxhash_engine_state_t es[NUM_ENGINES];
+	max_engine_t *engines[NUM_ENGINES];
+	maxhash_table_t *shards[NUM_SHARDS];
+	size_t failures = 0;
+	const char *step = "init";
+
+	for (size_t e = 0; e < NUM_ENGINES; e++)
+	{
+		maxfiles[e] = slic_mock_maxfile_init(LMEM_BURST_BYTES);
+		if (maxfiles[e] == NULL)
+			return 1;
+
+		for (size_t s = 2 * e; s < 2 * e + 2; s++)
+		{
+			slic_mock_perfect_params_t params = {
+				.kernel_name = KERNEL_NAME,
+				.hash_table_name = table_names[s],
+				.key_width_bits = 32,
+				.value_width_bits = 24,
+				.jenkins_chunk_width_bits = 8,
+				.num_intermediate_buckets = NUM_INTERMEDIATE,
+				.num_values_buckets = NUM_VALUES,
+				.intermediate_mem_type = s % 2 ? SLIC_MOCK_LMEM : SLIC_MOCK_FMEM,
+				.values_mem_type = s % 2 ? SLIC_MOCK_LMEM : SLIC_MOCK_FMEM,
+				.double_buffered = true,
+				.validate_results = true,
+			};
+			if (!slic_mock_add_perfect(maxfiles[e], &params))
+				return 1;
+		}
+
+		engines[e] = max_load(maxfiles[e], "*");
+		es[e] = (maxhash_engine_state_t) { maxfiles[e], engines[e], 0 };
+	}
+
+	for (size_t s = 0; s < NUM_SHARDS; s++)
+	{
+		shards[s] = create_mock_table(KERNEL_NAME, table_names[s], &es[s / 2]);
+		if (shards[s] == NULL)
+			return 1;
+	}
+
+	maxhash_sharded_table_t *sharded;
+	if (maxhash_sharded_table_init(&sharded, shards, NUM_SHARDS) !=
+			MAXHASH_ERR_OK)
+		return 1;
+
+	/* Keys are spread evenly, to the shards the kernel would pick. */
+	static bool present[NUM_KEYS];
+	static uint32_t values[NUM_KEYS];
+	size_t shard_sizes[NUM_SHARDS] = {0};
+
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		uint32_t key = key_of(i);
+		size_t shard;
+		failures += maxhash_sharded_shard_of(sharded, &key, sizeof(key),
+				&shard) != MAXHASH_ERR_OK;
+		CHECK(shard == reference_shard(key));
+		shard_sizes[shard]++;
+
+		values[i] = i;
+		present[i] = true;
+		failures += maxhash_sharded_put(sharded, &key, sizeof(key), &values[i],
+				3) != MAXHASH_ERR_OK;
+	}
+	for (size_t s = 0; s < NUM_SHARDS; s++)
+		CHECK(shard_sizes[s] > NUM_KEYS / NUM_SHARDS * 9 / 10 &&
+				shard_sizes[s] < NUM_KEYS / NUM_SHARDS * 11 / 10);
+
+	size_t size, num_committed;
+	maxhash_sharded_size(sharded, &size);
+	CHECK(size == NUM_KEYS);
+
+	step = "first commit";
+	CHECK(maxhash_sharded_commit(sharded, &num_committed) == MAXHASH_ERR_OK);
+	CHECK(num_committed == NUM_SHARDS);
+	failures += check(step, engines, present, values);
+
+	/* Nothing has changed, so nothing is committed. */
+	step = "unchanged";
+	slic_mock_stats_t before[NUM_ENGINES], after[NUM_ENGINES];
+	for (size_t e = 0; e < NUM_ENGINES; e++)
+		slic_mock_get_stats(engines[e], &before[e]);
+	CHECK(maxhash_sharded_commit(sharded, &num_committed) == MAXHASH_ERR_OK);
+	CHECK(num_committed == 0);
+	for (size_t e = 0; e < NUM_ENGINES; e++)
+	{
+		slic_mock_get_stats(engines[e], &after[e]);
+		CHECK(after[e].num_runs == before[e].num_runs);
+	}
+
+	/* Changing the keys of one shard only commits that shard, and leaves the
+	 * other engine alone. */
+	step = "one shard";
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		uint32_t key = key_of(i);
+		if (reference_shard(key) != 3 || i % 3 != 0)
+			continue;
+
+		if (i % 2)
+		{
+			CHECK(maxhash_sharded_remove(sharded, &key, sizeof(key)) ==
+					MAXHASH_ERR_OK);
+			present[i] = false;
+		}
+		else
+		{
+			values[i] = i + 1;
+			failures += maxhash_sharded_put(sharded, &key, sizeof(key),
+					&values[i], 3) != MAXHASH_ERR_OK;
+		}
+	}
+	for (size_t e = 0; e < NUM_ENGINES; e++)
+		slic_mock_get_stats(engines[e], &before[e]);
+	CHECK(maxhash_sharded_commit(sharded, &num_committed) == MAXHASH_ERR_OK);
+	CHECK(num_committed == 1);
+	slic_mock_get_stats(engines[0], &after[0]);
+	CHECK(after[0].num_runs == before[0].num_runs);
+	failures += check(step, engines, present, values);
+
+	/* Lookups in software go to the right shard. */
+	step = "software lookups";
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		uint32_t key = key_of(i);
+		uint32_t value = 0;
+		bool contains_key;
+		CHECK(maxhash_sharded_contains(sharded, &contains_key, &key,
+					sizeof(key)) == MAXHASH_ERR_OK);
+		CHECK(contains_key == present[i]);
+		CHECK((maxhash_sharded_get(sharded, &key, sizeof(key), &value) ==
+					MAXHASH_ERR_OK) == present[i]);
+		CHECK(!present[i] || value == values[i]);
+		if (failures > 10)
+			break;
+	}
+
+	/* Clearing the table commits every shard. */
+	step = "clear";
+	CHECK(maxhash_sharded_clear(sharded) == MAXHASH_ERR_OK);
+	memset(present, 0, sizeof(present));
+	CHECK(maxhash_sharded_commit(sharded, &num_committed) == MAXHASH_ERR_OK);
+	CHECK(num_committed == NUM_SHARDS);
+	failures += check(step, engines, present, values);
+
+	maxhash_sharded_free(sharded);
+	for (size_t e = 0; e < NUM_ENGINES; e++)
+	{
+		max_unload(engines[e]);
+		max_file_free(maxfiles[e]);
+	}
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
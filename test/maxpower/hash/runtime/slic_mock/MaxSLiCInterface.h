@@ -0,0 +1,69 @@
+/*
+ * MaxSLiCInterface.h
+ *
+ * The part of the SLiC interface that the MaxHash runtime uses, implemented
+ * against host memory by slic_mock.c.  Building the runtime with this
+ * directory ahead of the SLiC includes lets it be tested and benchmarked
+ * without a DFE or the simulator.
+ */
+
+#ifndef SLIC_MOCK_MAXSLICINTERFACE_H_
+#define SLIC_MOCK_MAXSLICINTERFACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct max_errors  max_errors_t;
+typedef struct max_file    max_file_t;
+typedef struct max_engine  max_engine_t;
+typedef struct max_actions max_actions_t;
+typedef struct max_run     max_run_t;
+
+struct slic_mock_maxfile;
+
+struct max_file {
+	max_errors_t *errors;
+	struct slic_mock_maxfile *mock;
+};
+
+/*
+ * In error mode 1 (the default), errors are fatal, as in SLiC.  In mode 0
+ * they are recorded, until cleared, for max_ok() to report.
+ */
+void max_errors_mode(max_errors_t *errors, int abort_on_error);
+void max_errors_clear(max_errors_t *errors);
+int max_ok(const max_errors_t *errors);
+
+uint64_t max_get_constant_uint64t(max_file_t *maxfile, const char *name);
+const char *max_get_constant_string(max_file_t *maxfile, const char *name);
+
+max_engine_t *max_load(max_file_t *maxfile, const char *engine_id_pattern);
+void max_unload(max_engine_t *engine);
+void max_file_free(max_file_t *maxfile);
+
+max_actions_t *max_actions_init(max_file_t *maxfile, const char *mode);
+void max_actions_free(max_actions_t *actions);
+void max_disable_validation(max_actions_t *actions);
+
+void max_set_mem_uint64t(max_actions_t *actions, const char *block_name,
+		const char *mem_name, size_t index, uint64_t value);
+void max_get_mem_uint64t(max_actions_t *actions, const char *block_name,
+		const char *mem_name, size_t index, uint64_t *value);
+void max_queue_input(max_actions_t *actions, const char *stream_name,
+		const void *data, size_t length);
+void max_route(max_actions_t *actions, const char *from_name,
+		const char *to_name);
+
+void max_run(max_engine_t *engine, max_actions_t *actions);
+max_run_t *max_run_nonblock(max_engine_t *engine, max_actions_t *actions);
+void max_wait(max_run_t *run);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SLIC_MOCK_MAXSLICINTERFACE_H_ */
@@ -0,0 +1,1355 @@
+/*
+ * slic_mock.c
+ *
+ * Runs the SLiC actions of the MaxHash runtime against host memory, with the
+ * memories laid out as the MaxHash MemInterfaces lay them out in hardware.
+ * The layouts and the lookups below follow the MaxJ (MinimalPerfectHashMap,
+ * CollisionHandlingHashMap, BurstMemInterface, FMemInterface, LMemInterface,
+ * DeepFMemInterface and JenkinsHash), not the runtime, so that the two can be checked against one
+ * another.  Actions run to completion when they are started.
+ */
+
+#include "slic_mock.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define MOCK_NAME_LEN       64
+#define MOCK_LONG_NAME_LEN  256
+#define HASH_WIDTH_BITS     32
+#define FMEM_BURST_BITS     64
+#define MAPPED_MEM_MAX_BITS 64
+#define DEEP_FMEM_MAX       16
+#define DEEP_FMEM_ID_BITS   4
+#define PCIE_WIDTH_BYTES    16
+#define MOCK_MAX_WAYS       8
+
+struct max_errors {
+	int abort_on_error;
+	int ok;
+};
+
+struct mock_constant {
+	char name[MOCK_LONG_NAME_LEN];
+	bool is_string;
+	uint64_t value;
+	char string[MOCK_NAME_LEN];
+	struct mock_constant *next;
+};
+
+/* One of the memories of a MaxHash table, and what it holds. */
+struct mock_mem {
+	slic_mock_mem_type_t type;
+	size_t entry_bits;
+	size_t num_entries;
+	bool double_buffered;
+
+	/* FMem and LMem entries are packed into bursts. */
+	size_t burst_bits;
+	size_t entries_per_burst;
+	size_t entry_size_bits;
+	size_t bursts_per_table;
+	size_t base_address_bursts;
+
+	/* Deep FMem entries are loaded from the shared host stream. */
+	unsigned deep_fmem_id;
+	size_t load_item_bytes;
+	size_t load_address;
+	uint64_t load_count[2];
+
+	char mapped_name[MOCK_NAME_LEN * 2];
+	char count_name[MOCK_LONG_NAME_LEN];
+	size_t depth;
+	uint64_t *words;
+	uint8_t *entries;
+};
+
+/*
+ * A MinimalPerfectHashMap, whose memories are its hash parameters and values,
+ * or a CollisionHandlingHashMap, whose memories are its ways.
+ */
+struct mock_table {
+	bool is_collision;
+	slic_mock_perfect_params_t params;
+	slic_mock_collision_params_t collision_params;
+	bool double_buffered;
+	char kernel_name[MOCK_NAME_LEN];
+	char hash_table_name[MOCK_NAME_LEN];
+	char buffer_select_name[MOCK_LONG_NAME_LEN];
+	uint64_t buffer_select[2];
+	struct mock_mem mems[MOCK_MAX_WAYS];
+	size_t num_mems;
+	struct mock_table *next;
+};
+
+#define HASH_PARAMS_MEM 0
+#define VALUES_MEM      1
+
+struct slic_mock_maxfile {
+	struct mock_constant *constants;
+	struct mock_table *tables;
+	size_t lmem_burst_size_bytes;
+	size_t lmem_size_bursts;
+	unsigned num_deep_fmems;
+	bool loaded;
+};
+
+struct max_engine {
+	max_file_t *maxfile;
+	pthread_mutex_t lock;
+	uint8_t *lmem;
+	uint32_t routes;
+	slic_mock_stats_t stats;
+};
+
+enum action_type {
+	ACTION_SET_MEM,
+	ACTION_GET_MEM,
+	ACTION_QUEUE_INPUT,
+	ACTION_ROUTE
+};
+
+struct action {
+	enum action_type type;
+	char block_name[MOCK_LONG_NAME_LEN];
+	char name[MOCK_LONG_NAME_LEN];
+	size_t index;
+	uint64_t value;
+	uint64_t *dest;
+	const void *data;
+	size_t length;
+};
+
+struct max_actions {
+	max_file_t *maxfile;
+	struct action *actions;
+	size_t num_actions;
+	size_t capacity;
+};
+
+struct max_run {
+	max_actions_t *actions;
+};
+
+
+
+static void mock_error(max_file_t *maxfile, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void mock_error(max_file_t *maxfile, const char *format, ...)
+{
+	va_list args;
+
+	if (!maxfile->errors->abort_on_error)
+	{
+		maxfile->errors->ok = 0;
+		return;
+	}
+
+	fprintf(stderr, "SLiC mock error: ");
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fprintf(stderr, "\n");
+	abort();
+}
+
+
+
+static size_t bits_to_address(size_t n)
+{
+	size_t bits = 1;
+	while (((size_t)1 << bits) < n)
+		bits++;
+	return bits;
+}
+
+
+
+static size_t next_power_of_two(size_t n)
+{
+	size_t power = 1;
+	while (power < n)
+		power *= 2;
+	return power;
+}
+
+
+
+static bool get_bit(const uint8_t *src, size_t bit)
+{
+	return (src[bit / 8] >> (bit % 8)) & 1;
+}
+
+
+
+/* Copy bits one at a time, numbered from the least significant bit up. */
+static void copy_bits(uint8_t *dest, size_t dest_offset_bits,
+		const uint8_t *src, size_t src_offset_bits, size_t width_bits)
+{
+	for (size_t bit = 0; bit < width_bits; bit++)
+	{
+		size_t d = dest_offset_bits + bit;
+		if (get_bit(src, src_offset_bits + bit))
+			dest[d / 8] |= 1 << (d % 8);
+		else
+			dest[d / 8] &= ~(1 << (d % 8));
+	}
+}
+
+
+
+static uint64_t get_bits(const uint8_t *src, size_t offset_bits,
+		size_t width_bits)
+{
+	uint64_t word = 0;
+	for (size_t bit = 0; bit < width_bits && bit < 64; bit++)
+		word |= (uint64_t)get_bit(src, offset_bits + bit) << bit;
+	return word;
+}
+
+
+
+/*
+ * JenkinsHash.hash(): the key is padded with zeros at its most significant
+ * end to a whole number of chunks, and the chunks are taken least
+ * significant first, each cast to the 32-bit hash type.
+ */
+static uint32_t model_jenkins(const uint8_t *key, size_t key_bits,
+		uint32_t param, size_t chunk_bits)
+{
+	uint32_t hash = param;
+	size_t num_chunks = (key_bits + chunk_bits - 1) / chunk_bits;
+
+	for (size_t chunk = 0; chunk < num_chunks; chunk++)
+	{
+		uint32_t chunk_value = 0;
+		for (size_t bit = 0; bit < chunk_bits && bit < HASH_WIDTH_BITS; bit++)
+		{
+			size_t key_bit = chunk * chunk_bits + bit;
+			if (key_bit < key_bits && get_bit(key, key_bit))
+				chunk_value |= UINT32_C(1) << bit;
+		}
+
+		hash += chunk_value;
+		hash += hash << 10;
+		hash ^= hash >> 6;
+	}
+
+	hash += hash << 3;
+	hash ^= hash >> 11;
+	hash += hash << 15;
+
+	return hash;
+}
+
+
+
+/* Constants. */
+
+static struct mock_constant *find_constant(max_file_t *maxfile,
+		const char *name, bool is_string)
+{
+	for (struct mock_constant *c = maxfile->mock->constants; c != NULL;
+			c = c->next)
+		if (c->is_string == is_string && !strcmp(c->name, name))
+			return c;
+	return NULL;
+}
+
+
+
+static struct mock_constant *add_constant(max_file_t *maxfile,
+		const char *name, bool is_string)
+{
+	struct mock_constant *c = find_constant(maxfile, name, is_string);
+	if (c != NULL)
+		return c;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		abort();
+	snprintf(c->name, sizeof(c->name), "%s", name);
+	c->is_string = is_string;
+	c->next = maxfile->mock->constants;
+	maxfile->mock->constants = c;
+	return c;
+}
+
+
+
+void slic_mock_set_constant_uint64t(max_file_t *maxfile, const char *name,
+		uint64_t value)
+{
+	add_constant(maxfile, name, false)->value = value;
+}
+
+
+
+void slic_mock_set_constant_string(max_file_t *maxfile, const char *name,
+		const char *value)
+{
+	struct mock_constant *c = add_constant(maxfile, name, true);
+	snprintf(c->string, sizeof(c->string), "%s", value);
+}
+
+
+
+uint64_t max_get_constant_uint64t(max_file_t *maxfile, const char *name)
+{
+	struct mock_constant *c = find_constant(maxfile, name, false);
+	if (c == NULL)
+	{
+		mock_error(maxfile, "no constant named '%s'.", name);
+		return 0;
+	}
+	return c->value;
+}
+
+
+
+const char *max_get_constant_string(max_file_t *maxfile, const char *name)
+{
+	struct mock_constant *c = find_constant(maxfile, name, true);
+	if (c == NULL)
+	{
+		mock_error(maxfile, "no string constant named '%s'.", name);
+		return "";
+	}
+	return c->string;
+}
+
+
+
+void max_errors_mode(max_errors_t *errors, int abort_on_error)
+{
+	errors->abort_on_error = abort_on_error;
+}
+
+
+
+void max_errors_clear(max_errors_t *errors)
+{
+	errors->ok = 1;
+}
+
+
+
+int max_ok(const max_errors_t *errors)
+{
+	return errors->ok;
+}
+
+
+
+/* Maxfiles. */
+
+max_file_t *slic_mock_maxfile_init(size_t lmem_burst_size_bytes)
+{
+	max_file_t *maxfile = calloc(1, sizeof(*maxfile));
+	if (maxfile == NULL)
+		return NULL;
+
+	maxfile->errors = calloc(1, sizeof(*maxfile->errors));
+	maxfile->mock = calloc(1, sizeof(*maxfile->mock));
+	if (maxfile->errors == NULL || maxfile->mock == NULL)
+	{
+		free(maxfile->errors);
+		free(maxfile->mock);
+		free(maxfile);
+		return NULL;
+	}
+
+	maxfile->errors->abort_on_error = 1;
+	maxfile->errors->ok = 1;
+	maxfile->mock->lmem_burst_size_bytes = lmem_burst_size_bytes;
+
+	slic_mock_set_constant_string(maxfile, "MaxHash_Version", "mock");
+	slic_mock_set_constant_uint64t(maxfile, "MemCtrlPro_DataBurstSizeInBytes",
+			lmem_burst_size_bytes);
+
+	return maxfile;
+}
+
+
+
+/* BurstMemInterface: whole entries per burst, a power of two of them. */
+static bool burst_layout(struct mock_mem *mem, size_t burst_bits)
+{
+	size_t base_entry_bits = (mem->entry_bits + 7) / 8 * 8;
+	size_t entries_per_burst = burst_bits / base_entry_bits;
+
+	if (entries_per_burst == 0)
+		return false;
+
+	if (next_power_of_two(entries_per_burst) != entries_per_burst)
+		entries_per_burst = next_power_of_two(entries_per_burst) / 2;
+	while (burst_bits % entries_per_burst > 0)
+		entries_per_burst /= 2;
+
+	mem->burst_bits = burst_bits;
+	mem->entries_per_burst = entries_per_burst;
+	mem->entry_size_bits = burst_bits / entries_per_burst;
+	mem->bursts_per_table = (mem->num_entries + entries_per_burst - 1) /
+		entries_per_burst;
+	return true;
+}
+
+
+
+static size_t num_occupied_bursts(const struct mock_mem *mem)
+{
+	return mem->bursts_per_table * (mem->double_buffered ? 2 : 1);
+}
+
+
+
+static bool add_mem(max_file_t *maxfile, struct mock_table *table,
+		struct mock_mem *mem, const char *mem_name,
+		slic_mock_mem_type_t type, size_t entry_bits, size_t num_entries,
+		size_t base_address_bursts)
+{
+	struct slic_mock_maxfile *mock = maxfile->mock;
+	char name[MOCK_LONG_NAME_LEN];
+
+	mem->type = type;
+	mem->entry_bits = entry_bits;
+	mem->num_entries = num_entries;
+	mem->double_buffered = table->double_buffered;
+	snprintf(mem->mapped_name, sizeof(mem->mapped_name), "%s_%s",
+			table->hash_table_name, mem_name);
+
+	snprintf(name, sizeof(name), "%s_%s_%s_MemType", table->kernel_name,
+			table->hash_table_name, mem_name);
+
+	if (type == SLIC_MOCK_FMEM)
+	{
+		slic_mock_set_constant_string(maxfile, name, "FMem");
+		if (!burst_layout(mem, FMEM_BURST_BITS))
+			return false;
+		mem->depth = num_occupied_bursts(mem);
+	}
+	else if (type == SLIC_MOCK_DEEP_FMEM)
+	{
+		slic_mock_set_constant_string(maxfile, name, "DeepFMem");
+		if (mock->num_deep_fmems == DEEP_FMEM_MAX)
+		{
+			fprintf(stderr, "Error: cannot attach more than %d Deep FMems to "
+					"the host stream.\n", DEEP_FMEM_MAX);
+			return false;
+		}
+
+		mem->deep_fmem_id = mock->num_deep_fmems++;
+		snprintf(name, sizeof(name), "%s_%s_%s_DeepFMemID",
+				table->kernel_name, table->hash_table_name, mem_name);
+		slic_mock_set_constant_uint64t(maxfile, name, mem->deep_fmem_id);
+
+		/* MaxHashUtils.padToPCIeWidth() */
+		size_t load_bits = (DEEP_FMEM_ID_BITS + entry_bits + 63) / 64 * 64;
+		mem->load_item_bytes = next_power_of_two(load_bits) / 8;
+		mem->entry_size_bits = (entry_bits + 7) / 8 * 8;
+		mem->depth = num_entries * (mem->double_buffered ? 2 : 1);
+		snprintf(mem->count_name, sizeof(mem->count_name), "%s_LoadCount",
+				mem->mapped_name);
+	}
+	else
+	{
+		slic_mock_set_constant_string(maxfile, name, "LMem");
+		if (!burst_layout(mem, mock->lmem_burst_size_bytes * 8))
+			return false;
+		mem->base_address_bursts = base_address_bursts;
+		snprintf(name, sizeof(name), "%s_%s_%s_BaseAddressBursts",
+				table->kernel_name, table->hash_table_name, mem_name);
+		slic_mock_set_constant_uint64t(maxfile, name, base_address_bursts);
+
+		size_t end = base_address_bursts + num_occupied_bursts(mem);
+		if (end > mock->lmem_size_bursts)
+			mock->lmem_size_bursts = end;
+	}
+
+	return true;
+}
+
+
+
+static struct mock_table *table_init(max_file_t *maxfile,
+		const char *kernel_name, const char *hash_table_name,
+		bool double_buffered)
+{
+	if (maxfile->mock->loaded)
+	{
+		fprintf(stderr, "Error: tables must be added before loading.\n");
+		return NULL;
+	}
+
+	struct mock_table *table = calloc(1, sizeof(*table));
+	if (table == NULL)
+		return NULL;
+
+	table->double_buffered = double_buffered;
+	snprintf(table->kernel_name, sizeof(table->kernel_name), "%s",
+			kernel_name);
+	snprintf(table->hash_table_name, sizeof(table->hash_table_name), "%s",
+			hash_table_name);
+	snprintf(table->buffer_select_name, sizeof(table->buffer_select_name),
+			"%s_BufferSelect", table->hash_table_name);
+	return table;
+}
+
+
+
+static void set_table_constant(max_file_t *maxfile,
+		const struct mock_table *table, const char *name, uint64_t value)
+{
+	char full_name[MOCK_LONG_NAME_LEN];
+	snprintf(full_name, sizeof(full_name), "%s_%s_%s", table->kernel_name,
+			table->hash_table_name, name);
+	slic_mock_set_constant_uint64t(maxfile, full_name, value);
+}
+
+
+
+static bool check_fmem_width(slic_mock_mem_type_t type, size_t entry_bits)
+{
+	if (type == SLIC_MOCK_FMEM && entry_bits > MAPPED_MEM_MAX_BITS)
+	{
+		fprintf(stderr, "Error: FMem entries of %zu bits are wider than the "
+				"supported maximum of %d bits.\n", entry_bits,
+				MAPPED_MEM_MAX_BITS);
+		return false;
+	}
+	return true;
+}
+
+
+
+bool slic_mock_add_perfect(max_file_t *maxfile,
+		const slic_mock_perfect_params_t *params)
+{
+	size_t values_entry_bits = 1 + (params->validate_results ?
+			params->key_width_bits : 0) + params->value_width_bits;
+
+	if (!check_fmem_width(params->values_mem_type, values_entry_bits))
+		return false;
+
+	struct mock_table *table = table_init(maxfile, params->kernel_name,
+			params->hash_table_name, params->double_buffered);
+	if (table == NULL)
+		return false;
+
+	table->params = *params;
+	table->params.kernel_name = table->kernel_name;
+	table->params.hash_table_name = table->hash_table_name;
+
+	/* The intermediate entries are {valid, direct, hashParam}, and the
+	 * values entries are {valid, key (if validated), value}. */
+	struct mock_mem *hash_params = &table->mems[HASH_PARAMS_MEM];
+	size_t base_address_bursts = params->base_address_bursts;
+	bool ok = add_mem(maxfile, table, hash_params, "HashParams",
+			params->intermediate_mem_type, 2 + HASH_WIDTH_BITS,
+			params->num_intermediate_buckets, base_address_bursts);
+	if (params->intermediate_mem_type == SLIC_MOCK_LMEM)
+		base_address_bursts += num_occupied_bursts(hash_params);
+	ok = ok && add_mem(maxfile, table, &table->mems[VALUES_MEM], "Values",
+			params->values_mem_type, values_entry_bits,
+			params->num_values_buckets, base_address_bursts);
+	table->num_mems = 2;
+
+	if (!ok)
+	{
+		fprintf(stderr, "Error: invalid memory layout for MaxHash table "
+				"'%s'.\n", params->hash_table_name);
+		free(table);
+		return false;
+	}
+
+	const struct {
+		const char *name;
+		uint64_t value;
+	} constants[] = {
+		{ "IsPresent", 1 },
+		{ "KeyWidth", params->key_width_bits },
+		{ "ValidateResults", params->validate_results },
+		{ "JenkinsChunkWidth", params->jenkins_chunk_width_bits },
+		{ "IsDoubleBuffered", params->double_buffered },
+		{ "Values_NumBuckets", params->num_values_buckets },
+		{ "HashParams_NumBuckets", params->num_intermediate_buckets },
+		{ "MaxBucketEntries", 1 },
+		{ "Values_Width", params->value_width_bits },
+		{ "HashParams_Width", HASH_WIDTH_BITS },
+		{ "Perfect", 1 },
+		{ "IndexWidth", bits_to_address(params->num_values_buckets) },
+	};
+
+	for (size_t i = 0; i < sizeof(constants) / sizeof(constants[0]); i++)
+		set_table_constant(maxfile, table, constants[i].name,
+				constants[i].value);
+
+	table->next = maxfile->mock->tables;
+	maxfile->mock->tables = table;
+	return true;
+}
+
+
+
+bool slic_mock_add_collision(max_file_t *maxfile,
+		const slic_mock_collision_params_t *params)
+{
+	size_t entry_bits = 1 + params->key_width_bits + params->value_width_bits;
+
+	if (params->max_bucket_entries < 2 ||
+			params->max_bucket_entries > MOCK_MAX_WAYS)
+	{
+		fprintf(stderr, "Error: collision-handling tables have 2 to %d ways "
+				"(not %zu).\n", MOCK_MAX_WAYS, params->max_bucket_entries);
+		return false;
+	}
+
+	if (!check_fmem_width(params->mem_type, entry_bits))
+		return false;
+
+	struct mock_table *table = table_init(maxfile, params->kernel_name,
+			params->hash_table_name, params->double_buffered);
+	if (table == NULL)
+		return false;
+
+	table->is_collision = true;
+	table->collision_params = *params;
+	table->collision_params.kernel_name = table->kernel_name;
+	table->collision_params.hash_table_name = table->hash_table_name;
+
+	/* Each way is a memory of {valid, key, value} entries, and those in LMem
+	 * follow one another. */
+	size_t base_address_bursts = params->base_address_bursts;
+	bool ok = true;
+	for (size_t way = 0; ok && way < params->max_bucket_entries; way++)
+	{
+		char mem_name[MOCK_NAME_LEN];
+		snprintf(mem_name, sizeof(mem_name), "Buckets%zu", way);
+		ok = add_mem(maxfile, table, &table->mems[way], mem_name,
+				params->mem_type, entry_bits, params->num_buckets,
+				base_address_bursts);
+		if (params->mem_type == SLIC_MOCK_LMEM)
+			base_address_bursts += num_occupied_bursts(&table->mems[way]);
+
+		char name[MOCK_NAME_LEN + sizeof("_NumBuckets")];
+		snprintf(name, sizeof(name), "%s_NumBuckets", mem_name);
+		set_table_constant(maxfile, table, name, params->num_buckets);
+		snprintf(name, sizeof(name), "%s_Width", mem_name);
+		set_table_constant(maxfile, table, name, params->value_width_bits);
+	}
+	table->num_mems = params->max_bucket_entries;
+
+	if (!ok)
+	{
+		fprintf(stderr, "Error: invalid memory layout for MaxHash table "
+				"'%s'.\n", params->hash_table_name);
+		free(table);
+		return false;
+	}
+
+	const struct {
+		const char *name;
+		uint64_t value;
+	} constants[] = {
+		{ "IsPresent", 1 },
+		{ "KeyWidth", params->key_width_bits },
+		{ "ValidateResults", 1 },
+		{ "JenkinsChunkWidth", params->jenkins_chunk_width_bits },
+		{ "IsDoubleBuffered", params->double_buffered },
+		{ "MaxBucketEntries", params->max_bucket_entries },
+		{ "Perfect", 0 },
+		{ "IndexWidth", bits_to_address(params->num_buckets *
+				params->max_bucket_entries) },
+	};
+
+	for (size_t i = 0; i < sizeof(constants) / sizeof(constants[0]); i++)
+		set_table_constant(maxfile, table, constants[i].name,
+				constants[i].value);
+
+	table->next = maxfile->mock->tables;
+	maxfile->mock->tables = table;
+	return true;
+}
+
+
+
+void max_file_free(max_file_t *maxfile)
+{
+	while (maxfile->mock->constants != NULL)
+	{
+		struct mock_constant *next = maxfile->mock->constants->next;
+		free(maxfile->mock->constants);
+		maxfile->mock->constants = next;
+	}
+
+	while (maxfile->mock->tables != NULL)
+	{
+		struct mock_table *next = maxfile->mock->tables->next;
+		free(maxfile->mock->tables);
+		maxfile->mock->tables = next;
+	}
+
+	free(maxfile->mock);
+	free(maxfile->errors);
+	free(maxfile);
+}
+
+
+
+/* Engines. */
+
+static void mem_free(struct mock_mem *mem)
+{
+	free(mem->words);
+	free(mem->entries);
+	mem->words = NULL;
+	mem->entries = NULL;
+}
+
+
+
+static bool mem_alloc(struct mock_mem *mem)
+{
+	mem->load_address = 0;
+	memset(mem->load_count, 0, sizeof(mem->load_count));
+
+	if (mem->type == SLIC_MOCK_FMEM)
+		mem->words = calloc(mem->depth, sizeof(uint64_t));
+	else if (mem->type == SLIC_MOCK_DEEP_FMEM)
+		mem->entries = calloc(mem->depth, mem->entry_size_bits / 8);
+	else
+		return true;
+
+	return mem->words != NULL || mem->entries != NULL;
+}
+
+
+
+max_engine_t *max_load(max_file_t *maxfile, const char *engine_id_pattern)
+{
+	struct slic_mock_maxfile *mock = maxfile->mock;
+	max_engine_t *engine = calloc(1, sizeof(*engine));
+	bool ok = engine != NULL;
+
+	if (ok)
+	{
+		engine->maxfile = maxfile;
+		pthread_mutex_init(&engine->lock, NULL);
+		engine->lmem = calloc(mock->lmem_size_bursts + 1,
+				mock->lmem_burst_size_bytes);
+		ok = engine->lmem != NULL;
+	}
+
+	for (struct mock_table *t = mock->tables; ok && t != NULL; t = t->next)
+	{
+		memset(t->buffer_select, 0, sizeof(t->buffer_select));
+		for (size_t i = 0; ok && i < t->num_mems; i++)
+			ok = mem_alloc(&t->mems[i]);
+	}
+
+	if (!ok)
+	{
+		mock_error(maxfile, "failed to allocate the engine's memories.");
+		if (engine != NULL)
+			max_unload(engine);
+		return NULL;
+	}
+
+	mock->loaded = true;
+	return engine;
+}
+
+
+
+void max_unload(max_engine_t *engine)
+{
+	for (struct mock_table *t = engine->maxfile->mock->tables; t != NULL;
+			t = t->next)
+		for (size_t i = 0; i < t->num_mems; i++)
+			mem_free(&t->mems[i]);
+
+	engine->maxfile->mock->loaded = false;
+	pthread_mutex_destroy(&engine->lock);
+	free(engine->lmem);
+	free(engine);
+}
+
+
+
+void slic_mock_get_stats(max_engine_t *engine, slic_mock_stats_t *stats)
+{
+	pthread_mutex_lock(&engine->lock);
+	*stats = engine->stats;
+	pthread_mutex_unlock(&engine->lock);
+}
+
+
+
+/* Actions. */
+
+max_actions_t *max_actions_init(max_file_t *maxfile, const char *mode)
+{
+	max_actions_t *actions = calloc(1, sizeof(*actions));
+	if (actions == NULL)
+		mock_error(maxfile, "failed to allocate an action set.");
+	else
+		actions->maxfile = maxfile;
+	return actions;
+}
+
+
+
+void max_actions_free(max_actions_t *actions)
+{
+	free(actions->actions);
+	free(actions);
+}
+
+
+
+void max_disable_validation(max_actions_t *actions)
+{
+}
+
+
+
+static struct action *add_action(max_actions_t *actions,
+		enum action_type type, const char *block_name, const char *name)
+{
+	if (actions->num_actions == actions->capacity)
+	{
+		size_t capacity = actions->capacity ? actions->capacity * 2 : 64;
+		struct action *grown = realloc(actions->actions,
+				capacity * sizeof(*grown));
+		if (grown == NULL)
+		{
+			mock_error(actions->maxfile, "failed to grow an action set.");
+			return NULL;
+		}
+		actions->actions = grown;
+		actions->capacity = capacity;
+	}
+
+	struct action *action = &actions->actions[actions->num_actions++];
+	memset(action, 0, sizeof(*action));
+	action->type = type;
+	snprintf(action->block_name, sizeof(action->block_name), "%s",
+			block_name);
+	snprintf(action->name, sizeof(action->name), "%s", name);
+	return action;
+}
+
+
+
+void max_set_mem_uint64t(max_actions_t *actions, const char *block_name,
+		const char *mem_name, size_t index, uint64_t value)
+{
+	struct action *action = add_action(actions, ACTION_SET_MEM, block_name,
+			mem_name);
+	if (action != NULL)
+	{
+		action->index = index;
+		action->value = value;
+	}
+}
+
+
+
+void max_get_mem_uint64t(max_actions_t *actions, const char *block_name,
+		const char *mem_name, size_t index, uint64_t *value)
+{
+	struct action *action = add_action(actions, ACTION_GET_MEM, block_name,
+			mem_name);
+	if (action != NULL)
+	{
+		action->index = index;
+		action->dest = value;
+	}
+}
+
+
+
+void max_queue_input(max_actions_t *actions, const char *stream_name,
+		const void *data, size_t length)
+{
+	struct action *action = add_action(actions, ACTION_QUEUE_INPUT, "",
+			stream_name);
+	if (action != NULL)
+	{
+		action->data = data;
+		action->length = length;
+	}
+}
+
+
+
+void max_route(max_actions_t *actions, const char *from_name,
+		const char *to_name)
+{
+	add_action(actions, ACTION_ROUTE, from_name, to_name);
+}
+
+
+
+/* Find the mapped memory that SLiC would know by these names. */
+static uint64_t *find_mapped_mem(max_engine_t *engine, const char *block_name,
+		const char *mem_name, size_t *depth)
+{
+	for (struct mock_table *t = engine->maxfile->mock->tables; t != NULL;
+			t = t->next)
+	{
+		if (strcmp(t->kernel_name, block_name))
+			continue;
+
+		if (!strcmp(mem_name, t->buffer_select_name) && t->double_buffered)
+		{
+			*depth = 2;
+			return t->buffer_select;
+		}
+
+		for (size_t i = 0; i < t->num_mems; i++)
+		{
+			struct mock_mem *mem = &t->mems[i];
+			if (mem->type == SLIC_MOCK_FMEM &&
+					!strcmp(mem_name, mem->mapped_name))
+			{
+				*depth = mem->depth;
+				return mem->words;
+			}
+
+			if (mem->type == SLIC_MOCK_DEEP_FMEM &&
+					!strcmp(mem_name, mem->count_name))
+			{
+				*depth = 2;
+				return mem->load_count;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+
+static void run_mem_action(max_engine_t *engine, const struct action *action)
+{
+	size_t depth;
+	uint64_t *words = find_mapped_mem(engine, action->block_name,
+			action->name, &depth);
+
+	if (words == NULL)
+	{
+		mock_error(engine->maxfile, "no mapped memory '%s' in block '%s'.",
+				action->name, action->block_name);
+		return;
+	}
+
+	if (action->index >= depth)
+	{
+		mock_error(engine->maxfile, "index %zu is beyond the end of mapped "
+				"memory '%s' (depth: %zu).", action->index, action->name,
+				depth);
+		return;
+	}
+
+	if (action->type == ACTION_SET_MEM)
+	{
+		words[action->index] = action->value;
+		engine->stats.num_mem_writes++;
+	}
+	else
+	{
+		*action->dest = words[action->index];
+		engine->stats.num_mem_reads++;
+	}
+}
+
+
+
+/*
+ * DeepFMemInterface: every memory the fanout routes the stream to reads it
+ * as items of its own load width, and takes those carrying its ID, in order,
+ * into the buffer that the kernel is not reading.  Its load counter advances
+ * each time it takes its last entry.
+ */
+static void deep_fmem_take(max_engine_t *engine, struct mock_table *table,
+		struct mock_mem *mem, const uint8_t *data, size_t length)
+{
+	if (length % mem->load_item_bytes != 0)
+	{
+		mock_error(engine->maxfile, "stream of %zu bytes is not a whole "
+				"number of %zu-byte loads of '%s'.", length,
+				mem->load_item_bytes, mem->mapped_name);
+		return;
+	}
+
+	size_t entry_bytes = mem->entry_size_bits / 8;
+	size_t buffer = mem->double_buffered ? (table->buffer_select[0] & 1) ^ 1 :
+		0;
+
+	for (const uint8_t *item = data; item < data + length;
+			item += mem->load_item_bytes)
+	{
+		if (get_bits(item, 0, DEEP_FMEM_ID_BITS) != mem->deep_fmem_id)
+			continue;
+
+		size_t index = buffer << bits_to_address(mem->num_entries) |
+			mem->load_address;
+		if (index >= mem->depth)
+		{
+			mock_error(engine->maxfile, "load of '%s' is beyond the end of "
+					"the memory.", mem->mapped_name);
+			return;
+		}
+
+		uint8_t *entry = mem->entries + index * entry_bytes;
+		memset(entry, 0, entry_bytes);
+		copy_bits(entry, 0, item, DEEP_FMEM_ID_BITS, mem->entry_bits);
+
+		if (++mem->load_address == mem->num_entries)
+		{
+			mem->load_address = 0;
+			mem->load_count[0]++;
+		}
+	}
+}
+
+
+
+static void run_stream_action(max_engine_t *engine,
+		const struct action *action)
+{
+	if (strcmp(action->name, "DeepFMemWriteCPUData"))
+	{
+		mock_error(engine->maxfile, "no input stream named '%s'.",
+				action->name);
+		return;
+	}
+
+	if (action->length % PCIE_WIDTH_BYTES != 0)
+	{
+		mock_error(engine->maxfile, "stream length (%zu) is not a multiple of "
+				"%d bytes.", action->length, PCIE_WIDTH_BYTES);
+		return;
+	}
+
+	engine->stats.num_stream_bytes += action->length;
+
+	for (struct mock_table *t = engine->maxfile->mock->tables; t != NULL;
+			t = t->next)
+		for (size_t i = 0; i < t->num_mems; i++)
+			if (t->mems[i].type == SLIC_MOCK_DEEP_FMEM &&
+					engine->routes & (UINT32_C(1) << t->mems[i].deep_fmem_id))
+				deep_fmem_take(engine, t, &t->mems[i], action->data,
+						action->length);
+}
+
+
+
+/* The routes of an action set hold until another action set sets some. */
+static void set_routes(max_engine_t *engine, const max_actions_t *actions)
+{
+	uint32_t routes = 0;
+	bool any_routes = false;
+
+	for (size_t i = 0; i < actions->num_actions; i++)
+	{
+		const struct action *action = &actions->actions[i];
+		if (action->type != ACTION_ROUTE)
+			continue;
+
+		char *end;
+		unsigned long id = strtoul(action->name, &end, 10);
+		if (strcmp(action->block_name, "DeepFMemFanout") || *end != '\0' ||
+				id >= engine->maxfile->mock->num_deep_fmems)
+		{
+			mock_error(engine->maxfile, "no route from '%s' to '%s'.",
+					action->block_name, action->name);
+			continue;
+		}
+
+		routes |= UINT32_C(1) << id;
+		any_routes = true;
+	}
+
+	if (any_routes)
+		engine->routes = routes;
+}
+
+
+
+void max_run(max_engine_t *engine, max_actions_t *actions)
+{
+	pthread_mutex_lock(&engine->lock);
+	engine->stats.num_runs++;
+	set_routes(engine, actions);
+
+	for (size_t i = 0; i < actions->num_actions; i++)
+	{
+		const struct action *action = &actions->actions[i];
+		if (action->type == ACTION_SET_MEM || action->type == ACTION_GET_MEM)
+			run_mem_action(engine, action);
+		else if (action->type == ACTION_QUEUE_INPUT)
+			run_stream_action(engine, action);
+	}
+
+	pthread_mutex_unlock(&engine->lock);
+}
+
+
+
+max_run_t *max_run_nonblock(max_engine_t *engine, max_actions_t *actions)
+{
+	max_run_t *run = calloc(1, sizeof(*run));
+	if (run == NULL)
+		mock_error(engine->maxfile, "failed to allocate a run.");
+	else
+		run->actions = actions;
+
+	max_run(engine, actions);
+	return run;
+}
+
+
+
+void max_wait(max_run_t *run)
+{
+	free(run);
+}
+
+
+
+void slic_mock_lmem_access(void *arg, bool is_read,
+		size_t base_address_bursts, void *data, size_t data_size_bursts)
+{
+	max_engine_t *engine = arg;
+	struct slic_mock_maxfile *mock = engine->maxfile->mock;
+
+	pthread_mutex_lock(&engine->lock);
+
+	if (base_address_bursts + data_size_bursts > mock->lmem_size_bursts)
+		mock_error(engine->maxfile, "LMem access to bursts %zu to %zu is "
+				"beyond the end of the tables (%zu bursts).",
+				base_address_bursts, base_address_bursts + data_size_bursts,
+				mock->lmem_size_bursts);
+	else
+	{
+		uint8_t *lmem = engine->lmem + base_address_bursts *
+			mock->lmem_burst_size_bytes;
+		size_t size_bytes = data_size_bursts * mock->lmem_burst_size_bytes;
+
+		if (is_read)
+			memcpy(data, lmem, size_bytes);
+		else
+		{
+			memcpy(lmem, data, size_bytes);
+			engine->stats.num_lmem_bursts_written += data_size_bursts;
+		}
+	}
+
+	pthread_mutex_unlock(&engine->lock);
+}
+
+
+
+/* The kernel's lookup. */
+
+/* Read entry "index" of a buffer into "entry", as MemInterface.get() does. */
+static bool read_entry(max_engine_t *engine, const struct mock_mem *mem,
+		size_t index, size_t buffer, uint8_t *entry)
+{
+	if (index >= mem->num_entries)
+	{
+		mock_error(engine->maxfile, "entry %zu of '%s' is beyond the end of "
+				"the table (%zu entries).", index, mem->mapped_name,
+				mem->num_entries);
+		return false;
+	}
+
+	size_t entry_bytes = (mem->entry_bits + 7) / 8;
+	memset(entry, 0, entry_bytes);
+
+	if (mem->type == SLIC_MOCK_DEEP_FMEM)
+	{
+		size_t address = buffer << bits_to_address(mem->num_entries) | index;
+		if (address >= mem->depth)
+		{
+			mock_error(engine->maxfile, "read of '%s' is beyond the end of "
+					"the memory.", mem->mapped_name);
+			return false;
+		}
+		copy_bits(entry, 0, mem->entries + address * mem->entry_size_bits / 8,
+				0, mem->entry_bits);
+		return true;
+	}
+
+	size_t burst = index / mem->entries_per_burst;
+	size_t offset_bits = index % mem->entries_per_burst * mem->entry_size_bits;
+
+	if (mem->type == SLIC_MOCK_FMEM)
+	{
+		/* FMemInterface: the buffer is the top bit of the word address. */
+		size_t address = buffer << bits_to_address(mem->bursts_per_table) |
+			burst;
+		if (address >= mem->depth)
+		{
+			mock_error(engine->maxfile, "read of '%s' is beyond the end of "
+					"the memory.", mem->mapped_name);
+			return false;
+		}
+		copy_bits(entry, 0, (const uint8_t *)&mem->words[address],
+				offset_bits, mem->entry_bits);
+	}
+	else
+	{
+		size_t address = mem->base_address_bursts +
+			buffer * mem->bursts_per_table + burst;
+		copy_bits(entry, 0, engine->lmem + address * mem->burst_bits / 8,
+				offset_bits, mem->entry_bits);
+	}
+
+	return true;
+}
+
+
+
+static struct mock_table *find_table(max_engine_t *engine,
+		const char *kernel_name, const char *hash_table_name,
+		bool is_collision)
+{
+	struct mock_table *t = engine->maxfile->mock->tables;
+	while (t != NULL && (strcmp(t->kernel_name, kernel_name) ||
+				strcmp(t->hash_table_name, hash_table_name) ||
+				t->is_collision != is_collision))
+		t = t->next;
+	return t;
+}
+
+
+
+static bool key_matches(const uint8_t *entry, const void *key,
+		size_t key_bits)
+{
+	for (size_t bit = 0; bit < key_bits; bit++)
+		if (get_bit(entry, 1 + bit) != get_bit(key, bit))
+			return false;
+	return true;
+}
+
+
+
+bool slic_mock_perfect_get(max_engine_t *engine, const char *kernel_name,
+		const char *hash_table_name, const void *key, void *value,
+		bool *contains_key)
+{
+	struct mock_table *p = find_table(engine, kernel_name, hash_table_name,
+			false);
+	if (p == NULL)
+		return false;
+
+	const slic_mock_perfect_params_t *params = &p->params;
+	size_t key_bits = params->key_width_bits;
+	uint8_t hash_params[(2 + HASH_WIDTH_BITS + 7) / 8];
+	uint8_t *entry = malloc((p->mems[VALUES_MEM].entry_bits + 7) / 8);
+	bool ok = entry != NULL;
+
+	pthread_mutex_lock(&engine->lock);
+	size_t buffer = params->double_buffered ? p->buffer_select[0] & 1 : 0;
+
+	/* Both hashes are cast to the width of the table's addresses. */
+	size_t first_hash = model_jenkins(key, key_bits, 0,
+			params->jenkins_chunk_width_bits) &
+		(((size_t)1 << bits_to_address(params->num_intermediate_buckets)) - 1);
+	ok = ok && read_entry(engine, &p->mems[HASH_PARAMS_MEM], first_hash,
+			buffer, hash_params);
+
+	if (ok)
+	{
+		bool direct = get_bits(hash_params, 1, 1);
+		uint32_t hash_param = get_bits(hash_params, 2, HASH_WIDTH_BITS);
+		size_t index = (direct ? hash_param : model_jenkins(key, key_bits,
+					hash_param, params->jenkins_chunk_width_bits)) &
+			(((size_t)1 << bits_to_address(params->num_values_buckets)) - 1);
+		ok = read_entry(engine, &p->mems[VALUES_MEM], index, buffer, entry);
+	}
+
+	pthread_mutex_unlock(&engine->lock);
+
+	if (ok)
+	{
+		size_t value_offset_bits = 1;
+		*contains_key = get_bits(entry, 0, 1);
+
+		if (params->validate_results)
+		{
+			if (!key_matches(entry, key, key_bits))
+				*contains_key = false;
+			value_offset_bits += key_bits;
+		}
+
+		memset(value, 0, (params->value_width_bits + 7) / 8);
+		copy_bits(value, 0, entry, value_offset_bits,
+				params->value_width_bits);
+	}
+
+	free(entry);
+	return ok;
+}
+
+
+
+bool slic_mock_collision_get(max_engine_t *engine, const char *kernel_name,
+		const char *hash_table_name, const void *key, void *value,
+		bool *contains_key)
+{
+	struct mock_table *c = find_table(engine, kernel_name, hash_table_name,
+			true);
+	if (c == NULL)
+		return false;
+
+	const slic_mock_collision_params_t *params = &c->collision_params;
+	size_t key_bits = params->key_width_bits;
+	uint8_t *entry = malloc((c->mems[0].entry_bits + 7) / 8);
+	bool ok = entry != NULL;
+	size_t num_matches = 0;
+
+	memset(value, 0, (params->value_width_bits + 7) / 8);
+
+	pthread_mutex_lock(&engine->lock);
+	size_t buffer = params->double_buffered ? c->buffer_select[0] & 1 : 0;
+
+	/* Way "n" is indexed by the hash with parameter "n", and the value is
+	 * that of the way whose key matches. */
+	for (size_t way = 0; ok && way < c->num_mems; way++)
+	{
+		size_t index = model_jenkins(key, key_bits, way,
+				params->jenkins_chunk_width_bits) &
+			(((size_t)1 << bits_to_address(params->num_buckets)) - 1);
+		ok = read_entry(engine, &c->mems[way], index, buffer, entry);
+
+		if (ok && get_bits(entry, 0, 1) && key_matches(entry, key, key_bits))
+		{
+			copy_bits(value, 0, entry, 1 + key_bits,
+					params->value_width_bits);
+			num_matches++;
+		}
+	}
+
+	pthread_mutex_unlock(&engine->lock);
+
+	/* The kernel's oneHotMux() is undefined for several matches. */
+	if (ok && num_matches > 1)
+	{
+		mock_error(engine->maxfile, "key found in %zu ways of '%s'.",
+				num_matches, hash_table_name);
+		ok = false;
+	}
+
+	*contains_key = num_matches > 0;
+	free(entry);
+	return ok;
+}
@@ -0,0 +1,131 @@
+/*
+ * slic_mock.h
+ *
+ * Host-memory stand-in for a DFE running MaxHash tables.  A mock maxfile
+ * carries the constants that MaxHashFactory and the memory interfaces add to
+ * a real one, and a mock engine holds the mapped memories, Deep FMems and
+ * LMem that the runtime loads on commit.  slic_mock_perfect_get() and
+ * slic_mock_collision_get() then look keys up the way the
+ * MinimalPerfectHashMap and CollisionHandlingHashMap kernels do, from the
+ * buffer the kernel is reading, so that what a commit leaves in the
+ * "hardware" can be checked against the software table.
+ */
+
+#ifndef SLIC_MOCK_H_
+#define SLIC_MOCK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "MaxSLiCInterface.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	SLIC_MOCK_FMEM,
+	SLIC_MOCK_DEEP_FMEM,
+	SLIC_MOCK_LMEM
+} slic_mock_mem_type_t;
+
+/* The MaxHashParameters of a MinimalPerfectHashMap instance. */
+typedef struct {
+	const char *kernel_name;
+	const char *hash_table_name;
+	size_t key_width_bits;
+	size_t value_width_bits;
+	size_t jenkins_chunk_width_bits;
+	size_t num_intermediate_buckets;
+	size_t num_values_buckets;
+	slic_mock_mem_type_t intermediate_mem_type;
+	slic_mock_mem_type_t values_mem_type;
+	bool double_buffered;
+	bool validate_results;
+	size_t base_address_bursts;
+} slic_mock_perfect_params_t;
+
+/* The MaxHashParameters of a CollisionHandlingHashMap instance, whose
+ * "max_bucket_entries" ways each have "num_buckets" entries. */
+typedef struct {
+	const char *kernel_name;
+	const char *hash_table_name;
+	size_t key_width_bits;
+	size_t value_width_bits;
+	size_t jenkins_chunk_width_bits;
+	size_t max_bucket_entries;
+	size_t num_buckets;
+	slic_mock_mem_type_t mem_type;
+	bool double_buffered;
+	size_t base_address_bursts;
+} slic_mock_collision_params_t;
+
+/* What the runtime has asked of the engine so far. */
+typedef struct {
+	size_t num_runs;
+	size_t num_mem_writes;
+	size_t num_mem_reads;
+	size_t num_stream_bytes;
+	size_t num_lmem_bursts_written;
+} slic_mock_stats_t;
+
+/**
+ * Create an empty maxfile for a manager whose LMem bursts are
+ * "lmem_burst_size_bytes" long.
+ */
+max_file_t *slic_mock_maxfile_init(size_t lmem_burst_size_bytes);
+
+void slic_mock_set_constant_uint64t(max_file_t *maxfile, const char *name,
+		uint64_t value);
+void slic_mock_set_constant_string(max_file_t *maxfile, const char *name,
+		const char *value);
+
+/**
+ * Add a MinimalPerfectHashMap to a maxfile, with the constants and memories
+ * that the kernel would have.  Fails, as the MaxJ would, for FMem entries
+ * wider than 64 bits or more than 16 Deep FMems.  Must be called before
+ * max_load().
+ */
+bool slic_mock_add_perfect(max_file_t *maxfile,
+		const slic_mock_perfect_params_t *params);
+
+/**
+ * Add a CollisionHandlingHashMap to a maxfile, as slic_mock_add_perfect()
+ * does for a MinimalPerfectHashMap.
+ */
+bool slic_mock_add_collision(max_file_t *maxfile,
+		const slic_mock_collision_params_t *params);
+
+/**
+ * Memory access function for maxhash_set_memory_access_fn(), with the engine
+ * as its argument.
+ */
+void slic_mock_lmem_access(void *engine, bool is_read,
+		size_t base_address_bursts, void *data, size_t data_size_bursts);
+
+/**
+ * Look "key" up as the kernel would.  "value" gets the value read from the
+ * table, and "contains_key" the kernel's containsKey() output.  Fails if
+ * there is no such table.
+ */
+bool slic_mock_perfect_get(max_engine_t *engine, const char *kernel_name,
+		const char *hash_table_name, const void *key, void *value,
+		bool *contains_key);
+
+/**
+ * Look "key" up in every way of a collision-handling table, as the kernel
+ * would.  Finding the key in more than one way is a mock error, as the
+ * kernel's result would be undefined.
+ */
+bool slic_mock_collision_get(max_engine_t *engine, const char *kernel_name,
+		const char *hash_table_name, const void *key, void *value,
+		bool *contains_key);
+
+void slic_mock_get_stats(max_engine_t *engine, slic_mock_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SLIC_MOCK_H_ */
@@ -0,0 +1,208 @@
+/*
+ * slic_mock_test.c
+ *
+ * Commits random changes to MaxHash tables backed by the mock SLiC engine,
+ * in FMem, Deep FMem and LMem, single and double buffered, and checks after
+ * every commit that the kernel's lookup, modelled over what the commit left
+ * in the engine's memories, agrees with the software table: every key that
+ * is present is found with its value, and, when results are validated, no
+ * other key is.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <maxhash.h>
+
+#include "slic_mock.h"
+
+#include "maxhash_test.h"
+
+#define KERNEL_NAME      "MockKernel"
+#define TABLE_NAME       "MockTable"
+#define MAX_WIDTH_BYTES  16
+#define NUM_VALUES       4096
+#define NUM_INTERMEDIATE 1024
+#define MAX_KEYS         3072
+#define NUM_COMMITS      12
+
+
+struct config {
+	const char *name;
+	slic_mock_mem_type_t intermediate_mem_type;
+	slic_mock_mem_type_t values_mem_type;
+	size_t key_width_bits;
+	size_t value_width_bits;
+	bool double_buffered;
+	bool validate_results;
+};
+
+
+static const struct config configs[] = {
+	{ "FMem", SLIC_MOCK_FMEM, SLIC_MOCK_FMEM, 32, 24, true, true },
+	{ "FMem, single buffered", SLIC_MOCK_FMEM, SLIC_MOCK_FMEM, 32, 24,
+		false, true },
+	{ "FMem, two entries per word", SLIC_MOCK_FMEM, SLIC_MOCK_FMEM, 16, 8,
+		true, true },
+	{ "FMem, unvalidated", SLIC_MOCK_FMEM, SLIC_MOCK_FMEM, 64, 32, true,
+		false },
+	{ "Deep FMem", SLIC_MOCK_DEEP_FMEM, SLIC_MOCK_DEEP_FMEM, 64, 64, true,
+		true },
+	{ "Deep FMem, single buffered", SLIC_MOCK_DEEP_FMEM, SLIC_MOCK_DEEP_FMEM,
+		48, 40, false, true },
+	{ "Deep FMem, wide entries", SLIC_MOCK_DEEP_FMEM, SLIC_MOCK_DEEP_FMEM,
+		128, 128, true, true },
+	{ "LMem", SLIC_MOCK_LMEM, SLIC_MOCK_LMEM, 64, 64, true, true },
+	{ "LMem, single buffered", SLIC_MOCK_LMEM, SLIC_MOCK_LMEM, 128, 96,
+		false, true },
+	{ "Deep FMem and LMem", SLIC_MOCK_DEEP_FMEM, SLIC_MOCK_LMEM, 64, 64, true,
+		true },
+	{ "FMem and Deep FMem", SLIC_MOCK_FMEM, SLIC_MOCK_DEEP_FMEM, 24, 32, true,
+		true },
+};
+
+
+/* Keys are distinct in their low 24 bits, so that every width holds them. */
+static void key_bytes_of(size_t i, size_t width_bytes, uint8_t *key)
+{
+	uint64_t word = (key_of(i) & ~UINT64_C(0xffffff)) | (i + 1);
+
+	for (size_t byte = 0; byte < width_bytes; byte++)
+		key[byte] = word >> (byte % 8 * 8) ^ byte / 8;
+}
+
+
+static size_t check(const struct config *config, maxhash_table_t *table,
+		max_engine_t *engine, size_t commit)
+{
+	size_t key_bytes = config->key_width_bits / 8;
+	size_t value_bytes = config->value_width_bits / 8;
+	size_t failures = 0;
+
+	for (size_t i = 0; i < MAX_KEYS + MAX_KEYS / 4; i++)
+	{
+		uint8_t key[MAX_WIDTH_BYTES];
+		uint8_t expected[MAX_WIDTH_BYTES] = {0};
+		uint8_t value[MAX_WIDTH_BYTES] = {0};
+		bool contains_key;
+
+		key_bytes_of(i, key_bytes, key);
+		bool present = maxhash_get(table, key, key_bytes, expected) ==
+			MAXHASH_ERR_OK;
+
+		if (!slic_mock_perfect_get(engine, KERNEL_NAME, TABLE_NAME, key, value,
+					&contains_key))
+			return failures + 1;
+
+		bool ok = present ? contains_key &&
+			!memcmp(value, expected, value_bytes) :
+			!contains_key || !config->validate_results;
+		if (!ok && failures++ < 10)
+			fprintf(stderr, "%s: mismatch after commit %zu (key: %zu): "
+					"present: %d, contains key: %d.\n", config->name, commit,
+					i, present, contains_key);
+	}
+
+	return failures;
+}
+
+
+static size_t run(const struct config *config)
+{
+	slic_mock_perfect_params_t params = {
+		.kernel_name = KERNEL_NAME,
+		.hash_table_name = TABLE_NAME,
+		.key_width_bits = config->key_width_bits,
+		.value_width_bits = config->value_width_bits,
+		.jenkins_chunk_width_bits = 8,
+		.num_intermediate_buckets = NUM_INTERMEDIATE,
+		.num_values_buckets = NUM_VALUES,
+		.intermediate_mem_type = config->intermediate_mem_type,
+		.values_mem_type = config->values_mem_type,
+		.double_buffered = config->double_buffered,
+		.validate_results = config->validate_results,
+		.base_address_bursts = 16,
+	};
+
+	maxhash_engine_state_t es;
+	maxhash_table_t *table = create_mock_perfect_table(&params, &es);
+	if (table == NULL)
+		return 1;
+
+	size_t key_bytes = config->key_width_bits / 8;
+	size_t value_bytes = config->value_width_bits / 8;
+	bool present[MAX_KEYS] = {false};
+	size_t num_present = 0;
+	size_t failures = 0;
+
+	for (size_t commit = 0; commit < NUM_COMMITS; commit++)
+	{
+		/* The first commit fills most of the table, and the rest change a
+		 * few keys each, or sometimes many. */
+		size_t num_changes = commit == 0 ? MAX_KEYS * 3 / 4 :
+			commit % 4 == 3 ? MAX_KEYS / 2 : (size_t)rand() % 64 + 1;
+
+		for (size_t change = 0; change < num_changes; change++)
+		{
+			size_t i = (size_t)rand() % MAX_KEYS;
+			uint8_t key[MAX_WIDTH_BYTES];
+			uint8_t value[MAX_WIDTH_BYTES];
+
+			key_bytes_of(i, key_bytes, key);
+
+			if (present[i] && rand() % 2)
+			{
+				failures += maxhash_remove(table, key, key_bytes) !=
+					MAXHASH_ERR_OK;
+				present[i] = false;
+				num_present--;
+				continue;
+			}
+
+			if (!present[i] && num_present == MAX_KEYS)
+				continue;
+
+			for (size_t byte = 0; byte < value_bytes; byte++)
+				value[byte] = rand();
+			failures += maxhash_put(table, key, key_bytes, value,
+					value_bytes) != MAXHASH_ERR_OK;
+			if (!present[i])
+				num_present++;
+			present[i] = true;
+		}
+
+		if (maxhash_commit(table) != MAXHASH_ERR_OK)
+		{
+			fprintf(stderr, "%s: commit %zu failed.\n", config->name, commit);
+			failures++;
+			break;
+		}
+
+		failures += check(config, table, es.engine, commit);
+	}
+
+	/* A commit with nothing to do leaves the lookups as they were. */
+	failures += maxhash_commit(table) != MAXHASH_ERR_OK;
+	failures += check(config, table, es.engine, NUM_COMMITS);
+
+	free_mock_perfect_table(table, &es);
+
+	printf("%-30s %s\n", config->name, failures ? "FAILED" : "passed");
+	return failures;
+}
+
+
+int main(void)
+{
+	size_t failures = 0;
+
+	srand(1);
+	for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++)
+		failures += run(&configs[c]);
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * stats_test.c
+ *
+ * Commits MaxHash tables backed by the mock SLiC engine and checks the
+ * statistics that each commit reports, through maxhash_get_stats() and a
+ * function set with maxhash_set_stats_fn(), and that committing prints
+ * nothing to stdout.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <maxhash.h>
+
+#include "slic_mock.h"
+
+#include "maxhash_test.h"
+
+#define KERNEL_NAME      "StatsKernel"
+#define TABLE_NAME       "StatsTable"
+#define NUM_VALUES       4096
+#define NUM_INTERMEDIATE 1024
+#define NUM_KEYS         3072
+
+
+struct calls {
+	size_t num_calls;
+	maxhash_stats_t last;
+};
+
+
+static void stats_fn(const maxhash_stats_t *stats, void *arg)
+{
+	struct calls *calls = arg;
+	calls->num_calls++;
+	calls->last = *stats;
+}
+
+
+/*
+ * Commit "table" (asynchronously if "async" is set) with stdout redirected,
+ * and check what it reports.  Returns the number of failures.
+ */
+static size_t commit(const char *name, const char *step, maxhash_table_t *table,
+		struct calls *calls, bool async, bool incremental, size_t num_keys,
+		maxhash_stats_t *stats)
+{
+	size_t failures = 0;
+	size_t num_calls = calls->num_calls;
+
+	fflush(stdout);
+	FILE *captured = tmpfile();
+	int saved_stdout = dup(STDOUT_FILENO);
+	dup2(fileno(captured), STDOUT_FILENO);
+
+	maxhash_err_t err;
+	if (async)
+	{
+		maxhash_commit_t *c;
+		err = maxhash_commit_async(table, &c);
+		if (err == MAXHASH_ERR_OK)
+			err = maxhash_commit_wait(c);
+	}
+	else
+		err = maxhash_commit(table);
+
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+	long printed = ftell(captured);
+	fclose(captured);
+
+	CHECK_NAMED(err == MAXHASH_ERR_OK);
+	CHECK_NAMED(printed == 0);
+	CHECK_NAMED(calls->num_calls == num_calls + 1);
+
+	maxhash_get_stats(table, stats);
+	CHECK_NAMED(!memcmp(stats, &calls->last, sizeof(*stats)));
+	CHECK_NAMED(stats->incremental == incremental);
+
+	size_t keys_placed = 0;
+	for (size_t n = 1; n <= MAXHASH_STATS_MAX_BUCKET_KEYS; n++)
+		keys_placed += n * stats->bucket_sizes[n];
+	if (!incremental)
+	{
+		size_t buckets = 0;
+		for (size_t n = 0; n <= MAXHASH_STATS_MAX_BUCKET_KEYS; n++)
+			buckets += stats->bucket_sizes[n];
+		CHECK_NAMED(buckets == NUM_INTERMEDIATE);
+		CHECK_NAMED(keys_placed == num_keys);
+	}
+	CHECK_NAMED(keys_placed >= stats->direct_buckets);
+
+	size_t bits = 1;
+	while ((stats->parameter_max >> bits) != 0)
+		bits++;
+	CHECK_NAMED(stats->parameter_bits == bits);
+
+	CHECK_NAMED(stats->search_seconds >= 0 && stats->serialise_seconds >= 0 &&
+			stats->transfer_seconds >= 0 && stats->switch_seconds >= 0);
+	CHECK_NAMED(stats->total_seconds >= stats->search_seconds +
+			stats->serialise_seconds + stats->transfer_seconds +
+			stats->switch_seconds - 1e-6);
+	CHECK_NAMED((stats->bursts_written == 0) ==
+			(stats->bytes_transferred == 0));
+
+	return failures;
+}
+
+
+static size_t run(const char *name, slic_mock_mem_type_t mem_type, bool async)
+{
+	slic_mock_perfect_params_t params = {
+		.kernel_name = KERNEL_NAME,
+		.hash_table_name = TABLE_NAME,
+		.key_width_bits = 32,
+		.value_width_bits = 24,
+		.jenkins_chunk_width_bits = 8,
+		.num_intermediate_buckets = NUM_INTERMEDIATE,
+		.num_values_buckets = NUM_VALUES,
+		.intermediate_mem_type = mem_type,
+		.values_mem_type = mem_type,
+		.double_buffered = true,
+		.validate_results = true,
+	};
+
+	maxhash_engine_state_t es;
+	maxhash_table_t *table = create_mock_perfect_table(&params, &es);
+	if (table == NULL)
+		return 1;
+
+	struct calls calls;
+	memset(&calls, 0, sizeof(calls));
+	maxhash_set_stats_fn(table, stats_fn, &calls);
+
+	size_t failures = 0;
+	maxhash_stats_t full, one, none;
+
+	for (size_t i = 0; i < NUM_KEYS; i++)
+	{
+		uint32_t key = key_of(i);
+		uint32_t value = i;
+		failures += maxhash_put(table, &key, sizeof(key), &value, 3) !=
+			MAXHASH_ERR_OK;
+	}
+	failures += commit(name, "full commit", table, &calls, async, false,
+			NUM_KEYS, &full);
+	const char *step = "full commit";
+	CHECK_NAMED(full.bytes_transferred > 0);
+	CHECK_NAMED(full.num_hashes > 0);
+
+	/* Changing one value moves nothing, and writes less. */
+	uint32_t key = key_of(0);
+	uint32_t value = 12345;
+	failures += maxhash_put(table, &key, sizeof(key), &value, 3) !=
+		MAXHASH_ERR_OK;
+	failures += commit(name, "one change", table, &calls, async, true, NUM_KEYS,
+			&one);
+	step = "one change";
+	CHECK_NAMED(one.bytes_transferred > 0);
+	CHECK_NAMED(one.bytes_transferred <= full.bytes_transferred);
+	CHECK_NAMED(one.moved_entries == 0);
+
+	/* The other buffer still needs the change, and then there is nothing. */
+	failures += commit(name, "catch up", table, &calls, async, true, NUM_KEYS,
+			&none);
+	failures += commit(name, "no changes", table, &calls, async, true,
+			NUM_KEYS, &none);
+	step = "no changes";
+	CHECK_NAMED(none.bytes_transferred == 0);
+
+	/* With no function set, the statistics are still kept. */
+	maxhash_set_stats_fn(table, NULL, NULL);
+	size_t num_calls = calls.num_calls;
+	failures += maxhash_commit(table) != MAXHASH_ERR_OK;
+	maxhash_get_stats(table, &none);
+	CHECK_NAMED(calls.num_calls == num_calls);
+	CHECK_NAMED(none.total_seconds > 0);
+
+	free_mock_perfect_table(table, &es);
+
+	printf("%-20s %s\n", name, failures ? "FAILED" : "passed");
+	return failures;
+}
+
+
+int main(void)
+{
+	size_t failures = 0;
+
+	failures += run("FMem", SLIC_MOCK_FMEM, false);
+	failures += run("Deep FMem", SLIC_MOCK_DEEP_FMEM, false);
+	failures += run("LMem", SLIC_MOCK_LMEM, false);
+	failures += run("LMem, asynchronous", SLIC_MOCK_LMEM, true);
+
+	printf(failures ? "FAILED\n" : "PASSED\n");
+	return failures ? 1 : 0;
+}